@@ -0,0 +1,60 @@
+#!/usr/bin/python3
+
+# Accept rate benchmark: a client stack opens and closes connections
+# as fast as possible, the server stack accepts them and reports
+# the number of connections accepted per second.
+# With a threads argument the connections are accepted by
+# Stack.accept_loop() native threads and collected with accept_many().
+
+import iothpy
+
+import sys
+import time
+import threading
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [connections] [threads]\ne,g: {1} vxvde://234.0.0.1 10000 2\n\n".format(name, name))
+    exit(1)
+
+count = int(sys.argv[2]) if len(sys.argv) > 2 else 10000
+threads = int(sys.argv[3]) if len(sys.argv) > 3 else 0
+
+def new_stack(addr):
+    stack = iothpy.Stack("vdestack", sys.argv[1])
+    ifindex = stack.if_nametoindex("vde0")
+    stack.linksetupdown(ifindex, 1)
+    stack.ipaddr_add(iothpy.AF_INET, addr, 24, ifindex)
+    return stack
+
+server_stack = new_stack("10.0.0.1")
+client_stack = new_stack("10.0.0.2")
+
+sock = server_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+sock.bind(('', 5000))
+sock.listen(128)
+
+def client():
+    for i in range(count):
+        c = client_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+        c.connect(("10.0.0.1", 5000))
+        c.close()
+
+t = threading.Thread(target = client, daemon=True)
+
+start = time.perf_counter()
+t.start()
+if threads > 0:
+    with server_stack.accept_loop(sock, threads=threads) as loop:
+        accepted = 0
+        while accepted < count:
+            for conn, addr in loop.accept_many():
+                conn.close()
+                accepted += 1
+else:
+    for i in range(count):
+        conn, addr = sock.accept()
+        conn.close()
+elapsed = time.perf_counter() - start
+
+print("accepted {0} connections in {1:.3f}s: {2:.0f} accept/s".format(count, elapsed, count / elapsed))
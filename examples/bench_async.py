@@ -0,0 +1,114 @@
+#!/usr/bin/python3
+
+# Asyncio echo benchmark: client coroutines on one stack exchange small
+# messages with an echo server on another stack. The same workload runs
+# once with the pure python loop.sock_recv()/loop.sock_sendall() helpers
+# and once with the native recv_async()/send_async() awaitables,
+# reporting the round trips per second.
+
+import iothpy
+
+import sys
+import time
+import asyncio
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [connections] [rounds]\ne,g: {1} vxvde://234.0.0.1 32 1000\n\n".format(name, name))
+    exit(1)
+
+connections = int(sys.argv[2]) if len(sys.argv) > 2 else 32
+rounds = int(sys.argv[3]) if len(sys.argv) > 3 else 1000
+message = b"x" * 64
+
+def new_stack(addr):
+    stack = iothpy.Stack("vdestack", sys.argv[1])
+    ifindex = stack.if_nametoindex("vde0")
+    stack.linksetupdown(ifindex, 1)
+    stack.ipaddr_add(iothpy.AF_INET, addr, 24, ifindex)
+    return stack
+
+server_stack = new_stack("10.0.0.1")
+client_stack = new_stack("10.0.0.2")
+
+class PythonOps:
+    """ The asyncio socket helpers, implemented in python """
+    def __init__(self, loop):
+        self.loop = loop
+
+    def recv(self, sock, n):
+        return self.loop.sock_recv(sock, n)
+
+    def sendall(self, sock, data):
+        return self.loop.sock_sendall(sock, data)
+
+    def accept(self, sock):
+        return self.loop.sock_accept(sock)
+
+    def connect(self, sock, address):
+        return self.loop.sock_connect(sock, address)
+
+class NativeOps:
+    """ The native awaitables of MSocket """
+    def recv(self, sock, n):
+        return sock.recv_async(n)
+
+    async def sendall(self, sock, data):
+        view = memoryview(data)
+        while view:
+            view = view[await sock.send_async(view):]
+
+    def accept(self, sock):
+        return sock.accept_async()
+
+    def connect(self, sock, address):
+        return sock.connect_async(address)
+
+async def echo(ops, conn):
+    while True:
+        data = await ops.recv(conn, 4096)
+        if not data:
+            break
+        await ops.sendall(conn, data)
+    conn.close()
+
+async def client(ops, port):
+    sock = client_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    sock.setblocking(False)
+    await ops.connect(sock, ("10.0.0.1", port))
+    for i in range(rounds):
+        await ops.sendall(sock, message)
+        received = 0
+        while received < len(message):
+            received += len(await ops.recv(sock, len(message) - received))
+    sock.close()
+
+async def run(name, ops, port):
+    listener = server_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    listener.setblocking(False)
+    listener.bind(('', port))
+    listener.listen(connections)
+
+    async def server():
+        echoes = []
+        for i in range(connections):
+            conn, addr = await ops.accept(listener)
+            conn.setblocking(False)
+            echoes.append(asyncio.ensure_future(echo(ops, conn)))
+        await asyncio.gather(*echoes)
+
+    serving = asyncio.ensure_future(server())
+    start = time.perf_counter()
+    await asyncio.gather(*[client(ops, port) for i in range(connections)])
+    elapsed = time.perf_counter() - start
+    await serving
+    listener.close()
+
+    count = connections * rounds
+    print("{0:>6}: {1} round trips in {2:.3f}s: {3:.0f} rtt/s".format(name, count, elapsed, count / elapsed))
+
+async def main():
+    await run("python", PythonOps(asyncio.get_running_loop()), 5000)
+    await run("native", NativeOps(), 5001)
+
+asyncio.run(main())
@@ -0,0 +1,76 @@
+#!/usr/bin/python3
+
+# Per-call overhead benchmark: time sendto, recv and recv_into with small
+# datagrams so that argument parsing is a large part of the cost of a call.
+
+import iothpy
+
+import sys
+import time
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [calls]\ne,g: {1} vxvde://234.0.0.1 100000\n\n".format(name, name))
+    exit(1)
+
+calls = int(sys.argv[2]) if len(sys.argv) > 2 else 100000
+batch = 64
+payload = b"x" * 16
+
+stack = iothpy.Stack("vdestack", sys.argv[1])
+ifindex = stack.if_nametoindex("vde0")
+stack.linksetupdown(ifindex, 1)
+stack.ipaddr_add(iothpy.AF_INET, "10.0.0.1", 24, ifindex)
+
+receiver = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+receiver.bind(("10.0.0.1", 5000))
+sender = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+dest = ("10.0.0.1", 5000)
+dest_addr = iothpy.Address("10.0.0.1", 5000)
+buf = bytearray(64)
+
+def bench(name, func):
+    # Send batches of datagrams so the receive buffer never overflows
+    elapsed = 0
+    for i in range(calls // batch):
+        elapsed += func()
+    print("{0:16} {1:8.0f} ns/call".format(name, elapsed * 1e9 / (calls // batch * batch)))
+
+def sendto():
+    start = time.perf_counter()
+    for i in range(batch):
+        sender.sendto(payload, dest)
+    elapsed = time.perf_counter() - start
+    for i in range(batch):
+        receiver.recv(64)
+    return elapsed
+
+def sendto_address():
+    start = time.perf_counter()
+    for i in range(batch):
+        sender.sendto(payload, dest_addr)
+    elapsed = time.perf_counter() - start
+    for i in range(batch):
+        receiver.recv(64)
+    return elapsed
+
+def recv():
+    for i in range(batch):
+        sender.sendto(payload, dest)
+    start = time.perf_counter()
+    for i in range(batch):
+        receiver.recv(64)
+    return time.perf_counter() - start
+
+def recv_into():
+    for i in range(batch):
+        sender.sendto(payload, dest)
+    start = time.perf_counter()
+    for i in range(batch):
+        receiver.recv_into(buf, 64)
+    return time.perf_counter() - start
+
+bench("sendto", sendto)
+bench("sendto Address", sendto_address)
+bench("recv", recv)
+bench("recv_into", recv_into)
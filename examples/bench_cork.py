@@ -0,0 +1,96 @@
+#!/usr/bin/python3
+
+# Write coalescing benchmark: each message is written with four small
+# send() calls, a header and three fields, as an RPC layer serializing
+# its fields does. Two workloads run on a pair of stacks:
+#   rpc:    the client waits for a one byte answer after each message,
+#           reports the messages per second and the mean round trip
+#   stream: the client writes the messages without waiting, reports the
+#           messages per second
+# Without arguments each send() goes to the stack, with TCP_NODELAY set
+# as RPC layers do to avoid the Nagle delays. With the cork argument the
+# client socket coalesces the writes with set_cork().
+
+import iothpy
+
+import socket
+import sys
+import time
+import threading
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [messages] [cork]\ne,g: {1} vxvde://234.0.0.1 20000 cork\n\n".format(name, name))
+    exit(1)
+
+count = int(sys.argv[2]) if len(sys.argv) > 2 else 20000
+cork = len(sys.argv) > 3 and sys.argv[3] == "cork"
+
+def new_stack(addr):
+    stack = iothpy.Stack("vdestack", sys.argv[1])
+    ifindex = stack.if_nametoindex("vde0")
+    stack.linksetupdown(ifindex, 1)
+    stack.ipaddr_add(iothpy.AF_INET, addr, 24, ifindex)
+    return stack
+
+server_stack = new_stack("10.0.0.1")
+client_stack = new_stack("10.0.0.2")
+
+sock = server_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+sock.bind(('', 5000))
+sock.listen(2)
+
+fields = [b"\x00\x00\x00\x1c", b"method:get;", b"key:12345678;", b"flags:0"]
+size = sum(len(f) for f in fields)
+
+def server():
+    # rpc: answer each message
+    conn, addr = sock.accept()
+    for i in range(count):
+        conn.recv_exact(size)
+        conn.sendall(b"k")
+    conn.close()
+
+    # stream: read everything
+    conn, addr = sock.accept()
+    while conn.recv(65536):
+        pass
+    conn.close()
+
+threading.Thread(target = server, daemon=True).start()
+
+def connect():
+    c = client_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    c.connect(("10.0.0.1", 5000))
+    if cork:
+        c.set_cork(16384)
+    else:
+        c.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    return c
+
+def report(name, c, elapsed):
+    line = "{0}: {1} messages in {2:.3f}s: {3:.0f} msg/s".format(name, count, elapsed, count / elapsed)
+    if name == "rpc":
+        line += ", {0:.1f}us per round trip".format(elapsed / count * 1e6)
+    sends = c.get_cork()["flushes"] / count if cork else len(fields)
+    line += ", {0:.3f} sends per message".format(sends)
+    print(line)
+
+c = connect()
+start = time.perf_counter()
+for i in range(count):
+    for f in fields:
+        c.send(f)
+    c.recv(1)
+report("rpc", c, time.perf_counter() - start)
+c.close()
+
+c = connect()
+start = time.perf_counter()
+for i in range(count):
+    for f in fields:
+        c.send(f)
+if cork:
+    c.flush()
+report("stream", c, time.perf_counter() - start)
+c.close()
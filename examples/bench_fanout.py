@@ -0,0 +1,44 @@
+#!/usr/bin/python3
+
+# Fan-out benchmark: the same command datagram is sent to many devices,
+# each a (host, port) destination on another stack. Reports the datagrams
+# sent per second by a python loop over sendto() and by sendto_many().
+
+import iothpy
+
+import sys
+import time
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [destinations] [rounds]\ne,g: {1} vxvde://234.0.0.1 5000 20\n\n".format(name, name))
+    exit(1)
+
+ndests = int(sys.argv[2]) if len(sys.argv) > 2 else 5000
+rounds = int(sys.argv[3]) if len(sys.argv) > 3 else 20
+payload = b"\x01set-mode:eco"
+
+stack = iothpy.Stack("vdestack", sys.argv[1])
+ifindex = stack.if_nametoindex("vde0")
+stack.linksetupdown(ifindex, 1)
+stack.ipaddr_add(iothpy.AF_INET, "10.0.0.1", 24, ifindex)
+
+# The devices live on 10.0.0.2, nothing needs to receive the datagrams
+dests = [("10.0.0.2", 10000 + i) for i in range(ndests)]
+sock = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+
+def loop():
+    for dest in dests:
+        sock.sendto(payload, dest)
+
+def many():
+    errors = sock.sendto_many(payload, dests)
+    assert not any(errors), errors
+
+for name, func in (("sendto loop", loop), ("sendto_many", many)):
+    start = time.perf_counter()
+    for i in range(rounds):
+        func()
+    elapsed = time.perf_counter() - start
+    print("{0}: {1} datagrams to {2} destinations in {3:.3f}s: {4:.0f} datagrams/s".format(
+          name, ndests * rounds, ndests, elapsed, ndests * rounds / elapsed))
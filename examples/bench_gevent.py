@@ -0,0 +1,83 @@
+#!/usr/bin/python3
+
+# Gevent echo benchmark: client greenlets on one stack exchange small
+# messages with an echo server on another stack, every connection served
+# by its own greenlet. With the threads argument the same workload runs
+# on python threads without the cooperative mode, for comparison.
+
+import sys
+import time
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [connections] [rounds] [gevent|threads]\ne,g: {1} vxvde://234.0.0.1 500 100\n\n".format(name, name))
+    exit(1)
+
+connections = int(sys.argv[2]) if len(sys.argv) > 2 else 500
+rounds = int(sys.argv[3]) if len(sys.argv) > 3 else 100
+mode = sys.argv[4] if len(sys.argv) > 4 else "gevent"
+message = b"x" * 64
+
+import iothpy
+
+if mode == "gevent":
+    import gevent
+    # The hook must be installed before creating the sockets
+    iothpy.use_gevent()
+    spawn = gevent.spawn
+    def join(tasks):
+        gevent.joinall(tasks, raise_error=True)
+else:
+    import threading
+    def spawn(func, *args):
+        t = threading.Thread(target = func, args = args, daemon = True)
+        t.start()
+        return t
+    def join(tasks):
+        for t in tasks:
+            t.join()
+
+def new_stack(addr):
+    stack = iothpy.Stack("vdestack", sys.argv[1])
+    ifindex = stack.if_nametoindex("vde0")
+    stack.linksetupdown(ifindex, 1)
+    stack.ipaddr_add(iothpy.AF_INET, addr, 24, ifindex)
+    return stack
+
+server_stack = new_stack("10.0.0.1")
+client_stack = new_stack("10.0.0.2")
+
+listener = server_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+listener.bind(('', 5000))
+listener.listen(connections)
+
+def echo(conn):
+    while True:
+        data = conn.recv(4096)
+        if not data:
+            break
+        conn.sendall(data)
+    conn.close()
+
+def server():
+    for i in range(connections):
+        conn, addr = listener.accept()
+        spawn(echo, conn)
+
+def client():
+    sock = client_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    sock.connect(("10.0.0.1", 5000))
+    for i in range(rounds):
+        sock.sendall(message)
+        received = 0
+        while received < len(message):
+            received += len(sock.recv(len(message) - received))
+    sock.close()
+
+spawn(server)
+start = time.perf_counter()
+join([spawn(client) for i in range(connections)])
+elapsed = time.perf_counter() - start
+
+count = connections * rounds
+print("{0}: {1} round trips in {2:.3f}s: {3:.0f} rtt/s".format(mode, count, elapsed, count / elapsed))
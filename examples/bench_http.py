@@ -0,0 +1,103 @@
+#!/usr/bin/python3
+
+# HTTP server benchmark: client threads on a client stack send keep-alive
+# GET requests for a small file to a server on the server stack for a few
+# seconds, reporting the requests served per second. The server runs once
+# as in vhttp.py, http.server on the stack, and once as iothpy.http.
+
+import iothpy
+from iothpy.http import HTTPServer
+
+import os
+import sys
+import time
+import tempfile
+import threading
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [clients] [seconds]\ne,g: {1} vxvde://234.0.0.1 16 5\n\n".format(name, name))
+    exit(1)
+
+clients = int(sys.argv[2]) if len(sys.argv) > 2 else 16
+seconds = float(sys.argv[3]) if len(sys.argv) > 3 else 5
+
+def new_stack(addr):
+    stack = iothpy.Stack("vdestack", sys.argv[1])
+    ifindex = stack.if_nametoindex("vde0")
+    stack.linksetupdown(ifindex, 1)
+    stack.ipaddr_add(iothpy.AF_INET, addr, 24, ifindex)
+    return stack
+
+server_stack = new_stack("10.0.0.1")
+client_stack = new_stack("10.0.0.2")
+
+root = tempfile.mkdtemp()
+with open(os.path.join(root, "index.html"), "wb") as f:
+    f.write(b"<html><body>" + b"x" * 1000 + b"</body></html>\n")
+
+def client(port, counts, index, stop):
+    c = client_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    c.connect(("10.0.0.1", port))
+    request = b"GET /index.html HTTP/1.1\r\nHost: 10.0.0.1\r\n\r\n"
+    buf = b""
+    while not stop.is_set():
+        c.sendall(request)
+        while b"\r\n\r\n" not in buf:
+            buf += c.recv(65536)
+        head, buf = buf.split(b"\r\n\r\n", 1)
+        length = int(head.lower().split(b"content-length:")[1].split(b"\r\n")[0])
+        while len(buf) < length:
+            buf += c.recv(65536)
+        buf = buf[length:]
+        counts[index] += 1
+    c.close()
+
+def run(name, start_server, port):
+    stop_server = start_server(port)
+    counts = [0] * clients
+    stop = threading.Event()
+    threads = [threading.Thread(target = client, args = (port, counts, i, stop)) for i in range(clients)]
+    for t in threads:
+        t.start()
+    time.sleep(seconds)
+    stop.set()
+    for t in threads:
+        t.join()
+    stop_server()
+    print("{0:>8}: {1:.0f} requests/s".format(name, sum(counts) / seconds))
+
+def vhttp(port):
+    import http.server
+    import functools
+
+    class Handler(http.server.SimpleHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+        def log_message(self, *args):
+            pass
+
+    # Like vhttp.py, but only this server runs on the stack
+    with server_stack.activate():
+        server = http.server.ThreadingHTTPServer(("", port), functools.partial(Handler, directory = root))
+    t = threading.Thread(target = server.serve_forever)
+    t.start()
+
+    def stop():
+        server.shutdown()
+        server.server_close()
+        t.join()
+    return stop
+
+def native(port):
+    server = HTTPServer.create(server_stack, ("", port))
+    server.static("/", root)
+    t = threading.Thread(target = server.serve_forever)
+    t.start()
+
+    def stop():
+        server.close()
+        t.join()
+    return stop
+
+run("vhttp", vhttp, 8000)
+run("native", native, 8001)
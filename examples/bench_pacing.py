@@ -0,0 +1,72 @@
+#!/usr/bin/python3
+
+# Pacing benchmark: a stream of datagrams is sent to a constrained device
+# at a fixed packet rate. Reports how close to the target rate and how
+# evenly spaced the datagrams arrive when paced by time.sleep() in python
+# and by the token bucket of the socket.
+
+import iothpy
+
+import sys
+import time
+import threading
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [packets/s] [count]\ne,g: {1} vxvde://234.0.0.1 2000 4000\n\n".format(name, name))
+    exit(1)
+
+rate = int(sys.argv[2]) if len(sys.argv) > 2 else 2000
+count = int(sys.argv[3]) if len(sys.argv) > 3 else 4000
+payload = b"\x00" * 512
+
+stack = iothpy.Stack("vdestack", sys.argv[1])
+ifindex = stack.if_nametoindex("vde0")
+stack.linksetupdown(ifindex, 1)
+stack.ipaddr_add(iothpy.AF_INET, "10.0.0.1", 24, ifindex)
+
+# The device is a socket of the same stack, timestamping the arrivals
+device = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+device.bind(("10.0.0.1", 5000))
+device.settimeout(1.0)
+
+def receive(arrivals):
+    try:
+        while len(arrivals) < count:
+            device.recv(2048)
+            arrivals.append(time.perf_counter())
+    except iothpy.timeout:
+        pass
+
+def sleep_paced(sock):
+    interval = 1.0 / rate
+    next_send = time.perf_counter()
+    for i in range(count):
+        delay = next_send - time.perf_counter()
+        if delay > 0:
+            time.sleep(delay)
+        sock.sendto(payload, ("10.0.0.1", 5000))
+        next_send += interval
+
+def bucket_paced(sock):
+    sock.set_pacing(packet_rate=rate)
+    for i in range(count):
+        sock.sendto(payload, ("10.0.0.1", 5000))
+
+for name, func in (("time.sleep", sleep_paced), ("set_pacing", bucket_paced)):
+    sock = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+    arrivals = []
+    receiver = threading.Thread(target=receive, args=(arrivals,))
+    receiver.start()
+    start = time.perf_counter()
+    cpu = time.process_time()
+    func(sock)
+    cpu = time.process_time() - cpu
+    elapsed = time.perf_counter() - start
+    receiver.join()
+    sock.close()
+
+    gaps = sorted(b - a for a, b in zip(arrivals, arrivals[1:]))
+    jitter = (gaps[len(gaps) * 99 // 100] - gaps[len(gaps) // 2]) * 1e6 if gaps else 0
+    print("{0}: {1} datagrams in {2:.3f}s: {3:.0f}/s for {4}/s, p99-p50 gap {5:.0f}us, cpu {6:.3f}s".format(
+          name, len(arrivals), elapsed, count / elapsed, rate, jitter, cpu))
@@ -0,0 +1,72 @@
+#!/usr/bin/python3
+
+# Connection pool benchmark: a client stack sends small requests to an
+# echo server on another stack, opening a new connection for each request
+# or, with the pool argument, reusing the connections of
+# Stack.connection_pool(). Reports the number of requests per second.
+
+import iothpy
+
+import sys
+import time
+import threading
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [requests] [pool]\ne,g: {1} vxvde://234.0.0.1 10000 pool\n\n".format(name, name))
+    exit(1)
+
+count = int(sys.argv[2]) if len(sys.argv) > 2 else 10000
+use_pool = len(sys.argv) > 3 and sys.argv[3] == "pool"
+
+def new_stack(addr):
+    stack = iothpy.Stack("vdestack", sys.argv[1])
+    ifindex = stack.if_nametoindex("vde0")
+    stack.linksetupdown(ifindex, 1)
+    stack.ipaddr_add(iothpy.AF_INET, addr, 24, ifindex)
+    return stack
+
+server_stack = new_stack("10.0.0.1")
+client_stack = new_stack("10.0.0.2")
+
+sock = server_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+sock.bind(('', 5000))
+sock.listen(128)
+
+def echo(conn):
+    with conn:
+        while True:
+            data = conn.recv(1024)
+            if not data:
+                return
+            conn.sendall(data)
+
+def server():
+    while True:
+        conn, addr = sock.accept()
+        threading.Thread(target = echo, args = (conn,), daemon=True).start()
+
+threading.Thread(target = server, daemon=True).start()
+
+address = ("10.0.0.1", 5000)
+pool = client_stack.connection_pool()
+
+start = time.perf_counter()
+for i in range(count):
+    if use_pool:
+        c = pool.acquire(address)
+    else:
+        c = client_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+        c.connect(address)
+    c.sendall(b"ping")
+    c.recv(1024)
+    if use_pool:
+        pool.release(c)
+    else:
+        c.close()
+elapsed = time.perf_counter() - start
+
+print("{0} requests in {1:.3f}s: {2:.0f} req/s".format(count, elapsed, count / elapsed))
+if use_pool:
+    print(pool.stats())
+pool.close()
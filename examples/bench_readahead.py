@@ -0,0 +1,74 @@
+#!/usr/bin/python3
+
+# Small reads benchmark: a server stack sends length-prefixed messages,
+# the client stack parses them with a recv(4) for the header and a recv()
+# for the payload, as many protocol parsers do. Reports the number of
+# messages parsed per second.
+# The mode argument selects how the client reads:
+#   plain:     recv() straight from the socket
+#   readahead: the same recv() calls served by set_readahead(65536)
+#   frame:     a single recv_frame() per message
+
+import iothpy
+
+import sys
+import time
+import struct
+import threading
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [messages] [plain|readahead|frame]\ne,g: {1} vxvde://234.0.0.1 100000 readahead\n\n".format(name, name))
+    exit(1)
+
+count = int(sys.argv[2]) if len(sys.argv) > 2 else 100000
+mode = sys.argv[3] if len(sys.argv) > 3 else "plain"
+
+def new_stack(addr):
+    stack = iothpy.Stack("vdestack", sys.argv[1])
+    ifindex = stack.if_nametoindex("vde0")
+    stack.linksetupdown(ifindex, 1)
+    stack.ipaddr_add(iothpy.AF_INET, addr, 24, ifindex)
+    return stack
+
+server_stack = new_stack("10.0.0.1")
+client_stack = new_stack("10.0.0.2")
+
+sock = server_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+sock.bind(('', 5000))
+sock.listen(1)
+
+message = struct.pack("!I", 12) + b"hello world!"
+
+def server():
+    conn, addr = sock.accept()
+    batch = message * 1000
+    for i in range(count // 1000):
+        conn.sendall(batch)
+    conn.sendall(message * (count % 1000))
+    conn.close()
+
+threading.Thread(target = server, daemon=True).start()
+
+c = client_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+c.connect(("10.0.0.1", 5000))
+if mode == "readahead":
+    c.set_readahead(65536)
+
+def recv_all(n):
+    data = c.recv(n)
+    while len(data) < n:
+        data += c.recv(n - len(data))
+    return data
+
+start = time.perf_counter()
+if mode == "frame":
+    for i in range(count):
+        c.recv_frame("!I")
+else:
+    for i in range(count):
+        size, = struct.unpack("!I", recv_all(4))
+        recv_all(size)
+elapsed = time.perf_counter() - start
+
+print("{0}: {1} messages in {2:.3f}s: {3:.0f} msg/s".format(mode, count, elapsed, count / elapsed))
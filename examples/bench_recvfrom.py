@@ -0,0 +1,51 @@
+#!/usr/bin/python3
+
+# recvfrom allocation benchmark: a few peers send small datagrams to a
+# single receiver, which reports datagrams per second and how many new
+# address tuples were allocated per datagram received.
+
+import iothpy
+
+import sys
+import time
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [datagrams] [peers]\ne,g: {1} vxvde://234.0.0.1 100000 4\n\n".format(name, name))
+    exit(1)
+
+count = int(sys.argv[2]) if len(sys.argv) > 2 else 100000
+npeers = int(sys.argv[3]) if len(sys.argv) > 3 else 4
+batch = 64
+payload = b"x" * 16
+
+stack = iothpy.Stack("vdestack", sys.argv[1])
+ifindex = stack.if_nametoindex("vde0")
+stack.linksetupdown(ifindex, 1)
+stack.ipaddr_add(iothpy.AF_INET, "10.0.0.1", 24, ifindex)
+
+receiver = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+receiver.bind(("10.0.0.1", 5000))
+dest = iothpy.Address("10.0.0.1", 5000)
+peers = [stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM) for i in range(npeers)]
+buf = bytearray(64)
+
+received = 0
+elapsed = 0
+# Keep every address returned so that a freed tuple is never reused
+# and each distinct id is one allocation
+addrs = []
+
+while received < count:
+    for i in range(batch):
+        peers[i % npeers].sendto(payload, dest)
+    start = time.perf_counter()
+    for i in range(batch):
+        nbytes, addr = receiver.recvfrom_into(buf)
+        addrs.append(addr)
+    elapsed += time.perf_counter() - start
+    received += batch
+
+tuples = len(set(map(id, addrs)))
+print("received {0} datagrams from {1} peers: {2:.0f} recvfrom/s".format(received, npeers, received / elapsed))
+print("address tuples allocated: {0} ({1:.4f} per datagram)".format(tuples, tuples / received))
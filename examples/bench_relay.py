@@ -0,0 +1,94 @@
+#!/usr/bin/python3
+
+# Port forwarding benchmark: a client stack sends data to a forwarder on
+# the server stack, which relays it to a kernel socket on 127.0.0.1.
+# The forwarder runs once with iothpy.relay() and once with a pair of
+# python threads doing recv/sendall, reporting the throughput of each.
+
+import iothpy
+
+import sys
+import time
+import socket
+import threading
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [megabytes]\ne,g: {1} vxvde://234.0.0.1 256\n\n".format(name, name))
+    exit(1)
+
+size = (int(sys.argv[2]) if len(sys.argv) > 2 else 256) * 1024 * 1024
+chunk = b"x" * 65536
+
+def new_stack(addr):
+    stack = iothpy.Stack("vdestack", sys.argv[1])
+    ifindex = stack.if_nametoindex("vde0")
+    stack.linksetupdown(ifindex, 1)
+    stack.ipaddr_add(iothpy.AF_INET, addr, 24, ifindex)
+    return stack
+
+server_stack = new_stack("10.0.0.1")
+client_stack = new_stack("10.0.0.2")
+
+# Kernel side: count the bytes and close when the forwarder shuts down
+sink = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+sink.bind(("127.0.0.1", 0))
+sink.listen(1)
+
+def sink_loop():
+    conn, addr = sink.accept()
+    while conn.recv(1 << 20):
+        pass
+    conn.close()
+
+def python_relay(a, b):
+    def pump(src, dst):
+        while True:
+            data = src.recv(65536)
+            if not data:
+                break
+            dst.sendall(data)
+        dst.shutdown(socket.SHUT_WR)
+
+    t = threading.Thread(target = pump, args = (b, a))
+    t.start()
+    pump(a, b)
+    t.join()
+
+def run(name, relay, port):
+    listener = server_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    listener.bind(('', port))
+    listener.listen(1)
+
+    def forwarder():
+        a, addr = listener.accept()
+        b = socket.create_connection(sink.getsockname())
+        relay(a, b)
+        a.close()
+        b.close()
+
+    threads = [threading.Thread(target = sink_loop), threading.Thread(target = forwarder)]
+    for t in threads:
+        t.start()
+
+    c = client_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    c.connect(("10.0.0.1", port))
+
+    start = time.perf_counter()
+    sent = 0
+    while sent < size:
+        c.sendall(chunk)
+        sent += len(chunk)
+    c.shutdown(socket.SHUT_WR)
+    c.recv(1)
+    elapsed = time.perf_counter() - start
+
+    for t in threads:
+        t.join()
+    c.close()
+    listener.close()
+
+    print("{0:>8}: {1:.1f} MB/s".format(name, size / elapsed / (1024 * 1024)))
+
+run("python", python_relay, 5000)
+run("native", iothpy.relay, 5001)
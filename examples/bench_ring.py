@@ -0,0 +1,81 @@
+#!/usr/bin/python3
+
+# I/O ring benchmark: many connections between two stacks exchange small
+# messages. Each round sends a message on every client socket and receives
+# it on the server side, once with plain send/recv calls and once with the
+# operations batched in an iothpy.IORing, reporting the messages per second.
+
+import iothpy
+
+import sys
+import time
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [connections] [rounds]\ne,g: {1} vxvde://234.0.0.1 64 1000\n\n".format(name, name))
+    exit(1)
+
+connections = int(sys.argv[2]) if len(sys.argv) > 2 else 64
+rounds = int(sys.argv[3]) if len(sys.argv) > 3 else 1000
+message = b"x" * 64
+
+def new_stack(addr):
+    stack = iothpy.Stack("vdestack", sys.argv[1])
+    ifindex = stack.if_nametoindex("vde0")
+    stack.linksetupdown(ifindex, 1)
+    stack.ipaddr_add(iothpy.AF_INET, addr, 24, ifindex)
+    return stack
+
+server_stack = new_stack("10.0.0.1")
+client_stack = new_stack("10.0.0.2")
+
+listener = server_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+listener.bind(('', 5000))
+listener.listen(connections)
+
+clients = []
+servers = []
+for i in range(connections):
+    c = client_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    c.connect(("10.0.0.1", 5000))
+    clients.append(c)
+    conn, addr = listener.accept()
+    servers.append(conn)
+
+def report(name, elapsed):
+    count = connections * rounds
+    print("{0:>6}: {1} messages in {2:.3f}s: {3:.0f} msg/s".format(name, count, elapsed, count / elapsed))
+
+start = time.perf_counter()
+for r in range(rounds):
+    for c in clients:
+        c.send(message)
+    for s in servers:
+        received = 0
+        while received < len(message):
+            received += len(s.recv(len(message) - received))
+report("calls", time.perf_counter() - start)
+
+with iothpy.IORing(entries = 2 * connections) as ring:
+    start = time.perf_counter()
+    for r in range(rounds):
+        for c in clients:
+            ring.send(c, message)
+        for s in servers:
+            ring.recv(s, len(message), user_data = s)
+        ring.submit()
+
+        pending = 2 * connections
+        while pending > 0:
+            for user_data, result in ring.completions(max = pending):
+                pending -= 1
+                # Short read, ask for the rest
+                if user_data is not None and len(result) < len(message):
+                    ring.recv(user_data, len(message) - len(result), user_data = user_data)
+                    ring.submit()
+                    pending += 1
+    report("ring", time.perf_counter() - start)
+
+for sock in clients + servers:
+    sock.close()
+listener.close()
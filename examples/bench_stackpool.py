@@ -0,0 +1,71 @@
+#!/usr/bin/python3
+
+# StackPool scaling benchmark: a pool of 1 to N server stacks accepts tcp
+# connections from a pool of client stacks, each client streams data to the
+# server, which reports the total throughput and the load of each stack.
+
+import iothpy
+
+import sys
+import time
+import threading
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [stacks] [MB per connection]\ne,g: {1} vxvde://234.0.0.1 4 64\n\n".format(name, name))
+    exit(1)
+
+max_stacks = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+size = (int(sys.argv[3]) if len(sys.argv) > 3 else 64) * 1024 * 1024
+connections = 4
+chunk = b"x" * 65536
+
+def configure(net):
+    def configure_stack(stack, index):
+        ifindex = stack.if_nametoindex("vde0")
+        stack.linksetupdown(ifindex, 1)
+        stack.ipaddr_add(iothpy.AF_INET, "10.0.{0}.{1}".format(net, index + 1), 16, ifindex)
+    return configure_stack
+
+def handle(conn):
+    buf = bytearray(65536)
+    while conn.recv_into(buf):
+        pass
+    conn.close()
+
+def client(pool, addr):
+    sock = pool.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    sock.connect(addr)
+    for i in range(size // len(chunk)):
+        sock.sendall(chunk)
+    sock.close()
+
+for nstacks in range(1, max_stacks + 1):
+    servers = iothpy.StackPool(nstacks, "vdestack", sys.argv[1], configure=configure(1))
+    clients = iothpy.StackPool(nstacks, "vdestack", sys.argv[1], configure=configure(2))
+    server = servers.create_server(("", 5000))
+
+    # Every client stack connects to every server stack
+    addrs = [("10.0.1.{0}".format(i + 1), 5000) for i in range(nstacks)]
+    threads = [threading.Thread(target=client, args=(clients, addrs[i % nstacks]))
+               for i in range(connections * nstacks)]
+
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+
+    handlers = []
+    for i in range(len(threads)):
+        conn, addr = server.accept()
+        h = threading.Thread(target=handle, args=(conn,))
+        h.start()
+        handlers.append(h)
+    for t in threads + handlers:
+        t.join()
+    elapsed = time.perf_counter() - start
+
+    stats = servers.stats()
+    print("{0:3} stacks {1:8.1f} MB/s  accepted per stack {2}  imbalance {3:.2f}".format(
+        nstacks, len(threads) * size / elapsed / 1e6,
+        [s["accepted"] for s in stats["stacks"]], stats["imbalance"]))
+    server.close()
@@ -0,0 +1,75 @@
+#!/usr/bin/python3
+
+# Subinterpreter benchmark (python >= 3.12): every interpreter has its own
+# GIL and drives its own stack with a udp socket pair. The total datagram
+# rate is reported for 1 to N interpreters running in parallel threads.
+
+import sys
+import time
+import threading
+
+try:
+    import _interpreters as interpreters
+except ImportError:
+    import _xxsubinterpreters as interpreters
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [interpreters] [datagrams per interpreter]\ne,g: {1} vxvde://234.0.0.1 4 100000\n\n".format(name, name))
+    exit(1)
+
+max_interps = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+count = int(sys.argv[3]) if len(sys.argv) > 3 else 100000
+batch = 64
+
+# Code run by each interpreter, it imports its own copy of iothpy
+worker_code = """
+import iothpy
+
+stack = iothpy.Stack("vdestack", {vdeurl!r})
+ifindex = stack.if_nametoindex("vde0")
+stack.linksetupdown(ifindex, 1)
+stack.ipaddr_add(iothpy.AF_INET, {addr!r}, 24, ifindex)
+
+receiver = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+receiver.bind(({addr!r}, 5000))
+sender = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+dest = iothpy.Address({addr!r}, 5000)
+payload = b"x" * 16
+buf = bytearray(64)
+
+for i in range({count} // {batch}):
+    for j in range({batch}):
+        sender.sendto(payload, dest)
+    for j in range({batch}):
+        receiver.recv_into(buf)
+
+receiver.close()
+sender.close()
+"""
+
+def run(interp, code):
+    err = interpreters.run_string(interp, code)
+    if err is not None:
+        print("interpreter failed:", err)
+
+base = None
+for ninterps in range(1, max_interps + 1):
+    interps = [interpreters.create() for i in range(ninterps)]
+    codes = [worker_code.format(vdeurl=sys.argv[1], addr="10.0.{0}.1".format(i + 1),
+                                count=count, batch=batch) for i in range(ninterps)]
+    threads = [threading.Thread(target=run, args=(interp, code)) for interp, code in zip(interps, codes)]
+
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - start
+
+    for interp in interps:
+        interpreters.destroy(interp)
+
+    rate = ninterps * (count // batch * batch) / elapsed
+    base = base or rate
+    print("{0:3} interpreters {1:10.0f} datagrams/s  speedup {2:.2f}".format(ninterps, rate, rate / base))
@@ -0,0 +1,63 @@
+#!/usr/bin/python3
+
+# Thread scaling benchmark: each thread drives its own pair of udp sockets
+# on a shared stack, the total datagram rate is reported for 1 to N threads.
+# On a free-threaded python build the rate should grow with the threads.
+
+import iothpy
+
+import sys
+import time
+import threading
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [threads] [datagrams per thread]\ne,g: {1} vxvde://234.0.0.1 8 100000\n\n".format(name, name))
+    exit(1)
+
+max_threads = int(sys.argv[2]) if len(sys.argv) > 2 else 8
+count = int(sys.argv[3]) if len(sys.argv) > 3 else 100000
+batch = 64
+payload = b"x" * 16
+
+stack = iothpy.Stack("vdestack", sys.argv[1])
+ifindex = stack.if_nametoindex("vde0")
+stack.linksetupdown(ifindex, 1)
+stack.ipaddr_add(iothpy.AF_INET, "10.0.0.1", 24, ifindex)
+
+def worker(port, barrier):
+    receiver = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+    receiver.bind(("10.0.0.1", port))
+    sender = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+    dest = iothpy.Address("10.0.0.1", port)
+    buf = bytearray(64)
+
+    barrier.wait()
+    for i in range(count // batch):
+        for j in range(batch):
+            sender.sendto(payload, dest)
+        for j in range(batch):
+            receiver.recv_into(buf)
+
+    receiver.close()
+    sender.close()
+
+gil = sys._is_gil_enabled() if hasattr(sys, "_is_gil_enabled") else True
+print("GIL enabled:", gil)
+
+base = None
+for nthreads in range(1, max_threads + 1):
+    barrier = threading.Barrier(nthreads + 1)
+    threads = [threading.Thread(target=worker, args=(5000 + i, barrier)) for i in range(nthreads)]
+    for t in threads:
+        t.start()
+
+    barrier.wait()
+    start = time.perf_counter()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - start
+
+    rate = nthreads * (count // batch * batch) / elapsed
+    base = base or rate
+    print("{0:3} threads {1:10.0f} datagrams/s  speedup {2:.2f}".format(nthreads, rate, rate / base))
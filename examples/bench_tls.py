@@ -0,0 +1,128 @@
+#!/usr/bin/python3
+
+# TLS throughput benchmark: a client on one stack sends megabytes of data
+# in chunks of the given size over TLS to a server on another stack, which
+# answers once it received all of it. Reports the megabytes and the chunks
+# per second, the small chunks show the cost of each record.
+# Without the python argument both ends use iothpy.tls. With it they pump
+# the ssl.MemoryBIO objects of an ssl.SSLObject in python, the way TLS on
+# ioth sockets was done before iothpy.tls.
+# A self-signed certificate is generated with the openssl command.
+
+import iothpy
+import iothpy.tls
+
+import os
+import ssl
+import subprocess
+import sys
+import tempfile
+import time
+import threading
+
+if(len(sys.argv) < 2):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl [megabytes] [chunk] [python]\ne,g: {1} vxvde://234.0.0.1 200 16384 python\n\n".format(name, name))
+    exit(1)
+
+megabytes = int(sys.argv[2]) if len(sys.argv) > 2 else 200
+chunk = int(sys.argv[3]) if len(sys.argv) > 3 else 16384
+python = len(sys.argv) > 4 and sys.argv[4] == "python"
+
+def new_stack(addr):
+    stack = iothpy.Stack("vdestack", sys.argv[1])
+    ifindex = stack.if_nametoindex("vde0")
+    stack.linksetupdown(ifindex, 1)
+    stack.ipaddr_add(iothpy.AF_INET, addr, 24, ifindex)
+    return stack
+
+class PythonTLS:
+    """TLS over an ioth socket with the memory BIOs pumped in python"""
+    def __init__(self, sock, context, server_side, server_hostname=None):
+        self.sock = sock
+        self.incoming = ssl.MemoryBIO()
+        self.outgoing = ssl.MemoryBIO()
+        self.obj = context.wrap_bio(self.incoming, self.outgoing, server_side, server_hostname)
+        self._do(self.obj.do_handshake)
+
+    def _do(self, op, *args):
+        while True:
+            try:
+                res = op(*args)
+            except ssl.SSLWantReadError:
+                self._flush()
+                data = self.sock.recv(32768)
+                if data:
+                    self.incoming.write(data)
+                else:
+                    self.incoming.write_eof()
+                continue
+            self._flush()
+            return res
+
+    def _flush(self):
+        data = self.outgoing.read()
+        if data:
+            self.sock.sendall(data)
+
+    def recv(self, n):
+        return self._do(self.obj.read, n)
+
+    def sendall(self, data):
+        self._do(self.obj.write, data)
+
+def wrap(sock, context, server_side, server_hostname=None):
+    if python:
+        return PythonTLS(sock, context, server_side, server_hostname)
+    return iothpy.tls.wrap_socket(sock, context, server_side=server_side, server_hostname=server_hostname)
+
+tmpdir = tempfile.TemporaryDirectory()
+cert = os.path.join(tmpdir.name, "cert.pem")
+key = os.path.join(tmpdir.name, "key.pem")
+subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1",
+                "-subj", "/CN=iothpy", "-keyout", key, "-out", cert],
+               check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+server_context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+server_context.load_cert_chain(cert, key)
+client_context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+client_context.load_verify_locations(cert)
+
+server_stack = new_stack("10.0.0.1")
+client_stack = new_stack("10.0.0.2")
+
+sock = server_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+sock.bind(('', 5000))
+sock.listen(1)
+
+total = megabytes * 1024 * 1024 // chunk * chunk
+
+def server():
+    conn, addr = sock.accept()
+    tls = wrap(conn, server_context, True)
+    received = 0
+    while received < total:
+        data = tls.recv(65536)
+        if not data:
+            break
+        received += len(data)
+    tls.sendall(b"k")
+    conn.close()
+
+threading.Thread(target = server, daemon=True).start()
+
+c = client_stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+c.connect(("10.0.0.1", 5000))
+tls = wrap(c, client_context, False, "iothpy")
+data = os.urandom(chunk)
+
+start = time.perf_counter()
+for i in range(total // chunk):
+    tls.sendall(data)
+tls.recv(1)
+elapsed = time.perf_counter() - start
+c.close()
+
+print("{0}: {1} MB in chunks of {2} bytes in {3:.3f}s: {4:.1f} MB/s, {5:.0f} chunks/s".format(
+      "python" if python else "iothpy.tls", total / (1024 * 1024), chunk, elapsed,
+      total / (1024 * 1024) / elapsed, total // chunk / elapsed))
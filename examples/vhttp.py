@@ -17,6 +17,8 @@ PORT = 8000
 
 Handler = http.server.SimpleHTTPRequestHandler
 
-with socketserver.TCPServer(("", PORT), Handler) as httpd:
+# One thread per connection, the override makes the server wait on the
+# stack sockets with iothpy.IothSelector
+with socketserver.ThreadingTCPServer(("", PORT), Handler) as httpd:
     print("serving at port", PORT)
     httpd.serve_forever()
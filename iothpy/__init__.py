@@ -65,12 +65,37 @@ For more information on stack configuration see help("iothpy.stack")
 # Import the Stack type
 from iothpy.stack import Stack
 
+# Import the StackPool type
+from iothpy.stackpool import StackPool
+
 # Import functions from the c module
 from iothpy._iothpy import getdefaulttimeout, setdefaulttimeout, CMSG_LEN, CMSG_SPACE, close, timeout
 
+# Import the pre-parsed address type
+from iothpy._iothpy import Address
+
+# Import the native relay between two sockets
+from iothpy._iothpy import relay
+
+# Import the submission/completion ring type
+from iothpy._iothpy import IORing
+
+# Import the cooperative mode functions
+from iothpy._iothpy import get_wait_hook, set_wait_hook
+from iothpy.cooperative import use_gevent
+
+# Import the selector for ioth sockets
+from iothpy.selector import IothSelector
+
 # Import the function to override the built-in socket module
 from iothpy.override import override_socket_module
 
+# Import the functions of the per context stack selection
+from iothpy.dispatch import current_stack, install_socket_dispatch
+
+# Import the operation deadline scope
+from iothpy.deadline import deadline, current_deadline
+
 # Import functions and constants from the builtin socket module 
 from socket import (
     # Convertion utils
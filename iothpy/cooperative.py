@@ -0,0 +1,58 @@
+# 
+# This file is part of the iothpy library: python support for ioth.
+# 
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License 
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Cooperative mode
+
+Wait hooks for greenlet libraries: with a hook installed the blocking
+operations of the sockets switch to other greenlets instead of blocking
+the whole thread.
+"""
+
+from iothpy._iothpy import set_wait_hook
+
+class _WaitTimeout(Exception):
+    pass
+
+def gevent_wait_hook():
+    """ Return a wait hook waiting on the gevent hub """
+    from gevent.socket import wait_read, wait_write
+
+    def hook(fd, writing, timeout):
+        try:
+            if writing:
+                wait_write(fd, timeout, _WaitTimeout)
+            else:
+                wait_read(fd, timeout, _WaitTimeout)
+        except _WaitTimeout:
+            return False
+        return True
+
+    return hook
+
+def use_gevent():
+    """ Make the sockets cooperate with gevent
+
+    Call it before creating the sockets, the file descriptors of the
+    sockets created before keep blocking the thread when they have no
+    timeout.
+    """
+    set_wait_hook(gevent_wait_hook())
@@ -0,0 +1,310 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cork.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <ioth.h>
+
+/* Delay before retrying a flush that could not send the whole buffer */
+#define CORK_RETRY_NS 1000000LL
+
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static int timer_running;       /* The thread is started, reset in the child of a fork */
+static struct cork* timer_list;
+
+struct cork*
+cork_new(int fd)
+{
+    struct cork* c = calloc(1, sizeof(struct cork));
+    if (c == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&c->lock, NULL) != 0) {
+        free(c);
+        return NULL;
+    }
+    c->fd = fd;
+    c->delay = -1;
+    return c;
+}
+
+/* Remove c from the timer list, the lock of the timer must be held */
+static void
+timer_unlink(struct cork* c)
+{
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        timer_list = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    c->next = c->prev = NULL;
+    __atomic_store_n(&c->scheduled, 0, __ATOMIC_RELAXED);
+}
+
+void
+cork_free(struct cork* c)
+{
+    /* The timer only uses the corks of its list while holding its lock */
+    pthread_mutex_lock(&timer_lock);
+    if (c->scheduled)
+        timer_unlink(c);
+    pthread_mutex_unlock(&timer_lock);
+
+    pthread_mutex_destroy(&c->lock);
+    free(c->buf);
+    free(c);
+}
+
+int
+cork_reserve(struct cork* c, size_t n)
+{
+    size_t pending = cork_pending(c);
+
+    if (c->size - c->len >= n)
+        return 0;
+
+    if (c->size - pending < n) {
+        size_t size = c->size ? c->size : 4096;
+        while (size - pending < n)
+            size *= 2;
+        char* buf = malloc(size);
+        if (buf == NULL)
+            return -1;
+        if (pending > 0)
+            memcpy(buf, c->buf + c->off, pending);
+        free(c->buf);
+        c->buf = buf;
+        c->size = size;
+    }
+    else {
+        memmove(c->buf, c->buf + c->off, pending);
+    }
+
+    c->off = 0;
+    c->len = pending;
+    return 0;
+}
+
+static void
+timespec_add_ns(struct timespec* ts, long long ns)
+{
+    ts->tv_sec += ns / 1000000000LL;
+    ts->tv_nsec += ns % 1000000000LL;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int
+timespec_before(const struct timespec* a, const struct timespec* b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+    Send the buffer of c without blocking, the lock of c must be held.
+    Returns 1 when the buffer is empty, 0 if the socket is not writable.
+*/
+static int
+cork_flush_nonblock(struct cork* c)
+{
+    while (cork_pending(c) > 0) {
+        if (c->fd == -1) {
+            c->off = c->len = 0;
+            break;
+        }
+
+        ssize_t n = ioth_send(c->fd, c->buf + c->off, cork_pending(c), MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            /* The data is lost as it would be by a failed send() */
+            c->error = errno;
+            c->off = c->len = 0;
+            break;
+        }
+        c->off += n;
+        c->flushes++;
+        c->timer_flushes++;
+    }
+
+    c->off = c->len = 0;
+    return 1;
+}
+
+static void*
+timer_thread(void* arg)
+{
+    struct timespec now, next;
+    struct cork *c, *following;
+    int have_next;
+
+    pthread_mutex_lock(&timer_lock);
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        have_next = 0;
+
+        for (c = timer_list; c != NULL; c = following) {
+            following = c->next;
+
+            if (!timespec_before(&now, &c->deadline)) {
+                /* A thread busy with the buffer flushes it by itself */
+                if (pthread_mutex_trylock(&c->lock) == 0) {
+                    int done = c->flushing || cork_flush_nonblock(c);
+                    pthread_mutex_unlock(&c->lock);
+                    if (done) {
+                        timer_unlink(c);
+                        continue;
+                    }
+                }
+
+                /* Try again soon, the socket was busy or not writable */
+                c->deadline = now;
+                timespec_add_ns(&c->deadline, CORK_RETRY_NS);
+            }
+
+            if (!have_next || timespec_before(&c->deadline, &next)) {
+                next = c->deadline;
+                have_next = 1;
+            }
+        }
+
+        if (have_next)
+            pthread_cond_timedwait(&timer_cond, &timer_lock, &next);
+        else
+            pthread_cond_wait(&timer_cond, &timer_lock);
+    }
+
+    return NULL;
+}
+
+/* Start the timer thread, the lock of the timer must be held. Returns an errno value */
+static int
+timer_start(void)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+    pthread_attr_t thread_attr;
+    int err;
+
+    /* The deadlines are on the monotonic clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    err = pthread_cond_init(&timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (err != 0)
+        return err;
+
+    /* The thread lives as long as the process, it sleeps when no socket is corked */
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&thread, &thread_attr, timer_thread, NULL);
+    pthread_attr_destroy(&thread_attr);
+    if (err == 0)
+        timer_running = 1;
+    return err;
+}
+
+/* The timer thread does not hold its lock or a cork lock while another thread forks */
+static void
+timer_atfork_prepare(void)
+{
+    pthread_mutex_lock(&timer_lock);
+}
+
+static void
+timer_atfork_parent(void)
+{
+    pthread_mutex_unlock(&timer_lock);
+}
+
+/*
+    The child has no timer thread, the next cork_schedule() starts a new
+    one. The timer of the parent sends the buffers scheduled before the
+    fork, the child drops its copy so that they are not sent twice.
+*/
+static void
+timer_atfork_child(void)
+{
+    while (timer_list != NULL) {
+        timer_list->off = timer_list->len = 0;
+        timer_unlink(timer_list);
+    }
+    timer_running = 0;
+    pthread_mutex_unlock(&timer_lock);
+}
+
+static void
+timer_init(void)
+{
+    pthread_atfork(timer_atfork_prepare, timer_atfork_parent, timer_atfork_child);
+}
+
+int
+cork_schedule(struct cork* c)
+{
+    if (__atomic_load_n(&c->scheduled, __ATOMIC_RELAXED))
+        return 0;
+
+    pthread_once(&timer_once, timer_init);
+
+    pthread_mutex_lock(&timer_lock);
+    if (!timer_running) {
+        int err = timer_start();
+        if (err != 0) {
+            pthread_mutex_unlock(&timer_lock);
+            errno = err;
+            return -1;
+        }
+    }
+    if (!c->scheduled) {
+        pthread_mutex_lock(&c->lock);
+        long long delay = c->delay;
+        pthread_mutex_unlock(&c->lock);
+
+        if (delay >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &c->deadline);
+            timespec_add_ns(&c->deadline, delay);
+
+            c->prev = NULL;
+            c->next = timer_list;
+            if (timer_list != NULL)
+                timer_list->prev = c;
+            timer_list = c;
+            __atomic_store_n(&c->scheduled, 1, __ATOMIC_RELAXED);
+            pthread_cond_signal(&timer_cond);
+        }
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return 0;
+}
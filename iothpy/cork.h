@@ -0,0 +1,59 @@
+#ifndef IOTHPY_CORK_H
+#define IOTHPY_CORK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+    Write coalescing of a socket: the small writes are copied to a buffer
+    sent with a single system call when it reaches a size threshold, when
+    it is flushed explicitly or when a short delay expires after the first
+    buffered byte. The delays are handled by a timer thread shared by all
+    the sockets, which sends the expired buffers without blocking. The
+    child of a fork starts its own thread when it arms a timer.
+    It does not use the python API: the timer runs without the GIL.
+*/
+struct cork {
+    pthread_mutex_t lock;       /* Protects all the fields, the timer runs concurrently */
+    int fd;                     /* -1 once the socket is closed */
+    char* buf;
+    size_t off;                 /* Data waiting to be sent is buf[off:len] */
+    size_t len;
+    size_t size;
+    size_t threshold;           /* Buffered bytes that trigger a flush, 0 when disabled */
+    long long delay;            /* Nanoseconds before the timer flushes, -1 for no timer */
+    int flushing;               /* A thread is sending the buffer, the timer leaves it alone */
+    int error;                  /* errno of a failed timer flush, reported by the next write */
+
+    /* Timer list, protected by the lock of the timer */
+    int scheduled;
+    struct timespec deadline;
+    struct cork* next;
+    struct cork* prev;
+
+    /* Counters */
+    unsigned long long writes;          /* Writes to the socket */
+    unsigned long long flushes;         /* Sends to the stack */
+    unsigned long long timer_flushes;   /* Sends to the stack made by the timer */
+};
+
+/* Allocate the cork of fd, returns NULL on failure */
+struct cork* cork_new(int fd);
+
+/* Remove the cork from the timer and free it, the buffered data is lost */
+void cork_free(struct cork* c);
+
+/* Number of bytes waiting in the buffer */
+#define cork_pending(c) ((c)->len - (c)->off)
+
+/* Make room for n more bytes at the end of the buffer, the lock must be held. Returns -1 on failure */
+int cork_reserve(struct cork* c, size_t n);
+
+/*
+    Arm the timer of c if it is not armed, the lock must not be held.
+    Returns -1 with errno set if the timer thread can't be started.
+*/
+int cork_schedule(struct cork* c);
+
+#endif /* IOTHPY_CORK_H */
@@ -0,0 +1,73 @@
+# 
+# This file is part of the iothpy library: python support for ioth.
+# 
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License 
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+"""Deadline module
+
+This module defines deadline(), a scope bounding the total time the ioth
+sockets spend waiting: every blocking operation of the scope, on any
+socket, waits at most until the deadline and raises iothpy.timeout once
+it has passed. The deadline is a contextvars variable, so each thread
+and each asyncio task has its own.
+
+See help("iothpy.deadline") for more information.
+"""
+
+import iothpy._iothpy as _iothpy
+
+# Read by the C sockets before each wait
+_current_deadline = _iothpy.deadline_var
+
+def current_deadline():
+    """Return the deadline of the current scope as a time of time.monotonic(), None if there is none"""
+    return _current_deadline.get(None)
+
+class deadline:
+    """Context manager bounding the waits of the sockets used in its scope
+
+    'when' is a time of time.monotonic(), in seconds. Inside the scope
+    each wait of a socket lasts at most until then, or less if the timeout
+    or the set_deadline() of the socket come first, so a request handler
+    gets a total budget instead of one timeout per call:
+
+        with iothpy.deadline(time.monotonic() + 0.5):
+            request = conn.recv_until(b"\\r\\n\\r\\n")
+            conn.sendall(handle(request))
+
+    A nested scope can only shorten the deadline of the outer one.
+    Entering it returns the deadline in effect.
+    """
+    __slots__ = ("when", "_token")
+
+    def __init__(self, when):
+        self.when = when
+        self._token = None
+
+    def __enter__(self):
+        if self._token is not None:
+            raise RuntimeError("the deadline is already entered")
+        outer = _current_deadline.get(None)
+        when = self.when if outer is None else min(outer, self.when)
+        self._token = _current_deadline.set(when)
+        return when
+
+    def __exit__(self, *args):
+        _current_deadline.reset(self._token)
+        self._token = None
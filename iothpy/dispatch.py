@@ -0,0 +1,168 @@
+# 
+# This file is part of the iothpy library: python support for ioth.
+# 
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License 
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+"""Dispatch module
+
+This module routes the built-in socket module to the stack activated in
+the current context with Stack.activate(), a contextvars variable: every
+thread and every asyncio task can use its own stack through unmodified
+code using the socket module, while the code running outside of any
+activation keeps using the kernel stack.
+
+See help("iothpy.Stack.activate") for more information.
+"""
+
+from iothpy.msocket import MSocket
+from iothpy.selector import IothSelector
+import iothpy._iothpy as _iothpy
+
+import contextvars
+import threading
+
+_current_stack = contextvars.ContextVar("iothpy_stack", default=None)
+
+def current_stack():
+    """Return the stack activated in the current context, None if there is none"""
+    return _current_stack.get()
+
+class StackActivation:
+    """Context manager returned by Stack.activate()
+
+    Entering it makes the stack the current one for the calling thread or
+    asyncio task, exiting it restores the previous one.
+    """
+    __slots__ = ("stack", "_token")
+
+    def __init__(self, stack):
+        self.stack = stack
+        self._token = None
+
+    def __enter__(self):
+        if self._token is not None:
+            raise RuntimeError("the stack activation is already entered")
+        self._token = _current_stack.set(self.stack)
+        return self.stack
+
+    def __exit__(self, *args):
+        _current_stack.reset(self._token)
+        self._token = None
+
+class _DispatchMeta(type):
+    # The sockets of the activated stacks are MSocket objects, make them
+    # pass the isinstance(sock, socket.socket) checks of the library code
+    def __instancecheck__(cls, obj):
+        return type.__instancecheck__(cls, obj) or ("_dispatch" in cls.__dict__ and isinstance(obj, MSocket))
+
+    def __subclasscheck__(cls, sub):
+        return type.__subclasscheck__(cls, sub) or ("_dispatch" in cls.__dict__ and issubclass(sub, MSocket))
+
+_install_lock = threading.Lock()
+_installed = False
+
+def install_socket_dispatch():
+    """Make the built-in socket module dispatch to the current stack
+
+    socket.socket, getaddrinfo, create_connection, create_server, close
+    and the default timeout functions look up the stack activated in the
+    current context, and fall back to the previous definitions when there
+    is none. The selectors are replaced as in override_socket_module().
+    Stack.activate() calls it, call it explicitly before importing modules
+    that keep a reference to socket.socket (from socket import socket).
+    Calling it again has no effect.
+    """
+    global _installed
+
+    with _install_lock:
+        if _installed:
+            return
+        _installed = True
+
+        import socket as socket_module
+        import selectors
+        import socketserver
+
+        default_socket = socket_module.socket
+        default_getaddrinfo = socket_module.getaddrinfo
+        default_create_connection = socket_module.create_connection
+        default_create_server = socket_module.create_server
+        default_close = socket_module.close
+        default_getdefaulttimeout = socket_module.getdefaulttimeout
+        default_setdefaulttimeout = socket_module.setdefaulttimeout
+
+        class socket(default_socket, metaclass = _DispatchMeta):
+            __slots__ = ()
+            _dispatch = True
+
+            def __new__(cls, family=-1, type=-1, proto=-1, fileno=None):
+                # Subclasses and the sockets wrapping an existing kernel fd,
+                # like the ones of accept() and dup(), stay on the kernel
+                if cls is socket and fileno is None:
+                    stack = _current_stack.get()
+                    if stack is not None:
+                        return stack.socket(family, type, proto)
+                return default_socket.__new__(cls, family, type, proto, fileno)
+
+        socket.__module__ = default_socket.__module__
+        socket.__qualname__ = default_socket.__qualname__
+        socket.__doc__ = default_socket.__doc__
+
+        def getaddrinfo(host, port, family=0, type=0, proto=0, flags=0):
+            stack = _current_stack.get()
+            if stack is None:
+                return default_getaddrinfo(host, port, family, type, proto, flags)
+            return stack.getaddrinfo(host, port, family, type, proto, flags)
+
+        def create_connection(*args, **kwargs):
+            stack = _current_stack.get()
+            if stack is None:
+                return default_create_connection(*args, **kwargs)
+            return stack.create_connection(*args, **kwargs)
+
+        def create_server(*args, **kwargs):
+            stack = _current_stack.get()
+            if stack is None:
+                return default_create_server(*args, **kwargs)
+            return stack.create_server(*args, **kwargs)
+
+        def close(fd):
+            if _current_stack.get() is None:
+                return default_close(fd)
+            return _iothpy.close(fd)
+
+        def getdefaulttimeout():
+            if _current_stack.get() is None:
+                return default_getdefaulttimeout()
+            return _iothpy.getdefaulttimeout()
+
+        # The default timeout is shared by the kernel and the stacks
+        def setdefaulttimeout(timeout):
+            default_setdefaulttimeout(timeout)
+            _iothpy.setdefaulttimeout(timeout)
+
+        for f in (getaddrinfo, create_connection, create_server, close,
+                  getdefaulttimeout, setdefaulttimeout):
+            f.__module__ = socket_module.__name__
+            f.__doc__ = getattr(socket_module, f.__name__).__doc__
+            socket_module.__dict__[f.__name__] = f
+        socket_module.__dict__["socket"] = socket
+
+        selectors.DefaultSelector = IothSelector
+        socketserver._ServerSelector = IothSelector
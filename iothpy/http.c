@@ -0,0 +1,1151 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "http.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <ioth.h>
+
+/* Size of the buffer used to send files and relay proxy responses */
+#define HTTP_CHUNK (64 * 1024)
+
+/* Connections accepted at most for each readable event of the listening socket */
+#define HTTP_ACCEPT_BATCH 64
+
+enum conn_state {
+    CONN_READ,                  /* Reading a request */
+    CONN_WRITE,                 /* Sending a response */
+    CONN_CONNECT,               /* Proxy: connecting to the upstream server */
+    CONN_FORWARD,               /* Proxy: sending the request upstream */
+    CONN_RELAY,                 /* Proxy: relaying the response to the client */
+};
+
+struct http_conn {
+    int fd;
+    int upstream;               /* Proxy socket, -1 if none */
+    short up_revents;           /* Events of upstream reported by the last poll */
+    enum conn_state state;
+    int keep_alive;             /* Read the next request after the response */
+    long long deadline;         /* Monotonic milliseconds */
+
+    char* in;
+    size_t in_len;
+    size_t in_cap;
+    size_t scanned;             /* Bytes of in searched for the end of the head */
+
+    /* The current request, its strings are offsets in in */
+    size_t head_len;            /* 0 until the head is parsed */
+    size_t body_len;
+    size_t method_len;
+    size_t target_off;
+    size_t target_len;
+    size_t headers_off;
+    size_t headers_len;
+    int head_only;              /* HEAD request, no body in the response */
+    int continued;              /* 100 Continue sent */
+
+    char* out;                  /* Data to send is out[out_off:out_len] */
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+    int file;                   /* File whose file_off..file_end range follows out, -1 if none */
+    off_t file_off;
+    off_t file_end;
+
+    char* fwd;                  /* Proxy: request for upstream is fwd[fwd_off:fwd_len] */
+    size_t fwd_off;
+    size_t fwd_len;
+    size_t fwd_cap;
+    unsigned long long relayed;
+};
+
+static long long
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Make room for need bytes in buf, returns -1 on failure */
+static int
+buf_reserve(char** buf, size_t* cap, size_t need)
+{
+    if (need <= *cap)
+        return 0;
+
+    size_t size = *cap < 4096 ? 4096 : *cap;
+    while (size < need)
+        size *= 2;
+
+    char* p = realloc(*buf, size);
+    if (p == NULL)
+        return -1;
+    *buf = p;
+    *cap = size;
+    return 0;
+}
+
+static int
+buf_append(char** buf, size_t* len, size_t* cap, const char* data, size_t size)
+{
+    if (buf_reserve(buf, cap, *len + size) < 0)
+        return -1;
+    memcpy(*buf + *len, data, size);
+    *len += size;
+    return 0;
+}
+
+static const char*
+status_reason(int status)
+{
+    switch (status) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 411: return "Length Required";
+    case 413: return "Content Too Large";
+    case 415: return "Unsupported Media Type";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Unknown";
+    }
+}
+
+static const struct {
+    const char* ext;
+    const char* type;
+} mime_types[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "text/javascript"},
+    {"mjs", "text/javascript"},
+    {"json", "application/json"},
+    {"txt", "text/plain"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"ico", "image/vnd.microsoft.icon"},
+    {"pdf", "application/pdf"},
+    {"wasm", "application/wasm"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+    {"mp3", "audio/mpeg"},
+    {"gz", "application/gzip"},
+    {"zip", "application/zip"},
+};
+
+static const char*
+mime_type(const char* name)
+{
+    const char* dot = strrchr(name, '.');
+    if (dot != NULL && strchr(dot, '/') == NULL) {
+        for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+            if (strcasecmp(dot + 1, mime_types[i].ext) == 0)
+                return mime_types[i].type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+/* The Date header changes once per second, format it once per second */
+static const char*
+http_date(struct http_loop* loop)
+{
+    time_t now = time(NULL);
+    if (now != loop->date_time) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(loop->date, sizeof(loop->date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        loop->date_time = now;
+    }
+    return loop->date;
+}
+
+static int
+conn_send(struct http_conn* c, const char* buf, size_t len)
+{
+    return ioth_send(c->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static struct http_conn*
+conn_new(int fd)
+{
+    struct http_conn* c = calloc(1, sizeof(struct http_conn));
+    if (c == NULL)
+        return NULL;
+    c->fd = fd;
+    c->upstream = -1;
+    c->file = -1;
+    c->state = CONN_READ;
+    return c;
+}
+
+static void
+conn_free(struct http_loop* loop, struct http_conn* c)
+{
+    ioth_close(c->fd);
+    if (c->upstream != -1)
+        ioth_close(c->upstream);
+    if (c->file != -1)
+        close(c->file);
+    free(c->in);
+    free(c->out);
+    free(c->fwd);
+    free(c);
+    __atomic_sub_fetch(&loop->srv->active, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    Queue the head of a response in out, followed by extra header lines.
+    Content-Length is omitted when length is negative, the statuses without
+    a body never have one. Returns -1 on failure.
+*/
+static int
+conn_head(struct http_loop* loop, struct http_conn* c, int status, const char* type,
+          long long length, const char* extra, size_t extra_len)
+{
+    char head[512];
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nServer: iothpy\r\nDate: %s\r\n",
+                     status, status_reason(status), http_date(loop));
+    if (length >= 0 && status >= 200 && status != 204 && status != 304)
+        n += snprintf(head + n, sizeof(head) - n, "Content-Length: %lld\r\n", length);
+    if (type != NULL)
+        n += snprintf(head + n, sizeof(head) - n, "Content-Type: %s\r\n", type);
+    n += snprintf(head + n, sizeof(head) - n, "Connection: %s\r\n",
+                  c->keep_alive ? "keep-alive" : "close");
+
+    if (status >= 400)
+        __atomic_add_fetch(&loop->srv->errors, 1, __ATOMIC_RELAXED);
+
+    if (buf_append(&c->out, &c->out_len, &c->out_cap, head, n) < 0 ||
+        buf_append(&c->out, &c->out_len, &c->out_cap, extra, extra_len) < 0 ||
+        buf_append(&c->out, &c->out_len, &c->out_cap, "\r\n", 2) < 0)
+        return -1;
+    c->state = CONN_WRITE;
+    return 0;
+}
+
+/* Queue a short plain text response with status, closing if requested */
+static int
+conn_error(struct http_loop* loop, struct http_conn* c, int status, int close)
+{
+    char body[128];
+    int n = snprintf(body, sizeof(body), "%d %s\n", status, status_reason(status));
+
+    if (close)
+        c->keep_alive = 0;
+    c->out_off = c->out_len = 0;
+    if (conn_head(loop, c, status, "text/plain", n, "", 0) < 0)
+        return -1;
+    if (!c->head_only && buf_append(&c->out, &c->out_len, &c->out_cap, body, n) < 0)
+        return -1;
+    return 0;
+}
+
+/* True if the comma separated list value contains token */
+static int
+has_token(const char* value, size_t len, const char* token)
+{
+    size_t tlen = strlen(token);
+    size_t i = 0;
+
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+            i++;
+        size_t start = i;
+        while (i < len && value[i] != ',')
+            i++;
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t'))
+            end--;
+        if (end - start == tlen && strncasecmp(value + start, token, tlen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int
+is_header(const char* name, size_t len, const char* header)
+{
+    return len == strlen(header) && strncasecmp(name, header, len) == 0;
+}
+
+/*
+    Parse the head of the request, in[0:head_len]. Returns 0 or the status
+    of the error response.
+*/
+static int
+conn_parse_head(struct http_conn* c)
+{
+    const char* in = c->in;
+    const char* end = in + c->head_len - 2;
+    const char* eol = memmem(in, c->head_len, "\r\n", 2);
+    int close_token = 0, keep_alive_token = 0, has_length = 0;
+    unsigned long long length = 0;
+
+    c->head_only = 0;
+
+    /* Request line: method SP target SP version */
+    const char* sp1 = memchr(in, ' ', eol - in);
+    if (sp1 == NULL || sp1 == in)
+        return 400;
+    const char* sp2 = memchr(sp1 + 1, ' ', eol - sp1 - 1);
+    if (sp2 == NULL || sp2 == sp1 + 1)
+        return 400;
+
+    const char* version = sp2 + 1;
+    size_t version_len = eol - version;
+    if (version_len != 8 || memcmp(version, "HTTP/1.", 7) != 0)
+        return (version_len > 5 && memcmp(version, "HTTP/", 5) == 0) ? 505 : 400;
+    if (version[7] != '0' && version[7] != '1')
+        return 505;
+    int minor = version[7] - '0';
+
+    c->method_len = sp1 - in;
+    c->target_off = sp1 + 1 - in;
+    c->target_len = sp2 - sp1 - 1;
+    c->headers_off = eol + 2 - in;
+    c->headers_len = end - (eol + 2);
+    c->head_only = c->method_len == 4 && memcmp(in, "HEAD", 4) == 0;
+
+    for (const char* p = eol + 2; p < end; p = eol + 2) {
+        eol = memmem(p, end + 2 - p, "\r\n", 2);
+        if (*p == ' ' || *p == '\t')
+            return 400;     /* Obsolete line folding */
+
+        const char* colon = memchr(p, ':', eol - p);
+        if (colon == NULL || colon == p)
+            return 400;
+        size_t name_len = colon - p;
+        if (memchr(p, ' ', name_len) != NULL || memchr(p, '\t', name_len) != NULL)
+            return 400;
+
+        const char* value = colon + 1;
+        const char* value_end = eol;
+        while (value < value_end && (*value == ' ' || *value == '\t'))
+            value++;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            value_end--;
+        size_t value_len = value_end - value;
+
+        if (is_header(p, name_len, "content-length")) {
+            unsigned long long n = 0;
+            if (value_len == 0 || value_len > 18)
+                return 400;
+            for (size_t i = 0; i < value_len; i++) {
+                if (value[i] < '0' || value[i] > '9')
+                    return 400;
+                n = n * 10 + (value[i] - '0');
+            }
+            if (has_length && n != length)
+                return 400;
+            has_length = 1;
+            length = n;
+        }
+        else if (is_header(p, name_len, "transfer-encoding")) {
+            /* Chunked request bodies are not supported */
+            return 501;
+        }
+        else if (is_header(p, name_len, "connection")) {
+            close_token |= has_token(value, value_len, "close");
+            keep_alive_token |= has_token(value, value_len, "keep-alive");
+        }
+        else if (is_header(p, name_len, "expect")) {
+            if (value_len != 12 || strncasecmp(value, "100-continue", 12) != 0)
+                return 417;
+            c->continued = -1;  /* Send 100 Continue before reading the body */
+        }
+    }
+
+    c->keep_alive = minor == 1 ? !close_token : keep_alive_token;
+    c->body_len = length;
+    return 0;
+}
+
+static int
+hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+/*
+    Map the path of a static route to a file name relative to the route
+    directory, decoding the %XX escapes. Returns -1 if the path leaves the
+    directory or is malformed.
+*/
+static int
+static_path(const char* path, size_t len, char* name, size_t size)
+{
+    char* decoded = malloc(len + 1);
+    size_t n = 0, out = 0;
+
+    if (decoded == NULL)
+        return -1;
+
+    for (size_t i = 0; i < len; i++) {
+        char ch = path[i];
+        if (ch == '%') {
+            int hi = i + 2 < len ? hex_value(path[i + 1]) : -1;
+            int lo = i + 2 < len ? hex_value(path[i + 2]) : -1;
+            if (hi < 0 || lo < 0 || (hi == 0 && lo == 0))
+                goto bad;
+            ch = (char)(hi * 16 + lo);
+            i += 2;
+        }
+        decoded[n++] = ch;
+    }
+
+    /* Join the segments skipping the empty and the "." ones, reject ".." */
+    for (size_t i = 0; i < n;) {
+        while (i < n && decoded[i] == '/')
+            i++;
+        size_t start = i;
+        while (i < n && decoded[i] != '/')
+            i++;
+        size_t seg = i - start;
+        if (seg == 0 || (seg == 1 && decoded[start] == '.'))
+            continue;
+        if (seg == 2 && decoded[start] == '.' && decoded[start + 1] == '.')
+            goto bad;
+        if (out + seg + 2 > size)
+            goto bad;
+        if (out > 0)
+            name[out++] = '/';
+        memcpy(name + out, decoded + start, seg);
+        out += seg;
+    }
+
+    if (out == 0)
+        name[out++] = '.';
+    name[out] = '\0';
+    free(decoded);
+    return 0;
+
+bad:
+    free(decoded);
+    return -1;
+}
+
+static int
+open_status(int err)
+{
+    if (err == ENOENT || err == ENOTDIR || err == ENAMETOOLONG || err == ELOOP)
+        return 404;
+    if (err == EACCES || err == EPERM)
+        return 403;
+    return 500;
+}
+
+static int
+serve_static(struct http_loop* loop, struct http_conn* c, struct http_route* route,
+             const char* path, size_t path_len)
+{
+    const char* target = c->in + c->target_off;
+    char name[4096];
+    struct stat st;
+
+    if (!c->head_only && (c->method_len != 3 || memcmp(c->in, "GET", 3) != 0)) {
+        static const char allow[] = "Allow: GET, HEAD\r\n";
+        return conn_head(loop, c, 405, NULL, 0, allow, sizeof(allow) - 1);
+    }
+
+    if (static_path(path + route->prefix_len, path_len - route->prefix_len, name, sizeof(name)) < 0)
+        return conn_error(loop, c, 404, 0);
+
+    int fd = openat(route->dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return conn_error(loop, c, open_status(errno), 0);
+    if (fstat(fd, &st) < 0)
+        goto error;
+
+    const char* served = name;
+    if (S_ISDIR(st.st_mode)) {
+        /* Like http.server, redirect to the path with the trailing slash */
+        if (path_len == 0 || path[path_len - 1] != '/') {
+            close(fd);
+            char* location = malloc(c->target_len + 16);
+            if (location == NULL)
+                return -1;
+            int n = sprintf(location, "Location: %.*s/", (int)path_len, path);
+            memcpy(location + n, target + path_len, c->target_len - path_len);
+            n += c->target_len - path_len;
+            memcpy(location + n, "\r\n", 2);
+            int res = conn_head(loop, c, 301, NULL, 0, location, n + 2);
+            free(location);
+            return res;
+        }
+
+        int index = openat(fd, "index.html", O_RDONLY | O_CLOEXEC);
+        close(fd);
+        if (index < 0)
+            return conn_error(loop, c, open_status(errno), 0);
+        fd = index;
+        served = "index.html";
+        if (fstat(fd, &st) < 0)
+            goto error;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        return conn_error(loop, c, 404, 0);
+    }
+
+    if (conn_head(loop, c, 200, mime_type(served), st.st_size, "", 0) < 0)
+        goto error;
+
+    if (c->head_only || st.st_size == 0) {
+        close(fd);
+    }
+    else {
+        c->file = fd;
+        c->file_off = 0;
+        c->file_end = st.st_size;
+    }
+    return 0;
+
+error:
+    close(fd);
+    return conn_error(loop, c, 500, 0);
+}
+
+/* Headers not forwarded to the upstream server, they describe the client connection */
+static int
+hop_by_hop(const char* name, size_t len)
+{
+    return is_header(name, len, "connection") || is_header(name, len, "keep-alive") ||
+           is_header(name, len, "proxy-connection") || is_header(name, len, "te") ||
+           is_header(name, len, "upgrade") || is_header(name, len, "expect");
+}
+
+/*
+    Open the upstream connection and queue the request for it. The
+    upstream server closes the connection after the response, which is
+    relayed as is, so the client connection is closed too.
+*/
+static int
+serve_proxy(struct http_loop* loop, struct http_conn* c, struct http_route* route)
+{
+    const char* in = c->in;
+    const char* p = in + c->headers_off;
+    const char* end = p + c->headers_len;
+
+    /* Request line and headers for the upstream server */
+    c->fwd_off = c->fwd_len = 0;
+    if (buf_append(&c->fwd, &c->fwd_len, &c->fwd_cap, in, c->target_off + c->target_len) < 0 ||
+        buf_append(&c->fwd, &c->fwd_len, &c->fwd_cap, " HTTP/1.1\r\n", 11) < 0)
+        return -1;
+    while (p < end) {
+        const char* eol = memmem(p, end + 2 - p, "\r\n", 2);
+        const char* colon = memchr(p, ':', eol - p);
+        if (!hop_by_hop(p, colon - p) &&
+            buf_append(&c->fwd, &c->fwd_len, &c->fwd_cap, p, eol + 2 - p) < 0)
+            return -1;
+        p = eol + 2;
+    }
+    if (buf_append(&c->fwd, &c->fwd_len, &c->fwd_cap, "Connection: close\r\n\r\n", 21) < 0 ||
+        buf_append(&c->fwd, &c->fwd_len, &c->fwd_cap, in + c->head_len, c->body_len) < 0)
+        return -1;
+
+    c->keep_alive = 0;
+    c->relayed = 0;
+
+    int fd = ioth_msocket(loop->srv->stack, route->addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return conn_error(loop, c, 502, 1);
+
+    int flags = ioth_fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || ioth_fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ioth_close(fd);
+        return conn_error(loop, c, 502, 1);
+    }
+    c->upstream = fd;
+    c->up_revents = 0;
+
+    if (ioth_connect(fd, (struct sockaddr*)&route->addr, route->addrlen) == 0) {
+        c->state = CONN_FORWARD;
+    }
+    else if (errno == EINPROGRESS || errno == EINTR) {
+        c->state = CONN_CONNECT;
+    }
+    else {
+        ioth_close(fd);
+        c->upstream = -1;
+        return conn_error(loop, c, 502, 1);
+    }
+    return 0;
+}
+
+static int
+serve_dynamic(struct http_loop* loop, struct http_conn* c, struct http_route* route)
+{
+    struct http_response resp = {0};
+    struct http_request req = {
+        .method = c->in,
+        .method_len = c->method_len,
+        .target = c->in + c->target_off,
+        .target_len = c->target_len,
+        .headers = c->in + c->headers_off,
+        .headers_len = c->headers_len,
+        .body = c->in + c->head_len,
+        .body_len = c->body_len,
+    };
+
+    if (loop->srv->dynamic(loop->arg, route, &req, &resp) < 0) {
+        free(resp.headers);
+        free(resp.body);
+        return -2;
+    }
+
+    int res = conn_head(loop, c, resp.status, NULL, resp.body_len, resp.headers, resp.headers_len);
+    if (res == 0 && !c->head_only && resp.status >= 200 && resp.status != 204 && resp.status != 304)
+        res = buf_append(&c->out, &c->out_len, &c->out_cap, resp.body, resp.body_len);
+    free(resp.headers);
+    free(resp.body);
+    return res;
+}
+
+/*
+    Whether the path of length path_len is under the route prefix, which
+    must end there or at a '/' so that /static does not match /staticfoo.
+*/
+static int
+route_match(struct http_route* route, const char* path, size_t path_len)
+{
+    size_t len = route->prefix_len;
+
+    if (path_len < len || memcmp(path, route->prefix, len) != 0)
+        return 0;
+    return path_len == len || route->prefix[len - 1] == '/' || path[len] == '/';
+}
+
+/*
+    Route the parsed request and queue its response. Returns 0, -1 to
+    close the connection or -2 if the dynamic callback stopped the loop.
+*/
+static int
+conn_dispatch(struct http_loop* loop, struct http_conn* c)
+{
+    struct http_server* srv = loop->srv;
+    const char* target = c->in + c->target_off;
+    size_t path_len = 0;
+
+    __atomic_add_fetch(&srv->requests, 1, __ATOMIC_RELAXED);
+    c->out_off = c->out_len = 0;
+
+    /* Only the origin form of the target is served */
+    if (target[0] != '/')
+        return conn_error(loop, c, 400, 1);
+    while (path_len < c->target_len && target[path_len] != '?' && target[path_len] != '#')
+        path_len++;
+
+    for (size_t i = 0; i < srv->nroutes; i++) {
+        struct http_route* route = &srv->routes[i];
+        if (!route_match(route, target, path_len))
+            continue;
+
+        switch (route->kind) {
+        case HTTP_ROUTE_STATIC:
+            return serve_static(loop, c, route, target, path_len);
+        case HTTP_ROUTE_PROXY:
+            return serve_proxy(loop, c, route);
+        case HTTP_ROUTE_DYNAMIC:
+            return serve_dynamic(loop, c, route);
+        }
+    }
+
+    return conn_error(loop, c, 404, 0);
+}
+
+/*
+    Parse the buffered input. Returns 1 when a request was dispatched, 0 if
+    more input is needed, -1 to close the connection and -2 to stop the loop.
+*/
+static int
+conn_parse(struct http_loop* loop, struct http_conn* c)
+{
+    struct http_server* srv = loop->srv;
+
+    if (c->head_len == 0) {
+        size_t from = c->scanned > 3 ? c->scanned - 3 : 0;
+        char* end = memmem(c->in + from, c->in_len - from, "\r\n\r\n", 4);
+        if (end == NULL) {
+            c->scanned = c->in_len;
+            if (c->in_len >= HTTP_MAX_HEAD)
+                return conn_error(loop, c, 431, 1) < 0 ? -1 : 1;
+            return 0;
+        }
+
+        /* Tolerate the empty lines before a request */
+        size_t skip = 0;
+        while (skip + 1 < c->in_len && c->in[skip] == '\r' && c->in[skip + 1] == '\n')
+            skip += 2;
+        if (skip > 0 && c->in + skip <= end) {
+            memmove(c->in, c->in + skip, c->in_len - skip);
+            c->in_len -= skip;
+            c->scanned = 0;
+            return conn_parse(loop, c);
+        }
+
+        c->head_len = end + 4 - c->in;
+        c->continued = 0;
+        int status = conn_parse_head(c);
+        if (status != 0)
+            return conn_error(loop, c, status, 1) < 0 ? -1 : 1;
+        if (c->body_len > srv->max_body)
+            return conn_error(loop, c, 413, 1) < 0 ? -1 : 1;
+    }
+
+    if (c->in_len < c->head_len + c->body_len) {
+        if (c->continued < 0) {
+            /* A client waiting for 100 Continue eventually sends the body anyway */
+            static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            conn_send(c, cont, sizeof(cont) - 1);
+            c->continued = 1;
+        }
+        return 0;
+    }
+
+    int res = conn_dispatch(loop, c);
+    return res < 0 ? res : 1;
+}
+
+/* Drop the request that was served and get ready for the next one */
+static void
+conn_next(struct http_conn* c)
+{
+    size_t used = c->head_len + c->body_len;
+
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    c->scanned = 0;
+    c->head_len = 0;
+    c->body_len = 0;
+    c->out_off = c->out_len = 0;
+    c->state = CONN_READ;
+
+    /* Release the buffers grown by large requests or responses */
+    if (c->in_len == 0 && c->in_cap > HTTP_CHUNK) {
+        free(c->in);
+        c->in = NULL;
+        c->in_cap = 0;
+    }
+    if (c->out_cap > HTTP_CHUNK) {
+        free(c->out);
+        c->out = NULL;
+        c->out_cap = 0;
+    }
+}
+
+/*
+    Send the response, reading the file that follows the head in chunks.
+    Returns 1 when done, 0 if the socket is full and -1 on errors.
+*/
+static int
+conn_flush(struct http_conn* c)
+{
+    for (;;) {
+        if (c->file != -1 && c->file_off < c->file_end) {
+            if (c->out_off == c->out_len)
+                c->out_off = c->out_len = 0;
+            if (buf_reserve(&c->out, &c->out_cap, HTTP_CHUNK) < 0)
+                return -1;
+            if (c->out_len < c->out_cap) {
+                size_t want = c->out_cap - c->out_len;
+                if ((off_t)want > c->file_end - c->file_off)
+                    want = c->file_end - c->file_off;
+                ssize_t n = pread(c->file, c->out + c->out_len, want, c->file_off);
+                if (n <= 0)
+                    return -1;  /* The file was truncated, the response can't be completed */
+                c->out_len += n;
+                c->file_off += n;
+            }
+        }
+
+        if (c->out_off < c->out_len) {
+            ssize_t n = conn_send(c, c->out + c->out_off, c->out_len - c->out_off);
+            if (n < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+            c->out_off += n;
+            continue;
+        }
+
+        if (c->file != -1 && c->file_off < c->file_end)
+            continue;
+        if (c->file != -1) {
+            close(c->file);
+            c->file = -1;
+        }
+        return 1;
+    }
+}
+
+static int
+proxy_failed(struct http_loop* loop, struct http_conn* c)
+{
+    ioth_close(c->upstream);
+    c->upstream = -1;
+
+    /* Once part of the response was relayed the client can only be disconnected */
+    if (c->relayed > 0)
+        return -1;
+    return conn_error(loop, c, 502, 1);
+}
+
+/*
+    Make as much progress as possible on a connection without blocking.
+    Returns 0 to wait for the next events, -1 to close the connection and
+    -2 to stop the loop.
+*/
+static int
+conn_run(struct http_loop* loop, struct http_conn* c)
+{
+    size_t limit = HTTP_MAX_HEAD + loop->srv->max_body;
+    ssize_t n;
+    int res;
+
+    for (;;) {
+        switch (c->state) {
+        case CONN_READ:
+            res = conn_parse(loop, c);
+            if (res != 0) {
+                if (res < 0)
+                    return res;
+                continue;
+            }
+
+            if (c->in_len == c->in_cap) {
+                size_t need = c->head_len ? c->head_len + c->body_len : HTTP_MAX_HEAD;
+                if (c->in_cap >= need || c->in_cap >= limit)
+                    return -1;
+                if (buf_reserve(&c->in, &c->in_cap, c->in_cap < 4096 ? 4096 : c->in_cap * 2) < 0)
+                    return -1;
+            }
+            n = ioth_recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, MSG_DONTWAIT);
+            if (n < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+            if (n == 0)
+                return -1;
+            c->in_len += n;
+            continue;
+
+        case CONN_WRITE:
+            res = conn_flush(c);
+            if (res <= 0)
+                return res;
+            if (!c->keep_alive)
+                return -1;
+            conn_next(c);
+            continue;
+
+        case CONN_CONNECT: {
+            int err;
+            socklen_t len = sizeof(err);
+            if (!(c->up_revents & (POLLOUT | POLLERR | POLLHUP)))
+                return 0;
+            if (ioth_getsockopt(c->upstream, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+                if (proxy_failed(loop, c) < 0)
+                    return -1;
+                continue;
+            }
+            c->state = CONN_FORWARD;
+            continue;
+        }
+
+        case CONN_FORWARD:
+            if (c->fwd_off < c->fwd_len) {
+                n = ioth_send(c->upstream, c->fwd + c->fwd_off, c->fwd_len - c->fwd_off,
+                              MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                        return 0;
+                    if (proxy_failed(loop, c) < 0)
+                        return -1;
+                    continue;
+                }
+                c->fwd_off += n;
+                continue;
+            }
+            free(c->fwd);
+            c->fwd = NULL;
+            c->fwd_cap = c->fwd_off = c->fwd_len = 0;
+            c->out_off = c->out_len = 0;
+            c->state = CONN_RELAY;
+            continue;
+
+        case CONN_RELAY:
+            if (c->out_off < c->out_len) {
+                n = conn_send(c, c->out + c->out_off, c->out_len - c->out_off);
+                if (n < 0)
+                    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+                c->out_off += n;
+                continue;
+            }
+            if (buf_reserve(&c->out, &c->out_cap, HTTP_CHUNK) < 0)
+                return -1;
+            n = ioth_recv(c->upstream, c->out, c->out_cap, MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    return 0;
+                if (proxy_failed(loop, c) < 0)
+                    return -1;
+                continue;
+            }
+            if (n == 0) {
+                if (c->relayed == 0) {
+                    if (proxy_failed(loop, c) < 0)
+                        return -1;
+                    continue;
+                }
+                /* The response is complete, send what is left and close */
+                ioth_close(c->upstream);
+                c->upstream = -1;
+                c->state = CONN_WRITE;
+                continue;
+            }
+            c->out_off = 0;
+            c->out_len = n;
+            c->relayed += n;
+            continue;
+        }
+    }
+}
+
+/* Events waited for by a connection on its client and upstream sockets */
+static void
+conn_events(struct http_conn* c, struct pollfd* client, struct pollfd* upstream)
+{
+    client->fd = c->fd;
+    client->events = 0;
+    client->revents = 0;
+    upstream->fd = c->upstream;
+    upstream->events = 0;
+    upstream->revents = 0;
+
+    switch (c->state) {
+    case CONN_READ:
+        client->events = POLLIN;
+        break;
+    case CONN_WRITE:
+        client->events = POLLOUT;
+        break;
+    case CONN_CONNECT:
+    case CONN_FORWARD:
+        upstream->events = POLLOUT;
+        break;
+    case CONN_RELAY:
+        if (c->out_off < c->out_len)
+            client->events = POLLOUT;
+        else
+            upstream->events = POLLIN;
+        break;
+    }
+}
+
+int
+http_loop_init(struct http_loop* loop, struct http_server* srv, void* arg)
+{
+    loop->srv = srv;
+    loop->arg = arg;
+    loop->nconns = 0;
+    loop->date_time = 0;
+    loop->date[0] = '\0';
+    loop->conns = calloc(srv->max_connections, sizeof(struct http_conn*));
+    loop->pfd = calloc(2 + 2 * srv->max_connections, sizeof(struct pollfd));
+    if (loop->conns == NULL || loop->pfd == NULL) {
+        http_loop_free(loop);
+        return -1;
+    }
+    return 0;
+}
+
+void
+http_loop_free(struct http_loop* loop)
+{
+    for (size_t i = 0; i < loop->nconns; i++)
+        conn_free(loop, loop->conns[i]);
+    loop->nconns = 0;
+    free(loop->conns);
+    free(loop->pfd);
+    loop->conns = NULL;
+    loop->pfd = NULL;
+}
+
+/* Accept the pending connections, returns -1 on fatal errors */
+static int
+loop_accept(struct http_loop* loop, long long now, long long* pause)
+{
+    struct http_server* srv = loop->srv;
+
+    for (int i = 0; i < HTTP_ACCEPT_BATCH && loop->nconns < srv->max_connections; i++) {
+        /* The listening fd is non-blocking, other loops can win the race */
+        int fd = ioth_accept(srv->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+                return 0;
+
+            /* Out of resources, stop accepting for a while */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                *pause = now + 10;
+                return 0;
+            }
+            return -1;
+        }
+
+        struct http_conn* c = conn_new(fd);
+        if (c == NULL) {
+            ioth_close(fd);
+            *pause = now + 10;
+            return 0;
+        }
+        c->deadline = now + srv->idle_timeout;
+        loop->conns[loop->nconns++] = c;
+        __atomic_add_fetch(&srv->accepted, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&srv->active, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+int
+http_loop_run(struct http_loop* loop)
+{
+    struct http_server* srv = loop->srv;
+    struct pollfd* pfd = loop->pfd;
+    long long pause = 0;
+
+    for (;;) {
+        long long now = now_ms();
+        long long wake = -1;
+        size_t n = loop->nconns;
+
+        pfd[0].fd = srv->stopfd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = srv->listen_fd;
+        pfd[1].events = 0;
+        pfd[1].revents = 0;
+        if (n < srv->max_connections) {
+            if (now >= pause)
+                pfd[1].events = POLLIN;
+            else
+                wake = pause;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            struct http_conn* c = loop->conns[i];
+            conn_events(c, &pfd[2 + 2 * i], &pfd[3 + 2 * i]);
+            if (srv->idle_timeout >= 0 && (wake < 0 || c->deadline < wake))
+                wake = c->deadline;
+        }
+
+        int timeout = -1;
+        if (wake >= 0)
+            timeout = wake > now ? (int)(wake - now) : 0;
+
+        if (poll(pfd, 2 + 2 * n, timeout) < 0)
+            return -1;
+        if (pfd[0].revents)
+            return 0;
+        if (pfd[1].revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+
+        /* Serve the ready connections, dropping the closed and the idle ones */
+        now = now_ms();
+        size_t j = 0;
+        for (size_t i = 0; i < n; i++) {
+            struct http_conn* c = loop->conns[i];
+            short revents = pfd[2 + 2 * i].revents;
+            int res = 0;
+
+            c->up_revents = pfd[3 + 2 * i].revents;
+            if (revents || c->up_revents) {
+                res = conn_run(loop, c);
+                c->deadline = now + srv->idle_timeout;
+            }
+            else if (srv->idle_timeout >= 0 && now >= c->deadline) {
+                res = -1;
+            }
+
+            if (res == -2) {
+                conn_free(loop, c);
+                for (i++; i < n; i++)
+                    loop->conns[j++] = loop->conns[i];
+                loop->nconns = j;
+                errno = ECANCELED;
+                return -1;
+            }
+            if (res < 0)
+                conn_free(loop, c);
+            else
+                loop->conns[j++] = c;
+        }
+        loop->nconns = j;
+
+        if ((pfd[1].revents & (POLLIN | POLLERR)) && loop_accept(loop, now, &pause) < 0)
+            return -1;
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef IOTHPY_HTTP_H
+#define IOTHPY_HTTP_H
+
+#include <stddef.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+struct ioth;
+
+/*
+    HTTP/1.1 server running on the sockets of an ioth stack: a poll loop
+    accepts the connections, parses the requests and serves them with
+    keep-alive and pipelining. Static files and reverse proxy routes are
+    served natively, the dynamic routes call back into the embedder.
+    It does not use the python API and runs without the GIL, several
+    loops can serve the same listening socket from different threads.
+*/
+
+/* Longest request line and headers accepted */
+#define HTTP_MAX_HEAD (16 * 1024)
+
+enum http_route_kind {
+    HTTP_ROUTE_STATIC,
+    HTTP_ROUTE_PROXY,
+    HTTP_ROUTE_DYNAMIC,
+};
+
+struct http_route {
+    char* prefix;               /* Matched against whole segments of the request path */
+    size_t prefix_len;
+    enum http_route_kind kind;
+    int dirfd;                  /* HTTP_ROUTE_STATIC: the served directory */
+    struct sockaddr_storage addr;   /* HTTP_ROUTE_PROXY: the upstream server */
+    socklen_t addrlen;
+    void* handler;              /* HTTP_ROUTE_DYNAMIC: passed back to the callback */
+};
+
+/* A request passed to the dynamic callback, the strings are not terminated */
+struct http_request {
+    const char* method;
+    size_t method_len;
+    const char* target;
+    size_t target_len;
+    const char* headers;        /* Header lines, each ending with CRLF */
+    size_t headers_len;
+    const char* body;
+    size_t body_len;
+};
+
+/* Filled by the dynamic callback, headers and body are freed with free() */
+struct http_response {
+    int status;
+    char* headers;              /* Header lines, each ending with CRLF */
+    size_t headers_len;
+    char* body;
+    size_t body_len;
+};
+
+/*
+    Serve a dynamic route. Returns 0 with resp filled or -1 to stop the
+    loop, http_loop_run() then fails with ECANCELED.
+*/
+typedef int (*http_dynamic_fn)(void* arg, const struct http_route* route,
+                               const struct http_request* req, struct http_response* resp);
+
+struct http_server {
+    int listen_fd;              /* Non-blocking listening socket of stack */
+    struct ioth* stack;         /* Stack of the proxy connections */
+    struct http_route* routes;  /* First match wins, longest prefixes first */
+    size_t nroutes;
+    int stopfd;                 /* The loops return when it is readable */
+    size_t max_connections;     /* Per loop */
+    size_t max_body;
+    int idle_timeout;           /* Milliseconds, -1 for none */
+    http_dynamic_fn dynamic;
+
+    /* Counters shared by all the loops, updated atomically */
+    unsigned long long accepted;
+    unsigned long long requests;
+    unsigned long long errors;  /* Responses with a 4xx or 5xx status */
+    size_t active;
+};
+
+struct http_conn;
+
+/* State of a loop, owned by the thread running it */
+struct http_loop {
+    struct http_server* srv;
+    void* arg;                  /* Passed to the dynamic callback */
+    struct http_conn** conns;
+    size_t nconns;
+    struct pollfd* pfd;
+    time_t date_time;           /* Second of the cached Date header */
+    char date[64];
+};
+
+/* Allocate the loop, returns -1 on failure */
+int http_loop_init(struct http_loop* loop, struct http_server* srv, void* arg);
+
+/* Close the connections of the loop and free it */
+void http_loop_free(struct http_loop* loop);
+
+/*
+    Serve until stopfd is readable. Returns 0 when stopped or -1 with errno
+    set, the loop can be resumed after EINTR.
+*/
+int http_loop_run(struct http_loop* loop);
+
+#endif /* IOTHPY_HTTP_H */
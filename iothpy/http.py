@@ -0,0 +1,195 @@
+# 
+# This file is part of the iothpy library: python support for ioth.
+# 
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License 
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+"""HTTP module
+
+This module defines HTTPServer, an HTTP/1.1 server running on a socket of
+an ioth stack. Connections, request parsing, keep-alive, static files and
+reverse proxying are handled natively without the GIL, python is only
+called for the routes served by a handler function.
+
+import iothpy
+from iothpy.http import HTTPServer
+
+server = HTTPServer.create(stack, ("", 8000))
+server.static("/", "/var/www")
+server.proxy("/api/", ("10.0.0.2", 8080))
+
+@server.route("/hello")
+def hello(method, target, headers, body):
+    return 200, {"Content-Type": "text/plain"}, "hello world\\n"
+
+server.serve_forever(threads = 4)
+
+See help("iothpy.http.HTTPServer") for more information.
+"""
+
+from . import _iothpy
+
+import socket as socket_module
+import threading
+
+class HTTPServer:
+    """HTTP/1.1 server on the listening socket sock
+
+    Parameters
+    ----------
+    sock : MSocket
+        Listening stream socket, it is switched to non-blocking mode
+
+    max_connections : int
+        Connections served at once by each serving thread
+
+    idle_timeout : float or None
+        Seconds of inactivity after which a connection is closed
+
+    max_body : int
+        Largest request body accepted, larger ones get a 413 response
+
+    The routes are matched in order of decreasing prefix length against
+    whole segments of the path of the request, so /static serves
+    /static/a.txt but not /staticfoo.txt. The first one matching serves it
+    and the requests matching no route get a 404 response.
+    """
+    def __init__(self, sock, *, max_connections = 1024, idle_timeout = 60.0,
+                 max_body = 1024 * 1024):
+        self.socket = sock
+        self.max_connections = max_connections
+        self.idle_timeout = idle_timeout
+        self.max_body = max_body
+        self._routes = []
+        self._server = None
+        self._lock = threading.Lock()
+
+    @classmethod
+    def create(cls, stack, address, *, backlog = None, reuse_port = False, **kwargs):
+        """Create a server listening on address on stack
+
+        backlog and reuse_port are passed to Stack.create_server(), the
+        other keyword arguments to the HTTPServer constructor.
+        """
+        family = socket_module.AF_INET6 if ":" in address[0] else socket_module.AF_INET
+        sock = stack.create_server(address, family = family, backlog = backlog,
+                                   reuse_port = reuse_port)
+        return cls(sock, **kwargs)
+
+    def _add(self, prefix, kind, target):
+        if not prefix.startswith("/"):
+            raise ValueError("route prefixes must start with '/'")
+        with self._lock:
+            if self._server is not None:
+                raise RuntimeError("routes can't be added to a running server")
+            self._routes.append((prefix, kind, target))
+
+    def static(self, prefix, directory):
+        """Serve the files of directory under prefix
+
+        GET and HEAD requests are served, a request for a directory serves
+        its index.html file. Directory listings are not generated.
+        """
+        self._add(prefix, "static", directory)
+
+    def proxy(self, prefix, address):
+        """Forward the requests under prefix to the server at address
+
+        address is a (host, port) tuple or an Address in the family of the
+        listening socket, the connection is opened on the same stack. The
+        request target is forwarded unchanged and the response is relayed
+        as is, after it the client connection is closed.
+        """
+        self._add(prefix, "proxy", address)
+
+    def route(self, prefix, handler = None):
+        """Serve the requests under prefix with handler
+
+        handler(method, target, headers, body) is called with the method
+        and the target strings, the list of (name, value) header pairs and
+        the body as bytes. It returns a (status, headers, body) tuple where
+        headers is a dictionary, a list of pairs or None and body is bytes,
+        str (sent as UTF-8) or None. Content-Length is added by the server.
+        If handler is not given, route() returns a decorator.
+        """
+        if handler is None:
+            def decorator(handler):
+                self._add(prefix, "handler", handler)
+                return handler
+            return decorator
+        self._add(prefix, "handler", handler)
+        return handler
+
+    def _get_server(self):
+        with self._lock:
+            if self._server is None:
+                routes = sorted(self._routes, key = lambda route: len(route[0]), reverse = True)
+                self._server = _iothpy.HTTPServer(self.socket, routes,
+                                                  max_connections = self.max_connections,
+                                                  idle_timeout = self.idle_timeout,
+                                                  max_body = self.max_body)
+            return self._server
+
+    def serve_forever(self, threads = 1):
+        """Serve the requests until shutdown() is called
+
+        threads is the number of threads serving the listening socket,
+        the calling thread is one of them.
+        """
+        server = self._get_server()
+        workers = [threading.Thread(target = server.serve_forever, daemon = True)
+                   for i in range(threads - 1)]
+        for t in workers:
+            t.start()
+        try:
+            server.serve_forever()
+        finally:
+            server.shutdown()
+            for t in workers:
+                t.join()
+
+    def shutdown(self):
+        """Stop serve_forever(), the server can't be started again"""
+        self._get_server().shutdown()
+
+    def close(self):
+        """Stop the server and close the listening socket"""
+        self.shutdown()
+        self.socket.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def stats(self):
+        """Return the counters of the server as a dictionary
+
+        accepted: connections accepted
+        requests: requests served
+        errors:   responses with a 4xx or 5xx status
+        active:   connections open
+        """
+        server = self._get_server()
+        return {
+            "accepted": server.accepted,
+            "requests": server.requests,
+            "errors": server.errors,
+            "active": server.active,
+        }
@@ -28,6 +28,8 @@
 
 #include "iothpy_stack.h"
 #include "iothpy_socket.h"
+#include "iothpy_address.h"
+#include "relay.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,7 +49,7 @@ PyDoc_STRVAR(iothpy_doc,
 "_iothpy c module\n\
 \n\
 This module defines the base classes MSocketBase and StackBase\n\
-used to interface with the ioth c api. \n\
+used to interface with the ioth c api and the Address type. \n\
 It also defines the functions needed to offer the same interface as\n\
 the built-in socket module\n\
 ");
@@ -121,11 +123,14 @@ range of values.");
 static PyObject *
 socket_getdefaulttimeout(PyObject *self, PyObject *Py_UNUSED(ignored))
 {
-    if (defaulttimeout < 0) {
+    iothpy_state* state = PyModule_GetState(self);
+    _PyTime_t timeout = get_defaulttimeout(state);
+
+    if (timeout < 0) {
         Py_RETURN_NONE;
     }
     else {
-        double seconds = _PyTime_AsSecondsDouble(defaulttimeout);
+        double seconds = _PyTime_AsSecondsDouble(timeout);
         return PyFloat_FromDouble(seconds);
     }
 }
@@ -145,7 +150,7 @@ socket_setdefaulttimeout(PyObject *self, PyObject *arg)
     if (socket_parse_timeout(&timeout, arg) < 0)
         return NULL;
 
-    defaulttimeout = timeout;
+    set_defaulttimeout((iothpy_state*)PyModule_GetState(self), timeout);
 
     Py_RETURN_NONE;
 }
@@ -158,6 +163,58 @@ A value of None indicates that new socket objects have no timeout.\n\
 When the socket module is first imported, the default is None.");
 
 
+/* Python API to get and set the cooperative wait hook */
+static PyObject *
+socket_get_wait_hook(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyObject* hook = get_wait_hook(PyModule_GetState(self));
+
+    if (hook == NULL)
+        Py_RETURN_NONE;
+    return hook;
+}
+
+PyDoc_STRVAR(get_wait_hook_doc,
+"get_wait_hook() -> hook\n\
+\n\
+Returns the wait hook set with set_wait_hook(), or None.");
+
+static PyObject *
+socket_set_wait_hook(PyObject *self, PyObject *hook)
+{
+    iothpy_state* state = PyModule_GetState(self);
+    PyObject* old;
+
+    if (hook == Py_None) {
+        hook = NULL;
+    }
+    else if (!PyCallable_Check(hook)) {
+        PyErr_SetString(PyExc_TypeError, "the wait hook must be callable or None");
+        return NULL;
+    }
+
+    Py_XINCREF(hook);
+    Py_BEGIN_CRITICAL_SECTION(state->socket_type);
+    old = state->wait_hook;
+    __atomic_store_n(&state->wait_hook, hook, __ATOMIC_RELAXED);
+    Py_END_CRITICAL_SECTION();
+    Py_XDECREF(old);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_wait_hook_doc,
+"set_wait_hook(hook)\n\
+\n\
+Enable the cooperative mode for greenlet libraries like gevent. Instead\n\
+of blocking the thread, the socket operations that must wait call\n\
+hook(fd, writing, timeout), which returns a true value when fd is ready\n\
+for reading (or writing if writing is true) and a false one when timeout\n\
+seconds have passed (timeout is None to wait forever). The file\n\
+descriptors of the sockets created afterwards are always non-blocking.\n\
+None disables the cooperative mode.");
+
+
 static PyObject *
 socket_close(PyObject *self, PyObject *fdobj)
 {
@@ -188,6 +245,80 @@ PyDoc_STRVAR(close_doc,
 Close an integer socket file descriptor.  This is like os.close(), but for\n\
 sockets; on some platforms os.close() won't work for socket file descriptors.");
 
+/* Get the relay end of an ioth socket or of any object with a fileno() method */
+static int
+relay_end_from_object(iothpy_state* state, PyObject* obj, struct relay_end* end)
+{
+    if (PyObject_TypeCheck(obj, state->socket_type)) {
+        end->fd = ((socket_object*)obj)->fd;
+        end->ioth = 1;
+        if (end->fd == -1) {
+            errno = EBADF;
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        return 0;
+    }
+
+    end->fd = PyObject_AsFileDescriptor(obj);
+    end->ioth = 0;
+    return end->fd == -1 ? -1 : 0;
+}
+
+static PyObject *
+socket_relay(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char* const kwlist[] = {"sock_a", "sock_b", "bufsize", NULL};
+    iothpy_state* state = PyModule_GetState(self);
+    PyObject* argv[3];
+    Py_ssize_t bufsize = 65536;
+    struct relay r;
+    int res;
+
+    if (!fastcall_unpack("relay", args, nargs, kwnames, kwlist, 2, argv))
+        return NULL;
+    if (argv[2] != NULL && !fastcall_ssize_t(argv[2], &bufsize))
+        return NULL;
+    if (bufsize <= 0) {
+        PyErr_SetString(PyExc_ValueError, "bufsize must be positive");
+        return NULL;
+    }
+
+    if (relay_end_from_object(state, argv[0], &r.end[0]) < 0 ||
+        relay_end_from_object(state, argv[1], &r.end[1]) < 0)
+        return NULL;
+
+    if (relay_init(&r, bufsize) < 0)
+        return PyErr_NoMemory();
+
+    for (;;) {
+        Py_BEGIN_ALLOW_THREADS
+        res = relay_run(&r);
+        Py_END_ALLOW_THREADS
+
+        if (res == 0)
+            break;
+        if (errno != EINTR || PyErr_CheckSignals() < 0) {
+            if (!PyErr_Occurred())
+                PyErr_SetFromErrno(PyExc_OSError);
+            relay_free(&r);
+            return NULL;
+        }
+    }
+
+    relay_free(&r);
+    return Py_BuildValue("(KK)", r.dir[0].bytes, r.dir[1].bytes);
+}
+
+PyDoc_STRVAR(relay_doc,
+"relay(sock_a, sock_b, bufsize=65536) -> (a_to_b, b_to_a)\n\
+\n\
+Forward the data received on each socket to the other one until both\n\
+directions reach end of file, without holding the GIL. When one side\n\
+closes, the other one is shut down for writing, when one side resets\n\
+the connection the relay ends. Each socket can be an ioth socket or a\n\
+kernel socket. Returns the number of bytes forwarded in each direction.");
+
 static PyMethodDef iothpy_methods[] = {
 #ifdef CMSG_LEN
     {"CMSG_LEN",   socket_CMSG_LEN, METH_VARARGS, CMSG_LEN_doc},
@@ -198,50 +329,222 @@ static PyMethodDef iothpy_methods[] = {
     {"getdefaulttimeout",  socket_getdefaulttimeout, METH_NOARGS, getdefaulttimeout_doc},
     {"setdefaulttimeout",  socket_setdefaulttimeout, METH_O, setdefaulttimeout_doc},    
 
+    {"get_wait_hook",      socket_get_wait_hook, METH_NOARGS, get_wait_hook_doc},
+    {"set_wait_hook",      socket_set_wait_hook, METH_O, set_wait_hook_doc},
+
     {"close",              socket_close, METH_O, close_doc},
+    {"relay",              (PyCFunction)(void(*)(void))socket_relay, METH_FASTCALL | METH_KEYWORDS, relay_doc},
 
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
-static struct PyModuleDef iothpy_module = {
-    PyModuleDef_HEAD_INIT,
-    "_iothpy",   /* name of module */
-    iothpy_doc,  /* module documentation, may be NULL */
-    -1,            /* size of per-interpreter state of the module,
-                      or -1 if the module keeps state in global variables. */
-    iothpy_methods
-};
+static int
+iothpy_exec(PyObject* module)
+{
+    iothpy_state* state = PyModule_GetState(module);
+
+    state->defaulttimeout = _PyTime_FromSeconds(-1);
+
+    state->socket_class_name = PyUnicode_InternFromString("_socket_class");
+    if (state->socket_class_name == NULL)
+        return -1;
+
+    /* A TimeoutError like socket.timeout since 3.10, so that the code
+       catching socket.timeout also catches the timeouts of the stacks */
+    state->socket_timeout = PyErr_NewException("_iothpy.timeout",
+                                               PyExc_TimeoutError, NULL);
+    if (state->socket_timeout == NULL)
+        return -1;
+    Py_INCREF(state->socket_timeout);
+    if (PyModule_AddObject(module, "timeout", state->socket_timeout) != 0) {
+        Py_DECREF(state->socket_timeout);
+        return -1;
+    }
 
-PyMODINIT_FUNC
-PyInit__iothpy(void)
-{ 
-#if PY_MINOR_VERSION > 9
-    Py_SET_TYPE(&stack_type, &PyType_Type);
-    Py_SET_TYPE(&socket_type, &PyType_Type);
-#else
-    Py_TYPE(&stack_type) = &PyType_Type;
-    Py_TYPE(&socket_type) = &PyType_Type;
+    /* The deadline() scopes of iothpy.deadline store their monotonic time here */
+    state->deadline_var = PyContextVar_New("iothpy_deadline", NULL);
+    if (state->deadline_var == NULL)
+        return -1;
+    Py_INCREF(state->deadline_var);
+    if (PyModule_AddObject(module, "deadline_var", state->deadline_var) != 0) {
+        Py_DECREF(state->deadline_var);
+        return -1;
+    }
+
+    /* Add a symbol for the stack type */
+    state->stack_type = stack_type_create(module);
+    if (state->stack_type == NULL || PyModule_AddType(module, state->stack_type) != 0)
+        return -1;
+
+    /* Add a symbol for the socket type */
+    state->socket_type = socket_type_create(module);
+    if (state->socket_type == NULL || PyModule_AddType(module, state->socket_type) != 0)
+        return -1;
+
+    /* Add a symbol for the address type */
+    state->address_type = address_type_create(module);
+    if (state->address_type == NULL || PyModule_AddType(module, state->address_type) != 0)
+        return -1;
+
+    /* Add a symbol for the accept loop type */
+    state->acceptor_type = acceptor_type_create(module);
+    if (state->acceptor_type == NULL || PyModule_AddType(module, state->acceptor_type) != 0)
+        return -1;
+
+    /* Add a symbol for the I/O ring type */
+    state->ring_type = ring_type_create(module);
+    if (state->ring_type == NULL || PyModule_AddType(module, state->ring_type) != 0)
+        return -1;
+
+    /* Add a symbol for the native HTTP server type */
+    state->http_type = http_type_create(module);
+    if (state->http_type == NULL || PyModule_AddType(module, state->http_type) != 0)
+        return -1;
+
+    /* Add a symbol for the connection pool type */
+    state->pool_type = pool_type_create(module);
+    if (state->pool_type == NULL || PyModule_AddType(module, state->pool_type) != 0)
+        return -1;
+
+    /* Add a symbol for the base type of the TLS sockets */
+    state->tls_type = tls_type_create(module);
+    if (state->tls_type == NULL || PyModule_AddType(module, state->tls_type) != 0)
+        return -1;
+
+    /* The awaitables of the asyncio operations are not exposed */
+    static const char* const async_names[ASYNC_NAME_COUNT] = {
+        "add_reader", "add_writer", "remove_reader", "remove_writer", "create_future",
+        "add_done_callback", "done", "set_result", "set_exception", "call_later",
+    };
+    for (int i = 0; i < ASYNC_NAME_COUNT; i++) {
+        state->async_names[i] = PyUnicode_InternFromString(async_names[i]);
+        if (state->async_names[i] == NULL)
+            return -1;
+    }
+
+    state->completed_op_type = completed_op_type_create(module);
+    if (state->completed_op_type == NULL)
+        return -1;
+    state->pending_op_type = pending_op_type_create(module);
+    if (state->pending_op_type == NULL)
+        return -1;
+
+    return 0;
+}
+
+static int
+iothpy_traverse(PyObject* module, visitproc visit, void* arg)
+{
+    iothpy_state* state = PyModule_GetState(module);
+    Py_VISIT(state->stack_type);
+    Py_VISIT(state->socket_type);
+    Py_VISIT(state->address_type);
+    Py_VISIT(state->acceptor_type);
+    Py_VISIT(state->ring_type);
+    Py_VISIT(state->completed_op_type);
+    Py_VISIT(state->pending_op_type);
+    Py_VISIT(state->http_type);
+    Py_VISIT(state->pool_type);
+    Py_VISIT(state->tls_type);
+    Py_VISIT(state->get_running_loop);
+    Py_VISIT(state->ssl_want_read);
+    Py_VISIT(state->ssl_want_write);
+    Py_VISIT(state->ssl_eof);
+    Py_VISIT(state->wait_hook);
+    Py_VISIT(state->deadline_var);
+    for (int i = 0; i < ASYNC_NAME_COUNT; i++)
+        Py_VISIT(state->async_names[i]);
+    Py_VISIT(state->socket_timeout);
+    Py_VISIT(state->socket_class_name);
+    return 0;
+}
+
+static int
+iothpy_clear(PyObject* module)
+{
+    iothpy_state* state = PyModule_GetState(module);
+    Py_CLEAR(state->stack_type);
+    Py_CLEAR(state->socket_type);
+    Py_CLEAR(state->address_type);
+    Py_CLEAR(state->acceptor_type);
+    Py_CLEAR(state->ring_type);
+    Py_CLEAR(state->completed_op_type);
+    Py_CLEAR(state->pending_op_type);
+    Py_CLEAR(state->http_type);
+    Py_CLEAR(state->pool_type);
+    Py_CLEAR(state->tls_type);
+    Py_CLEAR(state->get_running_loop);
+    Py_CLEAR(state->ssl_want_read);
+    Py_CLEAR(state->ssl_want_write);
+    Py_CLEAR(state->ssl_eof);
+    Py_CLEAR(state->wait_hook);
+    Py_CLEAR(state->deadline_var);
+    for (int i = 0; i < ASYNC_NAME_COUNT; i++)
+        Py_CLEAR(state->async_names[i]);
+    Py_CLEAR(state->socket_timeout);
+    Py_CLEAR(state->socket_class_name);
+    return 0;
+}
+
+static void
+iothpy_free(void* module)
+{
+    iothpy_clear((PyObject*)module);
+}
+
+static PyModuleDef_Slot iothpy_slots[] = {
+    {Py_mod_exec, iothpy_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    /* All the state is in the module, each interpreter can have its own GIL */
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
 #endif
-    PyObject* module = PyModule_Create(&iothpy_module);
+#if PY_VERSION_HEX >= 0x030D0000
+    /* Sockets lock their own state, the module can run without the GIL */
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
 
-    socket_timeout = PyErr_NewException("_iothpy.timeout",
-                                        PyExc_OSError, NULL);
-    if (socket_timeout == NULL)
-        return NULL;
-    Py_INCREF(socket_timeout);
-    PyModule_AddObject(module, "timeout", socket_timeout);
+static struct PyModuleDef iothpy_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_iothpy",
+    .m_doc = iothpy_doc,
+    .m_size = sizeof(iothpy_state),
+    .m_methods = iothpy_methods,
+    .m_slots = iothpy_slots,
+    .m_traverse = iothpy_traverse,
+    .m_clear = iothpy_clear,
+    .m_free = iothpy_free,
+};
 
-    /* Add a symbol for the stack type */
-    Py_INCREF((PyObject *)&stack_type);
-    if(PyModule_AddObject(module, "StackBase", (PyObject*)&stack_type) != 0) {
+iothpy_state*
+iothpy_get_state_by_type(PyTypeObject* type)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    PyObject* module = PyType_GetModuleByDef(type, &iothpy_module);
+    if (module == NULL)
         return NULL;
+    return PyModule_GetState(module);
+#else
+    /* Python subclasses have no module, look for it in the bases */
+    PyObject* mro = type->tp_mro;
+    for (Py_ssize_t i = 0; mro != NULL && i < PyTuple_GET_SIZE(mro); i++) {
+        PyTypeObject* base = (PyTypeObject*)PyTuple_GET_ITEM(mro, i);
+        if (!PyType_HasFeature(base, Py_TPFLAGS_HEAPTYPE))
+            continue;
+
+        PyObject* module = ((PyHeapTypeObject*)base)->ht_module;
+        if (module != NULL && PyModule_GetDef(module) == &iothpy_module)
+            return PyModule_GetState(module);
     }
 
-    /* Add a symbol for the socket type */
-    Py_INCREF((PyObject *)&socket_type);
-    if (PyModule_AddObject(module, "MSocketBase",
-                           (PyObject *)&socket_type) != 0)
-        return NULL;
+    PyErr_Format(PyExc_TypeError, "'%s' is not a subclass of an _iothpy type", type->tp_name);
+    return NULL;
+#endif
+}
 
-    return module;
+PyMODINIT_FUNC
+PyInit__iothpy(void)
+{ 
+    return PyModuleDef_Init(&iothpy_module);
 }
@@ -0,0 +1,96 @@
+#ifndef IOTHPY_H
+#define IOTHPY_H
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "utils.h"
+
+/* Methods of the event loop and of its futures called by the asyncio awaitables */
+enum async_name {
+    ASYNC_ADD_READER,
+    ASYNC_ADD_WRITER,
+    ASYNC_REMOVE_READER,
+    ASYNC_REMOVE_WRITER,
+    ASYNC_CREATE_FUTURE,
+    ASYNC_ADD_DONE_CALLBACK,
+    ASYNC_DONE,
+    ASYNC_SET_RESULT,
+    ASYNC_SET_EXCEPTION,
+    ASYNC_CALL_LATER,
+    ASYNC_NAME_COUNT
+};
+
+/*
+    State of the _iothpy module, every interpreter importing the module
+    has its own copy with its own types.
+*/
+typedef struct iothpy_state {
+    PyTypeObject* stack_type;
+    PyTypeObject* socket_type;
+    PyTypeObject* address_type;
+    PyTypeObject* acceptor_type;
+    PyTypeObject* ring_type;
+    PyTypeObject* completed_op_type;
+    PyTypeObject* pending_op_type;
+    PyTypeObject* http_type;
+    PyTypeObject* pool_type;
+    PyTypeObject* tls_type;
+    PyObject* socket_timeout;           /* The _iothpy.timeout exception */
+    PyObject* socket_class_name;        /* Interned "_socket_class" string */
+    PyObject* get_running_loop;         /* asyncio.get_running_loop, imported on first use */
+    PyObject* ssl_want_read;            /* ssl.SSLWantReadError, imported on first use */
+    PyObject* ssl_want_write;           /* ssl.SSLWantWriteError, imported on first use */
+    PyObject* ssl_eof;                  /* ssl.SSLEOFError, imported on first use */
+    PyObject* async_names[ASYNC_NAME_COUNT];    /* Interned method names */
+    _PyTime_t defaulttimeout;
+    PyObject* wait_hook;                /* Cooperative wait function, NULL if not set */
+    PyObject* deadline_var;             /* ContextVar of the deadline() scopes */
+} iothpy_state;
+
+/*
+    Return the state of the module that created type or one of its bases.
+    Returns NULL raising an exception if type is not an _iothpy type.
+*/
+iothpy_state* iothpy_get_state_by_type(PyTypeObject* type);
+
+/* Create the types of the module, returning a new reference */
+PyTypeObject* stack_type_create(PyObject* module);
+PyTypeObject* socket_type_create(PyObject* module);
+PyTypeObject* address_type_create(PyObject* module);
+PyTypeObject* acceptor_type_create(PyObject* module);
+PyTypeObject* ring_type_create(PyObject* module);
+PyTypeObject* completed_op_type_create(PyObject* module);
+PyTypeObject* pending_op_type_create(PyObject* module);
+PyTypeObject* http_type_create(PyObject* module);
+PyTypeObject* pool_type_create(PyObject* module);
+PyTypeObject* tls_type_create(PyObject* module);
+
+/* The default timeout can be changed by any thread without the GIL */
+#define get_defaulttimeout(state) __atomic_load_n(&(state)->defaulttimeout, __ATOMIC_RELAXED)
+#define set_defaulttimeout(state, t) __atomic_store_n(&(state)->defaulttimeout, (t), __ATOMIC_RELAXED)
+
+/*
+    In cooperative mode the sockets wait through the hook set with
+    set_wait_hook() instead of blocking the thread, the hook is swapped
+    under a critical section so that callers can take a reference.
+*/
+#define is_cooperative(state) (__atomic_load_n(&(state)->wait_hook, __ATOMIC_RELAXED) != NULL)
+
+static inline PyObject*
+get_wait_hook(iothpy_state* state)
+{
+    PyObject* hook;
+    Py_BEGIN_CRITICAL_SECTION(state->socket_type);
+    hook = state->wait_hook;
+    Py_XINCREF(hook);
+    Py_END_CRITICAL_SECTION();
+    return hook;
+}
+
+/* Immutable heap types, like static types, are only available since Python 3.10 */
+#ifndef Py_TPFLAGS_IMMUTABLETYPE
+#define Py_TPFLAGS_IMMUTABLETYPE 0
+#endif
+
+#endif /* IOTHPY_H */
@@ -0,0 +1,500 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_acceptor.h"
+#include "iothpy_stack.h"
+#include "iothpy_socket.h"
+#include "mpmc_queue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <ioth.h>
+
+/* A connection accepted by a native thread, waiting for python */
+struct accepted_conn {
+    int fd;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+};
+
+typedef struct acceptor_object {
+    PyObject_HEAD
+    iothpy_state* state;
+    socket_object* sock;        /* The listening socket */
+    int fd;                     /* Its file descriptor when the loop started */
+    int listen_flags;           /* fcntl flags of fd before the loop */
+
+    int efd;                    /* eventfd readable when connections are queued */
+    int stopfd;                 /* eventfd readable when the threads must stop */
+    int nthreads;
+    pthread_t* threads;
+
+    int closed;
+    int error;                  /* errno of the first fatal accept error */
+    unsigned long long accepted;
+
+    struct mpmc_queue queue;
+} acceptor_object;
+
+static void
+wake_consumers(acceptor_object* self)
+{
+    uint64_t one = 1;
+    ssize_t res = write(self->efd, &one, sizeof(one));
+    (void)res;
+}
+
+/* Reset the eventfd, the caller pops the queue right after */
+static void
+drain_wakeups(acceptor_object* self)
+{
+    uint64_t count;
+    ssize_t res = read(self->efd, &count, sizeof(count));
+    (void)res;
+}
+
+/* Body of the native acceptor threads, they never touch python objects */
+static void*
+acceptor_thread(void* arg)
+{
+    acceptor_object* self = arg;
+    struct pollfd fds[2];
+    struct accepted_conn conn;
+
+    fds[0].fd = self->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = self->stopfd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (fds[0].revents & POLLNVAL) {
+            int expected = 0;
+            __atomic_compare_exchange_n(&self->error, &expected, EBADF, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+
+        /* The listening fd is non-blocking, other threads can win the race */
+        conn.addrlen = sizeof(conn.addr);
+        conn.fd = ioth_accept(self->fd, (struct sockaddr*)&conn.addr, &conn.addrlen);
+        if (conn.fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            /* Out of resources, wait for python to close some sockets */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                if (poll(&fds[1], 1, 10) > 0)
+                    break;
+                continue;
+            }
+
+            int expected = 0;
+            __atomic_compare_exchange_n(&self->error, &expected, errno, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+
+        /* Queue full, wait for the consumers */
+        while (!mpmc_queue_push(&self->queue, &conn)) {
+            if (poll(&fds[1], 1, 1) > 0) {
+                ioth_close(conn.fd);
+                goto out;
+            }
+        }
+
+        __atomic_add_fetch(&self->accepted, 1, __ATOMIC_RELAXED);
+        wake_consumers(self);
+    }
+
+out:
+    /* Let the consumers see the error */
+    wake_consumers(self);
+    return NULL;
+}
+
+/* Stop and join the threads, close the queued connections and restore the listening fd */
+static void
+acceptor_stop(acceptor_object* self)
+{
+    struct accepted_conn conn;
+    uint64_t one = 1;
+
+    if (__atomic_exchange_n(&self->closed, 1, __ATOMIC_SEQ_CST))
+        return;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (self->stopfd != -1) {
+        ssize_t res = write(self->stopfd, &one, sizeof(one));
+        (void)res;
+    }
+    for (int i = 0; i < self->nthreads; i++)
+        pthread_join(self->threads[i], NULL);
+
+    if (self->queue.cells != NULL) {
+        while (mpmc_queue_pop(&self->queue, &conn))
+            ioth_close(conn.fd);
+    }
+
+    /* Restore the flags if the listening socket is still open */
+    if (self->sock != NULL && self->sock->fd == self->fd && self->listen_flags != -1)
+        ioth_fcntl(self->fd, F_SETFL, self->listen_flags);
+    Py_END_ALLOW_THREADS
+
+    if (self->efd != -1)
+        wake_consumers(self);
+}
+
+static void
+acceptor_dealloc(acceptor_object* self)
+{
+    acceptor_stop(self);
+
+    if (self->efd != -1)
+        close(self->efd);
+    if (self->stopfd != -1)
+        close(self->stopfd);
+    mpmc_queue_free(&self->queue);
+    PyMem_Free(self->threads);
+    Py_XDECREF(self->sock);
+
+    /* Instances of heap types own a reference to their type */
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject*)self);
+    Py_DECREF(tp);
+}
+
+static PyObject*
+acceptor_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    PyErr_SetString(PyExc_TypeError, "use Stack.accept_loop() to create an AcceptLoop");
+    return NULL;
+}
+
+PyObject*
+acceptor_create(PyObject* stack, PyObject* sockobj, int nthreads, Py_ssize_t queue_size)
+{
+    iothpy_state* state = ((stack_object*)stack)->state;
+
+    if (!PyObject_TypeCheck(sockobj, state->socket_type)) {
+        PyErr_SetString(PyExc_TypeError, "accept_loop() argument must be a socket");
+        return NULL;
+    }
+    socket_object* sock = (socket_object*)sockobj;
+
+    if (sock->stack != stack) {
+        PyErr_SetString(PyExc_ValueError, "the socket does not belong to this stack");
+        return NULL;
+    }
+    if (sock->fd == -1) {
+        errno = EBADF;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (nthreads < 1 || queue_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads and queue_size must be positive");
+        return NULL;
+    }
+    if ((size_t)queue_size > MPMC_QUEUE_MAX_CAPACITY) {
+        PyErr_Format(PyExc_ValueError, "queue_size must be at most %zu", (size_t)MPMC_QUEUE_MAX_CAPACITY);
+        return NULL;
+    }
+
+    acceptor_object* self = (acceptor_object*)state->acceptor_type->tp_alloc(state->acceptor_type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->state = state;
+    self->fd = sock->fd;
+    self->listen_flags = -1;
+    self->efd = -1;
+    self->stopfd = -1;
+    self->nthreads = 0;
+    self->threads = NULL;
+    self->closed = 0;
+    self->error = 0;
+    self->accepted = 0;
+    self->queue.cells = NULL;
+    Py_INCREF(sock);
+    self->sock = sock;
+
+    if (mpmc_queue_init(&self->queue, queue_size, sizeof(struct accepted_conn)) < 0) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    self->threads = PyMem_Calloc(nthreads, sizeof(pthread_t));
+    if (self->threads == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    self->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    self->stopfd = eventfd(0, EFD_CLOEXEC);
+    if (self->efd == -1 || self->stopfd == -1)
+        goto error;
+
+    /* The threads poll the listening fd and must not block in accept */
+    self->listen_flags = ioth_fcntl(self->fd, F_GETFL, 0);
+    if (self->listen_flags == -1)
+        goto error;
+    if (ioth_fcntl(self->fd, F_SETFL, self->listen_flags | O_NONBLOCK) == -1)
+        goto error;
+
+    for (int i = 0; i < nthreads; i++) {
+        errno = pthread_create(&self->threads[i], NULL, acceptor_thread, self);
+        if (errno != 0)
+            goto error;
+        self->nthreads++;
+    }
+
+    return (PyObject*)self;
+
+error:
+    PyErr_SetFromErrno(PyExc_OSError);
+    Py_DECREF(self);
+    return NULL;
+}
+
+
+PyDoc_STRVAR(accept_many_doc, "accept_many(max=64, timeout=None) -> list of (socket, address)\n\
+\n\
+Return up to max connections accepted by the native threads, waiting for\n\
+at least one for timeout seconds (None waits forever, 0 does not wait).\n\
+An empty list is returned on timeout. The sockets are of the same type as\n\
+the listening socket, as returned by accept().");
+
+static PyObject*
+acceptor_accept_many(acceptor_object* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"max", "timeout", NULL};
+    PyObject* argv[2];
+    Py_ssize_t max = 64;
+    _PyTime_t timeout = -1, deadline = 0;
+    struct accepted_conn conn;
+
+    if (!fastcall_unpack("accept_many", args, nargs, kwnames, kwlist, 0, argv))
+        return NULL;
+    if (argv[0] != NULL && !fastcall_ssize_t(argv[0], &max))
+        return NULL;
+    if (argv[1] != NULL && socket_parse_timeout(&timeout, argv[1]) < 0)
+        return NULL;
+    if (max < 1) {
+        PyErr_SetString(PyExc_ValueError, "max must be positive");
+        return NULL;
+    }
+    if (timeout > 0)
+        deadline = _PyTime_GetMonotonicClock() + timeout;
+
+    PyObject* list = PyList_New(0);
+    if (list == NULL)
+        return NULL;
+
+    for (;;) {
+        /* A push after the drain signals again, so no wakeup is lost */
+        drain_wakeups(self);
+
+        while (PyList_GET_SIZE(list) < max && mpmc_queue_pop(&self->queue, &conn)) {
+            PyObject* sock = socket_from_accepted_fd(self->sock, conn.fd, 1);
+            if (sock == NULL)
+                goto error;
+
+            PyObject* addr = make_sockaddr((struct sockaddr*)&conn.addr, conn.addrlen);
+            if (addr == NULL) {
+                Py_DECREF(sock);
+                goto error;
+            }
+
+            PyObject* pair = PyTuple_Pack(2, sock, addr);
+            Py_DECREF(sock);
+            Py_DECREF(addr);
+            if (pair == NULL || PyList_Append(list, pair) < 0) {
+                Py_XDECREF(pair);
+                goto error;
+            }
+            Py_DECREF(pair);
+        }
+
+        /* Stopped by max, leave fileno() readable for the rest of the queue */
+        if (PyList_GET_SIZE(list) == max)
+            wake_consumers(self);
+        if (PyList_GET_SIZE(list) > 0)
+            return list;
+
+        int error = __atomic_load_n(&self->error, __ATOMIC_RELAXED);
+        if (error != 0) {
+            errno = error;
+            PyErr_SetFromErrno(PyExc_OSError);
+            goto error;
+        }
+        if (__atomic_load_n(&self->closed, __ATOMIC_SEQ_CST)) {
+            PyErr_SetString(PyExc_ValueError, "accept loop is closed");
+            goto error;
+        }
+
+        /* Wait for the threads to queue new connections */
+        int ms = -1;
+        if (timeout == 0)
+            return list;
+        if (timeout > 0) {
+            _PyTime_t interval = deadline - _PyTime_GetMonotonicClock();
+            if (interval <= 0)
+                return list;
+            ms = (int)_PyTime_AsMilliseconds(interval, _PyTime_ROUND_CEILING);
+        }
+
+        struct pollfd pollfd = { .fd = self->efd, .events = POLLIN };
+        int n;
+
+        Py_BEGIN_ALLOW_THREADS
+        n = poll(&pollfd, 1, ms);
+        Py_END_ALLOW_THREADS
+
+        if (n < 0) {
+            if (errno != EINTR) {
+                PyErr_SetFromErrno(PyExc_OSError);
+                goto error;
+            }
+            if (PyErr_CheckSignals() < 0)
+                goto error;
+        }
+    }
+
+error:
+    /* Keep fileno() readable for the error and the connections left behind */
+    wake_consumers(self);
+    Py_DECREF(list);
+    return NULL;
+}
+
+PyDoc_STRVAR(close_doc, "close()\n\
+\n\
+Stop the native threads and close the connections not yet returned by\n\
+accept_many(). The listening socket is left open and put back in its\n\
+original blocking mode.");
+
+static PyObject*
+acceptor_close(acceptor_object* self, PyObject* Py_UNUSED(ignored))
+{
+    acceptor_stop(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+acceptor_enter(acceptor_object* self, PyObject* Py_UNUSED(ignored))
+{
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject*
+acceptor_exit(acceptor_object* self, PyObject* args)
+{
+    acceptor_stop(self);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(fileno_doc, "fileno() -> integer\n\
+\n\
+Return a file descriptor that is readable when connections are queued,\n\
+to wait for them with select, poll or selectors.");
+
+static PyObject*
+acceptor_fileno(acceptor_object* self, PyObject* Py_UNUSED(ignored))
+{
+    return PyLong_FromLong(self->efd);
+}
+
+static PyObject*
+acceptor_get_accepted(acceptor_object* self, void* closure)
+{
+    return PyLong_FromUnsignedLongLong(__atomic_load_n(&self->accepted, __ATOMIC_RELAXED));
+}
+
+static PyObject*
+acceptor_get_threads(acceptor_object* self, void* closure)
+{
+    return PyLong_FromLong(self->nthreads);
+}
+
+static PyObject*
+acceptor_get_closed(acceptor_object* self, void* closure)
+{
+    return PyBool_FromLong(__atomic_load_n(&self->closed, __ATOMIC_SEQ_CST));
+}
+
+static PyMethodDef acceptor_methods[] = {
+    {"accept_many", (PyCFunction)(void(*)(void))acceptor_accept_many, METH_FASTCALL | METH_KEYWORDS, accept_many_doc},
+    {"close", (PyCFunction)acceptor_close, METH_NOARGS, close_doc},
+    {"fileno", (PyCFunction)acceptor_fileno, METH_NOARGS, fileno_doc},
+    {"__enter__", (PyCFunction)acceptor_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)acceptor_exit, METH_VARARGS, NULL},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef acceptor_getset[] = {
+    {"accepted", (getter)acceptor_get_accepted, NULL, "number of connections accepted by the native threads", NULL},
+    {"threads", (getter)acceptor_get_threads, NULL, "number of native acceptor threads", NULL},
+    {"closed", (getter)acceptor_get_closed, NULL, "true if close() was called", NULL},
+    {NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(acceptor_doc,
+"AcceptLoop\n\
+\n\
+Native threads accepting connections on a listening socket without the GIL,\n\
+created by Stack.accept_loop(). The accepted connections are handed over\n\
+through a lock-free queue and returned in batches by accept_many().");
+
+static PyType_Slot acceptor_slots[] = {
+    {Py_tp_dealloc, acceptor_dealloc},
+    {Py_tp_doc, (void*)acceptor_doc},
+    {Py_tp_methods, acceptor_methods},
+    {Py_tp_getset, acceptor_getset},
+    {Py_tp_new, acceptor_new},
+    {0, NULL}
+};
+
+static PyType_Spec acceptor_spec = {
+    .name = "_iothpy.AcceptLoop",
+    .basicsize = sizeof(acceptor_object),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = acceptor_slots,
+};
+
+PyTypeObject*
+acceptor_type_create(PyObject* module)
+{
+    return (PyTypeObject*)PyType_FromModuleAndSpec(module, &acceptor_spec, NULL);
+}
@@ -0,0 +1,11 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "iothpy.h"
+
+/*
+    Start an accept loop on the listening socket sock of stack: nthreads
+    native threads accept connections without the GIL and queue them for
+    AcceptLoop.accept_many(). Returns a new AcceptLoop object.
+*/
+PyObject* acceptor_create(PyObject* stack, PyObject* sock, int nthreads, Py_ssize_t queue_size);
@@ -0,0 +1,198 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_address.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static void
+address_dealloc(address_object* self)
+{
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject*)self);
+    Py_DECREF(tp);
+}
+
+static PyObject*
+address_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"host", "port", "flowinfo", "scope_id", "family", NULL};
+
+    const char* host;
+    int port;
+    unsigned int flowinfo = 0, scope_id = 0;
+    int family = AF_UNSPEC;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "si|IIi:Address", kwnames,
+                                    &host, &port, &flowinfo, &scope_id, &family))
+        return NULL;
+
+    /* Guess the family from the host string if not specified */
+    if(family == AF_UNSPEC)
+        family = strchr(host, ':') ? AF_INET6 : AF_INET;
+
+    address_object* self = (address_object*)type->tp_alloc(type, 0);
+    if(self == NULL)
+        return NULL;
+
+    self->hash = -1;
+    if(!parse_inet_sockaddr("Address", family, host, port, flowinfo, scope_id,
+                            &self->addr, &self->addrlen)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject*)self;
+}
+
+static PyObject*
+address_get_host(address_object* self, void* closure)
+{
+    if(self->addr.sa.sa_family == AF_INET)
+        return make_ipv4_addr(&self->addr.in);
+    else
+        return make_ipv6_addr(&self->addr.in6);
+}
+
+static PyObject*
+address_get_port(address_object* self, void* closure)
+{
+    if(self->addr.sa.sa_family == AF_INET)
+        return PyLong_FromLong(ntohs(self->addr.in.sin_port));
+    else
+        return PyLong_FromLong(ntohs(self->addr.in6.sin6_port));
+}
+
+static PyObject*
+address_get_family(address_object* self, void* closure)
+{
+    return PyLong_FromLong(self->addr.sa.sa_family);
+}
+
+static PyObject*
+address_repr(address_object* self)
+{
+    PyObject* host = address_get_host(self, NULL);
+    if(host == NULL)
+        return NULL;
+
+    PyObject* port = address_get_port(self, NULL);
+    if(port == NULL) {
+        Py_DECREF(host);
+        return NULL;
+    }
+
+    PyObject* res = PyUnicode_FromFormat("Address(%R, %S)", host, port);
+    Py_DECREF(host);
+    Py_DECREF(port);
+    return res;
+}
+
+static Py_hash_t
+address_hash(address_object* self)
+{
+    if(self->hash == -1) {
+        PyObject* bytes = PyBytes_FromStringAndSize((char*)&self->addr, self->addrlen);
+        if(bytes == NULL)
+            return -1;
+        self->hash = PyObject_Hash(bytes);
+        Py_DECREF(bytes);
+    }
+    return self->hash;
+}
+
+static PyObject*
+address_richcompare(PyObject* self, PyObject* other, int op)
+{
+    /* Address can't be subclassed */
+    if(Py_TYPE(other) != Py_TYPE(self) || (op != Py_EQ && op != Py_NE))
+        Py_RETURN_NOTIMPLEMENTED;
+
+    address_object* a = (address_object*)self;
+    address_object* b = (address_object*)other;
+
+    int equal = a->addrlen == b->addrlen && memcmp(&a->addr, &b->addr, a->addrlen) == 0;
+    if(equal == (op == Py_EQ))
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+PyDoc_STRVAR(address_to_tuple_doc, "to_tuple() -> address tuple\n\
+\n\
+Return the address as a tuple, (host, port) for IPv4 addresses and\n\
+(host, port, flowinfo, scope_id) for IPv6 addresses.");
+
+static PyObject*
+address_to_tuple(address_object* self, PyObject* Py_UNUSED(ignored))
+{
+    return make_sockaddr(&self->addr.sa, self->addrlen);
+}
+
+static PyMethodDef address_methods[] = {
+    {"to_tuple", (PyCFunction)address_to_tuple, METH_NOARGS, address_to_tuple_doc},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef address_getset[] = {
+    {"host", (getter)address_get_host, NULL, "the host address as a string", NULL},
+    {"port", (getter)address_get_port, NULL, "the port number", NULL},
+    {"family", (getter)address_get_family, NULL, "the address family (AF_INET or AF_INET6)", NULL},
+    {NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(address_doc,
+"Address(host, port, flowinfo=0, scope_id=0, family=AF_UNSPEC)\n\
+\n\
+Pre-parsed IPv4 or IPv6 socket address. It can be passed to bind, connect,\n\
+connect_ex, sendto and sendmsg in place of an address tuple and is not\n\
+parsed again on every call. If family is not specified it is AF_INET6\n\
+if host contains ':' and AF_INET otherwise.");
+
+static PyType_Slot address_slots[] = {
+    {Py_tp_dealloc, address_dealloc},
+    {Py_tp_repr, address_repr},
+    {Py_tp_hash, address_hash},
+    {Py_tp_doc, (void*)address_doc},
+    {Py_tp_richcompare, address_richcompare},
+    {Py_tp_methods, address_methods},
+    {Py_tp_getset, address_getset},
+    {Py_tp_new, address_new},
+    {0, NULL}
+};
+
+static PyType_Spec address_spec = {
+    .name = "_iothpy.Address",
+    .basicsize = sizeof(address_object),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = address_slots,
+};
+
+PyTypeObject*
+address_type_create(PyObject* module)
+{
+    return (PyTypeObject*)PyType_FromModuleAndSpec(module, &address_spec, NULL);
+}
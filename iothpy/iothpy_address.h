@@ -0,0 +1,18 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "utils.h"
+#include "iothpy.h"
+
+/*
+    Pre-parsed IPv4 or IPv6 socket address, it can be used in place of
+    an address tuple to skip parsing on every sendto, connect, etc..
+*/
+typedef struct address_object {
+    PyObject_HEAD
+    sockaddr_union addr;
+    socklen_t addrlen;
+    Py_hash_t hash;             /* -1 until computed */
+} address_object;
+
+#define Address_Check(state, op) PyObject_TypeCheck(op, (state)->address_type)
@@ -0,0 +1,630 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_async.h"
+#include "iothpy_socket.h"
+
+#include <errno.h>
+
+#include <ioth.h>
+
+enum async_opcode {
+    ASYNC_RECV,
+    ASYNC_SEND,
+    ASYNC_ACCEPT,
+    ASYNC_CONNECT,
+};
+
+/* Awaitable of an operation that completed when it was started */
+typedef struct completed_op {
+    PyObject_HEAD
+    PyObject* result;
+} completed_op;
+
+/* Operation waiting for its socket, called back by the event loop */
+typedef struct pending_op {
+    PyObject_HEAD
+    socket_object* sock;
+    enum async_opcode opcode;
+    Py_ssize_t len;
+    int flags;
+    Py_buffer view;             /* ASYNC_SEND: the data being sent */
+    PyObject* loop;
+    PyObject* fut;
+    int fd;
+    int registered;             /* The loop is watching fd for this operation */
+} pending_op;
+
+
+/*
+    Run an operation once on the non-blocking socket. Returns 1 with the
+    result in *result, 0 if the socket is not ready or -1 with an exception.
+    The call cannot block, so unlike sock_call() it keeps the GIL.
+*/
+static int
+async_try(socket_object* s, enum async_opcode opcode, Py_ssize_t len, int flags,
+          Py_buffer* view, PyObject** result)
+{
+    int ok;
+
+    for (;;) {
+        switch (opcode) {
+        case ASYNC_RECV: {
+            struct sock_recv ctx;
+            PyObject* buf = PyBytes_FromStringAndSize(NULL, len);
+            if (buf == NULL)
+                return -1;
+
+            ctx.cbuf = PyBytes_AS_STRING(buf);
+            ctx.len = len;
+            ctx.flags = flags;
+
+            /* The bytes in the read-ahead buffer of the socket come first */
+            ctx.result = len > 0 ? rbuf_read(s, ctx.cbuf, len, flags) : 0;
+            if (ctx.result < 0) {
+                Py_DECREF(buf);
+                return -1;
+            }
+            ok = ctx.result > 0 || sock_recv_impl(s, &ctx);
+
+            if (!ok) {
+                Py_DECREF(buf);
+                break;
+            }
+            if (ctx.result != len && _PyBytes_Resize(&buf, ctx.result) < 0)
+                return -1;
+            *result = buf;
+            return 1;
+        }
+        case ASYNC_SEND: {
+            struct sock_send_ctx ctx;
+
+            ctx.buf = view->buf;
+            ctx.len = view->len;
+            ctx.flags = flags;
+            ok = sock_send_impl(s, &ctx);
+
+            if (!ok)
+                break;
+            *result = PyLong_FromSsize_t(ctx.result);
+            return *result == NULL ? -1 : 1;
+        }
+        case ASYNC_ACCEPT: {
+            struct sock_accept_ctx ctx;
+            sockaddr_union addr;
+            socklen_t addrlen = sizeof(addr);
+
+            ctx.addrbuf = &addr.sa;
+            ctx.addrlen = &addrlen;
+            ok = sock_accept_impl(s, &ctx);
+
+            if (!ok)
+                break;
+
+            /* Like loop.sock_accept(), the connection is non-blocking too */
+            PyObject* conn = socket_from_accepted_fd(s, ctx.result, 0);
+            if (conn == NULL)
+                return -1;
+            ((socket_object*)conn)->sock_timeout = 0;
+            if (internal_setblocking((socket_object*)conn, 0) < 0) {
+                Py_DECREF(conn);
+                return -1;
+            }
+
+            PyObject* peer = make_sockaddr(&addr.sa, addrlen);
+            if (peer == NULL) {
+                Py_DECREF(conn);
+                return -1;
+            }
+            *result = PyTuple_Pack(2, conn, peer);
+            Py_DECREF(conn);
+            Py_DECREF(peer);
+            return *result == NULL ? -1 : 1;
+        }
+        case ASYNC_CONNECT:
+            /* The connection was started by async_connect(), get its outcome */
+            ok = sock_connect_impl(s, NULL);
+            if (!ok)
+                break;
+            Py_INCREF(Py_None);
+            *result = Py_None;
+            return 1;
+        }
+
+        if (errno == EINTR) {
+            if (PyErr_CheckSignals() < 0)
+                return -1;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+}
+
+static PyObject*
+completed_op_create(iothpy_state* state, PyObject* result)
+{
+    completed_op* self = PyObject_New(completed_op, state->completed_op_type);
+    if (self == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    self->result = result;
+    return (PyObject*)self;
+}
+
+static void
+completed_op_dealloc(completed_op* self)
+{
+    PyTypeObject* tp = Py_TYPE(self);
+    Py_XDECREF(self->result);
+    PyObject_Free(self);
+    Py_DECREF(tp);
+}
+
+static PyObject*
+completed_op_await(completed_op* self)
+{
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+/* Finish the await at once, returning the result of the operation */
+static PyObject*
+completed_op_next(completed_op* self)
+{
+    PyObject* result = self->result;
+
+    if (result == NULL)
+        return NULL;
+
+    /* Tuples and exceptions would be taken as the arguments of StopIteration */
+    if (PyTuple_Check(result) || PyExceptionInstance_Check(result)) {
+        PyObject* exc = PyObject_CallFunctionObjArgs(PyExc_StopIteration, result, NULL);
+        if (exc == NULL)
+            return NULL;
+        PyErr_SetObject(PyExc_StopIteration, exc);
+        Py_DECREF(exc);
+    }
+    else {
+        PyErr_SetObject(PyExc_StopIteration, result);
+    }
+
+    /* The awaitable can only be awaited once */
+    Py_CLEAR(self->result);
+    return NULL;
+}
+
+static PyType_Slot completed_op_slots[] = {
+    {Py_tp_dealloc, completed_op_dealloc},
+    {Py_am_await, completed_op_await},
+    {Py_tp_iter, completed_op_await},
+    {Py_tp_iternext, completed_op_next},
+    {0, NULL}
+};
+
+static PyType_Spec completed_op_spec = {
+    .name = "_iothpy.CompletedOp",
+    .basicsize = sizeof(completed_op),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = completed_op_slots,
+};
+
+PyTypeObject*
+completed_op_type_create(PyObject* module)
+{
+    return (PyTypeObject*)PyType_FromModuleAndSpec(module, &completed_op_spec, NULL);
+}
+
+
+/* Call a method of the loop or of a future, arg1 and arg2 can be NULL */
+static PyObject*
+async_call(iothpy_state* state, enum async_name name, PyObject* obj, PyObject* arg1, PyObject* arg2)
+{
+    PyObject* args[3] = {obj, arg1, arg2};
+    size_t nargs = 1 + (arg1 != NULL) + (arg2 != NULL);
+
+    return PyObject_VectorcallMethod(state->async_names[name], args, nargs, NULL);
+}
+
+/* Stop watching the socket, if the loop still does */
+static int
+pending_op_unregister(pending_op* self)
+{
+    if (!self->registered)
+        return 0;
+    self->registered = 0;
+
+    int writing = (self->opcode == ASYNC_SEND || self->opcode == ASYNC_CONNECT);
+    PyObject* fd = PyLong_FromLong(self->fd);
+    if (fd == NULL)
+        return -1;
+    PyObject* res = async_call(self->sock->state, writing ? ASYNC_REMOVE_WRITER : ASYNC_REMOVE_READER,
+                               self->loop, fd, NULL);
+    Py_DECREF(fd);
+    if (res == NULL)
+        return -1;
+    Py_DECREF(res);
+    return 0;
+}
+
+/*
+    Start watching the socket. A paced send waits for its tokens with a
+    timer instead, the socket is writable and the loop would spin.
+*/
+static int
+pending_op_register(pending_op* self)
+{
+    iothpy_state* state = self->sock->state;
+    PyObject* res;
+
+    if (self->opcode == ASYNC_SEND) {
+        long long delay = sock_pacing_delay(self->sock, self->view.len);
+        if (delay > 0) {
+            if (pending_op_unregister(self) < 0)
+                return -1;
+            PyObject* secs = PyFloat_FromDouble(delay / 1e9);
+            if (secs == NULL)
+                return -1;
+            res = async_call(state, ASYNC_CALL_LATER, self->loop, secs, (PyObject*)self);
+            Py_DECREF(secs);
+            if (res == NULL)
+                return -1;
+            Py_DECREF(res);
+            return 0;
+        }
+    }
+    if (self->registered)
+        return 0;
+
+    int writing = (self->opcode == ASYNC_SEND || self->opcode == ASYNC_CONNECT);
+    PyObject* fd = PyLong_FromLong(self->fd);
+    if (fd == NULL)
+        return -1;
+    res = async_call(state, writing ? ASYNC_ADD_WRITER : ASYNC_ADD_READER, self->loop, fd, (PyObject*)self);
+    Py_DECREF(fd);
+    if (res == NULL)
+        return -1;
+    Py_DECREF(res);
+    self->registered = 1;
+    return 0;
+}
+
+/* Called by the loop when the socket is ready or when the timer of a paced send expires */
+static PyObject*
+pending_op_call(pending_op* self, PyObject* args, PyObject* kwargs)
+{
+    iothpy_state* state = self->sock->state;
+    PyObject* result = NULL;
+    PyObject* res;
+
+    res = async_call(state, ASYNC_DONE, self->fut, NULL, NULL);
+    if (res == NULL)
+        return NULL;
+    int done = PyObject_IsTrue(res);
+    Py_DECREF(res);
+    if (done) {
+        /* Cancelled while waiting */
+        if (pending_op_unregister(self) < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    int ready = 0;
+    if (self->opcode != ASYNC_SEND || sock_pacing_delay(self->sock, self->view.len) == 0)
+        ready = async_try(self->sock, self->opcode, self->len, self->flags, &self->view, &result);
+    if (ready == 0) {
+        if (pending_op_register(self) < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    if (ready < 0) {
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        if (traceback != NULL)
+            PyException_SetTraceback(value, traceback);
+        Py_XDECREF(type);
+        Py_XDECREF(traceback);
+
+        if (pending_op_unregister(self) < 0) {
+            Py_DECREF(value);
+            return NULL;
+        }
+        res = async_call(state, ASYNC_SET_EXCEPTION, self->fut, value, NULL);
+        Py_DECREF(value);
+    }
+    else {
+        if (pending_op_unregister(self) < 0) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        res = async_call(state, ASYNC_SET_RESULT, self->fut, result, NULL);
+        Py_DECREF(result);
+    }
+
+    if (res == NULL)
+        return NULL;
+    Py_DECREF(res);
+    Py_RETURN_NONE;
+}
+
+/* Done callback of the future, stops watching the socket after a cancel */
+static PyObject*
+pending_op_done(pending_op* self, PyObject* fut)
+{
+    if (pending_op_unregister(self) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static int
+pending_op_traverse(pending_op* self, visitproc visit, void* arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->sock);
+    Py_VISIT(self->loop);
+    Py_VISIT(self->fut);
+    return 0;
+}
+
+static int
+pending_op_clear(pending_op* self)
+{
+    Py_CLEAR(self->sock);
+    Py_CLEAR(self->loop);
+    Py_CLEAR(self->fut);
+    return 0;
+}
+
+static void
+pending_op_dealloc(pending_op* self)
+{
+    PyTypeObject* tp = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    if (self->opcode == ASYNC_SEND)
+        PyBuffer_Release(&self->view);
+    pending_op_clear(self);
+    tp->tp_free((PyObject*)self);
+    Py_DECREF(tp);
+}
+
+static PyMethodDef pending_op_methods[] = {
+    {"_done", (PyCFunction)pending_op_done, METH_O, NULL},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyType_Slot pending_op_slots[] = {
+    {Py_tp_dealloc, pending_op_dealloc},
+    {Py_tp_traverse, pending_op_traverse},
+    {Py_tp_clear, pending_op_clear},
+    {Py_tp_call, pending_op_call},
+    {Py_tp_methods, pending_op_methods},
+    {0, NULL}
+};
+
+static PyType_Spec pending_op_spec = {
+    .name = "_iothpy.PendingOp",
+    .basicsize = sizeof(pending_op),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+    .slots = pending_op_slots,
+};
+
+PyTypeObject*
+pending_op_type_create(PyObject* module)
+{
+    return (PyTypeObject*)PyType_FromModuleAndSpec(module, &pending_op_spec, NULL);
+}
+
+
+/* Get the running event loop, importing asyncio on first use */
+static PyObject*
+get_running_loop(iothpy_state* state)
+{
+    PyObject* func;
+
+    /* Threads of free-threaded builds can get here at the same time */
+    Py_BEGIN_CRITICAL_SECTION(state->pending_op_type);
+    func = state->get_running_loop;
+    if (func == NULL) {
+        PyObject* asyncio = PyImport_ImportModule("asyncio");
+        if (asyncio != NULL) {
+            func = PyObject_GetAttrString(asyncio, "get_running_loop");
+            Py_DECREF(asyncio);
+            state->get_running_loop = func;
+        }
+    }
+    Py_XINCREF(func);
+    Py_END_CRITICAL_SECTION();
+
+    if (func == NULL)
+        return NULL;
+    PyObject* loop = PyObject_CallNoArgs(func);
+    Py_DECREF(func);
+    return loop;
+}
+
+/*
+    Wait for the socket on the running loop. Takes the view of ASYNC_SEND,
+    returns the future completed by the operation.
+*/
+static PyObject*
+async_wait(socket_object* s, enum async_opcode opcode, Py_ssize_t len, int flags, Py_buffer* view)
+{
+    iothpy_state* state = s->state;
+    pending_op* op = NULL;
+    PyObject* res;
+
+    PyObject* loop = get_running_loop(state);
+    if (loop == NULL)
+        goto error;
+
+    op = PyObject_GC_New(pending_op, state->pending_op_type);
+    if (op == NULL) {
+        Py_DECREF(loop);
+        goto error;
+    }
+
+    Py_INCREF(s);
+    op->sock = s;
+    op->opcode = opcode;
+    op->len = len;
+    op->flags = flags;
+    if (view != NULL)
+        op->view = *view;
+    op->loop = loop;
+    op->fut = NULL;
+    op->fd = s->fd;
+    op->registered = 0;
+    PyObject_GC_Track(op);
+
+    op->fut = async_call(state, ASYNC_CREATE_FUTURE, loop, NULL, NULL);
+    if (op->fut == NULL)
+        goto fail;
+
+    if (pending_op_register(op) < 0)
+        goto fail;
+
+    PyObject* done = PyObject_GetAttrString((PyObject*)op, "_done");
+    if (done == NULL) {
+        pending_op_unregister(op);
+        goto fail;
+    }
+    res = async_call(state, ASYNC_ADD_DONE_CALLBACK, op->fut, done, NULL);
+    Py_DECREF(done);
+    if (res == NULL) {
+        pending_op_unregister(op);
+        goto fail;
+    }
+    Py_DECREF(res);
+
+    PyObject* fut = op->fut;
+    Py_INCREF(fut);
+    Py_DECREF(op);
+    return fut;
+
+error:
+    if (view != NULL)
+        PyBuffer_Release(view);
+    return NULL;
+
+fail:
+    Py_DECREF(op);
+    return NULL;
+}
+
+/* Check the socket can be used with the event loop */
+static int
+async_check(socket_object* s)
+{
+    if (s->fd == -1) {
+        errno = EBADF;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    if (s->sock_timeout != 0) {
+        PyErr_SetString(PyExc_ValueError, "the socket must be non-blocking");
+        return -1;
+    }
+    return 0;
+}
+
+/* Try the operation, then return a completed awaitable or wait on the loop */
+static PyObject*
+async_start(socket_object* s, enum async_opcode opcode, Py_ssize_t len, int flags, Py_buffer* view)
+{
+    PyObject* result = NULL;
+
+    if (async_check(s) < 0) {
+        if (view != NULL)
+            PyBuffer_Release(view);
+        return NULL;
+    }
+
+    /* A paced send goes straight to its timer */
+    int ready = 0;
+    if (opcode != ASYNC_SEND || sock_pacing_delay(s, view->len) == 0)
+        ready = async_try(s, opcode, len, flags, view, &result);
+    if (ready != 0) {
+        if (view != NULL)
+            PyBuffer_Release(view);
+        if (ready < 0)
+            return NULL;
+        return completed_op_create(s->state, result);
+    }
+
+    return async_wait(s, opcode, len, flags, view);
+}
+
+PyObject*
+async_recv(socket_object* s, Py_ssize_t len, int flags)
+{
+    return async_start(s, ASYNC_RECV, len, flags, NULL);
+}
+
+PyObject*
+async_send(socket_object* s, Py_buffer* view, int flags)
+{
+    return async_start(s, ASYNC_SEND, 0, flags, view);
+}
+
+PyObject*
+async_accept(socket_object* s)
+{
+    return async_start(s, ASYNC_ACCEPT, 0, 0, NULL);
+}
+
+PyObject*
+async_completed(socket_object* s, PyObject* result)
+{
+    if (result == NULL)
+        return NULL;
+    return completed_op_create(s->state, result);
+}
+
+PyObject*
+async_connect(socket_object* s, struct sockaddr* addr, socklen_t addrlen)
+{
+    int res;
+
+    if (async_check(s) < 0)
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    res = ioth_connect(s->fd, addr, addrlen);
+    Py_END_ALLOW_THREADS
+
+    if (res == 0) {
+        Py_INCREF(Py_None);
+        return completed_op_create(s->state, Py_None);
+    }
+    if (errno != EINPROGRESS && errno != EINTR) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    return async_wait(s, ASYNC_CONNECT, 0, 0, NULL);
+}
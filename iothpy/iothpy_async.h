@@ -0,0 +1,20 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <sys/socket.h>
+
+struct socket_object;
+
+/*
+    Awaitable socket operations for asyncio. The operation is tried at once
+    on the non-blocking socket and the returned awaitable completes without
+    suspending if it succeeded, otherwise it is an asyncio future completed
+    when the running loop reports the socket ready.
+*/
+PyObject* async_recv(struct socket_object* s, Py_ssize_t len, int flags);
+PyObject* async_send(struct socket_object* s, Py_buffer* view, int flags);
+PyObject* async_accept(struct socket_object* s);
+PyObject* async_connect(struct socket_object* s, struct sockaddr* addr, socklen_t addrlen);
+
+/* Return an awaitable completed with result, stealing the reference. Fails if result is NULL */
+PyObject* async_completed(struct socket_object* s, PyObject* result);
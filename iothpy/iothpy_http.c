@@ -0,0 +1,669 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_socket.h"
+#include "iothpy_stack.h"
+#include "http.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <ioth.h>
+
+typedef struct http_object {
+    PyObject_HEAD
+    iothpy_state* state;
+    socket_object* sock;        /* The listening socket */
+    int listen_flags;           /* fcntl flags of the listening fd before the server */
+    struct http_server srv;
+    PyObject* handlers;         /* Handlers of the dynamic routes */
+    int running;                /* serve_forever() calls in progress */
+    int closed;
+} http_object;
+
+/* State of a serve_forever() call, passed to the dynamic callback */
+struct http_call {
+    PyThreadState* tstate;      /* Saved while the loop runs without the GIL */
+    int failed;                 /* A handler raised an exception stopping the loop */
+};
+
+/* Append the "Name: value" line of a response header, returns -1 on failure */
+static int
+append_header(char** buf, size_t* len, size_t* cap, PyObject* name, PyObject* value)
+{
+    PyObject* line = PyUnicode_FromFormat("%S: %S\r\n", name, value);
+    if (line == NULL)
+        return -1;
+
+    PyObject* bytes = PyUnicode_AsLatin1String(line);
+    Py_DECREF(line);
+    if (bytes == NULL)
+        return -1;
+
+    /* Only the line terminator can be a line break */
+    const char* data = PyBytes_AS_STRING(bytes);
+    size_t size = PyBytes_GET_SIZE(bytes);
+    if (memchr(data, '\r', size - 2) != NULL || memchr(data, '\n', size - 2) != NULL) {
+        PyErr_SetString(PyExc_ValueError, "line break in a response header");
+        Py_DECREF(bytes);
+        return -1;
+    }
+
+    if (*len + size > *cap) {
+        size_t newcap = (*len + size) * 2;
+        char* p = realloc(*buf, newcap);
+        if (p == NULL) {
+            Py_DECREF(bytes);
+            PyErr_NoMemory();
+            return -1;
+        }
+        *buf = p;
+        *cap = newcap;
+    }
+    memcpy(*buf + *len, data, size);
+    *len += size;
+    Py_DECREF(bytes);
+    return 0;
+}
+
+/* Convert the (status, headers, body) tuple returned by a handler */
+static int
+http_response_from_result(PyObject* result, struct http_response* resp)
+{
+    PyObject *headers, *body, *items = NULL, *iter = NULL, *item;
+    size_t cap = 0;
+    Py_buffer view;
+
+    if (!PyTuple_Check(result) || PyTuple_GET_SIZE(result) != 3) {
+        PyErr_SetString(PyExc_TypeError, "HTTP handlers must return a (status, headers, body) tuple");
+        return -1;
+    }
+
+    resp->status = PyLong_AsLong(PyTuple_GET_ITEM(result, 0));
+    if (resp->status == -1 && PyErr_Occurred())
+        return -1;
+    if (resp->status < 100 || resp->status > 999) {
+        PyErr_SetString(PyExc_ValueError, "HTTP status out of range");
+        return -1;
+    }
+
+    /* Headers: None, a mapping or an iterable of (name, value) pairs */
+    headers = PyTuple_GET_ITEM(result, 1);
+    if (headers != Py_None) {
+        if (PyDict_Check(headers)) {
+            items = PyDict_Items(headers);
+            if (items == NULL)
+                return -1;
+            headers = items;
+        }
+        iter = PyObject_GetIter(headers);
+        Py_XDECREF(items);
+        if (iter == NULL)
+            return -1;
+
+        while ((item = PyIter_Next(iter)) != NULL) {
+            PyObject *name, *value;
+            if (!PyArg_ParseTuple(item, "OO;HTTP headers must be (name, value) pairs", &name, &value) ||
+                append_header(&resp->headers, &resp->headers_len, &cap, name, value) < 0) {
+                Py_DECREF(item);
+                Py_DECREF(iter);
+                return -1;
+            }
+            Py_DECREF(item);
+        }
+        Py_DECREF(iter);
+        if (PyErr_Occurred())
+            return -1;
+    }
+
+    /* Body: None, a str encoded to UTF-8 or a bytes-like object */
+    body = PyTuple_GET_ITEM(result, 2);
+    if (body == Py_None)
+        return 0;
+
+    if (PyUnicode_Check(body)) {
+        Py_ssize_t size;
+        const char* data = PyUnicode_AsUTF8AndSize(body, &size);
+        if (data == NULL)
+            return -1;
+        resp->body = malloc(size ? size : 1);
+        if (resp->body == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(resp->body, data, size);
+        resp->body_len = size;
+        return 0;
+    }
+
+    if (PyObject_GetBuffer(body, &view, PyBUF_SIMPLE) < 0)
+        return -1;
+    resp->body = malloc(view.len ? view.len : 1);
+    if (resp->body == NULL) {
+        PyBuffer_Release(&view);
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(resp->body, view.buf, view.len);
+    resp->body_len = view.len;
+    PyBuffer_Release(&view);
+    return 0;
+}
+
+/* Call handler(method, target, headers, body) for a request */
+static int
+http_call_handler(PyObject* handler, const struct http_request* req, struct http_response* resp)
+{
+    PyObject* args[4] = {NULL, NULL, NULL, NULL};
+    PyObject* result = NULL;
+    int res = -1;
+
+    args[0] = PyUnicode_DecodeLatin1(req->method, req->method_len, NULL);
+    args[1] = PyUnicode_DecodeLatin1(req->target, req->target_len, NULL);
+    args[2] = PyList_New(0);
+    args[3] = PyBytes_FromStringAndSize(req->body, req->body_len);
+    if (args[0] == NULL || args[1] == NULL || args[2] == NULL || args[3] == NULL)
+        goto done;
+
+    /* The header lines were validated by the parser */
+    const char* p = req->headers;
+    const char* end = p + req->headers_len;
+    while (p < end) {
+        const char* eol = memmem(p, end - p, "\r\n", 2);
+        const char* colon = memchr(p, ':', eol - p);
+        const char* value = colon + 1;
+        const char* value_end = eol;
+        while (value < value_end && (*value == ' ' || *value == '\t'))
+            value++;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            value_end--;
+
+        PyObject* pair = Py_BuildValue("(N N)",
+                                       PyUnicode_DecodeLatin1(p, colon - p, NULL),
+                                       PyUnicode_DecodeLatin1(value, value_end - value, NULL));
+        if (pair == NULL || PyList_Append(args[2], pair) < 0) {
+            Py_XDECREF(pair);
+            goto done;
+        }
+        Py_DECREF(pair);
+        p = eol + 2;
+    }
+
+    result = PyObject_Vectorcall(handler, args, 4, NULL);
+    if (result == NULL)
+        goto done;
+    res = http_response_from_result(result, resp);
+
+done:
+    for (int i = 0; i < 4; i++)
+        Py_XDECREF(args[i]);
+    Py_XDECREF(result);
+    return res;
+}
+
+/* Dynamic callback of the loop, called without the GIL */
+static int
+http_dynamic(void* arg, const struct http_route* route,
+             const struct http_request* req, struct http_response* resp)
+{
+    struct http_call* call = arg;
+    int res = 0;
+
+    PyEval_RestoreThread(call->tstate);
+
+    if (http_call_handler(route->handler, req, resp) < 0) {
+        free(resp->headers);
+        free(resp->body);
+        resp->headers = resp->body = NULL;
+        resp->headers_len = resp->body_len = 0;
+
+        if (PyErr_ExceptionMatches(PyExc_Exception)) {
+            /* Like socketserver, report the error and keep serving */
+            static const char body[] = "500 Internal Server Error\n";
+            PyErr_WriteUnraisable(route->handler);
+            resp->status = 500;
+            resp->body = strdup(body);
+            resp->body_len = resp->body ? sizeof(body) - 1 : 0;
+        }
+        else {
+            /* KeyboardInterrupt, SystemExit... stop serve_forever() */
+            call->failed = 1;
+            res = -1;
+        }
+    }
+
+    call->tstate = PyEval_SaveThread();
+    return res;
+}
+
+static void
+http_free_routes(http_object* self)
+{
+    for (size_t i = 0; i < self->srv.nroutes; i++) {
+        struct http_route* route = &self->srv.routes[i];
+        PyMem_Free(route->prefix);
+        if (route->kind == HTTP_ROUTE_STATIC && route->dirfd != -1)
+            close(route->dirfd);
+    }
+    PyMem_Free(self->srv.routes);
+    self->srv.routes = NULL;
+    self->srv.nroutes = 0;
+}
+
+static int
+http_parse_route(http_object* self, struct http_route* route, PyObject* item)
+{
+    PyObject *prefix, *target;
+    const char* kind;
+    Py_ssize_t len;
+
+    if (!PyArg_ParseTuple(item, "UsO;routes must be (prefix, kind, target) tuples", &prefix, &kind, &target))
+        return -1;
+
+    const char* data = PyUnicode_AsUTF8AndSize(prefix, &len);
+    if (data == NULL)
+        return -1;
+    if (len == 0 || data[0] != '/') {
+        PyErr_SetString(PyExc_ValueError, "route prefixes must start with '/'");
+        return -1;
+    }
+    route->prefix = PyMem_Malloc(len + 1);
+    if (route->prefix == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(route->prefix, data, len + 1);
+    route->prefix_len = len;
+
+    if (strcmp(kind, "static") == 0) {
+        PyObject* path;
+        if (!PyUnicode_FSConverter(target, &path))
+            return -1;
+        route->kind = HTTP_ROUTE_STATIC;
+        route->dirfd = open(PyBytes_AS_STRING(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (route->dirfd < 0) {
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, target);
+            Py_DECREF(path);
+            return -1;
+        }
+        Py_DECREF(path);
+    }
+    else if (strcmp(kind, "proxy") == 0) {
+        route->kind = HTTP_ROUTE_PROXY;
+        if (!get_sockaddr_from_tuple("proxy", self->sock, target,
+                                     (struct sockaddr*)&route->addr, &route->addrlen))
+            return -1;
+    }
+    else if (strcmp(kind, "handler") == 0) {
+        if (!PyCallable_Check(target)) {
+            PyErr_SetString(PyExc_TypeError, "route handlers must be callable");
+            return -1;
+        }
+        route->kind = HTTP_ROUTE_DYNAMIC;
+        if (PyList_Append(self->handlers, target) < 0)
+            return -1;
+        route->handler = target;
+    }
+    else {
+        PyErr_Format(PyExc_ValueError, "unknown route kind '%s'", kind);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stop the loops and restore the listening socket */
+static void
+http_stop(http_object* self)
+{
+    uint64_t one = 1;
+
+    if (__atomic_exchange_n(&self->closed, 1, __ATOMIC_SEQ_CST))
+        return;
+
+    if (self->srv.stopfd != -1) {
+        ssize_t res = write(self->srv.stopfd, &one, sizeof(one));
+        (void)res;
+    }
+
+    /* Restore the flags if the listening socket is still open */
+    if (self->sock != NULL && self->sock->fd == self->srv.listen_fd && self->listen_flags != -1)
+        ioth_fcntl(self->srv.listen_fd, F_SETFL, self->listen_flags);
+}
+
+static int
+http_traverse(http_object* self, visitproc visit, void* arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->sock);
+    Py_VISIT(self->handlers);
+    return 0;
+}
+
+static int
+http_clear(http_object* self)
+{
+    Py_CLEAR(self->handlers);
+    return 0;
+}
+
+static void
+http_dealloc(http_object* self)
+{
+    PyTypeObject* tp = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    http_stop(self);
+    http_free_routes(self);
+    if (self->srv.stopfd != -1)
+        close(self->srv.stopfd);
+    Py_CLEAR(self->sock);
+    http_clear(self);
+
+    /* Instances of heap types own a reference to their type */
+    tp->tp_free((PyObject*)self);
+    Py_DECREF(tp);
+}
+
+static PyObject*
+http_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    static char* kwlist[] = {"sock", "routes", "max_connections", "idle_timeout", "max_body", NULL};
+    PyObject *sockobj, *routes, *timeout_obj = NULL;
+    Py_ssize_t max_connections = 1024, max_body = 1024 * 1024;
+    _PyTime_t timeout;
+
+    iothpy_state* state = iothpy_get_state_by_type(type);
+    if (state == NULL)
+        return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|nOn:HTTPServer", kwlist, &sockobj, &routes,
+                                     &max_connections, &timeout_obj, &max_body))
+        return NULL;
+
+    if (!PyObject_TypeCheck(sockobj, state->socket_type)) {
+        PyErr_SetString(PyExc_TypeError, "HTTPServer() argument must be a socket");
+        return NULL;
+    }
+    socket_object* sock = (socket_object*)sockobj;
+    if (sock->fd == -1) {
+        errno = EBADF;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (max_connections < 1 || max_body < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_connections must be positive and max_body not negative");
+        return NULL;
+    }
+    if (timeout_obj == NULL)
+        timeout = _PyTime_FromSeconds(60);
+    else if (socket_parse_timeout(&timeout, timeout_obj) < 0)
+        return NULL;
+
+    PyObject* seq = PySequence_Fast(routes, "routes must be a sequence");
+    if (seq == NULL)
+        return NULL;
+
+    http_object* self = (http_object*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    self->state = state;
+    Py_INCREF(sock);
+    self->sock = sock;
+    self->listen_flags = -1;
+    self->running = 0;
+    self->closed = 0;
+    memset(&self->srv, 0, sizeof(self->srv));
+    self->srv.listen_fd = sock->fd;
+    self->srv.stack = ((stack_object*)sock->stack)->stack;
+    self->srv.stopfd = -1;
+    self->srv.max_connections = max_connections;
+    self->srv.max_body = max_body;
+    self->srv.idle_timeout = timeout < 0 ? -1 : (int)_PyTime_AsMilliseconds(timeout, _PyTime_ROUND_CEILING);
+    self->srv.dynamic = http_dynamic;
+    self->handlers = PyList_New(0);
+    if (self->handlers == NULL)
+        goto error;
+
+    Py_ssize_t nroutes = PySequence_Fast_GET_SIZE(seq);
+    self->srv.routes = PyMem_Calloc(nroutes ? nroutes : 1, sizeof(struct http_route));
+    if (self->srv.routes == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (Py_ssize_t i = 0; i < nroutes; i++) {
+        struct http_route* route = &self->srv.routes[i];
+        route->dirfd = -1;
+        self->srv.nroutes++;
+        if (http_parse_route(self, route, PySequence_Fast_GET_ITEM(seq, i)) < 0)
+            goto error;
+    }
+    Py_CLEAR(seq);
+
+    /* The stopfd is never drained, it stops every loop started after shutdown() */
+    self->srv.stopfd = eventfd(0, EFD_CLOEXEC);
+    if (self->srv.stopfd == -1)
+        goto oserror;
+
+    /* The loops poll the listening fd and must not block in accept */
+    self->listen_flags = ioth_fcntl(sock->fd, F_GETFL, 0);
+    if (self->listen_flags == -1)
+        goto oserror;
+    if (ioth_fcntl(sock->fd, F_SETFL, self->listen_flags | O_NONBLOCK) == -1)
+        goto oserror;
+
+    return (PyObject*)self;
+
+oserror:
+    PyErr_SetFromErrno(PyExc_OSError);
+error:
+    Py_XDECREF(seq);
+    Py_DECREF(self);
+    return NULL;
+}
+
+PyDoc_STRVAR(http_serve_forever_doc, "serve_forever()\n\
+\n\
+Serve the connections of the listening socket until shutdown() or close()\n\
+is called, without the GIL except to run the handlers. Several threads\n\
+can call it at once, each of them serving its own connections.");
+
+static PyObject*
+http_serve_forever(http_object* self, PyObject* Py_UNUSED(ignored))
+{
+    struct http_call call = { .tstate = NULL, .failed = 0 };
+    struct http_loop loop;
+    int res;
+
+    if (__atomic_load_n(&self->closed, __ATOMIC_SEQ_CST)) {
+        PyErr_SetString(PyExc_ValueError, "HTTP server is closed");
+        return NULL;
+    }
+    if (http_loop_init(&loop, &self->srv, &call) < 0)
+        return PyErr_NoMemory();
+
+    __atomic_add_fetch(&self->running, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        call.tstate = PyEval_SaveThread();
+        res = http_loop_run(&loop);
+        PyEval_RestoreThread(call.tstate);
+
+        if (res == 0)
+            break;
+        if (call.failed)
+            break;
+        if (errno != EINTR) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            break;
+        }
+        if (PyErr_CheckSignals() < 0) {
+            res = -1;
+            break;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    http_loop_free(&loop);
+    Py_END_ALLOW_THREADS
+    __atomic_sub_fetch(&self->running, 1, __ATOMIC_SEQ_CST);
+
+    if (res < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(http_shutdown_doc, "shutdown()\n\
+\n\
+Make all the serve_forever() calls return, closing their connections.\n\
+The server can't be used anymore, the listening socket is left open.");
+
+static PyObject*
+http_shutdown(http_object* self, PyObject* Py_UNUSED(ignored))
+{
+    http_stop(self);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(http_close_doc, "close()\n\
+\n\
+Same as shutdown().");
+
+static PyObject*
+http_enter(http_object* self, PyObject* Py_UNUSED(ignored))
+{
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject*
+http_exit(http_object* self, PyObject* args)
+{
+    http_stop(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+http_get_socket(http_object* self, void* closure)
+{
+    Py_INCREF(self->sock);
+    return (PyObject*)self->sock;
+}
+
+static PyObject*
+http_get_accepted(http_object* self, void* closure)
+{
+    return PyLong_FromUnsignedLongLong(__atomic_load_n(&self->srv.accepted, __ATOMIC_RELAXED));
+}
+
+static PyObject*
+http_get_requests(http_object* self, void* closure)
+{
+    return PyLong_FromUnsignedLongLong(__atomic_load_n(&self->srv.requests, __ATOMIC_RELAXED));
+}
+
+static PyObject*
+http_get_errors(http_object* self, void* closure)
+{
+    return PyLong_FromUnsignedLongLong(__atomic_load_n(&self->srv.errors, __ATOMIC_RELAXED));
+}
+
+static PyObject*
+http_get_active(http_object* self, void* closure)
+{
+    return PyLong_FromSize_t(__atomic_load_n(&self->srv.active, __ATOMIC_RELAXED));
+}
+
+static PyObject*
+http_get_running(http_object* self, void* closure)
+{
+    return PyLong_FromLong(__atomic_load_n(&self->running, __ATOMIC_SEQ_CST));
+}
+
+static PyObject*
+http_get_closed(http_object* self, void* closure)
+{
+    return PyBool_FromLong(__atomic_load_n(&self->closed, __ATOMIC_SEQ_CST));
+}
+
+static PyMethodDef http_methods[] = {
+    {"serve_forever", (PyCFunction)http_serve_forever, METH_NOARGS, http_serve_forever_doc},
+    {"shutdown", (PyCFunction)http_shutdown, METH_NOARGS, http_shutdown_doc},
+    {"close", (PyCFunction)http_shutdown, METH_NOARGS, http_close_doc},
+    {"__enter__", (PyCFunction)http_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)http_exit, METH_VARARGS, NULL},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef http_getset[] = {
+    {"socket", (getter)http_get_socket, NULL, "the listening socket", NULL},
+    {"accepted", (getter)http_get_accepted, NULL, "number of connections accepted", NULL},
+    {"requests", (getter)http_get_requests, NULL, "number of requests served", NULL},
+    {"errors", (getter)http_get_errors, NULL, "number of responses with a 4xx or 5xx status", NULL},
+    {"active", (getter)http_get_active, NULL, "number of open connections", NULL},
+    {"running", (getter)http_get_running, NULL, "number of serve_forever() calls in progress", NULL},
+    {"closed", (getter)http_get_closed, NULL, "true if shutdown() or close() was called", NULL},
+    {NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(http_doc,
+"HTTPServer(sock, routes, max_connections=1024, idle_timeout=60.0, max_body=1048576)\n\
+\n\
+Native HTTP/1.1 server on the listening socket sock, use iothpy.http for\n\
+a friendlier interface. routes is a sequence of (prefix, kind, target)\n\
+tuples, the first one whose prefix starts the request path serves it,\n\
+the prefix matching whole path segments:\n\
+  (prefix, \"static\", directory)  serve the files of directory\n\
+  (prefix, \"proxy\", address)     forward the request to address\n\
+  (prefix, \"handler\", callable)  call callable(method, target, headers, body)\n\
+returning a (status, headers, body) tuple.\n\
+Each serve_forever() call handles up to max_connections connections,\n\
+idle_timeout seconds without activity close a connection (None never)\n\
+and max_body is the largest request body accepted.");
+
+static PyType_Slot http_slots[] = {
+    {Py_tp_dealloc, http_dealloc},
+    {Py_tp_traverse, http_traverse},
+    {Py_tp_clear, http_clear},
+    {Py_tp_doc, (void*)http_doc},
+    {Py_tp_methods, http_methods},
+    {Py_tp_getset, http_getset},
+    {Py_tp_new, http_new},
+    {0, NULL}
+};
+
+static PyType_Spec http_spec = {
+    .name = "_iothpy.HTTPServer",
+    .basicsize = sizeof(http_object),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+    .slots = http_slots,
+};
+
+PyTypeObject*
+http_type_create(PyObject* module)
+{
+    return (PyTypeObject*)PyType_FromModuleAndSpec(module, &http_spec, NULL);
+}
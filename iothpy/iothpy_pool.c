@@ -0,0 +1,563 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_pool.h"
+#include "iothpy_stack.h"
+#include "iothpy_socket.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <ioth.h>
+
+typedef struct pool_object {
+    PyObject_HEAD
+    iothpy_state* state;
+    PyObject* stack;
+    int family;
+    Py_ssize_t max_per_host;
+    _PyTime_t idle_timeout;     /* -1 keeps the idle connections forever */
+
+    PyObject* idle;             /* address -> list of (socket, release time), most recent last */
+    PyObject* lent;             /* socket -> address of the connections acquired */
+    Py_ssize_t nidle;
+
+    int closed;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+} pool_object;
+
+/*
+    A cheap check of an idle connection: nothing can be waiting on it,
+    end of file means the peer closed it and data means a stale response.
+*/
+static int
+pool_conn_alive(PyObject* sock)
+{
+    int fd = ((socket_object*)sock)->fd;
+    char byte;
+
+    if (fd == -1)
+        return 0;
+    ssize_t n = ioth_recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Close the sockets of list, reporting the errors as unraisable */
+static void
+pool_close_all(PyObject* list)
+{
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(list); i++) {
+        PyObject* sock = PyList_GET_ITEM(list, i);
+        PyObject* res = PyObject_CallMethod(sock, "close", NULL);
+        if (res == NULL)
+            PyErr_WriteUnraisable(sock);
+        Py_XDECREF(res);
+    }
+}
+
+/*
+    Move the idle connections of list that expired before now, or all of
+    them if now is -1, to victims. Returns -1 on failure.
+*/
+static int
+pool_expire(pool_object* self, PyObject* list, _PyTime_t now, PyObject* victims)
+{
+    Py_ssize_t n = 0;
+
+    /* The oldest connections are at the start of the list */
+    while (n < PyList_GET_SIZE(list)) {
+        PyObject* entry = PyList_GET_ITEM(list, n);
+        if (now != -1) {
+            _PyTime_t released = PyLong_AsLongLong(PyTuple_GET_ITEM(entry, 1));
+            if (self->idle_timeout < 0 || now - released < self->idle_timeout)
+                break;
+        }
+        if (PyList_Append(victims, PyTuple_GET_ITEM(entry, 0)) < 0)
+            return -1;
+        n++;
+    }
+
+    if (n > 0 && PyList_SetSlice(list, 0, n, NULL) < 0)
+        return -1;
+    self->nidle -= n;
+    if (now != -1)
+        self->evictions += n;
+    return 0;
+}
+
+static int
+pool_traverse(pool_object* self, visitproc visit, void* arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->stack);
+    Py_VISIT(self->idle);
+    Py_VISIT(self->lent);
+    return 0;
+}
+
+static int
+pool_clear(pool_object* self)
+{
+    Py_CLEAR(self->stack);
+    Py_CLEAR(self->idle);
+    Py_CLEAR(self->lent);
+    return 0;
+}
+
+static void
+pool_dealloc(pool_object* self)
+{
+    PyTypeObject* tp = Py_TYPE(self);
+
+    /* The idle sockets are closed by their own deallocation */
+    PyObject_GC_UnTrack(self);
+    pool_clear(self);
+
+    /* Instances of heap types own a reference to their type */
+    tp->tp_free((PyObject*)self);
+    Py_DECREF(tp);
+}
+
+static PyObject*
+pool_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    PyErr_SetString(PyExc_TypeError, "use Stack.connection_pool() to create a ConnectionPool");
+    return NULL;
+}
+
+PyObject*
+pool_create(PyObject* stack, Py_ssize_t max_per_host, PyObject* idle_timeout, int family)
+{
+    iothpy_state* state = ((stack_object*)stack)->state;
+    _PyTime_t timeout;
+
+    if (max_per_host < 1) {
+        PyErr_SetString(PyExc_ValueError, "max_per_host must be positive");
+        return NULL;
+    }
+    if (socket_parse_timeout(&timeout, idle_timeout) < 0)
+        return NULL;
+
+    pool_object* self = (pool_object*)state->pool_type->tp_alloc(state->pool_type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->state = state;
+    Py_INCREF(stack);
+    self->stack = stack;
+    self->family = family;
+    self->max_per_host = max_per_host;
+    self->idle_timeout = timeout;
+    self->idle = PyDict_New();
+    self->lent = PyDict_New();
+    if (self->idle == NULL || self->lent == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*)self;
+}
+
+PyDoc_STRVAR(pool_acquire_doc, "acquire(address, timeout) -> socket\n\
+\n\
+Return a connection to address, a (host, port) tuple or an Address. The\n\
+most recently released idle connection is reused if it is still open,\n\
+otherwise a new one is connected. If timeout is given it is set on the\n\
+socket with settimeout(). Give the socket back with release(), or with\n\
+discard() if it can't be reused.");
+
+static PyObject*
+pool_acquire(pool_object* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"address", "timeout", NULL};
+    PyObject* argv[2];
+    PyObject* sock = NULL;
+    int closed, failed = 0;
+
+    if (!fastcall_unpack("acquire", args, nargs, kwnames, kwlist, 1, argv))
+        return NULL;
+    PyObject* address = argv[0];
+
+    PyObject* victims = PyList_New(0);
+    if (victims == NULL)
+        return NULL;
+
+    _PyTime_t now = _PyTime_GetMonotonicClock();
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    closed = self->closed;
+    PyObject* list = closed ? NULL : PyDict_GetItemWithError(self->idle, address);
+    if (list != NULL && pool_expire(self, list, now, victims) < 0)
+        failed = 1;
+
+    /* Reuse the warmest connection, it is the least likely to be closed by the peer */
+    while (!failed && list != NULL && PyList_GET_SIZE(list) > 0) {
+        Py_ssize_t last = PyList_GET_SIZE(list) - 1;
+        PyObject* candidate = PyTuple_GET_ITEM(PyList_GET_ITEM(list, last), 0);
+        Py_INCREF(candidate);
+        if (PyList_SetSlice(list, last, last + 1, NULL) < 0) {
+            Py_DECREF(candidate);
+            failed = 1;
+            break;
+        }
+        self->nidle--;
+
+        if (pool_conn_alive(candidate)) {
+            sock = candidate;
+            break;
+        }
+        self->evictions++;
+        if (PyList_Append(victims, candidate) < 0)
+            failed = 1;
+        Py_DECREF(candidate);
+    }
+
+    if (!failed && !closed && !PyErr_Occurred()) {
+        if (sock != NULL)
+            self->hits++;
+        else
+            self->misses++;
+    }
+    Py_END_CRITICAL_SECTION();
+
+    pool_close_all(victims);
+    Py_DECREF(victims);
+
+    if (failed || PyErr_Occurred())
+        goto error;
+    if (closed) {
+        PyErr_SetString(PyExc_ValueError, "connection pool is closed");
+        return NULL;
+    }
+
+    if (sock == NULL) {
+        sock = PyObject_CallMethod(self->stack, "socket", "ii", self->family, SOCK_STREAM);
+        if (sock == NULL)
+            return NULL;
+        if (!PyObject_TypeCheck(sock, self->state->socket_type)) {
+            PyErr_SetString(PyExc_TypeError, "Stack.socket() did not return an ioth socket");
+            goto error;
+        }
+        if (argv[1] != NULL) {
+            PyObject* res = PyObject_CallMethod(sock, "settimeout", "O", argv[1]);
+            if (res == NULL)
+                goto error;
+            Py_DECREF(res);
+        }
+        PyObject* res = PyObject_CallMethod(sock, "connect", "(O)", address);
+        if (res == NULL) {
+            PyObject *type, *value, *tb;
+            PyErr_Fetch(&type, &value, &tb);
+            res = PyObject_CallMethod(sock, "close", NULL);
+            Py_XDECREF(res);
+            PyErr_Restore(type, value, tb);
+            goto error;
+        }
+        Py_DECREF(res);
+    }
+    else if (argv[1] != NULL) {
+        PyObject* res = PyObject_CallMethod(sock, "settimeout", "O", argv[1]);
+        if (res == NULL)
+            goto error;
+        Py_DECREF(res);
+    }
+
+    if (PyDict_SetItem(self->lent, sock, address) < 0)
+        goto error;
+    return sock;
+
+error:
+    Py_XDECREF(sock);
+    return NULL;
+}
+
+/* Remove sock from the connections acquired, returning its address */
+static PyObject*
+pool_take_lent(pool_object* self, PyObject* sock)
+{
+    PyObject* address = PyDict_GetItemWithError(self->lent, sock);
+    if (address == NULL) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "the socket was not acquired from this pool");
+        return NULL;
+    }
+    Py_INCREF(address);
+    if (PyDict_DelItem(self->lent, sock) < 0) {
+        Py_DECREF(address);
+        return NULL;
+    }
+    return address;
+}
+
+PyDoc_STRVAR(pool_release_doc, "release(sock)\n\
+\n\
+Give back a connection returned by acquire(), keeping it open for the\n\
+next acquire() of the same address. When max_per_host connections to the\n\
+address are already idle the oldest one is closed.");
+
+static PyObject*
+pool_release(pool_object* self, PyObject* sock)
+{
+    PyObject* entry = NULL;
+    int failed = 0;
+
+    PyObject* victims = PyList_New(0);
+    if (victims == NULL)
+        return NULL;
+
+    PyObject* now = PyLong_FromLongLong(_PyTime_GetMonotonicClock());
+    if (now == NULL) {
+        Py_DECREF(victims);
+        return NULL;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    PyObject* address = pool_take_lent(self, sock);
+    if (address == NULL) {
+        failed = 1;
+    }
+    else if (self->closed || ((socket_object*)sock)->fd == -1) {
+        failed = PyList_Append(victims, sock) < 0;
+    }
+    else {
+        PyObject* list = PyDict_GetItemWithError(self->idle, address);
+        if (list == NULL && !PyErr_Occurred()) {
+            list = PyList_New(0);
+            if (list != NULL) {
+                failed = PyDict_SetItem(self->idle, address, list) < 0;
+                Py_DECREF(list);
+            }
+        }
+        if (list == NULL)
+            failed = 1;
+
+        if (!failed && PyList_GET_SIZE(list) >= self->max_per_host) {
+            failed = PyList_Append(victims, PyTuple_GET_ITEM(PyList_GET_ITEM(list, 0), 0)) < 0 ||
+                     PyList_SetSlice(list, 0, 1, NULL) < 0;
+            if (!failed) {
+                self->nidle--;
+                self->evictions++;
+            }
+        }
+        if (!failed) {
+            entry = PyTuple_Pack(2, sock, now);
+            failed = entry == NULL || PyList_Append(list, entry) < 0;
+            if (!failed)
+                self->nidle++;
+        }
+    }
+    Py_XDECREF(address);
+    Py_END_CRITICAL_SECTION();
+
+    Py_XDECREF(entry);
+    Py_DECREF(now);
+    pool_close_all(victims);
+    Py_DECREF(victims);
+
+    if (failed)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pool_discard_doc, "discard(sock)\n\
+\n\
+Close a connection returned by acquire() instead of releasing it, e.g.\n\
+after an error left it in an unknown state.");
+
+static PyObject*
+pool_discard(pool_object* self, PyObject* sock)
+{
+    PyObject* address;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    address = pool_take_lent(self, sock);
+    Py_END_CRITICAL_SECTION();
+
+    if (address == NULL)
+        return NULL;
+    Py_DECREF(address);
+    return PyObject_CallMethod(sock, "close", NULL);
+}
+
+/* Close the idle connections expired at now, or all of them if now is -1 */
+static Py_ssize_t
+pool_expire_all(pool_object* self, _PyTime_t now)
+{
+    PyObject *victims, *address, *list;
+    Py_ssize_t pos = 0, count;
+    int failed = 0;
+
+    victims = PyList_New(0);
+    if (victims == NULL)
+        return -1;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    while (PyDict_Next(self->idle, &pos, &address, &list)) {
+        if (pool_expire(self, list, now, victims) < 0) {
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed && now == -1)
+        PyDict_Clear(self->idle);
+    Py_END_CRITICAL_SECTION();
+
+    count = PyList_GET_SIZE(victims);
+    pool_close_all(victims);
+    Py_DECREF(victims);
+    return failed ? -1 : count;
+}
+
+PyDoc_STRVAR(pool_prune_doc, "prune() -> int\n\
+\n\
+Close the idle connections older than idle_timeout, returning their\n\
+number. acquire() prunes the connections of its address by itself.");
+
+static PyObject*
+pool_prune(pool_object* self, PyObject* Py_UNUSED(ignored))
+{
+    Py_ssize_t count = pool_expire_all(self, _PyTime_GetMonotonicClock());
+    if (count < 0)
+        return NULL;
+    return PyLong_FromSsize_t(count);
+}
+
+PyDoc_STRVAR(pool_close_doc, "close()\n\
+\n\
+Close the idle connections, the ones still acquired are closed when\n\
+they are released.");
+
+static PyObject*
+pool_close(pool_object* self, PyObject* Py_UNUSED(ignored))
+{
+    Py_BEGIN_CRITICAL_SECTION(self);
+    self->closed = 1;
+    Py_END_CRITICAL_SECTION();
+
+    if (pool_expire_all(self, -1) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pool_enter(pool_object* self, PyObject* Py_UNUSED(ignored))
+{
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject*
+pool_exit(pool_object* self, PyObject* args)
+{
+    return pool_close(self, NULL);
+}
+
+PyDoc_STRVAR(pool_stats_doc, "stats() -> dict\n\
+\n\
+Return the counters of the pool:\n\
+  hits:      acquire() calls that reused an idle connection\n\
+  misses:    acquire() calls that opened a new connection\n\
+  evictions: idle connections closed because expired, dead or in excess\n\
+  idle:      connections waiting in the pool\n\
+  lent:      connections acquired and not yet released");
+
+static PyObject*
+pool_stats(pool_object* self, PyObject* Py_UNUSED(ignored))
+{
+    PyObject* stats;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    stats = Py_BuildValue("{s:K,s:K,s:K,s:n,s:n}",
+                          "hits", self->hits,
+                          "misses", self->misses,
+                          "evictions", self->evictions,
+                          "idle", self->nidle,
+                          "lent", PyDict_GET_SIZE(self->lent));
+    Py_END_CRITICAL_SECTION();
+    return stats;
+}
+
+static PyObject*
+pool_get_max_per_host(pool_object* self, void* closure)
+{
+    return PyLong_FromSsize_t(self->max_per_host);
+}
+
+static PyObject*
+pool_get_idle_timeout(pool_object* self, void* closure)
+{
+    if (self->idle_timeout < 0)
+        Py_RETURN_NONE;
+    return PyFloat_FromDouble(_PyTime_AsSecondsDouble(self->idle_timeout));
+}
+
+static PyObject*
+pool_get_closed(pool_object* self, void* closure)
+{
+    return PyBool_FromLong(self->closed);
+}
+
+static PyMethodDef pool_methods[] = {
+    {"acquire", (PyCFunction)(void(*)(void))pool_acquire, METH_FASTCALL | METH_KEYWORDS, pool_acquire_doc},
+    {"release", (PyCFunction)pool_release, METH_O, pool_release_doc},
+    {"discard", (PyCFunction)pool_discard, METH_O, pool_discard_doc},
+    {"prune", (PyCFunction)pool_prune, METH_NOARGS, pool_prune_doc},
+    {"stats", (PyCFunction)pool_stats, METH_NOARGS, pool_stats_doc},
+    {"close", (PyCFunction)pool_close, METH_NOARGS, pool_close_doc},
+    {"__enter__", (PyCFunction)pool_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)pool_exit, METH_VARARGS, NULL},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef pool_getset[] = {
+    {"max_per_host", (getter)pool_get_max_per_host, NULL, "idle connections kept for each address", NULL},
+    {"idle_timeout", (getter)pool_get_idle_timeout, NULL, "seconds an idle connection is kept, None for ever", NULL},
+    {"closed", (getter)pool_get_closed, NULL, "true if close() was called", NULL},
+    {NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(pool_doc,
+"Pool of keep-alive connections of a stack, see Stack.connection_pool()");
+
+static PyType_Slot pool_slots[] = {
+    {Py_tp_dealloc, pool_dealloc},
+    {Py_tp_traverse, pool_traverse},
+    {Py_tp_clear, pool_clear},
+    {Py_tp_doc, (void*)pool_doc},
+    {Py_tp_methods, pool_methods},
+    {Py_tp_getset, pool_getset},
+    {Py_tp_new, pool_new},
+    {0, NULL}
+};
+
+static PyType_Spec pool_spec = {
+    .name = "_iothpy.ConnectionPool",
+    .basicsize = sizeof(pool_object),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+    .slots = pool_slots,
+};
+
+PyTypeObject*
+pool_type_create(PyObject* module)
+{
+    return (PyTypeObject*)PyType_FromModuleAndSpec(module, &pool_spec, NULL);
+}
@@ -0,0 +1,12 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "iothpy.h"
+
+/*
+    Create a pool of keep-alive connections of stack, keeping up to
+    max_per_host idle connections for each address for idle_timeout
+    seconds (a float, or None to keep them forever). Returns a new
+    ConnectionPool object.
+*/
+PyObject* pool_create(PyObject* stack, Py_ssize_t max_per_host, PyObject* idle_timeout, int family);
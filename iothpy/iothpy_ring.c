@@ -0,0 +1,873 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_socket.h"
+#include "mpmc_queue.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <ioth.h>
+
+enum ring_opcode {
+    RING_RECV,
+    RING_SEND,
+    RING_ACCEPT,
+    RING_CONNECT,
+};
+
+/*
+    An operation of the ring. Python fills it and holds the references,
+    the worker thread only runs the sock_*_impl callback on it and sets
+    result or error.
+*/
+struct ring_op {
+    enum ring_opcode opcode;
+    socket_object* sock;
+    PyObject* user_data;
+    PyObject* obj;              /* RING_RECV: the bytes object being filled */
+    Py_buffer view;             /* RING_SEND: the data being sent */
+
+    sockaddr_union addr;        /* RING_ACCEPT: peer address, RING_CONNECT: target address */
+    socklen_t addrlen;
+    union {
+        struct sock_recv recv;
+        struct sock_send_ctx send;
+        struct sock_accept_ctx accept;
+    } ctx;
+
+    int ready;                  /* The worker can try the operation without blocking */
+    int started;                /* RING_CONNECT: ioth_connect() was called */
+    int error;                  /* errno of the operation, 0 on success */
+};
+
+typedef struct ring_object {
+    PyObject_HEAD
+    iothpy_state* state;
+    size_t entries;
+
+    struct mpmc_queue sq;       /* Submission ring, python to the worker */
+    struct mpmc_queue cq;       /* Completion ring, the worker to python */
+    int wakefd;                 /* eventfd waking the worker on submit() and close() */
+    int cqfd;                   /* eventfd readable when completions are queued */
+    pthread_t thread;
+    int started;
+
+    int closed;
+    int error;                  /* errno of a fatal error of the worker */
+    size_t inflight;            /* Operations queued and not yet returned by completions() */
+    size_t unsubmitted;         /* Operations queued since the last submit() */
+    unsigned long long submitted;
+    unsigned long long completed;
+} ring_object;
+
+static void
+eventfd_signal(int fd)
+{
+    uint64_t one = 1;
+    ssize_t res = write(fd, &one, sizeof(one));
+    (void)res;
+}
+
+static void
+eventfd_drain(int fd)
+{
+    uint64_t count;
+    ssize_t res = read(fd, &count, sizeof(count));
+    (void)res;
+}
+
+/*
+    Try an operation without blocking. Returns 1 when it is done, with
+    its result or error set, and 0 when it must wait for its socket.
+*/
+static int
+ring_op_run(struct ring_op* op)
+{
+    socket_object* s = op->sock;
+    int fd = __atomic_load_n(&s->fd, __ATOMIC_RELAXED);
+    int ok;
+
+    switch (op->opcode) {
+    case RING_RECV:
+        /* Already served from the read-ahead buffer by ring_recv() */
+        if (op->ctx.recv.result > 0)
+            return 1;
+        ok = sock_recv_impl(s, &op->ctx.recv);
+        break;
+    case RING_SEND:
+        /* A paced send waits for its turn with the poll timeout, not in the stack */
+        if (sock_pacing_delay(s, op->ctx.send.len) > 0)
+            return 0;
+        ok = sock_send_impl(s, &op->ctx.send);
+        break;
+    case RING_ACCEPT:
+        /* The fd was made non-blocking by ring_accept(), another thread can win the race */
+        op->addrlen = sizeof(op->addr);
+        ok = sock_accept_impl(s, &op->ctx.accept);
+        break;
+    case RING_CONNECT:
+        if (!op->started) {
+            op->started = 1;
+            if (ioth_connect(fd, &op->addr.sa, op->addrlen) == 0)
+                return 1;
+            if (errno == EINPROGRESS || errno == EINTR)
+                return 0;
+            ok = 0;
+        }
+        else {
+            ok = sock_connect_impl(s, NULL);
+        }
+        break;
+    default:
+        errno = EINVAL;
+        ok = 0;
+    }
+
+    if (!ok) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        op->error = errno;
+    }
+    return 1;
+}
+
+static void
+ring_complete(ring_object* self, struct ring_op* op)
+{
+    /* The completion ring has room for every operation in flight */
+    mpmc_queue_push(&self->cq, &op);
+}
+
+/* Body of the worker thread, it never touches python objects */
+static void*
+ring_thread(void* arg)
+{
+    ring_object* self = arg;
+    struct ring_op** pending = malloc(self->entries * sizeof(struct ring_op*));
+    struct pollfd* pfd = malloc((self->entries + 1) * sizeof(struct pollfd));
+    size_t npending = 0;
+    struct ring_op* op;
+
+    if (pending == NULL || pfd == NULL) {
+        __atomic_store_n(&self->error, ENOMEM, __ATOMIC_RELAXED);
+        goto out;
+    }
+
+    for (;;) {
+        while (npending < self->entries && mpmc_queue_pop(&self->sq, &op))
+            pending[npending++] = op;
+
+        /* Run the operations that can make progress, keep the others */
+        size_t ncompleted = 0, j = 0;
+        for (size_t i = 0; i < npending; i++) {
+            op = pending[i];
+            if (op->ready && ring_op_run(op)) {
+                ring_complete(self, op);
+                ncompleted++;
+            }
+            else {
+                pending[j++] = op;
+            }
+        }
+        npending = j;
+
+        if (ncompleted > 0) {
+            __atomic_add_fetch(&self->completed, ncompleted, __ATOMIC_RELAXED);
+            eventfd_signal(self->cqfd);
+        }
+
+        if (__atomic_load_n(&self->closed, __ATOMIC_SEQ_CST))
+            break;
+
+        /* Wait for a pending socket or for python */
+        int timeout = -1;
+        pfd[0].fd = self->wakefd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        for (size_t i = 0; i < npending; i++) {
+            op = pending[i];
+            pfd[i + 1].fd = __atomic_load_n(&op->sock->fd, __ATOMIC_RELAXED);
+            pfd[i + 1].events = (op->opcode == RING_RECV || op->opcode == RING_ACCEPT) ? POLLIN : POLLOUT;
+            pfd[i + 1].revents = 0;
+            op->ready = 0;
+
+            /* A socket closed by python fails the operation */
+            if (pfd[i + 1].fd == -1) {
+                op->ready = 1;
+                timeout = 0;
+            }
+            else if (op->opcode == RING_SEND) {
+                /* A paced send is retried when its turn comes, whatever the socket */
+                long long delay = sock_pacing_delay(op->sock, op->ctx.send.len);
+                if (delay > 0) {
+                    int ms = (int)((delay + 999999) / 1000000);
+                    pfd[i + 1].fd = -1;
+                    op->ready = 1;
+                    if (timeout < 0 || ms < timeout)
+                        timeout = ms;
+                }
+            }
+        }
+
+        if (poll(pfd, npending + 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            __atomic_store_n(&self->error, errno, __ATOMIC_RELAXED);
+            break;
+        }
+
+        if (pfd[0].revents)
+            eventfd_drain(self->wakefd);
+        for (size_t i = 0; i < npending; i++) {
+            if (pfd[i + 1].revents)
+                pending[i]->ready = 1;
+        }
+    }
+
+out:
+    /* Cancel what is left, python frees the operations in completions() or close() */
+    if (pending != NULL) {
+        for (size_t i = 0; i < npending; i++) {
+            pending[i]->error = ECANCELED;
+            ring_complete(self, pending[i]);
+        }
+    }
+    while (mpmc_queue_pop(&self->sq, &op)) {
+        op->error = ECANCELED;
+        ring_complete(self, op);
+    }
+    eventfd_signal(self->cqfd);
+
+    free(pending);
+    free(pfd);
+    return NULL;
+}
+
+static void
+ring_op_free(struct ring_op* op)
+{
+    /* view is zeroed if the operation failed before getting the buffer */
+    if (op->opcode == RING_SEND)
+        PyBuffer_Release(&op->view);
+    Py_XDECREF(op->obj);
+    Py_XDECREF(op->user_data);
+    Py_DECREF(op->sock);
+    PyMem_Free(op);
+}
+
+/* Stop and join the worker, dropping the operations not yet completed */
+static void
+ring_stop(ring_object* self)
+{
+    struct ring_op* op;
+
+    if (__atomic_exchange_n(&self->closed, 1, __ATOMIC_SEQ_CST))
+        return;
+
+    if (self->started) {
+        Py_BEGIN_ALLOW_THREADS
+        eventfd_signal(self->wakefd);
+        pthread_join(self->thread, NULL);
+        Py_END_ALLOW_THREADS
+    }
+
+    if (self->cq.cells != NULL) {
+        while (mpmc_queue_pop(&self->cq, &op))
+            ring_op_free(op);
+    }
+    if (self->sq.cells != NULL) {
+        while (mpmc_queue_pop(&self->sq, &op))
+            ring_op_free(op);
+    }
+    __atomic_store_n(&self->inflight, 0, __ATOMIC_RELAXED);
+
+    if (self->cqfd != -1)
+        eventfd_signal(self->cqfd);
+}
+
+static void
+ring_dealloc(ring_object* self)
+{
+    ring_stop(self);
+
+    if (self->wakefd != -1)
+        close(self->wakefd);
+    if (self->cqfd != -1)
+        close(self->cqfd);
+    mpmc_queue_free(&self->sq);
+    mpmc_queue_free(&self->cq);
+
+    /* Instances of heap types own a reference to their type */
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject*)self);
+    Py_DECREF(tp);
+}
+
+static PyObject*
+ring_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    static char* kwlist[] = {"entries", NULL};
+    Py_ssize_t entries = 256;
+
+    iothpy_state* state = iothpy_get_state_by_type(type);
+    if (state == NULL)
+        return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n:IORing", kwlist, &entries))
+        return NULL;
+    if (entries < 1) {
+        PyErr_SetString(PyExc_ValueError, "entries must be positive");
+        return NULL;
+    }
+    if ((size_t)entries > MPMC_QUEUE_MAX_CAPACITY) {
+        PyErr_Format(PyExc_ValueError, "entries must be at most %zu", (size_t)MPMC_QUEUE_MAX_CAPACITY);
+        return NULL;
+    }
+
+    ring_object* self = (ring_object*)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->state = state;
+    self->entries = entries;
+    self->sq.cells = NULL;
+    self->cq.cells = NULL;
+    self->wakefd = -1;
+    self->cqfd = -1;
+    self->started = 0;
+    self->closed = 0;
+    self->error = 0;
+    self->inflight = 0;
+    self->unsubmitted = 0;
+    self->submitted = 0;
+    self->completed = 0;
+
+    if (mpmc_queue_init(&self->sq, entries, sizeof(struct ring_op*)) < 0 ||
+        mpmc_queue_init(&self->cq, entries, sizeof(struct ring_op*)) < 0) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    self->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    self->cqfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->wakefd == -1 || self->cqfd == -1)
+        goto error;
+
+    errno = pthread_create(&self->thread, NULL, ring_thread, self);
+    if (errno != 0)
+        goto error;
+    self->started = 1;
+
+    return (PyObject*)self;
+
+error:
+    PyErr_SetFromErrno(PyExc_OSError);
+    Py_DECREF(self);
+    return NULL;
+}
+
+/*
+    Allocate an operation on sock, reserving its slot in the rings.
+    Returns NULL with an exception set if the ring is closed or full.
+*/
+static struct ring_op*
+ring_op_new(ring_object* self, enum ring_opcode opcode, PyObject* sockobj, PyObject* user_data)
+{
+    if (__atomic_load_n(&self->closed, __ATOMIC_SEQ_CST)) {
+        PyErr_SetString(PyExc_ValueError, "I/O ring is closed");
+        return NULL;
+    }
+    if (!PyObject_TypeCheck(sockobj, self->state->socket_type)) {
+        PyErr_SetString(PyExc_TypeError, "the ring operations need an ioth socket");
+        return NULL;
+    }
+    if (((socket_object*)sockobj)->fd == -1) {
+        errno = EBADF;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    if (__atomic_add_fetch(&self->inflight, 1, __ATOMIC_RELAXED) > self->entries) {
+        __atomic_sub_fetch(&self->inflight, 1, __ATOMIC_RELAXED);
+        errno = EBUSY;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    struct ring_op* op = PyMem_Calloc(1, sizeof(struct ring_op));
+    if (op == NULL) {
+        __atomic_sub_fetch(&self->inflight, 1, __ATOMIC_RELAXED);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    op->opcode = opcode;
+    Py_INCREF(sockobj);
+    op->sock = (socket_object*)sockobj;
+    Py_INCREF(user_data);
+    op->user_data = user_data;
+    return op;
+}
+
+/* Hand an operation to the worker, it runs after the next submit() */
+static PyObject*
+ring_op_queue(ring_object* self, struct ring_op* op)
+{
+    /* Cannot fail, the submission ring has room for every operation in flight */
+    mpmc_queue_push(&self->sq, &op);
+    __atomic_add_fetch(&self->unsubmitted, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&self->submitted, 1, __ATOMIC_RELAXED);
+    Py_RETURN_NONE;
+}
+
+static void
+ring_op_discard(ring_object* self, struct ring_op* op)
+{
+    ring_op_free(op);
+    __atomic_sub_fetch(&self->inflight, 1, __ATOMIC_RELAXED);
+}
+
+PyDoc_STRVAR(ring_recv_doc, "recv(sock, bufsize, flags=0, user_data=None)\n\
+\n\
+Queue a recv() of up to bufsize bytes on sock. Its completion is the\n\
+bytes object received. The bytes already in the read-ahead buffer of\n\
+sock are returned first.");
+
+static PyObject*
+ring_recv(ring_object* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"sock", "bufsize", "flags", "user_data", NULL};
+    PyObject* argv[4];
+    Py_ssize_t bufsize;
+    int flags = 0;
+
+    if (!fastcall_unpack("recv", args, nargs, kwnames, kwlist, 2, argv))
+        return NULL;
+    if (!fastcall_ssize_t(argv[1], &bufsize))
+        return NULL;
+    if (argv[2] != NULL && !fastcall_int(argv[2], &flags))
+        return NULL;
+    if (bufsize < 0) {
+        PyErr_SetString(PyExc_ValueError, "negative buffersize in recv");
+        return NULL;
+    }
+
+    struct ring_op* op = ring_op_new(self, RING_RECV, argv[0], argv[3] ? argv[3] : Py_None);
+    if (op == NULL)
+        return NULL;
+
+    op->obj = PyBytes_FromStringAndSize(NULL, bufsize);
+    if (op->obj == NULL) {
+        ring_op_discard(self, op);
+        return NULL;
+    }
+
+    op->ctx.recv.cbuf = PyBytes_AS_STRING(op->obj);
+    op->ctx.recv.len = bufsize;
+    op->ctx.recv.flags = flags | MSG_DONTWAIT;
+
+    /* The bytes in the read-ahead buffer of the socket come first, like in recv() */
+    op->ctx.recv.result = bufsize > 0 ? rbuf_read(op->sock, op->ctx.recv.cbuf, bufsize, flags) : 0;
+    if (op->ctx.recv.result < 0) {
+        ring_op_discard(self, op);
+        return NULL;
+    }
+    op->ready = 1;
+    return ring_op_queue(self, op);
+}
+
+PyDoc_STRVAR(ring_send_doc, "send(sock, data, flags=0, user_data=None)\n\
+\n\
+Queue a send() of data on sock. Its completion is the number of bytes\n\
+sent, which can be less than len(data). data must not be modified until\n\
+the operation completes.");
+
+static PyObject*
+ring_send(ring_object* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"sock", "data", "flags", "user_data", NULL};
+    PyObject* argv[4];
+    int flags = 0;
+
+    if (!fastcall_unpack("send", args, nargs, kwnames, kwlist, 2, argv))
+        return NULL;
+    if (argv[2] != NULL && !fastcall_int(argv[2], &flags))
+        return NULL;
+
+    struct ring_op* op = ring_op_new(self, RING_SEND, argv[0], argv[3] ? argv[3] : Py_None);
+    if (op == NULL)
+        return NULL;
+
+    if (!fastcall_buffer(argv[1], &op->view)) {
+        ring_op_discard(self, op);
+        return NULL;
+    }
+
+    op->ctx.send.buf = op->view.buf;
+    op->ctx.send.len = op->view.len;
+    op->ctx.send.flags = flags | MSG_DONTWAIT | MSG_NOSIGNAL;
+    op->ready = 1;
+    return ring_op_queue(self, op);
+}
+
+PyDoc_STRVAR(ring_accept_doc, "accept(sock, user_data=None)\n\
+\n\
+Queue an accept() on the listening socket sock. Its completion is the\n\
+(socket, address) pair returned by sock.accept(). The fd of a blocking\n\
+sock is made non-blocking so that the worker never waits for it, its\n\
+methods keep blocking.");
+
+static PyObject*
+ring_accept(ring_object* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"sock", "user_data", NULL};
+    PyObject* argv[2];
+
+    if (!fastcall_unpack("accept", args, nargs, kwnames, kwlist, 1, argv))
+        return NULL;
+
+    struct ring_op* op = ring_op_new(self, RING_ACCEPT, argv[0], argv[1] ? argv[1] : Py_None);
+    if (op == NULL)
+        return NULL;
+
+    if (internal_fd_nonblocking(op->sock) < 0) {
+        ring_op_discard(self, op);
+        return NULL;
+    }
+
+    op->ctx.accept.addrbuf = &op->addr.sa;
+    op->ctx.accept.addrlen = &op->addrlen;
+    return ring_op_queue(self, op);
+}
+
+PyDoc_STRVAR(ring_connect_doc, "connect(sock, address, user_data=None)\n\
+\n\
+Queue a connect() of sock to address. Its completion is None. The fd\n\
+of a blocking sock is made non-blocking so that the connection runs in\n\
+the background, its methods keep blocking.");
+
+static PyObject*
+ring_connect(ring_object* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"sock", "address", "user_data", NULL};
+    PyObject* argv[3];
+
+    if (!fastcall_unpack("connect", args, nargs, kwnames, kwlist, 2, argv))
+        return NULL;
+
+    struct ring_op* op = ring_op_new(self, RING_CONNECT, argv[0], argv[2] ? argv[2] : Py_None);
+    if (op == NULL)
+        return NULL;
+
+    if (!get_sockaddr_from_tuple("connect", op->sock, argv[1], &op->addr.sa, &op->addrlen) ||
+        internal_fd_nonblocking(op->sock) < 0) {
+        ring_op_discard(self, op);
+        return NULL;
+    }
+
+    op->ready = 1;
+    return ring_op_queue(self, op);
+}
+
+PyDoc_STRVAR(ring_submit_doc, "submit() -> int\n\
+\n\
+Wake the worker to run the operations queued since the last call,\n\
+returning their number.");
+
+static PyObject*
+ring_submit(ring_object* self, PyObject* Py_UNUSED(ignored))
+{
+    size_t count = __atomic_exchange_n(&self->unsubmitted, 0, __ATOMIC_RELAXED);
+
+    /* One wakeup for the whole batch */
+    if (count > 0)
+        eventfd_signal(self->wakefd);
+    return PyLong_FromSize_t(count);
+}
+
+/* Build the (user_data, result) pair of a completed operation */
+static PyObject*
+ring_op_result(struct ring_op* op)
+{
+    PyObject* result;
+
+    if (op->error != 0) {
+        result = PyObject_CallFunction(PyExc_OSError, "is", op->error, strerror(op->error));
+    }
+    else switch (op->opcode) {
+    case RING_RECV:
+        if (op->ctx.recv.result != op->ctx.recv.len &&
+            _PyBytes_Resize(&op->obj, op->ctx.recv.result) < 0)
+            return NULL;
+        result = op->obj;
+        op->obj = NULL;
+        break;
+    case RING_SEND:
+        result = PyLong_FromSsize_t(op->ctx.send.result);
+        break;
+    case RING_ACCEPT: {
+        PyObject* sock = socket_from_accepted_fd(op->sock, op->ctx.accept.result, 0);
+        if (sock == NULL)
+            return NULL;
+        PyObject* addr = make_sockaddr(&op->addr.sa, op->addrlen);
+        if (addr == NULL) {
+            Py_DECREF(sock);
+            return NULL;
+        }
+        result = PyTuple_Pack(2, sock, addr);
+        Py_DECREF(sock);
+        Py_DECREF(addr);
+        break;
+    }
+    default:
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+
+    if (result == NULL)
+        return NULL;
+
+    PyObject* pair = PyTuple_Pack(2, op->user_data, result);
+    Py_DECREF(result);
+    return pair;
+}
+
+PyDoc_STRVAR(ring_completions_doc, "completions(max=64, timeout=None) -> list of (user_data, result)\n\
+\n\
+Return up to max completed operations, waiting for at least one for\n\
+timeout seconds (None waits forever, 0 does not wait). The result of a\n\
+failed operation is the OSError instance it would have raised. An empty\n\
+list is returned on timeout or when no operation is in flight.");
+
+static PyObject*
+ring_completions(ring_object* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"max", "timeout", NULL};
+    PyObject* argv[2];
+    Py_ssize_t max = 64;
+    _PyTime_t timeout = -1, deadline = 0;
+    struct ring_op* op;
+
+    if (!fastcall_unpack("completions", args, nargs, kwnames, kwlist, 0, argv))
+        return NULL;
+    if (argv[0] != NULL && !fastcall_ssize_t(argv[0], &max))
+        return NULL;
+    if (argv[1] != NULL && socket_parse_timeout(&timeout, argv[1]) < 0)
+        return NULL;
+    if (max < 1) {
+        PyErr_SetString(PyExc_ValueError, "max must be positive");
+        return NULL;
+    }
+    if (timeout > 0)
+        deadline = _PyTime_GetMonotonicClock() + timeout;
+
+    PyObject* list = PyList_New(0);
+    if (list == NULL)
+        return NULL;
+
+    for (;;) {
+        while (PyList_GET_SIZE(list) < max && mpmc_queue_pop(&self->cq, &op)) {
+            PyObject* pair = ring_op_result(op);
+            ring_op_discard(self, op);
+            if (pair == NULL || PyList_Append(list, pair) < 0) {
+                Py_XDECREF(pair);
+                goto error;
+            }
+            Py_DECREF(pair);
+        }
+
+        if (PyList_GET_SIZE(list) > 0)
+            return list;
+
+        int error = __atomic_load_n(&self->error, __ATOMIC_RELAXED);
+        if (error != 0) {
+            errno = error;
+            PyErr_SetFromErrno(PyExc_OSError);
+            goto error;
+        }
+        if (__atomic_load_n(&self->closed, __ATOMIC_SEQ_CST)) {
+            PyErr_SetString(PyExc_ValueError, "I/O ring is closed");
+            goto error;
+        }
+        if (__atomic_load_n(&self->inflight, __ATOMIC_RELAXED) == 0)
+            return list;
+
+        /* Wait for the worker to complete some operations */
+        int ms = -1;
+        if (timeout == 0)
+            return list;
+        if (timeout > 0) {
+            _PyTime_t interval = deadline - _PyTime_GetMonotonicClock();
+            if (interval <= 0)
+                return list;
+            ms = (int)_PyTime_AsMilliseconds(interval, _PyTime_ROUND_CEILING);
+        }
+
+        struct pollfd pollfd = { .fd = self->cqfd, .events = POLLIN };
+        int n;
+
+        Py_BEGIN_ALLOW_THREADS
+        n = poll(&pollfd, 1, ms);
+        if (n > 0)
+            eventfd_drain(self->cqfd);
+        Py_END_ALLOW_THREADS
+
+        if (n < 0) {
+            if (errno != EINTR) {
+                PyErr_SetFromErrno(PyExc_OSError);
+                goto error;
+            }
+            if (PyErr_CheckSignals() < 0)
+                goto error;
+        }
+    }
+
+error:
+    Py_DECREF(list);
+    return NULL;
+}
+
+PyDoc_STRVAR(ring_close_doc, "close()\n\
+\n\
+Stop the worker thread. The operations not yet returned by completions()\n\
+are dropped, the sockets are left open.");
+
+static PyObject*
+ring_close(ring_object* self, PyObject* Py_UNUSED(ignored))
+{
+    ring_stop(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+ring_enter(ring_object* self, PyObject* Py_UNUSED(ignored))
+{
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject*
+ring_exit(ring_object* self, PyObject* args)
+{
+    ring_stop(self);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(ring_fileno_doc, "fileno() -> integer\n\
+\n\
+Return a file descriptor that is readable when completions are queued,\n\
+to wait for them with select, poll or selectors.");
+
+static PyObject*
+ring_fileno(ring_object* self, PyObject* Py_UNUSED(ignored))
+{
+    return PyLong_FromLong(self->cqfd);
+}
+
+static PyObject*
+ring_get_entries(ring_object* self, void* closure)
+{
+    return PyLong_FromSize_t(self->entries);
+}
+
+static PyObject*
+ring_get_inflight(ring_object* self, void* closure)
+{
+    return PyLong_FromSize_t(__atomic_load_n(&self->inflight, __ATOMIC_RELAXED));
+}
+
+static PyObject*
+ring_get_submitted(ring_object* self, void* closure)
+{
+    return PyLong_FromUnsignedLongLong(__atomic_load_n(&self->submitted, __ATOMIC_RELAXED));
+}
+
+static PyObject*
+ring_get_completed(ring_object* self, void* closure)
+{
+    return PyLong_FromUnsignedLongLong(__atomic_load_n(&self->completed, __ATOMIC_RELAXED));
+}
+
+static PyObject*
+ring_get_closed(ring_object* self, void* closure)
+{
+    return PyBool_FromLong(__atomic_load_n(&self->closed, __ATOMIC_SEQ_CST));
+}
+
+static PyMethodDef ring_methods[] = {
+    {"recv", (PyCFunction)(void(*)(void))ring_recv, METH_FASTCALL | METH_KEYWORDS, ring_recv_doc},
+    {"send", (PyCFunction)(void(*)(void))ring_send, METH_FASTCALL | METH_KEYWORDS, ring_send_doc},
+    {"accept", (PyCFunction)(void(*)(void))ring_accept, METH_FASTCALL | METH_KEYWORDS, ring_accept_doc},
+    {"connect", (PyCFunction)(void(*)(void))ring_connect, METH_FASTCALL | METH_KEYWORDS, ring_connect_doc},
+    {"submit", (PyCFunction)ring_submit, METH_NOARGS, ring_submit_doc},
+    {"completions", (PyCFunction)(void(*)(void))ring_completions, METH_FASTCALL | METH_KEYWORDS, ring_completions_doc},
+    {"close", (PyCFunction)ring_close, METH_NOARGS, ring_close_doc},
+    {"fileno", (PyCFunction)ring_fileno, METH_NOARGS, ring_fileno_doc},
+    {"__enter__", (PyCFunction)ring_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)ring_exit, METH_VARARGS, NULL},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef ring_getset[] = {
+    {"entries", (getter)ring_get_entries, NULL, "maximum number of operations in flight", NULL},
+    {"inflight", (getter)ring_get_inflight, NULL, "operations queued and not yet returned by completions()", NULL},
+    {"submitted", (getter)ring_get_submitted, NULL, "number of operations queued", NULL},
+    {"completed", (getter)ring_get_completed, NULL, "number of operations completed by the worker", NULL},
+    {"closed", (getter)ring_get_closed, NULL, "true if close() was called", NULL},
+    {NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(ring_doc,
+"IORing(entries=256)\n\
+\n\
+Submission and completion rings served by a native worker thread. The\n\
+operations queued with recv(), send(), accept() and connect() run after\n\
+submit() without the GIL, and completions() returns their results in\n\
+batches. At most entries operations can be in flight.");
+
+static PyType_Slot ring_slots[] = {
+    {Py_tp_dealloc, ring_dealloc},
+    {Py_tp_doc, (void*)ring_doc},
+    {Py_tp_methods, ring_methods},
+    {Py_tp_getset, ring_getset},
+    {Py_tp_new, ring_new},
+    {0, NULL}
+};
+
+static PyType_Spec ring_spec = {
+    .name = "_iothpy.IORing",
+    .basicsize = sizeof(ring_object),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = ring_slots,
+};
+
+PyTypeObject*
+ring_type_create(PyObject* module)
+{
+    return (PyTypeObject*)PyType_FromModuleAndSpec(module, &ring_spec, NULL);
+}
@@ -28,6 +28,10 @@
 #include "utils.h"
 #include "iothpy_stack.h"
 #include "iothpy_socket.h"
+#include "iothpy_address.h"
+#include "iothpy_async.h"
+#include "cork.h"
+#include "pacer.h"
 
 //PyMemberDef
 #include <structmember.h>
@@ -47,8 +51,6 @@
 
 #include <ioth.h>
 
-_PyTime_t defaulttimeout = _PYTIME_FROMSECONDS(-1);
-
 /* 
    Parse a timeout object into a _PyTime_t, raise an exception and return -1 if
    not a valid timeout object
@@ -83,14 +85,30 @@ int socket_parse_timeout(_PyTime_t *timeout, PyObject *timeout_obj)
 }
 
 
-/* Utility to get a sockaddr from a tuple argument passed to a python function.
+/* Utility to get a sockaddr from a tuple or Address argument passed to a python function.
    addr must be a pointer to an allocated sockaddr struct of the proper size for the 
    family of the socket. Returns 0 on invalid arguments */
-static int
+int
 get_sockaddr_from_tuple(char* func_name, socket_object* s, PyObject* args, struct sockaddr* sockaddr, socklen_t* len)
 {
     char* ip_addr_string;
     int port;
+    unsigned int flowinfo = 0, scope_id = 0;
+
+    /* Pre-parsed address, only check the family */
+    if (Address_Check(s->state, args))
+    {
+        address_object* a = (address_object*)args;
+        if (a->addr.sa.sa_family != s->family) {
+            PyErr_Format(PyExc_ValueError, "%s(): address family does not match the socket family", func_name);
+            return 0;
+        }
+
+        memcpy(sockaddr, &a->addr, a->addrlen);
+        if(len)
+            *len = a->addrlen;
+        return 1;
+    }
 
     if (!PyTuple_Check(args)) 
     {
@@ -98,8 +116,19 @@ get_sockaddr_from_tuple(char* func_name, socket_object* s, PyObject* args, struc
         return 0;
     }
 
-    if (!PyArg_ParseTuple(args, "si;AF_INET address must be a pair (host, port)",
-                          &ip_addr_string, &port))
+    if (s->family == AF_INET6) {
+        if (!PyArg_ParseTuple(args, "si|II;AF_INET6 address must be a tuple (host, port[, flowinfo[, scopeid]])",
+                              &ip_addr_string, &port, &flowinfo, &scope_id))
+        {
+            if (PyErr_ExceptionMatches(PyExc_OverflowError)) 
+            {
+                PyErr_Format(PyExc_OverflowError, "%s(): port must be 0-65535", func_name);
+            }
+            return 0;
+        }
+    }
+    else if (!PyArg_ParseTuple(args, "si;AF_INET address must be a pair (host, port)",
+                               &ip_addr_string, &port))
     {
         if (PyErr_ExceptionMatches(PyExc_OverflowError)) 
         {
@@ -108,74 +137,177 @@ get_sockaddr_from_tuple(char* func_name, socket_object* s, PyObject* args, struc
         return 0;
     }
 
-    if (port < 0 || port > 0xffff) {
-        PyErr_Format(PyExc_OverflowError, "%s(): port must be 0-65535", func_name);
+    return parse_inet_sockaddr(func_name, s->family, ip_addr_string, port, flowinfo, scope_id,
+                               (sockaddr_union*)sockaddr, len);
+}
+
+
+/* 
+    Like get_sockaddr_from_tuple but remembers the last parsed tuples in a
+    small per-socket cache, for callers that send to the same addresses 
+    over and over without using Address objects.
+*/
+static int
+get_sockaddr_cached_lock_held(char* func_name, socket_object* s, PyObject* args, Py_hash_t hash,
+                              struct sockaddr* sockaddr, socklen_t* len)
+{
+    struct addr_cache_entry* entry;
+
+    if (s->addr_cache == NULL) {
+        s->addr_cache = PyMem_Calloc(ADDR_CACHE_SIZE, sizeof(struct addr_cache_entry));
+        if (s->addr_cache == NULL) {
+            PyErr_NoMemory();
+            return 0;
+        }
+    }
+
+    entry = &s->addr_cache[(size_t)hash % ADDR_CACHE_SIZE];
+    if (entry->key != NULL) {
+        int equal = (entry->key == args);
+        if (!equal) {
+            /* Hold the key, the entry could be replaced if the comparison suspends the lock */
+            PyObject* key = entry->key;
+            Py_INCREF(key);
+            equal = PyObject_RichCompareBool(key, args, Py_EQ);
+            Py_DECREF(key);
+            if (equal < 0)
+                return 0;
+        }
+        if (equal) {
+            memcpy(sockaddr, &entry->addr, entry->addrlen);
+            if (len)
+                *len = entry->addrlen;
+            return 1;
+        }
+    }
+
+    if (!get_sockaddr_from_tuple(func_name, s, args, (struct sockaddr*)&entry->addr, &entry->addrlen)) {
+        Py_CLEAR(entry->key);
         return 0;
     }
+    Py_INCREF(args);
+    Py_XSETREF(entry->key, args);
 
-    // const char* address;
-    switch (s->family) {
-        case AF_INET:
-        {
-            struct sockaddr_in* addr = (struct sockaddr_in*)sockaddr;
-            if(len)
-                *len = sizeof(*addr);
+    memcpy(sockaddr, &entry->addr, entry->addrlen);
+    if (len)
+        *len = entry->addrlen;
+    return 1;
+}
 
-            addr->sin_family = AF_INET;
-            addr->sin_port = htons(port);
+static int
+get_sockaddr_cached(char* func_name, socket_object* s, PyObject* args, struct sockaddr* sockaddr, socklen_t* len)
+{
+    Py_hash_t hash;
+    int res;
 
-            /* Special case empty string to INADDR_ANY */
-            if(ip_addr_string[0] == '\0') 
-            {
-                addr->sin_addr.s_addr = htonl(INADDR_ANY);
-            }
-            /* Special case <broadcast> string to INADDR_BROADCAST */
-            else if(strcmp(ip_addr_string, "<broadcast>") == 0)
-            {
-                addr->sin_addr.s_addr = htonl(INADDR_BROADCAST);
-            }
-            else 
-            {
-                if(inet_pton(AF_INET, ip_addr_string, &addr->sin_addr) != 1) 
-                {
-                    PyErr_SetString(PyExc_ValueError, "invalid ip address");
-                    return 0;
-                }
-            }
-        } break;
+    /* Only cache exact (str, int) pairs, so that equal tuples parse the same way */
+    if (!PyTuple_CheckExact(args) || PyTuple_GET_SIZE(args) != 2 ||
+        !PyUnicode_CheckExact(PyTuple_GET_ITEM(args, 0)) ||
+        !PyLong_CheckExact(PyTuple_GET_ITEM(args, 1)))
+        return get_sockaddr_from_tuple(func_name, s, args, sockaddr, len);
 
-        case AF_INET6:
-        {
-            struct sockaddr_in6* addr = (struct sockaddr_in6*)sockaddr;
-            if(len)
-                *len = sizeof(*addr);
+    hash = PyObject_Hash(args);
+    if (hash == -1)
+        return 0;
 
-            addr->sin6_family = AF_INET6;
-            addr->sin6_port = htons(port);
+    /* The cache is shared by the threads sending on the socket */
+    Py_BEGIN_CRITICAL_SECTION(s);
+    res = get_sockaddr_cached_lock_held(func_name, s, args, hash, sockaddr, len);
+    Py_END_CRITICAL_SECTION();
 
-            /* Special case empty string to INADDR_ANY */
-            if(ip_addr_string[0] == '\0') 
-            {
-                addr->sin6_addr = in6addr_any;
-            }
-            else 
-            {
-                if(inet_pton(AF_INET6, ip_addr_string, &addr->sin6_addr) != 1) 
-                {
-                    PyErr_SetString(PyExc_ValueError, "invalid ip address");
-                    return 0;
-                }
-            }
-        } break;
+    return res;
+}
 
-        default:
-        {
-            PyErr_SetString(PyExc_ValueError, "invalid socket family");
-            return 0;
-        } break;
+/* Release the address caches of a socket */
+static void
+clear_addr_cache(socket_object* s)
+{
+    if (s->addr_cache != NULL) {
+        for (int i = 0; i < ADDR_CACHE_SIZE; i++)
+            Py_CLEAR(s->addr_cache[i].key);
+        PyMem_Free(s->addr_cache);
+        s->addr_cache = NULL;
     }
 
-    return 1;
+    if (s->peer_cache != NULL) {
+        for (int i = 0; i < s->peer_cache_len; i++)
+            Py_CLEAR(s->peer_cache[i].tuple);
+        PyMem_Free(s->peer_cache);
+        s->peer_cache = NULL;
+        s->peer_cache_len = 0;
+    }
+}
+
+
+/* 
+    Like make_sockaddr but returns the same immutable tuple for repeated 
+    peers, looking up the raw sockaddr in a small per-socket LRU.
+    Returns a new reference.
+*/
+static PyObject*
+make_sockaddr_cached_lock_held(socket_object* s, struct sockaddr* addr, socklen_t addrlen)
+{
+    struct peer_cache_entry* cache;
+    struct peer_cache_entry entry;
+    int i;
+
+    if (s->peer_cache == NULL) {
+        s->peer_cache = PyMem_Calloc(PEER_CACHE_SIZE, sizeof(struct peer_cache_entry));
+        if (s->peer_cache == NULL)
+            return PyErr_NoMemory();
+    }
+    cache = s->peer_cache;
+
+    for (i = 0; i < s->peer_cache_len; i++) {
+        if (cache[i].addrlen == addrlen && memcmp(&cache[i].addr, addr, addrlen) == 0)
+            break;
+    }
+
+    if (i < s->peer_cache_len) {
+        /* Hit, move the entry to the front */
+        entry = cache[i];
+        memmove(&cache[1], &cache[0], i * sizeof(struct peer_cache_entry));
+        cache[0] = entry;
+        Py_INCREF(entry.tuple);
+        return entry.tuple;
+    }
+
+    /* Miss, build the tuple and replace the least recently used entry */
+    PyObject* tuple = make_sockaddr(addr, addrlen);
+    if (tuple == NULL)
+        return NULL;
+
+    if (s->peer_cache_len == PEER_CACHE_SIZE) {
+        Py_DECREF(cache[PEER_CACHE_SIZE - 1].tuple);
+        s->peer_cache_len--;
+    }
+    memmove(&cache[1], &cache[0], s->peer_cache_len * sizeof(struct peer_cache_entry));
+    s->peer_cache_len++;
+
+    memset(&cache[0].addr, 0, sizeof(cache[0].addr));
+    memcpy(&cache[0].addr, addr, addrlen);
+    cache[0].addrlen = addrlen;
+    Py_INCREF(tuple);
+    cache[0].tuple = tuple;
+
+    return tuple;
+}
+
+static PyObject*
+make_sockaddr_cached(socket_object* s, struct sockaddr* addr, socklen_t addrlen)
+{
+    PyObject* res;
+
+    if (addrlen == 0 || addrlen > sizeof(sockaddr_union) ||
+        (addr->sa_family != AF_INET && addr->sa_family != AF_INET6))
+        return make_sockaddr(addr, addrlen);
+
+    /* The cache is shared by the threads receiving on the socket */
+    Py_BEGIN_CRITICAL_SECTION(s);
+    res = make_sockaddr_cached_lock_held(s, addr, addrlen);
+    Py_END_CRITICAL_SECTION();
+
+    return res;
 }
 
 
@@ -210,8 +342,6 @@ getsockaddrlen(socket_object *s, socklen_t *len_ret)
 #define SOCK_TIMEOUT_ERR EWOULDBLOCK
 #define SOCK_INPROGRESS_ERR EINPROGRESS
 
-PyObject *socket_timeout;
-
 /* Poll on a socket object */
 static int
 internal_select(socket_object *s, int writing, _PyTime_t interval, int connect)
@@ -269,8 +399,155 @@ internal_select(socket_object *s, int writing, _PyTime_t interval, int connect)
 }
 
 
-/* Utility function to call blocking methods on a socket */
+/*
+    sock_call() in cooperative mode. The fd is non-blocking and sock_func
+    is tried first, when the socket is not ready the wait goes through the
+    hook, hook(fd, writing, timeout) returning false on timeout, so that
+    other greenlets can run in the meantime.
+*/
+static int
+sock_call_hook(socket_object *s,
+               PyObject *hook,
+               int writing,
+               int (*sock_func) (socket_object* s, void *data),
+               void *data,
+               int connect,
+               int *err,
+               _PyTime_t timeout)
+{
+    _PyTime_t deadline = 0;
+    int wait = connect;     /* connect() is already in progress */
+    int res;
+
+    if (timeout > 0)
+        deadline = _PyTime_GetMonotonicClock() + timeout;
+
+    while (1) {
+        if (wait) {
+            PyObject *timeout_obj, *ready_obj;
+            int ready;
+
+            if (timeout > 0) {
+                _PyTime_t interval = deadline - _PyTime_GetMonotonicClock();
+                if (interval < 0)
+                    interval = 0;
+                timeout_obj = PyFloat_FromDouble(_PyTime_AsSecondsDouble(interval));
+                if (timeout_obj == NULL) {
+                    if (err)
+                        *err = -1;
+                    return -1;
+                }
+            }
+            else {
+                Py_INCREF(Py_None);
+                timeout_obj = Py_None;
+            }
+
+            ready_obj = PyObject_CallFunction(hook, "iOO", s->fd, writing ? Py_True : Py_False, timeout_obj);
+            Py_DECREF(timeout_obj);
+            ready = ready_obj == NULL ? -1 : PyObject_IsTrue(ready_obj);
+            Py_XDECREF(ready_obj);
+
+            if (ready < 0) {
+                if (err)
+                    *err = -1;
+                return -1;
+            }
+            if (!ready) {
+                if (err)
+                    *err = SOCK_TIMEOUT_ERR;
+                else
+                    PyErr_SetString(s->state->socket_timeout, "timed out");
+                return -1;
+            }
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        res = sock_func(s, data);
+        Py_END_ALLOW_THREADS
+
+        if (res) {
+            if (err)
+                *err = 0;
+            return 0;
+        }
+
+        if (err)
+            *err = GET_SOCK_ERROR;
+
+        if (CHECK_ERRNO(EINTR)) {
+            if (PyErr_CheckSignals()) {
+                if (err)
+                    *err = -1;
+                return -1;
+            }
+            wait = 0;
+            continue;
+        }
+
+        /* Non-blocking sockets (timeout 0) fail at once as usual */
+        if (timeout != 0 && (CHECK_ERRNO(EWOULDBLOCK) || CHECK_ERRNO(EAGAIN))) {
+            wait = 1;
+            continue;
+        }
+
+        if (!err)
+            PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+}
+
+/*
+    Deadline of the waits on the socket: the earliest of set_deadline()
+    and of the deadline() scope of the current context, 0 if there is
+    none. Returns -1 raising an exception.
+*/
 static int
+sock_op_deadline(socket_object* s, _PyTime_t* deadline)
+{
+    PyObject* value;
+    _PyTime_t scope;
+
+    *deadline = s->sock_deadline;
+    if (PyContextVar_Get(s->state->deadline_var, NULL, &value) < 0)
+        return -1;
+    if (value == NULL)
+        return 0;
+
+    int res = _PyTime_FromSecondsObject(&scope, value, _PyTime_ROUND_CEILING);
+    Py_DECREF(value);
+    if (res < 0)
+        return -1;
+    /* 0 means no deadline, a deadline in the past is just expired */
+    if (scope <= 0)
+        scope = 1;
+    if (*deadline == 0 || scope < *deadline)
+        *deadline = scope;
+    return 0;
+}
+
+/*
+    Deadline of the sock_call() running on the thread, 0 if it has none.
+    The pacing of the operations called without the GIL sleeps at most
+    until then, and sets it to -1 when it gives up because of it.
+*/
+static __thread _PyTime_t call_deadline;
+
+/* Make the fd of a blocking socket non-blocking, see iothpy_socket.h */
+int
+internal_fd_nonblocking(socket_object* s)
+{
+    int res = 0;
+
+    Py_BEGIN_CRITICAL_SECTION(s);
+    if (s->sock_timeout < 0 && !s->fd_nonblocking)
+        res = internal_setblocking(s, 0);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+/* Utility function to call blocking methods on a socket */
+int
 sock_call(socket_object *s,
              int writing,
              int (*sock_func) (socket_object* s, void *data),
@@ -279,7 +556,7 @@ sock_call(socket_object *s,
              int *err,
              _PyTime_t timeout)
 {
-    int has_timeout = (timeout > 0);
+    int has_timeout, wait;
     _PyTime_t deadline = 0;
     int deadline_initialized = 0;
     int res;
@@ -287,12 +564,58 @@ sock_call(socket_object *s,
     /* sock_call() must be called with the GIL held. */
     assert(PyGILState_Check());
 
+    /* A non-blocking socket never waits, otherwise the deadline of the
+       operation cuts the timeout short. The clock read here also starts
+       the timeout, the loop reads it again only to wait once more. */
+    if (timeout != 0) {
+        _PyTime_t op_deadline;
+
+        if (sock_op_deadline(s, &op_deadline) < 0) {
+            if (err)
+                *err = -1;
+            return -1;
+        }
+        if (op_deadline != 0) {
+            _PyTime_t now = _PyTime_GetMonotonicClock();
+
+            if (op_deadline <= now) {
+                /* The budget is spent */
+                if (err)
+                    *err = SOCK_TIMEOUT_ERR;
+                else
+                    PyErr_SetString(s->state->socket_timeout, "timed out");
+                return -1;
+            }
+            if (timeout < 0 || op_deadline - now < timeout)
+                timeout = op_deadline - now;
+            deadline = now + timeout;
+
+            /* It must not block in the stack past the deadline */
+            if (!s->fd_nonblocking && internal_fd_nonblocking(s) < 0) {
+                if (err)
+                    *err = -1;
+                return -1;
+            }
+        }
+    }
+    has_timeout = (timeout > 0);
+    wait = has_timeout || connect;
+
+    if (is_cooperative(s->state)) {
+        PyObject* hook = get_wait_hook(s->state);
+        if (hook != NULL) {
+            res = sock_call_hook(s, hook, writing, sock_func, data, connect, err, timeout);
+            Py_DECREF(hook);
+            return res;
+        }
+    }
+
     /* outer loop to retry select() when select() is interrupted by a signal
        or to retry select()+sock_func() on false positive (see above) */
     while (1) {
         /* For connect(), poll even for blocking socket. The connection
            runs asynchronously. */
-        if (has_timeout || connect) {
+        if (wait) {
             if (has_timeout) {
                 _PyTime_t interval;
 
@@ -301,8 +624,10 @@ sock_call(socket_object *s,
                     interval = deadline - _PyTime_GetMonotonicClock();
                 }
                 else {
+                    /* Already set with the deadline of the operation */
+                    if (deadline == 0)
+                        deadline = _PyTime_GetMonotonicClock() + timeout;
                     deadline_initialized = 1;
-                    deadline = _PyTime_GetMonotonicClock() + timeout;
                     interval = timeout;
                 }
 
@@ -340,7 +665,7 @@ sock_call(socket_object *s,
                 if (err)
                     *err = SOCK_TIMEOUT_ERR;
                 else
-                    PyErr_SetString(socket_timeout, "timed out");
+                    PyErr_SetString(s->state->socket_timeout, "timed out");
                 return -1;
             }
 
@@ -350,9 +675,12 @@ sock_call(socket_object *s,
         /* inner loop to retry sock_func() when sock_func() is interrupted
            by a signal */
         while (1) {
+            call_deadline = has_timeout ? deadline : 0;
             Py_BEGIN_ALLOW_THREADS
             res = sock_func(s, data);
             Py_END_ALLOW_THREADS
+            int expired = (call_deadline == -1);
+            call_deadline = 0;
 
             if (res) {
                 /* sock_func() succeeded */
@@ -361,6 +689,15 @@ sock_call(socket_object *s,
                 return 0;
             }
 
+            if (expired) {
+                /* The pacing would wait past the deadline */
+                if (err)
+                    *err = SOCK_TIMEOUT_ERR;
+                else
+                    PyErr_SetString(s->state->socket_timeout, "timed out");
+                return -1;
+            }
+
             if (err)
                 *err = GET_SOCK_ERROR;
 
@@ -377,13 +714,17 @@ sock_call(socket_object *s,
             /* retry sock_func() */
         }
 
-        if (s->sock_timeout > 0
+        if ((has_timeout || (timeout < 0 && s->fd_nonblocking))
             && (CHECK_ERRNO(EWOULDBLOCK) || CHECK_ERRNO(EAGAIN))) {
             /* False positive: sock_func() failed with EWOULDBLOCK or EAGAIN.
                For example, select() could indicate a socket is ready for
                reading, but the data then discarded by the OS because of a
                wrong checksum.
+               A blocking socket can also have a non-blocking fd, created
+               while a wait hook was set or used under a deadline: it
+               waits on select() too.
                Loop on select() to recheck for socket readyness. */
+            wait = 1;
             continue;
         }
 
@@ -396,99 +737,594 @@ sock_call(socket_object *s,
 }
 
 
-static PyObject *
-sock_bind(PyObject *self, PyObject *args)
-{
-    socket_object* s = (socket_object*)self;
-
-    struct sockaddr_storage addrbuf;
-    socklen_t addrlen;
-    if(!get_sockaddr_from_tuple("bind", s, args, (struct sockaddr*)&addrbuf, &addrlen))
-    {
-        return NULL;
-    }
+/*
+    Pacing of set_pacing(), see pacer.h. The send operations take their
+    tokens without the GIL right before calling the stack: a blocking
+    socket sleeps until its turn, a non-blocking one fails with EWOULDBLOCK.
+    The sleep is bounded by the timeout or the deadline of the sock_call()
+    running the send, past them the send fails with EWOULDBLOCK and
+    call_deadline is set to -1.
+*/
 
-    int res;
-    Py_BEGIN_ALLOW_THREADS
-    res = ioth_bind(s->fd, (struct sockaddr*)&addrbuf, addrlen);
-    Py_END_ALLOW_THREADS
+#define pacer_enabled(s) ((s)->pacer != NULL && __atomic_load_n(&(s)->pacer->enabled, __ATOMIC_RELAXED))
 
-    if(res != 0) {
-        PyErr_SetFromErrno(PyExc_OSError);
+/* Take the tokens of a send of len bytes, returns 0 with errno set if it can't go */
+static int
+pace(socket_object* s, size_t len)
+{
+    _PyTime_t deadline = call_deadline;
+    int err = pacer_take(s->pacer, len, s->sock_timeout != 0, deadline > 0 ? deadline : 0);
+    if (err == ETIMEDOUT) {
+        call_deadline = -1;
+        err = EWOULDBLOCK;
+    }
+    if (err != 0) {
+        errno = err;
         return 0;
     }
-
-    Py_RETURN_NONE;
+    return 1;
 }
 
-PyDoc_STRVAR(bind_doc,
-"bind(address)\n\
-\n\
-Bind the socket to a local address.  For IP sockets, the address is a\n\
-pair (host, port); the host must refer to the local host. For raw packet\n\
-sockets the address is a tuple (ifname, proto [,pkttype [,hatype [,addr]]])");
+/* Give back the tokens of the bytes of a send of len bytes not sent, keeping errno */
+static void
+unpace(socket_object* s, size_t len, Py_ssize_t result)
+{
+    if (result < 0)
+        pacer_untake(s->pacer, len, 1);
+    else if ((size_t)result < len)
+        pacer_untake(s->pacer, len - result, 0);
+}
 
-static PyObject *
-sock_listen(PyObject *self, PyObject *args)
+long long
+sock_pacing_delay(socket_object* s, size_t len)
 {
-    socket_object* s = (socket_object*)self;
+    if (!pacer_enabled(s))
+        return 0;
+    return pacer_delay(s->pacer, len);
+}
 
-    int backlog = Py_MIN(SOMAXCONN, 128);
-    int res;
+/*
+    Cork mode, see cork.h. send(), sendall() and send_async() append to the
+    buffer of the cork, the other operations flush it first to keep the
+    order of the data and to not wait for an answer to a request still
+    sitting in the buffer.
+*/
 
-    if (!PyArg_ParseTuple(args, "|i:listen", &backlog))
-        return NULL;
+#define cork_enabled(s) ((s)->cork != NULL && __atomic_load_n(&(s)->cork->threshold, __ATOMIC_RELAXED) > 0)
 
-    if (backlog < 0)
-        backlog = 0;
+struct cork_send_ctx {
+    struct iovec iov[2];
+    Py_ssize_t result;
+};
 
+static int
+cork_send_impl(socket_object* s, void* data)
+{
+    struct cork_send_ctx* ctx = data;
+    struct msghdr msg = {0};
 
-    Py_BEGIN_ALLOW_THREADS
-    res = ioth_listen(s->fd, backlog);
-    Py_END_ALLOW_THREADS
+    /* Skip the buffer once it has been sent */
+    int first = ctx->iov[0].iov_len == 0;
+    msg.msg_iov = ctx->iov + first;
+    msg.msg_iovlen = 2 - first;
 
-    if(res != 0) {
-        PyErr_SetFromErrno(PyExc_OSError);
+    ctx->result = ioth_sendmsg(s->fd, &msg, 0);
+    return ctx->result >= 0;
+}
+
+/* Put len bytes back in front of the buffer of the cork, the lock must be held */
+static int
+cork_unsend(struct cork* c, const char* data, size_t len)
+{
+    if (len == 0)
         return 0;
+    if (c->off >= len) {
+        c->off -= len;
     }
+    else {
+        if (cork_reserve(c, len) < 0)
+            return -1;
+        memmove(c->buf + c->off + len, c->buf + c->off, cork_pending(c));
+        c->len += len;
+    }
+    memcpy(c->buf + c->off, data, len);
+    return 0;
+}
 
+/*
+    Send the buffer of the cork followed by len bytes of data, with a single
+    system call when the stack takes them all. On a non-blocking socket the
+    bytes that can't be sent are kept in the buffer, the timer sends them
+    later. Returns -1 raising an exception on failure.
+*/
+static int
+cork_flush(socket_object* s, const char* data, Py_ssize_t len)
+{
+    struct cork* c = s->cork;
+    struct cork_send_ctx ctx;
+    char* buf;
+    size_t off, end, size;
+    _PyTime_t deadline = 0, interval = s->sock_timeout;
+    int err = 0, schedule = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->flushing) {
+        /* Another thread is flushing, it sends the data after its own */
+        int res = (len > 0 && cork_reserve(c, len) < 0) ? -1 : 0;
+        if (res == 0 && len > 0) {
+            memcpy(c->buf + c->len, data, len);
+            c->len += len;
+        }
+        pthread_mutex_unlock(&c->lock);
+        if (res < 0)
+            PyErr_NoMemory();
+        return res;
+    }
 
-        Py_RETURN_NONE;
+    /* Take the buffer, the other writers start a new one meanwhile */
+    buf = c->buf;
+    off = c->off;
+    end = c->len;
+    size = c->size;
+    c->buf = NULL;
+    c->off = c->len = c->size = 0;
+    c->flushing = 1;
+    pthread_mutex_unlock(&c->lock);
+
+    ctx.iov[0].iov_base = buf + off;
+    ctx.iov[0].iov_len = end - off;
+    ctx.iov[1].iov_base = (char*)data;
+    ctx.iov[1].iov_len = len;
+
+    if (s->sock_timeout > 0)
+        deadline = _PyTime_GetMonotonicClock() + s->sock_timeout;
+
+    while (ctx.iov[0].iov_len + ctx.iov[1].iov_len > 0) {
+        if (deadline != 0) {
+            interval = deadline - _PyTime_GetMonotonicClock();
+            if (interval <= 0) {
+                err = SOCK_TIMEOUT_ERR;
+                break;
+            }
+        }
+
+        if (sock_call(s, 1, cork_send_impl, &ctx, 0, &err, interval) < 0)
+            break;
+
+        pthread_mutex_lock(&c->lock);
+        c->flushes++;
+        pthread_mutex_unlock(&c->lock);
+
+        size_t n = ctx.result;
+        size_t first = Py_MIN(n, ctx.iov[0].iov_len);
+        ctx.iov[0].iov_base = (char*)ctx.iov[0].iov_base + first;
+        ctx.iov[0].iov_len -= first;
+        ctx.iov[1].iov_base = (char*)ctx.iov[1].iov_base + (n - first);
+        ctx.iov[1].iov_len -= n - first;
+
+        /* Send the data buffered by the other threads in the meantime */
+        if (ctx.iov[0].iov_len + ctx.iov[1].iov_len == 0) {
+            pthread_mutex_lock(&c->lock);
+            if (cork_pending(c) > 0) {
+                free(buf);
+                buf = c->buf;
+                ctx.iov[0].iov_base = buf + c->off;
+                ctx.iov[0].iov_len = cork_pending(c);
+                size = c->size;
+                c->buf = NULL;
+                c->off = c->len = c->size = 0;
+            }
+            pthread_mutex_unlock(&c->lock);
+        }
     }
 
-    PyDoc_STRVAR(listen_doc,
-    "listen([backlog])\n\
-    \n\
-    Enable a server to accept connections.  If backlog is specified, it must be\n\
-    at least 0 (if it is lower, it is set to 0); it specifies the number of\n\
-    unaccepted connections that the system will allow before refusing new\n\
-    connections. If not specified, a default reasonable value is chosen.");
+    /* Non-blocking sockets keep what could not be sent, data included */
+    int keep = err == EWOULDBLOCK || err == EAGAIN;
+    int nonblock = keep && s->sock_timeout == 0;
+
+    pthread_mutex_lock(&c->lock);
+    c->flushing = 0;
+    int res = cork_unsend(c, ctx.iov[0].iov_base, ctx.iov[0].iov_len);
+    if (res == 0 && nonblock && ctx.iov[1].iov_len > 0) {
+        res = cork_reserve(c, ctx.iov[1].iov_len);
+        if (res == 0) {
+            memcpy(c->buf + c->len, ctx.iov[1].iov_base, ctx.iov[1].iov_len);
+            c->len += ctx.iov[1].iov_len;
+        }
+    }
+    schedule = cork_pending(c) > 0;
+    if (c->buf == NULL) {
+        /* Reuse the memory of the buffer taken */
+        c->buf = buf;
+        c->size = size;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&c->lock);
+    free(buf);
 
-    static PyObject* 
-    new_socket_from_fd(stack_object* stack, int family, int type, int proto, int fd)
-    {
-        PyObject* socket_args = Py_BuildValue("Oiiii", (PyObject*)stack, family, type, proto, fd);
-        if(!socket_args) {
+    if (res < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (schedule && cork_schedule(c) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    if (err == 0 || nonblock)
+        return 0;
+    if (err == -1)
+        return -1;
+    if (keep)
+        PyErr_SetString(s->state->socket_timeout, "timed out");
+    else {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return -1;
+}
+
+/*
+    Write data to a corked socket: append it to the buffer while the buffer
+    stays under the threshold, otherwise send them together. MSG_EOR marks
+    the end of a message and flushes at once. Returns -1 raising an
+    exception on failure.
+*/
+static int
+cork_write(socket_object* s, const char* data, Py_ssize_t len, int flags)
+{
+    struct cork* c = s->cork;
+    int err, schedule;
+
+    pthread_mutex_lock(&c->lock);
+    err = c->error;
+    c->error = 0;
+    c->writes++;
+    if (err == 0 && !c->flushing && !(flags & MSG_EOR) && cork_pending(c) + len < c->threshold) {
+        if (cork_reserve(c, len) < 0) {
+            pthread_mutex_unlock(&c->lock);
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(c->buf + c->len, data, len);
+        c->len += len;
+        schedule = c->delay >= 0;
+        pthread_mutex_unlock(&c->lock);
+
+        if (schedule && cork_schedule(c) < 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        return 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (err != 0) {
+        /* Report the failure of a flush of the timer */
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return cork_flush(s, data, len);
+}
+
+/*
+    Flush the cork before another operation on the socket. Before a write
+    the buffer must be empty, which fails with BlockingIOError on a
+    non-blocking socket that can't take it all. Returns -1 raising an
+    exception on failure.
+*/
+static int
+cork_before(socket_object* s, int writing)
+{
+    struct cork* c = __atomic_load_n(&s->cork, __ATOMIC_ACQUIRE);
+
+    if (c == NULL || __atomic_load_n(&c->len, __ATOMIC_RELAXED) == 0)
+        return 0;
+    if (cork_flush(s, NULL, 0) < 0)
+        return -1;
+
+    if (writing) {
+        pthread_mutex_lock(&c->lock);
+        size_t pending = cork_pending(c);
+        pthread_mutex_unlock(&c->lock);
+        if (pending > 0) {
+            errno = EWOULDBLOCK;
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Stop the timer from using the fd of a socket closed or detached */
+static void
+cork_detach(socket_object* s)
+{
+    struct cork* c = __atomic_load_n(&s->cork, __ATOMIC_ACQUIRE);
+
+    if (c != NULL) {
+        pthread_mutex_lock(&c->lock);
+        c->fd = -1;
+        c->off = c->len = 0;
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+
+/*
+    Write queue of queue_write(): the buffers are kept without copying them
+    and sent without blocking, with the GIL held like the asyncio operations,
+    when queue_write() or drain_queue() are called. The high and low
+    watermarks tell the producer when to pause and when to resume.
+*/
+
+/* Buffers passed to a single sendmsg() */
+#define WQUEUE_IOV 64
+
+/* Default high watermark */
+#define WQUEUE_HIGH (256 * 1024)
+
+struct wqueue_entry {
+    Py_buffer view;
+    Py_ssize_t off;             /* Bytes of view already sent */
+};
+
+struct wqueue {
+    struct wqueue_entry* entries;   /* Queued buffers are entries[head:head + count] */
+    Py_ssize_t head;
+    Py_ssize_t count;
+    Py_ssize_t capacity;
+    Py_ssize_t bytes;               /* Bytes waiting to be sent */
+    Py_ssize_t high;
+    Py_ssize_t low;
+    Py_ssize_t limit;               /* queue_write() fails beyond it */
+    int paused;                     /* Went over high and not yet back under low */
+
+    /* Counters */
+    unsigned long long queued;      /* Bytes passed to queue_write() */
+    unsigned long long sent;
+    unsigned long long sends;       /* sendmsg() calls */
+    unsigned long long pauses;
+    unsigned long long dropped;     /* Bytes discarded by close() */
+    Py_ssize_t peak;                /* Largest value of bytes */
+};
+
+#define wqueue_pending(s) ((s)->wqueue != NULL && __atomic_load_n(&(s)->wqueue->bytes, __ATOMIC_RELAXED) > 0)
+
+static struct wqueue*
+wqueue_get(socket_object* s)
+{
+    if (s->wqueue == NULL) {
+        struct wqueue* q = PyMem_Calloc(1, sizeof(struct wqueue));
+        if (q == NULL) {
+            PyErr_NoMemory();
             return NULL;
         }
+        q->high = WQUEUE_HIGH;
+        q->low = WQUEUE_HIGH / 4;
+        q->limit = 4 * WQUEUE_HIGH;
+        s->wqueue = q;
+    }
+    return s->wqueue;
+}
 
-        // Instantiate a socket by calling the constructor of the socket type
-        PyObject* socket = PyObject_CallObject((PyObject*)&socket_type, socket_args);
+/* Release the buffers of the queue, counting them as dropped */
+static void
+wqueue_clear(struct wqueue* q)
+{
+    for (Py_ssize_t i = q->head; i < q->head + q->count; i++)
+        PyBuffer_Release(&q->entries[i].view);
+    q->dropped += q->bytes;
+    q->head = q->count = 0;
+    q->bytes = 0;
+    q->paused = 0;
+}
 
-        // Release arguments
-        Py_DECREF(socket_args);
+/* Free the queue of a socket being finalized */
+static void
+wqueue_free(socket_object* s)
+{
+    if (s->wqueue != NULL) {
+        wqueue_clear(s->wqueue);
+        PyMem_Free(s->wqueue->entries);
+        PyMem_Free(s->wqueue);
+        s->wqueue = NULL;
+    }
+}
 
-        return socket;
+/*
+    Send the queued buffers until the socket is not writable, the socket
+    must be locked. Returns -1 raising an exception on failure, the unsent
+    data stays queued.
+*/
+static int
+wqueue_send_lock_held(socket_object* s, struct wqueue* q)
+{
+    struct iovec iov[WQUEUE_IOV];
+    struct msghdr msg = {0};
+    ssize_t n;
+
+    while (q->count > 0) {
+        int niov = 0;
+        for (Py_ssize_t i = q->head; i < q->head + q->count && niov < WQUEUE_IOV; i++, niov++) {
+            iov[niov].iov_base = (char*)q->entries[i].view.buf + q->entries[i].off;
+            iov[niov].iov_len = q->entries[i].view.len - q->entries[i].off;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+
+        n = ioth_sendmsg(s->fd, &msg, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                if (PyErr_CheckSignals())
+                    return -1;
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+
+        q->sends++;
+        q->sent += n;
+        q->bytes -= n;
+
+        /* Release the buffers sent entirely */
+        while (n > 0) {
+            struct wqueue_entry* e = &q->entries[q->head];
+            Py_ssize_t left = e->view.len - e->off;
+            if (n < left) {
+                e->off += n;
+                break;
+            }
+            n -= left;
+            PyBuffer_Release(&e->view);
+            q->head++;
+            q->count--;
+        }
     }
 
+    if (q->count == 0)
+        q->head = 0;
+    if (q->paused && q->bytes <= q->low)
+        q->paused = 0;
+    return 0;
+}
 
-    struct sock_accept_ctx {
-        socklen_t* addrlen;
-        struct sockaddr* addrbuf;
-        int result;
-    };
+/* Append a buffer to the queue, the socket must be locked */
+static int
+wqueue_append_lock_held(struct wqueue* q, Py_buffer* view, Py_ssize_t off)
+{
+    if (q->head + q->count == q->capacity) {
+        if (q->head > 0) {
+            memmove(q->entries, q->entries + q->head, q->count * sizeof(struct wqueue_entry));
+            q->head = 0;
+        }
+        else {
+            Py_ssize_t capacity = q->capacity ? 2 * q->capacity : 16;
+            struct wqueue_entry* entries = PyMem_Realloc(q->entries, capacity * sizeof(struct wqueue_entry));
+            if (entries == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            q->entries = entries;
+            q->capacity = capacity;
+        }
+    }
 
-    static int
+    struct wqueue_entry* e = &q->entries[q->head + q->count];
+    e->view = *view;
+    e->off = off;
+    q->count++;
+    q->bytes += view->len - off;
+    if (q->bytes > q->peak)
+        q->peak = q->bytes;
+    if (!q->paused && q->bytes >= q->high) {
+        q->paused = 1;
+        q->pauses++;
+    }
+    return 0;
+}
+
+/*
+    Send what is queued before a direct write on the socket, which fails
+    with BlockingIOError if the queue can't be emptied at once so that the
+    data is not reordered. Returns -1 raising an exception on failure.
+*/
+static int
+wqueue_before(socket_object* s)
+{
+    int res = 0;
+
+    if (!wqueue_pending(s))
+        return 0;
+
+    Py_BEGIN_CRITICAL_SECTION(s);
+    if (wqueue_send_lock_held(s, s->wqueue) < 0) {
+        res = -1;
+    }
+    else if (s->wqueue->bytes > 0) {
+        PyErr_SetString(PyExc_BlockingIOError, "the write queue of the socket is not empty");
+        res = -1;
+    }
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+
+static PyObject *
+sock_bind(PyObject *self, PyObject *args)
+{
+    socket_object* s = (socket_object*)self;
+
+    struct sockaddr_storage addrbuf;
+    socklen_t addrlen;
+    if(!get_sockaddr_from_tuple("bind", s, args, (struct sockaddr*)&addrbuf, &addrlen))
+    {
+        return NULL;
+    }
+
+    int res;
+    Py_BEGIN_ALLOW_THREADS
+    res = ioth_bind(s->fd, (struct sockaddr*)&addrbuf, addrlen);
+    Py_END_ALLOW_THREADS
+
+    if(res != 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return 0;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(bind_doc,
+"bind(address)\n\
+\n\
+Bind the socket to a local address.  For IP sockets, the address is a\n\
+pair (host, port); the host must refer to the local host. For raw packet\n\
+sockets the address is a tuple (ifname, proto [,pkttype [,hatype [,addr]]])");
+
+static PyObject *
+sock_listen(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    socket_object* s = (socket_object*)self;
+
+    int backlog = Py_MIN(SOMAXCONN, 128);
+    int res;
+
+    if (!fastcall_check_nargs("listen", nargs, NULL, 0, 1))
+        return NULL;
+    if (nargs > 0 && !fastcall_int(args[0], &backlog))
+        return NULL;
+
+    if (backlog < 0)
+        backlog = 0;
+
+
+    Py_BEGIN_ALLOW_THREADS
+    res = ioth_listen(s->fd, backlog);
+    Py_END_ALLOW_THREADS
+
+    if(res != 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return 0;
+    }
+
+
+        Py_RETURN_NONE;
+    }
+
+    PyDoc_STRVAR(listen_doc,
+    "listen([backlog])\n\
+    \n\
+    Enable a server to accept connections.  If backlog is specified, it must be\n\
+    at least 0 (if it is lower, it is set to 0); it specifies the number of\n\
+    unaccepted connections that the system will allow before refusing new\n\
+    connections. If not specified, a default reasonable value is chosen.");
+
+    int
     sock_accept_impl(socket_object* s, void *data)
     {
         struct sock_accept_ctx* ctx = data;
@@ -496,6 +1332,7 @@ sock_listen(PyObject *self, PyObject *args)
         socklen_t *paddrlen = ctx->addrlen;
 
         ctx->result = ioth_accept(s->fd, paddrbuf, paddrlen);
+        return ctx->result >= 0;
     }
 
     static PyObject*
@@ -522,49 +1359,263 @@ sock_listen(PyObject *self, PyObject *args)
             return NULL;
         }
 
-        PyObject* sock = PyLong_FromLong(connfd);
+        PyObject* sock = socket_from_accepted_fd(s, connfd, 0);
         if (sock == NULL) {
-            ioth_close(connfd);
             return NULL;
         }
 
         PyObject* addr = make_sockaddr((struct sockaddr*)&addrbuf, addrlen);
         if(!addr) {
-            ioth_close(connfd);
-            Py_XDECREF(sock);
+            Py_DECREF(sock);
             return NULL;
         }
 
-        PyObject* res = PyTuple_Pack(2, sock, addr);
+        PyObject* res = PyTuple_Pack(2, sock, addr);
+
+        Py_DECREF(sock);
+        Py_DECREF(addr);
+
+        return res;
+    }
+
+    PyDoc_STRVAR(accept_doc,
+    "_accept() -> (socket object, address info)\n\
+    \n\
+    Wait for an incoming connection.  Return a new socket object of the\n\
+    same type as this one representing the connection, and the address\n\
+    of the client.  For IP sockets, the address info is a pair (hostaddr, port).");
+
+
+    int
+    sock_recv_impl(socket_object* s, void *data)
+    {
+        struct sock_recv *ctx = data;
+
+        ctx->result = ioth_recv(s->fd, ctx->cbuf, ctx->len, ctx->flags);
+        return ctx->result >= 0;
+    }
+
+    /* Smallest read-ahead buffer, the framing methods receive up to this much at once */
+    #define RBUF_MIN_SIZE 65536
+
+    /* Number of bytes waiting in the read-ahead buffer */
+    #define rbuf_len(s) ((s)->rbuf_end - (s)->rbuf_start)
+
+    /*
+        Take the read-ahead buffer, which is then used without the GIL.
+        Returns 0 raising RuntimeError if another thread is using it.
+    */
+    static int
+    rbuf_acquire(socket_object* s)
+    {
+        if (__atomic_exchange_n(&s->rbuf_busy, 1, __ATOMIC_ACQUIRE)) {
+            PyErr_SetString(PyExc_RuntimeError, "concurrent buffered reads on the same socket");
+            return 0;
+        }
+        return 1;
+    }
+
+    #define rbuf_release(s) __atomic_store_n(&(s)->rbuf_busy, 0, __ATOMIC_RELEASE)
+
+    /* Consume n bytes of the read-ahead buffer */
+    static void
+    rbuf_consume(socket_object* s, Py_ssize_t n)
+    {
+        s->rbuf_start += n;
+        if (s->rbuf_start == s->rbuf_end) {
+            s->rbuf_start = s->rbuf_end = 0;
+
+            /* Don't keep the memory of a large frame around */
+            if (s->rbuf_size > Py_MAX(RBUF_MIN_SIZE, s->readahead)) {
+                PyMem_Free(s->rbuf);
+                s->rbuf = NULL;
+                s->rbuf_size = 0;
+            }
+        }
+    }
+
+    /*
+        Make room for n more bytes at the end of the read-ahead buffer,
+        moving the data to its start or growing it. Returns 0 raising an
+        exception on failure.
+    */
+    static int
+    rbuf_reserve(socket_object* s, Py_ssize_t n)
+    {
+        Py_ssize_t len = rbuf_len(s);
+
+        if (s->rbuf_size - s->rbuf_end >= n)
+            return 1;
+
+        if (s->rbuf_size - len < n) {
+            /* Grow geometrically so that filling a large frame is linear */
+            Py_ssize_t size = Py_MAX(len + n, Py_MAX(2 * s->rbuf_size, RBUF_MIN_SIZE));
+            char* buf = PyMem_Malloc(size);
+            if (buf == NULL) {
+                PyErr_NoMemory();
+                return 0;
+            }
+            if (len > 0)
+                memcpy(buf, s->rbuf + s->rbuf_start, len);
+            PyMem_Free(s->rbuf);
+            s->rbuf = buf;
+            s->rbuf_size = size;
+        }
+        else {
+            memmove(s->rbuf, s->rbuf + s->rbuf_start, len);
+        }
+
+        s->rbuf_start = 0;
+        s->rbuf_end = len;
+        return 1;
+    }
+
+    /* Return the buffered bytes to the other receive methods, see iothpy_socket.h */
+    Py_ssize_t
+    rbuf_read(socket_object* s, char* cbuf, Py_ssize_t len, int flags)
+    {
+        Py_ssize_t n;
+
+        if (__atomic_load_n(&s->rbuf, __ATOMIC_RELAXED) == NULL)
+            return 0;
+        if (!rbuf_acquire(s))
+            return -1;
+
+        n = Py_MIN(rbuf_len(s), len);
+        if (n > 0) {
+            memcpy(cbuf, s->rbuf + s->rbuf_start, n);
+            if (!(flags & MSG_PEEK))
+                rbuf_consume(s, n);
+        }
+
+        rbuf_release(s);
+        return n;
+    }
+
+    /* Put bytes back in front of the read-ahead buffer, see iothpy_socket.h */
+    int
+    rbuf_unread(socket_object* s, const char* buf, Py_ssize_t len)
+    {
+        int res = 0;
+
+        if (len == 0)
+            return 0;
+        if (!rbuf_acquire(s))
+            return -1;
+
+        if (!rbuf_reserve(s, len))
+            res = -1;
+        else {
+            memmove(s->rbuf + s->rbuf_start + len, s->rbuf + s->rbuf_start, rbuf_len(s));
+            memcpy(s->rbuf + s->rbuf_start, buf, len);
+            s->rbuf_end += len;
+        }
+
+        rbuf_release(s);
+        return res;
+    }
+
+    /*
+        Timeout of the next receive of a framing method, whose deadline
+        was computed from the socket timeout when it was called.
+        Returns 0 raising the timeout exception if it already expired.
+    */
+    static int
+    rbuf_timeout(socket_object* s, _PyTime_t deadline, _PyTime_t* timeout)
+    {
+        if (deadline == 0) {
+            *timeout = s->sock_timeout;
+            return 1;
+        }
+
+        *timeout = deadline - _PyTime_GetMonotonicClock();
+        if (*timeout <= 0) {
+            PyErr_SetString(s->state->socket_timeout, "timed out");
+            return 0;
+        }
+        return 1;
+    }
+
+    static _PyTime_t
+    rbuf_deadline(socket_object* s)
+    {
+        if (s->sock_timeout <= 0)
+            return 0;
+        return _PyTime_GetMonotonicClock() + s->sock_timeout;
+    }
 
-        Py_XDECREF(sock);
-        Py_XDECREF(addr);
+    /*
+        Receive until the read-ahead buffer holds at least need bytes, each
+        receive asks for all the free space of the buffer, which is made at
+        least RBUF_MIN_SIZE long in total. Returns 1 on
+        success, 0 if the peer closed the connection first and -1 raising
+        an exception. The buffer must be taken.
+    */
+    static int
+    rbuf_fill(socket_object* s, Py_ssize_t need, _PyTime_t deadline)
+    {
+        struct sock_recv ctx;
+        _PyTime_t timeout;
 
-        return res;
+        while (rbuf_len(s) < need) {
+            if (!rbuf_reserve(s, Py_MAX(need, RBUF_MIN_SIZE) - rbuf_len(s)))
+                return -1;
+            if (!rbuf_timeout(s, deadline, &timeout) || cork_before(s, 0) < 0)
+                return -1;
+
+            ctx.cbuf = s->rbuf + s->rbuf_end;
+            ctx.len = s->rbuf_size - s->rbuf_end;
+            ctx.flags = 0;
+            if (sock_call(s, 0, sock_recv_impl, &ctx, 0, NULL, timeout) < 0)
+                return -1;
+            if (ctx.result == 0)
+                return 0;
+            s->rbuf_end += ctx.result;
+        }
+        return 1;
     }
 
-    PyDoc_STRVAR(accept_doc,
-    "_accept() -> (integer, address info)\n\
-    \n\
-    Wait for an incoming connection.  Return a new socket file descriptor\n\
-    representing the connection, and the address of the client.\n\
-    For IP sockets, the address info is a pair (hostaddr, port).");
+    /*
+        Serve a small recv() from the read-ahead buffer, filling it with one
+        receive of up to readahead bytes when it is empty. Returns the number
+        of bytes copied to cbuf, 0 at the end of the stream or -1 on failure.
+    */
+    static Py_ssize_t
+    rbuf_readahead(socket_object* s, char* cbuf, Py_ssize_t len, int flags)
+    {
+        struct sock_recv ctx;
+        Py_ssize_t n = -1;
 
+        if (!rbuf_acquire(s))
+            return -1;
 
-    struct sock_recv {
-        char *cbuf;
-        Py_ssize_t len;
-        int flags;
-        Py_ssize_t result;
-    };
+        /* Another thread may have filled it in the meantime */
+        if (rbuf_len(s) == 0) {
+            if (!rbuf_reserve(s, s->readahead))
+                goto done;
 
-    static int
-    sock_recv_impl(socket_object* s, void *data)
-    {
-        struct sock_recv *ctx = data;
+            if (cork_before(s, 0) < 0)
+                goto done;
 
-        ctx->result = ioth_recv(s->fd, ctx->cbuf, ctx->len, ctx->flags);
-        return ctx->result >= 0;
+            /* The peeked data is moved to the buffer, where it stays */
+            ctx.cbuf = s->rbuf + s->rbuf_end;
+            ctx.len = s->readahead;
+            ctx.flags = flags & ~MSG_PEEK;
+            if (sock_call(s, 0, sock_recv_impl, &ctx, 0, NULL, s->sock_timeout) < 0)
+                goto done;
+            s->rbuf_end += ctx.result;
+        }
+
+        n = Py_MIN(rbuf_len(s), len);
+        if (n > 0) {
+            memcpy(cbuf, s->rbuf + s->rbuf_start, n);
+            if (!(flags & MSG_PEEK))
+                rbuf_consume(s, n);
+        }
+
+    done:
+        rbuf_release(s);
+        return n;
     }
 
 
@@ -582,11 +1633,25 @@ sock_listen(PyObject *self, PyObject *args)
     {
         struct sock_recv ctx;
 
+        Py_ssize_t n;
+
         if (len == 0) {
             /* If 0 bytes were requested, do nothing. */
             return 0;
         }
 
+        /* Return the bytes left by the framing methods first */
+        n = rbuf_read(s, cbuf, len, flags);
+        if (n != 0)
+            return n;
+
+        /* Small reads go through the read-ahead buffer, if enabled */
+        if (len < s->readahead && !(flags & (MSG_OOB | MSG_WAITALL)))
+            return rbuf_readahead(s, cbuf, len, flags);
+
+        if (cork_before(s, 0) < 0)
+            return -1;
+
         ctx.cbuf = cbuf;
         ctx.len = len;
         ctx.flags = flags;
@@ -597,15 +1662,19 @@ sock_listen(PyObject *self, PyObject *args)
     }
 
     static PyObject *
-    sock_recv(PyObject *self, PyObject *args)
+    sock_recv(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
     {
         socket_object* s = (socket_object*)self;
 
-        ssize_t recvlen = 0;
+        Py_ssize_t recvlen = 0;
         ssize_t outlen = 0;
         int flags = 0;
 
-        if(!PyArg_ParseTuple(args, "n|i", &recvlen, &flags))
+        if(!fastcall_check_nargs("recv", nargs, NULL, 1, 2))
+            return NULL;
+        if(!fastcall_ssize_t(args[0], &recvlen))
+            return NULL;
+        if(nargs > 1 && !fastcall_int(args[1], &flags))
             return NULL;
 
         PyObject *buf = PyBytes_FromStringAndSize(NULL, recvlen);
@@ -617,7 +1686,8 @@ sock_listen(PyObject *self, PyObject *args)
         outlen = sock_recv_guts(s, PyBytes_AS_STRING(buf), recvlen, flags);
 
         if(outlen < 0) {
-            PyErr_SetString(PyExc_Exception, "failed to read from socket");
+            /* Keep the OSError of sock_call, BlockingIOError for non-blocking sockets */
+            Py_DECREF(buf);
             return NULL;
         }
 
@@ -640,20 +1710,27 @@ sock_listen(PyObject *self, PyObject *args)
 
 
     static PyObject*
-    sock_recv_into(PyObject* self, PyObject *args, PyObject *kwds)
+    sock_recv_into(PyObject* self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
     {
         socket_object* s = (socket_object*)self;
 
-        static char *kwlist[] = {"buffer", "nbytes", "flags", 0};
+        static const char *kwlist[] = {"buffer", "nbytes", "flags", 0};
+        PyObject *argv[3];
 
         int flags = 0;
         Py_buffer pbuf;
         char *buf;
         Py_ssize_t buflen, readlen, recvlen = 0;
 
+        if (!fastcall_unpack("recv_into", args, nargs, kwnames, kwlist, 1, argv))
+            return NULL;
+        if (argv[1] != NULL && !fastcall_ssize_t(argv[1], &recvlen))
+            return NULL;
+        if (argv[2] != NULL && !fastcall_int(argv[2], &flags))
+            return NULL;
+
         /* Get the buffer's memory */
-        if (!PyArg_ParseTupleAndKeywords(args, kwds, "w*|ni:recv_into", kwlist,
-                                         &pbuf, &recvlen, &flags))
+        if (!fastcall_rwbuffer(argv[0], &pbuf))
             return NULL;
         buf = pbuf.buf;
         buflen = pbuf.len;
@@ -698,6 +1775,382 @@ sock_listen(PyObject *self, PyObject *args)
     \n\
     See recv() for documentation about the flags.");
 
+    /*
+        The end of the stream was reached by a framing method: return b""
+        if nothing was buffered, otherwise raise EOFError leaving the
+        partial frame in the buffer.
+    */
+    static PyObject*
+    rbuf_eof(socket_object* s)
+    {
+        if (rbuf_len(s) == 0)
+            return PyBytes_FromStringAndSize(NULL, 0);
+
+        PyErr_Format(PyExc_EOFError, "connection closed with an incomplete frame of %zd bytes",
+                     rbuf_len(s));
+        return NULL;
+    }
+
+    /*
+        Return the n bytes following the first skip bytes of the buffer,
+        consuming both. Nothing is consumed on failure, the bytes received
+        are left in the buffer for the next call. The buffer must be taken
+        and hold at least skip bytes.
+    */
+    static PyObject*
+    rbuf_read_exact(socket_object* s, Py_ssize_t skip, Py_ssize_t n, _PyTime_t deadline)
+    {
+        struct sock_recv ctx;
+        _PyTime_t timeout;
+        PyObject* buf;
+        Py_ssize_t got;
+        int res;
+
+        if (skip + n <= RBUF_MIN_SIZE || rbuf_len(s) >= skip + n) {
+            res = rbuf_fill(s, skip + n, deadline);
+            if (res <= 0)
+                return res == 0 ? rbuf_eof(s) : NULL;
+
+            buf = PyBytes_FromStringAndSize(s->rbuf + s->rbuf_start + skip, n);
+            if (buf != NULL)
+                rbuf_consume(s, skip + n);
+            return buf;
+        }
+
+        /* Large frames are received straight into the bytes object */
+        buf = PyBytes_FromStringAndSize(NULL, n);
+        if (buf == NULL)
+            return NULL;
+
+        got = rbuf_len(s) - skip;
+        memcpy(PyBytes_AS_STRING(buf), s->rbuf + s->rbuf_start + skip, got);
+
+        res = 1;
+        while (got < n) {
+            if (!rbuf_timeout(s, deadline, &timeout) || cork_before(s, 0) < 0) {
+                res = -1;
+                break;
+            }
+            ctx.cbuf = PyBytes_AS_STRING(buf) + got;
+            ctx.len = n - got;
+            ctx.flags = 0;
+            if (sock_call(s, 0, sock_recv_impl, &ctx, 0, NULL, timeout) < 0) {
+                res = -1;
+                break;
+            }
+            if (ctx.result == 0) {
+                res = 0;
+                break;
+            }
+            got += ctx.result;
+        }
+
+        if (res > 0) {
+            rbuf_consume(s, rbuf_len(s));
+            return buf;
+        }
+
+        /* Keep what was received after the buffered bytes */
+        Py_ssize_t extra = got - (rbuf_len(s) - skip);
+        if (extra > 0) {
+            PyObject *type, *value, *tb;
+            PyErr_Fetch(&type, &value, &tb);
+            if (rbuf_reserve(s, extra)) {
+                memcpy(s->rbuf + s->rbuf_end, PyBytes_AS_STRING(buf) + got - extra, extra);
+                s->rbuf_end += extra;
+                PyErr_Restore(type, value, tb);
+            }
+            else {
+                Py_XDECREF(type);
+                Py_XDECREF(value);
+                Py_XDECREF(tb);
+            }
+        }
+        Py_DECREF(buf);
+
+        if (res == 0 && !PyErr_Occurred())
+            return rbuf_eof(s);
+        return NULL;
+    }
+
+    static PyObject*
+    sock_recv_exact(PyObject* self, PyObject* arg)
+    {
+        socket_object* s = (socket_object*)self;
+        Py_ssize_t n;
+        PyObject* res;
+
+        if (!fastcall_ssize_t(arg, &n))
+            return NULL;
+        if (n < 0) {
+            PyErr_SetString(PyExc_ValueError, "negative size in recv_exact");
+            return NULL;
+        }
+
+        if (!rbuf_acquire(s))
+            return NULL;
+        res = rbuf_read_exact(s, 0, n, rbuf_deadline(s));
+        rbuf_release(s);
+
+        return res;
+    }
+
+    PyDoc_STRVAR(recv_exact_doc,
+    "recv_exact(n) -> data\n\
+    \n\
+    Receive exactly n bytes from the socket. Return b\"\" if the remote end\n\
+    closed the connection before sending any byte and raise EOFError if it\n\
+    closed it after sending part of them. The socket timeout applies to the\n\
+    whole call. The data received in excess is kept in a buffer of the socket\n\
+    for the next calls, so do the data received before an error.");
+
+    static PyObject*
+    sock_recv_until(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+    {
+        socket_object* s = (socket_object*)self;
+
+        static const char* const kwlist[] = {"delim", "max", NULL};
+        PyObject* argv[2];
+        Py_ssize_t max = 65536, scanned = 0;
+        Py_buffer delim;
+        PyObject* res = NULL;
+
+        if (!fastcall_unpack("recv_until", args, nargs, kwnames, kwlist, 1, argv))
+            return NULL;
+        if (argv[1] != NULL && !fastcall_ssize_t(argv[1], &max))
+            return NULL;
+        if (!fastcall_buffer(argv[0], &delim))
+            return NULL;
+        if (delim.len == 0) {
+            PyBuffer_Release(&delim);
+            PyErr_SetString(PyExc_ValueError, "empty delimiter in recv_until");
+            return NULL;
+        }
+
+        if (!rbuf_acquire(s)) {
+            PyBuffer_Release(&delim);
+            return NULL;
+        }
+
+        _PyTime_t deadline = rbuf_deadline(s);
+        while (1) {
+            Py_ssize_t len = rbuf_len(s);
+
+            /* Only look at the bytes that arrived since the last search */
+            Py_ssize_t from = Py_MAX(scanned - delim.len + 1, 0);
+            char* found = len > from ? memmem(s->rbuf + s->rbuf_start + from, len - from, delim.buf, delim.len) : NULL;
+            if (found != NULL) {
+                Py_ssize_t n = found - (s->rbuf + s->rbuf_start) + delim.len;
+                if (n > max) {
+                    PyErr_Format(PyExc_ValueError, "delimiter not found in the first %zd bytes", max);
+                    break;
+                }
+                res = PyBytes_FromStringAndSize(s->rbuf + s->rbuf_start, n);
+                if (res != NULL)
+                    rbuf_consume(s, n);
+                break;
+            }
+            if (len >= max) {
+                PyErr_Format(PyExc_ValueError, "delimiter not found in the first %zd bytes", max);
+                break;
+            }
+
+            scanned = len;
+            int filled = rbuf_fill(s, len + 1, deadline);
+            if (filled <= 0) {
+                if (filled == 0)
+                    res = rbuf_eof(s);
+                break;
+            }
+        }
+
+        rbuf_release(s);
+        PyBuffer_Release(&delim);
+        return res;
+    }
+
+    PyDoc_STRVAR(recv_until_doc,
+    "recv_until(delim, max=65536) -> data\n\
+    \n\
+    Receive up to and including the first occurrence of the bytes delim.\n\
+    Raise ValueError if delim is not found in the first max bytes, the\n\
+    bytes are left to the next calls. The end of the connection and the\n\
+    timeouts are handled as by recv_exact().");
+
+    /*
+        Parse a struct format with a single unsigned integer, the length
+        prefix of recv_frame(). Returns 0 raising ValueError if the format
+        is not supported.
+    */
+    static int
+    parse_frame_header(const char* fmt, Py_ssize_t* size, int* little_endian)
+    {
+        int native = 1;
+
+        *little_endian = PY_LITTLE_ENDIAN;
+        switch (*fmt) {
+            case '<':
+                *little_endian = 1;
+                native = 0;
+                fmt++;
+                break;
+            case '>':
+            case '!':
+                *little_endian = 0;
+                native = 0;
+                fmt++;
+                break;
+            case '=':
+                native = 0;
+                fmt++;
+                break;
+            case '@':
+                fmt++;
+                break;
+        }
+
+        if (fmt[0] != '\0' && fmt[1] == '\0') {
+            switch (fmt[0]) {
+                case 'B': *size = 1; return 1;
+                case 'H': *size = 2; return 1;
+                case 'I': *size = 4; return 1;
+                case 'L': *size = native ? sizeof(long) : 4; return 1;
+                case 'Q': *size = 8; return 1;
+            }
+        }
+
+        PyErr_SetString(PyExc_ValueError, "header_fmt must be a struct format of one of B, H, I, L or Q");
+        return 0;
+    }
+
+    static PyObject*
+    sock_recv_frame(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+    {
+        socket_object* s = (socket_object*)self;
+
+        static const char* const kwlist[] = {"header_fmt", "max", NULL};
+        PyObject* argv[2];
+        const char* fmt = "!I";
+        Py_ssize_t max = 16 * 1024 * 1024, hsize;
+        int little_endian;
+        PyObject* res = NULL;
+
+        if (!fastcall_unpack("recv_frame", args, nargs, kwnames, kwlist, 0, argv))
+            return NULL;
+        if (argv[0] != NULL) {
+            if (!PyUnicode_Check(argv[0])) {
+                PyErr_Format(PyExc_TypeError, "recv_frame(): header_fmt must be str, not %.200s",
+                             Py_TYPE(argv[0])->tp_name);
+                return NULL;
+            }
+            fmt = PyUnicode_AsUTF8(argv[0]);
+            if (fmt == NULL)
+                return NULL;
+        }
+        if (argv[1] != NULL && !fastcall_ssize_t(argv[1], &max))
+            return NULL;
+        if (!parse_frame_header(fmt, &hsize, &little_endian))
+            return NULL;
+
+        if (!rbuf_acquire(s))
+            return NULL;
+
+        _PyTime_t deadline = rbuf_deadline(s);
+        int filled = rbuf_fill(s, hsize, deadline);
+        if (filled <= 0) {
+            if (filled == 0)
+                res = rbuf_eof(s);
+            goto done;
+        }
+
+        const unsigned char* p = (const unsigned char*)s->rbuf + s->rbuf_start;
+        unsigned long long length = 0;
+        for (Py_ssize_t i = 0; i < hsize; i++)
+            length = (length << 8) | p[little_endian ? hsize - 1 - i : i];
+
+        if (length > (unsigned long long)max) {
+            PyErr_Format(PyExc_ValueError, "frame of %llu bytes is larger than %zd bytes", length, max);
+            goto done;
+        }
+        res = rbuf_read_exact(s, hsize, (Py_ssize_t)length, deadline);
+
+    done:
+        rbuf_release(s);
+        return res;
+    }
+
+    PyDoc_STRVAR(recv_frame_doc,
+    "recv_frame(header_fmt=\"!I\", max=16777216) -> data\n\
+    \n\
+    Receive a frame prefixed by its length, an unsigned integer packed with\n\
+    the struct format header_fmt, and return its payload. Raise ValueError\n\
+    if the length is larger than max. The end of the connection and the\n\
+    timeouts are handled as by recv_exact().");
+
+    static PyObject*
+    sock_pending(PyObject* self, PyObject* Py_UNUSED(ignored))
+    {
+        socket_object* s = (socket_object*)self;
+        Py_ssize_t n;
+
+        if (!rbuf_acquire(s))
+            return NULL;
+        n = rbuf_len(s);
+        rbuf_release(s);
+
+        return PyLong_FromSsize_t(n);
+    }
+
+    PyDoc_STRVAR(pending_doc,
+    "pending() -> int\n\
+    \n\
+    Return the number of bytes received in the buffer of the socket and not\n\
+    yet returned. Only iothpy.IothSelector sees them: check pending() before\n\
+    waiting for the socket to become readable with the other selectors.");
+
+    static PyObject*
+    sock_set_readahead(PyObject* self, PyObject* arg)
+    {
+        socket_object* s = (socket_object*)self;
+        Py_ssize_t size;
+
+        if (!fastcall_ssize_t(arg, &size))
+            return NULL;
+        if (size < 0) {
+            PyErr_SetString(PyExc_ValueError, "negative size in set_readahead");
+            return NULL;
+        }
+
+        if (!rbuf_acquire(s))
+            return NULL;
+        s->readahead = size;
+        rbuf_release(s);
+
+        Py_RETURN_NONE;
+    }
+
+    PyDoc_STRVAR(set_readahead_doc,
+    "set_readahead(size)\n\
+    \n\
+    Serve the recv() and recv_into() calls asking for less than size bytes\n\
+    from a buffer of the socket, filled by receiving up to size bytes at once,\n\
+    so that a parser reading a few bytes at a time does not make a system\n\
+    call for each of them. MSG_PEEK looks at the buffer, MSG_OOB and\n\
+    MSG_WAITALL bypass it. A size of 0 disables the read-ahead, the bytes\n\
+    already buffered are still returned first. See also pending().");
+
+    static PyObject*
+    sock_get_readahead(PyObject* self, PyObject* Py_UNUSED(ignored))
+    {
+        return PyLong_FromSsize_t(((socket_object*)self)->readahead);
+    }
+
+    PyDoc_STRVAR(get_readahead_doc,
+    "get_readahead() -> int\n\
+    \n\
+    Return the read-ahead size set with set_readahead(), 0 if disabled.");
+
+
 
 
     struct sock_recvfrom_ctx {
@@ -739,20 +2192,34 @@ sock_listen(PyObject *self, PyObject *args)
         socklen_t addrlen;
         struct sock_recvfrom_ctx ctx;
 
+        Py_ssize_t n;
+
         *addr = NULL;
 
         if (!getsockaddrlen(s, &addrlen))
             return -1;
 
+        /* The bytes left by the framing methods come from the connected peer */
+        n = len > 0 ? rbuf_read(s, cbuf, len, flags) : 0;
+        if (n != 0) {
+            if (n > 0) {
+                Py_INCREF(Py_None);
+                *addr = Py_None;
+            }
+            return n;
+        }
+
         ctx.cbuf = cbuf;
         ctx.len = len;
         ctx.flags = flags;
         ctx.addrbuf = (struct sockaddr*)&addrbuf;
         ctx.addrlen = &addrlen;
+        if (cork_before(s, 0) < 0)
+            return -1;
         if (sock_call(s, 0, sock_recvfrom_impl, &ctx, 0, NULL, s->sock_timeout) < 0)
             return -1;
 
-        *addr = make_sockaddr((struct sockaddr*)&addrbuf, addrlen);
+        *addr = make_sockaddr_cached(s, (struct sockaddr*)&addrbuf, addrlen);
         if (*addr == NULL)
             return -1;
 
@@ -760,16 +2227,20 @@ sock_listen(PyObject *self, PyObject *args)
     }
 
     static PyObject*
-    sock_recvfrom(PyObject *self, PyObject *args){
+    sock_recvfrom(PyObject *self, PyObject *const *args, Py_ssize_t nargs){
         socket_object* s = (socket_object*)self;
 
         PyObject *ret = NULL;
         int flags = 0;
-        ssize_t recvlen, outlen;
+        Py_ssize_t recvlen;
+        ssize_t outlen;
 
-        if (!PyArg_ParseTuple(args, "n|i:recvfrom", &recvlen, &flags)){
+        if (!fastcall_check_nargs("recvfrom", nargs, NULL, 1, 2))
+            return NULL;
+        if (!fastcall_ssize_t(args[0], &recvlen))
+            return NULL;
+        if (nargs > 1 && !fastcall_int(args[1], &flags))
             return NULL;
-        }
 
         if (recvlen < 0) {
             PyErr_SetString(PyExc_ValueError,
@@ -815,11 +2286,12 @@ sock_listen(PyObject *self, PyObject *args)
     /* s.recvfrom_into(buffer[, nbytes [,flags]]) method */
 
     static PyObject *
-    sock_recvfrom_into(PyObject* self, PyObject *args, PyObject* kwds)
+    sock_recvfrom_into(PyObject* self, PyObject *const *args, Py_ssize_t nargs, PyObject* kwnames)
     {
         socket_object* s = (socket_object*)self;
 
-        static char *kwlist[] = {"buffer", "nbytes", "flags", 0};
+        static const char *kwlist[] = {"buffer", "nbytes", "flags", 0};
+        PyObject *argv[3];
 
         int flags = 0;
         Py_buffer pbuf;
@@ -828,9 +2300,13 @@ sock_listen(PyObject *self, PyObject *args)
 
         PyObject *addr = NULL;
 
-        if (!PyArg_ParseTupleAndKeywords(args, kwds, "w*|ni:recvfrom_into",
-                                         kwlist, &pbuf,
-                                         &recvlen, &flags))
+        if (!fastcall_unpack("recvfrom_into", args, nargs, kwnames, kwlist, 1, argv))
+            return NULL;
+        if (argv[1] != NULL && !fastcall_ssize_t(argv[1], &recvlen))
+            return NULL;
+        if (argv[2] != NULL && !fastcall_int(argv[2], &flags))
+            return NULL;
+        if (!fastcall_rwbuffer(argv[0], &pbuf))
             return NULL;
         buf = pbuf.buf;
         buflen = pbuf.len;
@@ -1015,6 +2491,8 @@ sock_listen(PyObject *self, PyObject *args)
 
         ctx.msg = &msg;
         ctx.flags = flags;
+        if (cork_before(s, 0) < 0)
+            goto finally;
         if (sock_call(s, 0, sock_recvmsg_impl, &ctx, 0, NULL, s->sock_timeout) < 0)
             goto finally;
 
@@ -1266,24 +2744,27 @@ SCM_RIGHTS mechanism.");
 #endif    /* CMSG_LEN */
 
 
-struct sock_send_ctx {
-    char *buf;
-    Py_ssize_t len;
-    int flags;
-    Py_ssize_t result;
-};
-
-static int
+int
 sock_send_impl(socket_object *s, void *data)
 {
     struct sock_send_ctx *ctx = data;
 
+    if (pacer_enabled(s)) {
+        /* Stream writes are cut to the burst, sendall() sends the rest at the pace */
+        size_t len = s->type == SOCK_STREAM ? pacer_chunk(s->pacer, ctx->len) : (size_t)ctx->len;
+        if (!pace(s, len))
+            return 0;
+        ctx->result = ioth_send(s->fd, ctx->buf, len, ctx->flags);
+        unpace(s, len, ctx->result);
+        return ctx->result >= 0;
+    }
+
     ctx->result = ioth_send(s->fd, ctx->buf, ctx->len, ctx->flags);
     return ctx->result >= 0;
 }
 
 static PyObject *
-sock_send(PyObject *self, PyObject *args) 
+sock_send(PyObject *self, PyObject *const *args, Py_ssize_t nargs) 
 {
     socket_object* s = (socket_object*)self;
 
@@ -1291,14 +2772,31 @@ sock_send(PyObject *self, PyObject *args)
     Py_buffer pbuf;
     struct sock_send_ctx ctx;
 
-    if (!PyArg_ParseTuple(args, "y*|i:send", &pbuf, &flags))
+    if (!fastcall_check_nargs("send", nargs, NULL, 1, 2))
+        return NULL;
+    if (nargs > 1 && !fastcall_int(args[1], &flags))
+        return NULL;
+    if (!fastcall_buffer(args[0], &pbuf))
+        return NULL;
+    if (wqueue_before(s) < 0) {
+        PyBuffer_Release(&pbuf);
         return NULL;
+    }
+
+    /* A corked socket takes all the data */
+    if (cork_enabled(s) && !(flags & ~MSG_EOR)) {
+        Py_ssize_t len = pbuf.len;
+        int res = cork_write(s, pbuf.buf, len, flags);
+        PyBuffer_Release(&pbuf);
+        return res < 0 ? NULL : PyLong_FromSsize_t(len);
+    }
 
     ctx.buf = pbuf.buf;
     ctx.len = pbuf.len;
     ctx.flags = flags;
 
-    if (sock_call(s, 1, sock_send_impl, &ctx, 0, NULL, s->sock_timeout) < 0) {
+    if (cork_before(s, 1) < 0 ||
+        sock_call(s, 1, sock_send_impl, &ctx, 0, NULL, s->sock_timeout) < 0) {
         PyBuffer_Release(&pbuf);
         return NULL;
     }
@@ -1317,7 +2815,7 @@ sent; this may be less than len(data) if the network is busy.");
 
 
 static PyObject *
-sock_sendall(PyObject *self, PyObject *args)
+sock_sendall(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
     socket_object* s = (socket_object*)self;
 
@@ -1332,11 +2830,27 @@ sock_sendall(PyObject *self, PyObject *args)
     int deadline_initialized = 0;
     PyObject *res = NULL;
 
-    if (!PyArg_ParseTuple(args, "y*|i:sendall", &pbuf, &flags))
+    if (!fastcall_check_nargs("sendall", nargs, NULL, 1, 2))
+        return NULL;
+    if (nargs > 1 && !fastcall_int(args[1], &flags))
+        return NULL;
+    if (!fastcall_buffer(args[0], &pbuf))
         return NULL;
     buf = pbuf.buf;
     len = pbuf.len;
 
+    if (wqueue_before(s) < 0)
+        goto done;
+    if (cork_enabled(s) && !(flags & ~MSG_EOR)) {
+        if (cork_write(s, buf, len, flags) == 0) {
+            Py_INCREF(Py_None);
+            res = Py_None;
+        }
+        goto done;
+    }
+    if (cork_before(s, 1) < 0)
+        goto done;
+
     do {
         if (has_timeout) {
             if (deadline_initialized) {
@@ -1349,7 +2863,7 @@ sock_sendall(PyObject *self, PyObject *args)
             }
 
             if (interval <= 0) {
-                PyErr_SetString(socket_timeout, "timed out");
+                PyErr_SetString(s->state->socket_timeout, "timed out");
                 goto done;
             }
         }
@@ -1389,6 +2903,478 @@ argument, see the Unix manual.  This calls send() repeatedly\n\
 until all data is sent.  If an error occurs, it's impossible\n\
 to tell how much data has been sent.");
 
+static PyObject*
+sock_set_cork(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    socket_object* s = (socket_object*)self;
+
+    static const char* const kwlist[] = {"threshold", "delay", NULL};
+    PyObject* argv[2];
+    Py_ssize_t threshold;
+    _PyTime_t delay = 1000000;     /* 1 ms */
+    struct cork* c;
+
+    if (!fastcall_unpack("set_cork", args, nargs, kwnames, kwlist, 1, argv))
+        return NULL;
+    if (!fastcall_ssize_t(argv[0], &threshold))
+        return NULL;
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "negative threshold in set_cork");
+        return NULL;
+    }
+    if (argv[1] != NULL && socket_parse_timeout(&delay, argv[1]) < 0)
+        return NULL;
+
+    /* The cork is allocated once and lives as long as the socket */
+    Py_BEGIN_CRITICAL_SECTION(s);
+    c = s->cork;
+    if (c == NULL && threshold > 0) {
+        c = cork_new(s->fd);
+        __atomic_store_n(&s->cork, c, __ATOMIC_RELEASE);
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (c == NULL) {
+        if (threshold > 0)
+            return PyErr_NoMemory();
+        Py_RETURN_NONE;
+    }
+
+    /* Disabling sends what is left */
+    if (threshold == 0 && cork_before(s, 1) < 0)
+        return NULL;
+
+    pthread_mutex_lock(&c->lock);
+    c->threshold = threshold;
+    c->delay = delay;
+    pthread_mutex_unlock(&c->lock);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_cork_doc,
+"set_cork(threshold, delay=0.001)\n\
+\n\
+Coalesce the small writes of send(), sendall() and send_async() in a\n\
+buffer of the socket, sent with a single system call when it reaches\n\
+threshold bytes, when flush() is called or delay seconds after the first\n\
+byte buffered (None for no delay). A write with the MSG_EOR flag ends a\n\
+message and is sent at once with the buffer. The other operations on the\n\
+socket, receives included, send the buffer first. A threshold of 0 sends\n\
+the buffer and disables the coalescing.");
+
+static PyObject*
+sock_get_cork(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    socket_object* s = (socket_object*)self;
+    struct cork* c = __atomic_load_n(&s->cork, __ATOMIC_ACQUIRE);
+    PyObject* res;
+
+    if (c == NULL)
+        Py_RETURN_NONE;
+
+    pthread_mutex_lock(&c->lock);
+    size_t threshold = c->threshold;
+    long long delay = c->delay;
+    size_t pending = cork_pending(c);
+    unsigned long long writes = c->writes;
+    unsigned long long flushes = c->flushes;
+    unsigned long long timer_flushes = c->timer_flushes;
+    pthread_mutex_unlock(&c->lock);
+
+    if (threshold == 0)
+        Py_RETURN_NONE;
+
+    PyObject* delay_obj;
+    if (delay < 0) {
+        Py_INCREF(Py_None);
+        delay_obj = Py_None;
+    }
+    else {
+        delay_obj = PyFloat_FromDouble(_PyTime_AsSecondsDouble(delay));
+        if (delay_obj == NULL)
+            return NULL;
+    }
+
+    res = Py_BuildValue("{s:n,s:N,s:n,s:K,s:K,s:K}",
+                        "threshold", (Py_ssize_t)threshold,
+                        "delay", delay_obj,
+                        "pending", (Py_ssize_t)pending,
+                        "writes", writes,
+                        "flushes", flushes,
+                        "timer_flushes", timer_flushes);
+    return res;
+}
+
+PyDoc_STRVAR(get_cork_doc,
+"get_cork() -> dict or None\n\
+\n\
+Return None if the writes are not coalesced, otherwise the settings of\n\
+set_cork() and the counters of the socket:\n\
+  pending:       bytes waiting in the buffer\n\
+  writes:        writes to the socket\n\
+  flushes:       sends to the stack\n\
+  timer_flushes: sends to the stack made when the delay expired");
+
+static PyObject*
+sock_flush(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    if (cork_before((socket_object*)self, 0) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(flush_doc,
+"flush()\n\
+\n\
+Send the writes coalesced by set_cork(). On a non-blocking socket the\n\
+data that the stack can't take stays in the buffer and is sent later.");
+
+/* Parse an optional non-negative rate or burst, None and missing are 0 */
+static int
+pacing_parse(const char* name, PyObject* obj, double* value)
+{
+    *value = 0;
+    if (obj == NULL || obj == Py_None)
+        return 1;
+    *value = PyFloat_AsDouble(obj);
+    if (*value == -1 && PyErr_Occurred())
+        return 0;
+    if (!(*value >= 0)) {
+        PyErr_Format(PyExc_ValueError, "%s must be a non-negative number", name);
+        return 0;
+    }
+    return 1;
+}
+
+static PyObject*
+sock_set_pacing(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    socket_object* s = (socket_object*)self;
+
+    static const char* const kwlist[] = {"rate", "packet_rate", "burst", "packet_burst", NULL};
+    PyObject* argv[4];
+    double rate, packet_rate, burst, packet_burst;
+    struct pacer* p;
+
+    if (!fastcall_unpack("set_pacing", args, nargs, kwnames, kwlist, 0, argv))
+        return NULL;
+    if (!pacing_parse("rate", argv[0], &rate) || !pacing_parse("packet_rate", argv[1], &packet_rate) ||
+        !pacing_parse("burst", argv[2], &burst) || !pacing_parse("packet_burst", argv[3], &packet_burst))
+        return NULL;
+
+    /* By default the buckets hold 10 ms of sends, at least a full packet */
+    if (argv[2] == NULL || argv[2] == Py_None)
+        burst = Py_MAX(rate / 100, 1500);
+    if (argv[3] == NULL || argv[3] == Py_None)
+        packet_burst = Py_MAX(packet_rate / 100, 1);
+    if (burst < 1 || packet_burst < 1) {
+        PyErr_SetString(PyExc_ValueError, "burst and packet_burst must be at least 1");
+        return NULL;
+    }
+
+    /* The pacer is allocated once and lives as long as the socket */
+    Py_BEGIN_CRITICAL_SECTION(s);
+    p = s->pacer;
+    if (p == NULL && (rate > 0 || packet_rate > 0)) {
+        p = pacer_new();
+        __atomic_store_n(&s->pacer, p, __ATOMIC_RELEASE);
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (p == NULL) {
+        if (rate > 0 || packet_rate > 0)
+            return PyErr_NoMemory();
+        Py_RETURN_NONE;
+    }
+
+    pacer_set(p, rate, packet_rate, burst, packet_burst);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_pacing_doc,
+"set_pacing(rate=None, packet_rate=None, burst=None, packet_burst=None)\n\
+\n\
+Limit the sends of the socket to rate bytes and packet_rate packets per\n\
+second, None for no limit, with token buckets of burst bytes and\n\
+packet_burst packets (10 ms of sends by default, at least 1500 bytes and\n\
+a packet). The sends sleep without the GIL until the buckets allow them,\n\
+stream writes larger than burst being cut, and on a non-blocking socket\n\
+they fail with BlockingIOError instead. The write coalescing of set_cork()\n\
+and the write queue are not paced. Without limits the pacing is removed.");
+
+static PyObject*
+sock_get_pacing(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    socket_object* s = (socket_object*)self;
+    struct pacer* p = __atomic_load_n(&s->pacer, __ATOMIC_ACQUIRE);
+
+    if (p == NULL)
+        Py_RETURN_NONE;
+
+    long long delay = pacer_delay(p, 1);
+    pthread_mutex_lock(&p->lock);
+    double rate = p->rate, packet_rate = p->packet_rate;
+    double burst = p->burst, packet_burst = p->packet_burst;
+    unsigned long long bytes = p->bytes, packets = p->packets;
+    unsigned long long delayed = p->delayed, refused = p->refused;
+    long long throttled_ns = p->throttled_ns;
+    pthread_mutex_unlock(&p->lock);
+
+    /* Without a limit the rate is None */
+    PyObject* rate_obj = rate > 0 ? PyFloat_FromDouble(rate) : (Py_INCREF(Py_None), Py_None);
+    PyObject* packet_rate_obj = packet_rate > 0 ? PyFloat_FromDouble(packet_rate) : (Py_INCREF(Py_None), Py_None);
+    PyObject* res = NULL;
+    if (rate_obj != NULL && packet_rate_obj != NULL)
+        res = Py_BuildValue("{s:O,s:O,s:d,s:d,s:K,s:K,s:K,s:K,s:d,s:d}",
+                            "rate", rate_obj,
+                            "packet_rate", packet_rate_obj,
+                            "burst", burst,
+                            "packet_burst", packet_burst,
+                            "bytes", bytes,
+                            "packets", packets,
+                            "delayed", delayed,
+                            "refused", refused,
+                            "throttled_time", throttled_ns / 1e9,
+                            "delay", delay / 1e9);
+    Py_XDECREF(rate_obj);
+    Py_XDECREF(packet_rate_obj);
+    return res;
+}
+
+PyDoc_STRVAR(get_pacing_doc,
+"get_pacing() -> dict or None\n\
+\n\
+Return None if set_pacing() was never called, otherwise its settings and\n\
+the counters of the socket:\n\
+  bytes, packets:  data and sends that went to the stack\n\
+  delayed:         sends that slept for their turn\n\
+  refused:         sends of the non-blocking socket failed for lack of tokens\n\
+  throttled_time:  seconds slept by the delayed sends\n\
+  delay:           seconds before the next send is allowed");
+
+static PyObject*
+sock_queue_write(PyObject* self, PyObject* arg)
+{
+    socket_object* s = (socket_object*)self;
+    struct wqueue* q;
+    Py_buffer view;
+    int res = 0, paused = 0;
+
+    if (cork_enabled(s)) {
+        PyErr_SetString(PyExc_ValueError, "queue_write() can't be used on a corked socket");
+        return NULL;
+    }
+    if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) < 0)
+        return NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(s);
+    q = wqueue_get(s);
+    if (q == NULL) {
+        res = -1;
+    }
+    else if (q->bytes + view.len > q->limit) {
+        PyErr_SetString(PyExc_BlockingIOError, "the write queue of the socket is full");
+        res = -1;
+    }
+    else {
+        Py_ssize_t off = 0;
+        q->queued += view.len;
+
+        /* Nothing queued: try to send it right away */
+        if (q->count == 0 && view.len > 0) {
+            ssize_t n;
+            do {
+                n = ioth_send(s->fd, view.buf, view.len, MSG_DONTWAIT);
+            } while (n < 0 && errno == EINTR);
+
+            if (n >= 0) {
+                q->sends++;
+                q->sent += n;
+                off = n;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                PyErr_SetFromErrno(PyExc_OSError);
+                res = -1;
+            }
+        }
+        else {
+            /* Make room for the new buffer if the socket can take more */
+            res = wqueue_send_lock_held(s, q);
+        }
+
+        /* Keep the buffer, without copying it, until it is sent */
+        if (res == 0 && off < view.len) {
+            res = wqueue_append_lock_held(q, &view, off);
+            if (res == 0)
+                view.obj = NULL;
+        }
+        paused = q->paused;
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (view.obj != NULL)
+        PyBuffer_Release(&view);
+    if (res < 0)
+        return NULL;
+    return PyBool_FromLong(!paused);
+}
+
+PyDoc_STRVAR(queue_write_doc,
+"queue_write(data) -> bool\n\
+\n\
+Send data without blocking, keeping in a queue of the socket the part\n\
+that the stack can't take at once. The queue holds a reference to data\n\
+instead of copying it: don't modify a mutable buffer until it is sent.\n\
+Return False when the queued bytes reach the high watermark of\n\
+set_write_queue(): the producer should pause until drain_queue() returns\n\
+True. Raise BlockingIOError, queueing nothing, if the queue would exceed\n\
+its limit. Direct writes on the socket fail with BlockingIOError while\n\
+the queue is not empty.");
+
+static PyObject*
+sock_drain_queue(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    socket_object* s = (socket_object*)self;
+    int res = 0, paused = 0;
+
+    Py_BEGIN_CRITICAL_SECTION(s);
+    if (s->wqueue != NULL) {
+        res = wqueue_send_lock_held(s, s->wqueue);
+        paused = s->wqueue->paused;
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (res < 0)
+        return NULL;
+    return PyBool_FromLong(!paused);
+}
+
+PyDoc_STRVAR(drain_queue_doc,
+"drain_queue() -> bool\n\
+\n\
+Send the data of the write queue that the stack can take without blocking,\n\
+call it when the socket becomes writable. Return True unless the queue is\n\
+still paused, i.e. it went over the high watermark and is not yet back\n\
+under the low one.");
+
+static PyObject*
+sock_queued(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    socket_object* s = (socket_object*)self;
+    Py_ssize_t bytes = 0;
+
+    Py_BEGIN_CRITICAL_SECTION(s);
+    if (s->wqueue != NULL)
+        bytes = s->wqueue->bytes;
+    Py_END_CRITICAL_SECTION();
+
+    return PyLong_FromSsize_t(bytes);
+}
+
+PyDoc_STRVAR(queued_doc,
+"queued() -> int\n\
+\n\
+Return the number of bytes waiting in the write queue.");
+
+static PyObject*
+sock_set_write_queue(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    socket_object* s = (socket_object*)self;
+
+    static const char* const kwlist[] = {"high", "low", "limit", NULL};
+    PyObject* argv[3];
+    Py_ssize_t high = WQUEUE_HIGH, low, limit;
+    struct wqueue* q;
+    int res = 0;
+
+    if (!fastcall_unpack("set_write_queue", args, nargs, kwnames, kwlist, 0, argv))
+        return NULL;
+    if (argv[0] != NULL && !fastcall_ssize_t(argv[0], &high))
+        return NULL;
+    low = high / 4;
+    limit = 4 * high;
+    if (argv[1] != NULL && argv[1] != Py_None && !fastcall_ssize_t(argv[1], &low))
+        return NULL;
+    if (argv[2] != NULL && argv[2] != Py_None && !fastcall_ssize_t(argv[2], &limit))
+        return NULL;
+
+    if (low < 0 || low > high || high > limit) {
+        PyErr_SetString(PyExc_ValueError, "set_write_queue() needs 0 <= low <= high <= limit");
+        return NULL;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(s);
+    q = wqueue_get(s);
+    if (q == NULL) {
+        res = -1;
+    }
+    else {
+        q->high = high;
+        q->low = low;
+        q->limit = limit;
+        if (!q->paused && q->bytes >= high) {
+            q->paused = 1;
+            q->pauses++;
+        }
+        else if (q->paused && q->bytes <= low) {
+            q->paused = 0;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (res < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_write_queue_doc,
+"set_write_queue(high=262144, low=high // 4, limit=4 * high)\n\
+\n\
+Set the watermarks of the write queue of queue_write(): the queue pauses\n\
+when it holds high bytes or more and resumes when it gets back to low\n\
+bytes or less. queue_write() refuses the data that would take it over\n\
+limit bytes, which bounds the memory held for a slow peer.");
+
+static PyObject*
+sock_write_queue_stats(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    socket_object* s = (socket_object*)self;
+    PyObject* res = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(s);
+    struct wqueue* q = wqueue_get(s);
+    if (q != NULL)
+        res = Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:O,s:K,s:K,s:K,s:K,s:K,s:n}",
+                            "queued", q->bytes,
+                            "buffers", q->count,
+                            "high", q->high,
+                            "low", q->low,
+                            "limit", q->limit,
+                            "paused", q->paused ? Py_True : Py_False,
+                            "bytes_queued", q->queued,
+                            "bytes_sent", q->sent,
+                            "sends", q->sends,
+                            "pauses", q->pauses,
+                            "dropped", q->dropped,
+                        "peak", q->peak);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+PyDoc_STRVAR(write_queue_stats_doc,
+"write_queue_stats() -> dict\n\
+\n\
+Return the state and the counters of the write queue:\n\
+  queued, buffers:        bytes and buffers waiting to be sent\n\
+  high, low, limit:       the settings of set_write_queue()\n\
+  paused:                 the producer should wait for drain_queue()\n\
+  bytes_queued, bytes_sent, sends: data passed to queue_write(), sent,\n\
+                          and the system calls that sent it\n\
+  pauses:                 times the high watermark was reached\n\
+  dropped:                bytes discarded by close()\n\
+  peak:                   largest number of bytes queued");
+
 
 #ifdef CMSG_LEN
 /* If length is in range, set *result to CMSG_LEN(length) and return
@@ -1441,67 +3427,241 @@ static int
 sock_sendto_impl(socket_object *s, void *data)
 {
     struct sock_sendto_ctx *ctx = data;
+    int paced = pacer_enabled(s);
 
+    if (paced && !pace(s, ctx->len))
+        return 0;
     ctx->result = ioth_sendto(s->fd, ctx->buf, ctx->len, ctx->flags, ctx->addrbuf, ctx->addrlen);
+    if (paced)
+        unpace(s, ctx->len, ctx->result);
     return ctx->result >= 0;
 }
 
 /* s.sendto(data, [flags,] sockaddr) method */
 
 static PyObject *
-sock_sendto(PyObject* self, PyObject *args)
+sock_sendto(PyObject* self, PyObject *const *args, Py_ssize_t nargs)
 {
     socket_object* s = (socket_object*)self;
     
     Py_buffer pbuf;
     PyObject *addro;
-    Py_ssize_t arglen;
     struct sockaddr_storage addrbuf;
-    int addrlen, flags;
+    socklen_t addrlen;
+    int flags;
     struct sock_sendto_ctx ctx;
 
     flags = 0;
-    arglen = PyTuple_Size(args);
-    switch (arglen) {
+    switch (nargs) {
         case 2:
-            if (!PyArg_ParseTuple(args, "y*O:sendto", &pbuf, &addro)) {
+            addro = args[1];
+            break;
+        case 3:
+            if (!fastcall_int(args[1], &flags))
                 return NULL;
-            }
+            addro = args[2];
+            break;
+        default:
+            PyErr_Format(PyExc_TypeError, "sendto() takes 2 or 3 arguments (%zd given)", nargs);
+            return NULL;
+    }
+
+    if (!fastcall_buffer(args[0], &pbuf))
+        return NULL;
+
+    if(!get_sockaddr_cached("sendto", s, addro, (struct sockaddr*)&addrbuf, &addrlen)) {
+        PyBuffer_Release(&pbuf);
+        return NULL;
+    }
+
+    ctx.buf = pbuf.buf;
+    ctx.len = pbuf.len;
+    ctx.flags = flags;
+    ctx.addrlen = addrlen;
+    ctx.addrbuf = (struct sockaddr*)&addrbuf;
+    if (wqueue_before(s) < 0 || cork_before(s, 1) < 0 ||
+        sock_call(s, 1, sock_sendto_impl, &ctx, 0, NULL, s->sock_timeout) < 0) {
+        PyBuffer_Release(&pbuf);
+        return NULL;
+    }
+    PyBuffer_Release(&pbuf);
+
+    return PyLong_FromSsize_t(ctx.result);
+}
+
+PyDoc_STRVAR(sendto_doc,
+"sendto(data[, flags], address) -> count\n\
+\n\
+Like send(data, flags) but allows specifying the destination address.\n\
+For IP sockets, the address is a pair (hostaddr, port).");
+
+/* A destination of sendto_many() and the result of the send to it */
+struct sendto_many_dest {
+    sockaddr_union addr;
+    socklen_t addrlen;
+    int err;
+};
+
+struct sock_sendto_many_ctx {
+    char *buf;
+    Py_ssize_t len;
+    int flags;
+    struct sendto_many_dest* dests;
+    Py_ssize_t ndests;
+    Py_ssize_t next;            /* First destination not yet sent to */
+};
+
+/*
+    Send to the destinations from ctx->next on, called without the GIL.
+    Stops at the first destination for which the socket would block or
+    that was interrupted by a signal.
+*/
+static void
+sendto_many_run(socket_object* s, struct sock_sendto_many_ctx* ctx)
+{
+    while (ctx->next < ctx->ndests) {
+        struct sendto_many_dest* d = &ctx->dests[ctx->next];
+        int paced = pacer_enabled(s);
+        ssize_t n;
+
+        if (paced && !pace(s, ctx->len))
+            n = -1;
+        else {
+            n = ioth_sendto(s->fd, ctx->buf, ctx->len, ctx->flags, &d->addr.sa, d->addrlen);
+            if (paced)
+                unpace(s, ctx->len, n);
+        }
+
+        if (n >= 0)
+            d->err = 0;
+        else if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)
+            return;
+        else
+            d->err = errno;
+        ctx->next++;
+    }
+}
+
+/* s.sendto_many(data, addresses[, flags]) method */
+
+static PyObject *
+sock_sendto_many(PyObject* self, PyObject *const *args, Py_ssize_t nargs)
+{
+    socket_object* s = (socket_object*)self;
+
+    Py_buffer pbuf;
+    PyObject *seq, *res = NULL;
+    int flags = 0;
+    struct sock_sendto_many_ctx ctx;
+    _PyTime_t deadline = 0;
+
+    if (!fastcall_check_nargs("sendto_many", nargs, NULL, 2, 3))
+        return NULL;
+    if (nargs > 2 && !fastcall_int(args[2], &flags))
+        return NULL;
+    seq = PySequence_Fast(args[1], "sendto_many() argument 2 must be an iterable of addresses");
+    if (seq == NULL)
+        return NULL;
+    if (!fastcall_buffer(args[0], &pbuf)) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    ctx.buf = pbuf.buf;
+    ctx.len = pbuf.len;
+    ctx.flags = flags;
+    ctx.ndests = PySequence_Fast_GET_SIZE(seq);
+    ctx.next = 0;
+    ctx.dests = PyMem_Malloc(Py_MAX(ctx.ndests, 1) * sizeof(struct sendto_many_dest));
+    if (ctx.dests == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* Parse every address before sending to any */
+    for (Py_ssize_t i = 0; i < ctx.ndests; i++) {
+        struct sendto_many_dest* d = &ctx.dests[i];
+        if (!get_sockaddr_from_tuple("sendto_many", s, PySequence_Fast_GET_ITEM(seq, i),
+                                     &d->addr.sa, &d->addrlen))
+            goto done;
+    }
+
+    if (wqueue_before(s) < 0 || cork_before(s, 1) < 0)
+        goto done;
+    /* The timeout and the deadline of the operation are for the whole call */
+    if (s->sock_timeout != 0) {
+        _PyTime_t op_deadline;
+        if (sock_op_deadline(s, &op_deadline) < 0)
+            goto done;
+        if (s->sock_timeout > 0)
+            deadline = _PyTime_GetMonotonicClock() + s->sock_timeout;
+        if (op_deadline != 0 && (deadline == 0 || op_deadline < deadline))
+            deadline = op_deadline;
+    }
+
+    while (ctx.next < ctx.ndests) {
+        /* The pacing of the datagrams sleeps until the deadline at most */
+        call_deadline = deadline;
+        Py_BEGIN_ALLOW_THREADS
+        sendto_many_run(s, &ctx);
+        Py_END_ALLOW_THREADS
+        call_deadline = 0;
+        if (ctx.next == ctx.ndests)
             break;
-        case 3:
-            if (!PyArg_ParseTuple(args, "y*iO:sendto", &pbuf, &flags, &addro)) {
-                return NULL;
+
+        /* The socket is full or a signal arrived, go on as sendto() does */
+        struct sendto_many_dest* d = &ctx.dests[ctx.next++];
+        _PyTime_t timeout = s->sock_timeout;
+        if (deadline != 0) {
+            timeout = deadline - _PyTime_GetMonotonicClock();
+            if (timeout <= 0) {
+                d->err = EWOULDBLOCK;
+                continue;
             }
-            break;
-        default:
-            PyErr_Format(PyExc_TypeError, "sendto() takes 2 or 3 arguments (%zd given)", arglen);
-            return NULL;
-    }
+        }
+        else if (timeout == 0) {
+            d->err = EWOULDBLOCK;
+            continue;
+        }
 
-    if(!get_sockaddr_from_tuple("sendto", s, addro, (struct sockaddr*)&addrbuf, &addrlen)) {
-        PyBuffer_Release(&pbuf);
-        return NULL;
+        struct sock_sendto_ctx one;
+        one.buf = ctx.buf;
+        one.len = ctx.len;
+        one.flags = flags;
+        one.addrlen = d->addrlen;
+        one.addrbuf = &d->addr.sa;
+        if (sock_call(s, 1, sock_sendto_impl, &one, 0, &d->err, timeout) < 0 && d->err == -1)
+            goto done;
     }
 
-    ctx.buf = pbuf.buf;
-    ctx.len = pbuf.len;
-    ctx.flags = flags;
-    ctx.addrlen = addrlen;
-    ctx.addrbuf = (struct sockaddr*)&addrbuf;
-    if (sock_call(s, 1, sock_sendto_impl, &ctx, 0, NULL, s->sock_timeout) < 0) {
-        PyBuffer_Release(&pbuf);
-        return NULL;
+    res = PyList_New(ctx.ndests);
+    if (res == NULL)
+        goto done;
+    for (Py_ssize_t i = 0; i < ctx.ndests; i++) {
+        PyObject* err = PyLong_FromLong(ctx.dests[i].err);
+        if (err == NULL) {
+            Py_CLEAR(res);
+            goto done;
+        }
+        PyList_SET_ITEM(res, i, err);
     }
-    PyBuffer_Release(&pbuf);
 
-    return PyLong_FromSsize_t(ctx.result);
+done:
+    PyMem_Free(ctx.dests);
+    PyBuffer_Release(&pbuf);
+    Py_DECREF(seq);
+    return res;
 }
 
-PyDoc_STRVAR(sendto_doc,
-"sendto(data[, flags], address) -> count\n\
+PyDoc_STRVAR(sendto_many_doc,
+"sendto_many(data, addresses[, flags]) -> list\n\
 \n\
-Like send(data, flags) but allows specifying the destination address.\n\
-For IP sockets, the address is a pair (hostaddr, port).");
+Send data as one datagram to each of the addresses, which are parsed\n\
+before sending to any of them, with the GIL released for the whole loop.\n\
+Returns the list of the errno of each send, 0 if it succeeded. A socket\n\
+with a timeout waits for it to be writable as sendto() does, the timeout\n\
+being for the whole call, the sends that could not be done in time get\n\
+EWOULDBLOCK.");
 
 
 /* The sendmsg() and recvmsg[_into]() methods require a working
@@ -1574,8 +3734,18 @@ static int
 sock_sendmsg_impl(socket_object *s, void *data)
 {
     struct sock_sendmsg_ctx *ctx = data;
+    int paced = pacer_enabled(s);
+    size_t len = 0;
 
+    if (paced) {
+        for (size_t i = 0; i < (size_t)ctx->msg->msg_iovlen; i++)
+            len += ctx->msg->msg_iov[i].iov_len;
+        if (!pace(s, len))
+            return 0;
+    }
     ctx->result = ioth_sendmsg(s->fd, ctx->msg, ctx->flags);
+    if (paced)
+        unpace(s, len, ctx->result);
     return (ctx->result >= 0);
 }
 
@@ -1736,6 +3906,8 @@ sock_sendmsg(PyObject* self, PyObject *args)
 
     ctx.msg = &msg;
     ctx.flags = flags;
+    if (wqueue_before(s) < 0 || cork_before(s, 1) < 0)
+        goto finally;
     if (sock_call(s, 1, sock_sendmsg_impl, &ctx, 0, NULL, s->sock_timeout) < 0)
         goto finally;
 
@@ -1778,21 +3950,46 @@ static PyObject *
 sock_close(PyObject *self, PyObject *args)
 {
     socket_object* s = (socket_object*)self;
-    if(s->fd != -1)
+    int fd, flushed;
+
+    /* Send what the stack takes at once from the write queue, drop the rest */
+    if (wqueue_pending(s)) {
+        Py_BEGIN_CRITICAL_SECTION(s);
+        if (wqueue_send_lock_held(s, s->wqueue) < 0)
+            PyErr_Clear();
+        wqueue_clear(s->wqueue);
+        Py_END_CRITICAL_SECTION();
+    }
+
+    /* Send the coalesced writes, the socket is closed even if it fails */
+    flushed = cork_before(s, 0);
+
+    /* Take the fd atomically so that concurrent closes close it only once */
+    Py_BEGIN_CRITICAL_SECTION(s);
+    fd = s->fd;
+    s->fd = -1;
+    Py_END_CRITICAL_SECTION();
+    cork_detach(s);
+
+    if(fd != -1)
     {
         int res;
 
         Py_BEGIN_ALLOW_THREADS
-        res = ioth_close(s->fd);
+        res = ioth_close(fd);
         Py_END_ALLOW_THREADS
 
-        s->fd = -1;
         if(res < 0 && errno != ECONNRESET) {
+            if (flushed < 0)
+                PyErr_Clear();
             PyErr_SetFromErrno(PyExc_OSError);
             return NULL;
         }
     }
 
+    if (flushed < 0)
+        return NULL;
+
     //Return none if no errors
     Py_RETURN_NONE;
 }
@@ -1804,7 +4001,7 @@ Close the socket.  It cannot be used after this call.");
 
 
 
-static int
+int
 sock_connect_impl(socket_object* s, void* Py_UNUSED(data))
 {
     int err;
@@ -1831,6 +4028,15 @@ internal_connect(socket_object* s, struct sockaddr *addr, int addrlen,
 {
     int res, err, wait_connect;
 
+    /* Under a deadline a blocking socket connects without blocking, see sock_call() */
+    if (s->sock_timeout < 0 && !s->fd_nonblocking) {
+        _PyTime_t op_deadline;
+        if (sock_op_deadline(s, &op_deadline) < 0)
+            return -1;
+        if (op_deadline != 0 && internal_fd_nonblocking(s) < 0)
+            return -1;
+    }
+
     Py_BEGIN_ALLOW_THREADS
     res = ioth_connect(s->fd, addr, addrlen);
     Py_END_ALLOW_THREADS
@@ -1851,7 +4057,9 @@ internal_connect(socket_object* s, struct sockaddr *addr, int addrlen,
         wait_connect = (s->sock_timeout != 0);
     }
     else {
-        wait_connect = (s->sock_timeout > 0 && err == SOCK_INPROGRESS_ERR);
+        /* The fd of a blocking socket can be non-blocking too, see sock_call() */
+        wait_connect = ((s->sock_timeout > 0 || (s->sock_timeout < 0 && s->fd_nonblocking))
+                        && err == SOCK_INPROGRESS_ERR);
     }
 
     if (!wait_connect) {
@@ -1963,11 +4171,6 @@ sock_getsockopt(PyObject *self, PyObject *args)
                           &level, &optname, &buflen))
         return NULL;
 
-    if (buflen <= 0 || buflen > 1024) {
-        PyErr_SetString(PyExc_OSError, "getsockopt buflen out of range");
-        return NULL;
-    }
-
     if (buflen == 0) {
         int flag = 0;
         socklen_t flagsize = sizeof(flag);
@@ -1981,6 +4184,11 @@ sock_getsockopt(PyObject *self, PyObject *args)
         return PyLong_FromLong(flag);
     }
 
+    if (buflen <= 0 || buflen > 1024) {
+        PyErr_SetString(PyExc_OSError, "getsockopt buflen out of range");
+        return NULL;
+    }
+
     buf = PyBytes_FromStringAndSize((char *)NULL, buflen);
     if (buf == NULL)
         return NULL;
@@ -2064,8 +4272,17 @@ static PyObject *
 sock_detach(PyObject* self, PyObject *Py_UNUSED(ignored))
 {
     socket_object* s = (socket_object*)self;
-    int fd = s->fd;
+    int fd;
+
+    if (cork_before(s, 0) < 0)
+        return NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(s);
+    fd = s->fd;
     s->fd = -1;
+    Py_END_CRITICAL_SECTION();
+    cork_detach(s);
+
     return PyLong_FromLong(fd);
 }
 
@@ -2088,6 +4305,10 @@ sock_shutdown(PyObject *self, PyObject *arg)
     if (how == -1 && PyErr_Occurred())
         return NULL;
 
+    /* The queued and coalesced writes go out before the end of the stream */
+    if (how != SHUT_RD && (wqueue_before(s) < 0 || cork_before(s, 1) < 0))
+        return NULL;
+
     Py_BEGIN_ALLOW_THREADS
     res = ioth_shutdown(s->fd, how);
     Py_END_ALLOW_THREADS
@@ -2166,12 +4387,16 @@ info is a pair (hostaddr, port).");
 
 /* Function to perform the setting of socket blocking mode
    internally. block = (1 | 0). */
-static int
+int
 internal_setblocking(socket_object* s, int block)
 {
     int result = -1;
     int delay_flag, new_delay_flag;
 
+    /* The cooperative waits need a non-blocking fd */
+    if (block && is_cooperative(s->state))
+        block = 0;
+
     /* Use fcntl instead of ioctl because it's supported by picoxnet */
     Py_BEGIN_ALLOW_THREADS
     delay_flag = ioth_fcntl(s->fd, F_GETFL, 0);
@@ -2192,6 +4417,9 @@ done:
     if (result) {
         PyErr_SetFromErrno(PyExc_OSError);
     }
+    else {
+        s->fd_nonblocking = !block;
+    }
 
     return result;
 }
@@ -2213,8 +4441,13 @@ sock_setblocking(PyObject *self, PyObject *arg)
     if (block == -1 && PyErr_Occurred())
         return NULL;
 
+    int res;
+    Py_BEGIN_CRITICAL_SECTION(s);
     s->sock_timeout = _PyTime_FromSeconds(block ? -1 : 0);
-    if (internal_setblocking(s, block) == -1) {
+    res = internal_setblocking(s, block);
+    Py_END_CRITICAL_SECTION();
+
+    if (res == -1) {
         return NULL;
     }
     Py_RETURN_NONE;
@@ -2267,9 +4500,8 @@ sock_settimeout(PyObject *self, PyObject *arg)
     if (socket_parse_timeout(&timeout, arg) < 0)
         return NULL;
 
-    s->sock_timeout = timeout;
-
     int block = timeout < 0;
+    int res;
     /* Blocking mode for a Python socket object means that operations
        like :meth:`recv` or :meth:`sendall` will block the execution of
        the current thread until they are complete or aborted with a
@@ -2288,7 +4520,13 @@ sock_settimeout(PyObject *self, PyObject *arg)
         ``> 0``              ``True``              non-blocking
     */
 
-    if (internal_setblocking(s, block) == -1) {
+    /* Keep the timeout and the fd mode consistent with concurrent calls */
+    Py_BEGIN_CRITICAL_SECTION(s);
+    s->sock_timeout = timeout;
+    res = internal_setblocking(s, block);
+    Py_END_CRITICAL_SECTION();
+
+    if (res == -1) {
         return NULL;
     }
     Py_RETURN_NONE;
@@ -2325,6 +4563,149 @@ Returns the timeout in seconds (float) associated with socket\n\
 operations. A timeout of None indicates that timeouts on socket\n\
 operations are disabled.");
 
+/* s.set_deadline(when) method */
+static PyObject *
+sock_set_deadline(PyObject *self, PyObject *arg)
+{
+    socket_object* s = (socket_object*)self;
+    _PyTime_t deadline = 0;
+
+    if (arg != Py_None) {
+        if (_PyTime_FromSecondsObject(&deadline, arg, _PyTime_ROUND_CEILING) < 0)
+            return NULL;
+        /* 0 means no deadline, a deadline in the past is just expired */
+        if (deadline <= 0)
+            deadline = 1;
+    }
+    s->sock_deadline = deadline;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_deadline_doc,
+"set_deadline(when)\n\
+\n\
+Bound the total time spent waiting by the operations on the socket.\n\
+'when' is a time of time.monotonic(), in seconds, or None to remove\n\
+the deadline. Each wait lasts at most until then, or less if the timeout\n\
+of the socket is shorter, and once it has passed the operations that\n\
+would wait raise timeout. It applies to blocking sockets as well, whose\n\
+fd becomes non-blocking, while non-blocking ones never wait. See also\n\
+iothpy.deadline().");
+
+/* s.get_deadline() method */
+static PyObject *
+sock_get_deadline(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    socket_object* s = (socket_object*)self;
+
+    if (s->sock_deadline == 0)
+        Py_RETURN_NONE;
+    return PyFloat_FromDouble(_PyTime_AsSecondsDouble(s->sock_deadline));
+}
+
+PyDoc_STRVAR(get_deadline_doc,
+"get_deadline() -> when\n\
+\n\
+Return the deadline set with set_deadline() as a time of time.monotonic(),\n\
+None if there is none.");
+
+
+/* Awaitable operations for asyncio, see iothpy_async.c */
+
+static PyObject *
+sock_recv_async(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    Py_ssize_t recvlen;
+    int flags = 0;
+
+    if (!fastcall_check_nargs("recv_async", nargs, NULL, 1, 2))
+        return NULL;
+    if (!fastcall_ssize_t(args[0], &recvlen))
+        return NULL;
+    if (nargs > 1 && !fastcall_int(args[1], &flags))
+        return NULL;
+    if (recvlen < 0) {
+        PyErr_SetString(PyExc_ValueError, "negative buffersize in recv_async");
+        return NULL;
+    }
+
+    return async_recv((socket_object*)self, recvlen, flags);
+}
+
+PyDoc_STRVAR(recv_async_doc,
+"recv_async(buffersize[, flags]) -> awaitable\n\
+\n\
+Like recv() for asyncio, the awaitable returns the data received. The data\n\
+already available is returned without suspending the coroutine, otherwise\n\
+it waits for the socket on the running loop. The socket must be non-blocking.");
+
+static PyObject *
+sock_send_async(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    Py_buffer pbuf;
+    int flags = 0;
+
+    if (!fastcall_check_nargs("send_async", nargs, NULL, 1, 2))
+        return NULL;
+    if (nargs > 1 && !fastcall_int(args[1], &flags))
+        return NULL;
+    if (!fastcall_buffer(args[0], &pbuf))
+        return NULL;
+    if (wqueue_before((socket_object*)self) < 0) {
+        PyBuffer_Release(&pbuf);
+        return NULL;
+    }
+
+    /* A corked socket takes all the data without waiting */
+    if (cork_enabled((socket_object*)self) && !(flags & ~MSG_EOR)) {
+        Py_ssize_t len = pbuf.len;
+        int res = cork_write((socket_object*)self, pbuf.buf, len, flags);
+        PyBuffer_Release(&pbuf);
+        if (res < 0)
+            return NULL;
+        return async_completed((socket_object*)self, PyLong_FromSsize_t(len));
+    }
+
+    return async_send((socket_object*)self, &pbuf, flags);
+}
+
+PyDoc_STRVAR(send_async_doc,
+"send_async(data[, flags]) -> awaitable\n\
+\n\
+Like send() for asyncio, the awaitable returns the number of bytes sent.\n\
+The socket must be non-blocking.");
+
+static PyObject *
+sock_accept_async(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return async_accept((socket_object*)self);
+}
+
+PyDoc_STRVAR(accept_async_doc,
+"accept_async() -> awaitable\n\
+\n\
+Like accept() for asyncio, the awaitable returns a (socket, address) pair\n\
+and the new socket is non-blocking. The socket must be non-blocking.");
+
+static PyObject *
+sock_connect_async(PyObject *self, PyObject *addro)
+{
+    socket_object* s = (socket_object*)self;
+    struct sockaddr_storage addrbuf;
+    socklen_t addrlen;
+
+    if (!get_sockaddr_from_tuple("connect_async", s, addro, (struct sockaddr*)&addrbuf, &addrlen))
+        return NULL;
+
+    return async_connect(s, (struct sockaddr*)&addrbuf, addrlen);
+}
+
+PyDoc_STRVAR(connect_async_doc,
+"connect_async(address) -> awaitable\n\
+\n\
+Like connect() for asyncio, the awaitable returns None once connected.\n\
+The socket must be non-blocking.");
+
 
 static PyMethodDef socket_methods[] = 
 {
@@ -2332,15 +4713,32 @@ static PyMethodDef socket_methods[] =
     {"close",   sock_close,   METH_NOARGS,  close_doc},
     {"connect", sock_connect, METH_O,       connect_doc},
     {"connect_ex", sock_connect_ex, METH_O, connect_ex_doc},
-    {"listen",  sock_listen,  METH_VARARGS, listen_doc},
+    {"listen",  (PyCFunction)(void(*)(void))sock_listen,  METH_FASTCALL, listen_doc},
     {"_accept",  sock_accept,  METH_NOARGS, accept_doc},
-    {"recv",    sock_recv,    METH_VARARGS, recv_doc},
-    {"recv_into", (PyCFunction)sock_recv_into, METH_VARARGS | METH_KEYWORDS, recv_into_doc},
-    {"recvfrom", sock_recvfrom, METH_VARARGS, recvfrom_doc},
-    {"recvfrom_into", (PyCFunction)sock_recvfrom_into, METH_VARARGS | METH_KEYWORDS, recvfrom_into_doc},
-    {"send",    sock_send,    METH_VARARGS, send_doc},  
-    {"sendall",    sock_sendall,    METH_VARARGS, sendall_doc},  
-    {"sendto", sock_sendto, METH_VARARGS, sendto_doc},
+    {"recv",    (PyCFunction)(void(*)(void))sock_recv,    METH_FASTCALL, recv_doc},
+    {"recv_into", (PyCFunction)(void(*)(void))sock_recv_into, METH_FASTCALL | METH_KEYWORDS, recv_into_doc},
+    {"recv_exact", (PyCFunction)sock_recv_exact, METH_O, recv_exact_doc},
+    {"recv_until", (PyCFunction)(void(*)(void))sock_recv_until, METH_FASTCALL | METH_KEYWORDS, recv_until_doc},
+    {"recv_frame", (PyCFunction)(void(*)(void))sock_recv_frame, METH_FASTCALL | METH_KEYWORDS, recv_frame_doc},
+    {"pending", sock_pending, METH_NOARGS, pending_doc},
+    {"set_readahead", sock_set_readahead, METH_O, set_readahead_doc},
+    {"get_readahead", sock_get_readahead, METH_NOARGS, get_readahead_doc},
+    {"set_cork", (PyCFunction)(void(*)(void))sock_set_cork, METH_FASTCALL | METH_KEYWORDS, set_cork_doc},
+    {"get_cork", sock_get_cork, METH_NOARGS, get_cork_doc},
+    {"flush", sock_flush, METH_NOARGS, flush_doc},
+    {"set_pacing", (PyCFunction)(void(*)(void))sock_set_pacing, METH_FASTCALL | METH_KEYWORDS, set_pacing_doc},
+    {"get_pacing", sock_get_pacing, METH_NOARGS, get_pacing_doc},
+    {"queue_write", sock_queue_write, METH_O, queue_write_doc},
+    {"drain_queue", sock_drain_queue, METH_NOARGS, drain_queue_doc},
+    {"queued", sock_queued, METH_NOARGS, queued_doc},
+    {"set_write_queue", (PyCFunction)(void(*)(void))sock_set_write_queue, METH_FASTCALL | METH_KEYWORDS, set_write_queue_doc},
+    {"write_queue_stats", sock_write_queue_stats, METH_NOARGS, write_queue_stats_doc},
+    {"recvfrom", (PyCFunction)(void(*)(void))sock_recvfrom, METH_FASTCALL, recvfrom_doc},
+    {"recvfrom_into", (PyCFunction)(void(*)(void))sock_recvfrom_into, METH_FASTCALL | METH_KEYWORDS, recvfrom_into_doc},
+    {"send",    (PyCFunction)(void(*)(void))sock_send,    METH_FASTCALL, send_doc},  
+    {"sendall",    (PyCFunction)(void(*)(void))sock_sendall,    METH_FASTCALL, sendall_doc},  
+    {"sendto", (PyCFunction)(void(*)(void))sock_sendto, METH_FASTCALL, sendto_doc},
+    {"sendto_many", (PyCFunction)(void(*)(void))sock_sendto_many, METH_FASTCALL, sendto_many_doc},
 
 #ifdef CMSG_LEN
     {"recvmsg",      sock_recvmsg, METH_VARARGS, recvmsg_doc},
@@ -2359,6 +4757,13 @@ static PyMethodDef socket_methods[] =
     {"getblocking", sock_getblocking, METH_NOARGS, getblocking_doc},
     {"settimeout",  sock_settimeout, METH_O, settimeout_doc},
     {"gettimeout",  sock_gettimeout, METH_NOARGS, gettimeout_doc},
+    {"set_deadline", sock_set_deadline, METH_O, set_deadline_doc},
+    {"get_deadline", sock_get_deadline, METH_NOARGS, get_deadline_doc},
+
+    {"recv_async", (PyCFunction)(void(*)(void))sock_recv_async, METH_FASTCALL, recv_async_doc},
+    {"send_async", (PyCFunction)(void(*)(void))sock_send_async, METH_FASTCALL, send_async_doc},
+    {"accept_async", sock_accept_async, METH_NOARGS, accept_async_doc},
+    {"connect_async", sock_connect_async, METH_O, connect_async_doc},
 
 
     {NULL, NULL} /* sentinel */
@@ -2372,8 +4777,10 @@ socket_dealloc(socket_object* self)
     if(PyObject_CallFinalizerFromDealloc((PyObject*)self) < 0)
         return;
     
+    /* Instances of heap types own a reference to their type */
     PyTypeObject* tp = Py_TYPE(self);
     tp->tp_free(self);
+    Py_DECREF(tp);
 }
 
 static PyObject*
@@ -2405,13 +4812,15 @@ init_sockobject(socket_object *s, PyObject* stack, int fd, int family, int type,
 #endif
 
 #ifdef SOCK_NONBLOCK
-    if (type & SOCK_NONBLOCK)
+    if (type & SOCK_NONBLOCK) {
         s->sock_timeout = 0;
+        s->fd_nonblocking = 1;
+    }
     else
 #endif
     {
-        s->sock_timeout = defaulttimeout;
-        if (defaulttimeout >= 0) {
+        s->sock_timeout = get_defaulttimeout(s->state);
+        if (s->sock_timeout >= 0 || is_cooperative(s->state)) {
             if (internal_setblocking(s, 0) == -1) {
                 return -1;
             }
@@ -2424,6 +4833,44 @@ init_sockobject(socket_object *s, PyObject* stack, int fd, int family, int type,
     return 0;
 }
 
+/*
+    Return the file descriptor of a new socket: a new ioth socket on stack
+    if fdobj is NULL or None, otherwise the integer value of fdobj.
+    Returns -1 raising an exception on failure.
+*/
+int
+socket_fd_from_args(PyObject* stack, int family, int type, int proto, PyObject* fdobj)
+{
+    int fd;
+
+    /* Create a new socket */
+    if(fdobj == NULL || fdobj == Py_None)
+    {
+        fd = ioth_msocket(((struct stack_object*)stack)->stack, family, type, proto);
+        if(fd == -1)
+        {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        return fd;
+    }
+
+    /* Create a socket from an existing file descriptor */
+    if (PyFloat_Check(fdobj)) {
+        PyErr_SetString(PyExc_TypeError, "integer argument expected, got float");
+        return -1;
+    }
+
+    fd = PyLong_AsLong(fdobj);
+    if (PyErr_Occurred())
+        return -1;
+    if (fd == -1) {
+        PyErr_SetString(PyExc_ValueError, "invalid file descriptor");
+        return -1;
+    }
+    return fd;
+}
+
 static int
 socket_initobj(PyObject* self, PyObject* args, PyObject* kwds)
 {
@@ -2440,32 +4887,9 @@ socket_initobj(PyObject* self, PyObject* args, PyObject* kwds)
     if(!PyArg_ParseTuple(args, "Oiii|O", &stack, &family, &type, &proto, &fdobj))
         return -1;
 
-    /* Create a new socket */
-    if(fdobj == NULL || fdobj == Py_None)
-    {
-        fd = ioth_msocket(((struct stack_object*)stack)->stack, family, type, proto);
-        if(fd == -1)
-        {
-            PyErr_SetFromErrno(PyExc_OSError);
-            return -1;
-        }
-    }
-    /* Create a socket from an existing file descriptor */
-    else 
-    {
-        if (PyFloat_Check(fdobj)) {
-            PyErr_SetString(PyExc_TypeError, "integer argument expected, got float");
-            return -1;
-        }
-
-        fd = PyLong_AsLong(fdobj);
-        if (PyErr_Occurred())
-            return -1;
-        if (fd == -1) {
-            PyErr_SetString(PyExc_ValueError, "invalid file descriptor");
-            return -1;
-        }
-    }
+    fd = socket_fd_from_args(stack, family, type, proto, fdobj);
+    if (fd == -1)
+        return -1;
     
     if (init_sockobject(s, stack, fd, family, type, proto) == -1) {
         ioth_close(fd);
@@ -2479,18 +4903,122 @@ static PyObject*
 socket_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyObject *new;
+
+    iothpy_state* state = iothpy_get_state_by_type(type);
+    if (state == NULL)
+        return NULL;
+
     new = type->tp_alloc(type, 0);
 
     if (new != NULL) {
         socket_object* s = (socket_object*)new;
+        s->state = state;
         s->fd = -1;
         s->sock_timeout = _PyTime_FromSeconds(-1);
         s->stack = NULL;
+        s->io_refs = 0;
+        s->closed = 0;
+        s->addr_cache = NULL;
+        s->peer_cache = NULL;
+        s->peer_cache_len = 0;
     }
     
     return new;
 }
 
+/* 
+    Vectorcall constructor used when MSocketBase itself is called,
+    python subclasses go through tp_new and tp_init.
+*/
+static PyObject*
+socket_vectorcall(PyObject* type, PyObject* const* args, size_t nargsf, PyObject* kwnames)
+{
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    int family, socktype, proto;
+
+    if (!fastcall_check_nargs("MSocketBase", nargs, kwnames, 4, 5))
+        return NULL;
+
+    iothpy_state* state = iothpy_get_state_by_type((PyTypeObject*)type);
+    if (state == NULL)
+        return NULL;
+
+    if (!PyObject_TypeCheck(args[0], state->stack_type)) {
+        PyErr_SetString(PyExc_TypeError, "stack must be of type StackBase");
+        return NULL;
+    }
+
+    if (!fastcall_int(args[1], &family) || !fastcall_int(args[2], &socktype) ||
+        !fastcall_int(args[3], &proto))
+        return NULL;
+
+    int fd = socket_fd_from_args(args[0], family, socktype, proto, nargs > 4 ? args[4] : NULL);
+    if (fd == -1)
+        return NULL;
+
+    return socket_from_fd((PyTypeObject*)type, args[0], fd, family, socktype, proto);
+}
+
+/*
+    Create a socket object of the given type (MSocketBase or a subclass)
+    wrapping an already open file descriptor. The python constructor is
+    not called, the object is initialized exactly as MSocketBase.__init__
+    would do. The socket takes ownership of fd, which is closed on failure.
+*/
+PyObject*
+socket_from_fd(PyTypeObject* type, PyObject* stack, int fd, int family, int socktype, int proto)
+{
+    PyObject* new = socket_new(type, NULL, NULL);
+    if (new == NULL) {
+        ioth_close(fd);
+        return NULL;
+    }
+
+    if (init_sockobject((socket_object*)new, stack, fd, family, socktype, proto) == -1) {
+        /* The finalizer closes fd */
+        Py_DECREF(new);
+        return NULL;
+    }
+
+    return new;
+}
+
+/*
+    Create the socket object for a connection accepted on the listening
+    socket s, with the same type as s. The python constructor of MSocket
+    subclasses is skipped. nonblock_inherited tells that fd could have
+    inherited O_NONBLOCK from the listening fd, blocking sockets are then
+    put back in blocking mode. Takes ownership of fd.
+*/
+PyObject*
+socket_from_accepted_fd(socket_object* s, int fd, int nonblock_inherited)
+{
+    PyObject* sock = socket_from_fd(Py_TYPE(s), s->stack, fd,
+                                    s->family, s->type, s->proto);
+    if (sock == NULL)
+        return NULL;
+
+    /* Issue #7995: if no default timeout is set and the listening
+       socket had a (non-zero) timeout, force the new socket in blocking
+       mode to override platform-specific socket flags inheritance. */
+    socket_object* conn = (socket_object*)sock;
+    int force_blocking = 0;
+    if (get_defaulttimeout(s->state) < 0 && s->sock_timeout > 0) {
+        conn->sock_timeout = _PyTime_FromSeconds(-1);
+        force_blocking = 1;
+    }
+    else if (nonblock_inherited && conn->sock_timeout < 0) {
+        force_blocking = 1;
+    }
+
+    if (force_blocking && internal_setblocking(conn, 1) == -1) {
+        Py_DECREF(sock);
+        return NULL;
+    }
+
+    return sock;
+}
+
 static void
 socket_finalize(socket_object* s)
 {
@@ -2499,6 +5027,16 @@ socket_finalize(socket_object* s)
     PyErr_Fetch(&error_type, &error_value, &error_traceback);
 
     Py_XDECREF(s->stack);
+    clear_addr_cache(s);
+    PyMem_Free(s->rbuf);
+    s->rbuf = NULL;
+    if (s->cork != NULL) {
+        cork_free(s->cork);
+        s->cork = NULL;
+    }
+    wqueue_free(s);
+    pacer_free(s->pacer);
+    s->pacer = NULL;
     if (s->fd != -1) {
         ioth_close(s->fd);
         s->fd = -1;
@@ -2515,60 +5053,42 @@ static PyMemberDef socket_memberlist[] = {
        {"type", T_INT, offsetof(socket_object, type), READONLY, "the socket type"},
        {"proto", T_INT, offsetof(socket_object, proto), READONLY, "the socket protocol"},
        {"stack", T_OBJECT_EX, offsetof(socket_object, stack), READONLY, "the stack of the socket"},
+       {"_io_refs", T_INT, offsetof(socket_object, io_refs), 0, "number of makefile() objects using the socket"},
+       {"_closed", T_BOOL, offsetof(socket_object, closed), 0, "true if close() was called on the socket"},
        {0},
 };
 
 
 PyDoc_STRVAR(socket_doc, "Test documentation for MSocketBase type");
 
-PyTypeObject socket_type = {
-    PyVarObject_HEAD_INIT(0, 0)    /* Must fill in type value later */
-    "_iothpy.MSocketBase",                    /* tp_name */
-    sizeof(socket_object),                      /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    (destructor)socket_dealloc,                 /* tp_dealloc */
-    0,                                          /* tp_vectorcall_offset */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_as_async */
-    (reprfunc)socket_repr,                      /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
-    socket_doc,                                 /* tp_doc */
-    0,                                          /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    0,                                          /* tp_iter */
-    0,                                          /* tp_iternext */
-    socket_methods,                             /* tp_methods */
-    socket_memberlist,                          /* tp_members */
-    0,                                          /* tp_getset */
-    0,                                          /* tp_base */
-    0,                                          /* tp_dict */
-    0,                                          /* tp_descr_get */
-    0,                                          /* tp_descr_set */
-    0,                                          /* tp_dictoffset */
-    socket_initobj,                             /* tp_init */
-    PyType_GenericAlloc,                        /* tp_alloc */
-    socket_new,                                 /* tp_new */
-    PyObject_Del,                               /* tp_free */
-    0,                                          /* tp_is_gc */
-    0,                                          /* tp_bases */
-    0,                                          /* tp_mro */
-    0,                                          /* tp_cache */
-    0,                                          /* tp_subclasses */
-    0,                                          /* tp_weaklist */
-    0,                                          /* tp_del */
-    0,                                          /* tp_version_tag */
-    (destructor)socket_finalize,                /* tp_finalize */
+static PyType_Slot socket_slots[] = {
+    {Py_tp_dealloc, socket_dealloc},
+    {Py_tp_repr, socket_repr},
+    {Py_tp_doc, (void*)socket_doc},
+    {Py_tp_methods, socket_methods},
+    {Py_tp_members, socket_memberlist},
+    {Py_tp_init, socket_initobj},
+    {Py_tp_new, socket_new},
+    {Py_tp_finalize, socket_finalize},
+    {0, NULL}
+};
+
+static PyType_Spec socket_spec = {
+    .name = "_iothpy.MSocketBase",
+    .basicsize = sizeof(socket_object),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = socket_slots,
 };
 
+PyTypeObject*
+socket_type_create(PyObject* module)
+{
+    PyTypeObject* type = (PyTypeObject*)PyType_FromModuleAndSpec(module, &socket_spec, NULL);
+    if (type == NULL)
+        return NULL;
+
+    /* There is no slot for the vectorcall constructor before Python 3.14 */
+    type->tp_vectorcall = socket_vectorcall;
+    return type;
+}
+
@@ -1,9 +1,37 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include "utils.h"
+#include "iothpy.h"
+
+struct cork;
+struct wqueue;
+struct pacer;
+
+/* Number of entries of the per-socket cache of parsed address tuples */
+#define ADDR_CACHE_SIZE 8
+
+struct addr_cache_entry {
+    PyObject* key;              /* The address tuple, NULL if the entry is empty */
+    sockaddr_union addr;
+    socklen_t addrlen;
+};
+
+/* Number of entries of the per-socket LRU of peer address tuples */
+#define PEER_CACHE_SIZE 16
+
+struct peer_cache_entry {
+    sockaddr_union addr;
+    socklen_t addrlen;
+    PyObject* tuple;            /* The (host, port) tuple returned for addr */
+};
+
 typedef struct socket_object 
 {
     PyObject_HEAD
+    /* State of the module that created the socket type */
+    iothpy_state* state;
+
     /* 
         Python object representing the stack to which the socket belongs 
         The socket increses the reference count of the stack on creation
@@ -21,14 +49,117 @@ typedef struct socket_object
     int proto;
 
     _PyTime_t sock_timeout;     /* Operation timeout in seconds */
+    _PyTime_t sock_deadline;    /* Monotonic deadline of set_deadline(), 0 if none */
+    char fd_nonblocking;        /* The fd is O_NONBLOCK, blocking sockets wait with poll() */
+
+    /* State of the python MSocket wrapper, kept here so that sockets
+       created from C (accept, Stack.socket) don't need its constructor */
+    int io_refs;                /* Number of makefile() objects */
+    char closed;                /* close() was called */
+
+    /* Cache of the tuples passed to sendto, allocated on first use */
+    struct addr_cache_entry* addr_cache;
+
+    /* LRU of the addresses returned by recvfrom, most recent first, allocated on first use */
+    struct peer_cache_entry* peer_cache;
+    int peer_cache_len;
+
+    /* Read-ahead buffer of the framing methods, allocated on first use.
+       The bytes between rbuf_start and rbuf_end were received and not yet
+       returned, recv(), recv_into() and recvfrom() return them first. */
+    char* rbuf;
+    Py_ssize_t rbuf_size;
+    Py_ssize_t rbuf_start;
+    Py_ssize_t rbuf_end;
+    int rbuf_busy;              /* A thread is using the buffer without the GIL */
+    Py_ssize_t readahead;       /* Size of the receives of the small recv() calls, 0 if disabled */
+
+    /* Write coalescing of set_cork(), allocated on first use */
+    struct cork* cork;
+
+    /* Write queue of queue_write(), allocated on first use */
+    struct wqueue* wqueue;
+
+    /* Rate limits of set_pacing(), allocated on first use */
+    struct pacer* pacer;
     
 } socket_object;
 
-extern PyTypeObject socket_type;
-extern PyObject *socket_timeout;
-extern _PyTime_t defaulttimeout;
+/*
+    Operations run by sock_call() without the GIL, also used by the I/O ring.
+    They return 0 with errno set on failure.
+*/
+struct sock_accept_ctx {
+    socklen_t* addrlen;
+    struct sockaddr* addrbuf;
+    int result;
+};
+
+struct sock_recv {
+    char *cbuf;
+    Py_ssize_t len;
+    int flags;
+    Py_ssize_t result;
+};
+
+struct sock_send_ctx {
+    char *buf;
+    Py_ssize_t len;
+    int flags;
+    Py_ssize_t result;
+};
+
+int sock_accept_impl(socket_object* s, void *data);
+int sock_recv_impl(socket_object* s, void *data);
+int sock_send_impl(socket_object* s, void *data);
+int sock_connect_impl(socket_object* s, void* data);
+
+/*
+    Call sock_func without the GIL, waiting up to timeout for the socket to
+    be ready (writable if writing). The wait is cut short by the deadline
+    of the socket and by the one of the deadline() scope of the caller.
+    With err NULL a failure raises an exception, otherwise *err is set to
+    the errno of the failure, to EWOULDBLOCK on timeout or to -1 if an
+    exception was raised.
+*/
+int sock_call(socket_object *s, int writing, int (*sock_func) (socket_object* s, void *data),
+              void *data, int connect, int *err, _PyTime_t timeout);
+
+/*
+    Copy to cbuf the bytes waiting in the read-ahead buffer of the socket,
+    consuming them unless flags has MSG_PEEK. Returns the number of bytes
+    copied, 0 if there are none, or -1 raising an exception.
+*/
+Py_ssize_t rbuf_read(socket_object* s, char* cbuf, Py_ssize_t len, int flags);
+
+/*
+    Put len bytes of buf back in front of the read-ahead buffer of the
+    socket, to be returned first by the next receive. Returns -1 raising
+    an exception.
+*/
+int rbuf_unread(socket_object* s, const char* buf, Py_ssize_t len);
+
+/*
+    Nanoseconds before a send of len bytes on the socket is allowed by its
+    pacing, 0 if it is now or the socket is not paced. For the callers that
+    can't sleep and must not wait for the socket to be writable meanwhile.
+*/
+long long sock_pacing_delay(socket_object* s, size_t len);
+
+/*
+    Make the fd of a blocking socket non-blocking, the socket stays blocking
+    and from then on sock_call() waits on poll() instead of blocking in the
+    stack. For the socket under a deadline and the operations of the I/O
+    ring. Returns -1 raising an exception.
+*/
+int internal_fd_nonblocking(socket_object* s);
 
+int internal_setblocking(socket_object* s, int block);
+int get_sockaddr_from_tuple(char* func_name, socket_object* s, PyObject* args, struct sockaddr* sockaddr, socklen_t* len);
 int socket_parse_timeout(_PyTime_t *timeout, PyObject *timeout_obj);
+int socket_fd_from_args(PyObject* stack, int family, int type, int proto, PyObject* fdobj);
+PyObject* socket_from_fd(PyTypeObject* type, PyObject* stack, int fd, int family, int socktype, int proto);
+PyObject* socket_from_accepted_fd(socket_object* s, int fd, int nonblock_inherited);
 int get_CMSG_LEN(size_t length, size_t *result);
 int get_CMSG_SPACE(size_t length, size_t *result);
 
@@ -22,6 +22,8 @@
 #include "utils.h"
 #include "iothpy_stack.h"
 #include "iothpy_socket.h"
+#include "iothpy_acceptor.h"
+#include "iothpy_pool.h"
 
 
 #ifndef _GNU_SOURCE
@@ -52,8 +54,10 @@ stack_dealloc(stack_object* self)
         return;
     }
 
+    /* Instances of heap types own a reference to their type */
     PyTypeObject* tp = Py_TYPE(self);
     tp->tp_free(self);
+    Py_DECREF(tp);
 }
 
 static void 
@@ -92,10 +96,15 @@ stack_str(stack_object* self)
 static PyObject*
 stack_new(PyTypeObject* type, PyObject* args, PyObject *kwargs)
 {
+    iothpy_state* state = iothpy_get_state_by_type(type);
+    if(state == NULL)
+        return NULL;
+
     PyObject* new = type->tp_alloc(type, 0);
 
     stack_object* self = (stack_object*)new;
     if(self != NULL) {
+        self->state = state;
         self->stack = NULL;
         self->stack_dns = NULL;
     }
@@ -117,31 +126,20 @@ static int stack_dns_init(stack_object* self, char* config){
     return 0;
 }
 
+/* Initialize the stack, shared by tp_init and the vectorcall constructor */
 static int
-stack_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
+stack_init_impl(stack_object* s, const char* stack_name, PyObject* vdeurl, char* config_dns)
 {
-    stack_object* s = (stack_object*)self;
-
-    PyObject* vdeurl = NULL;
-
-    char* config_dns = NULL;
-    char* stack_name = NULL;
-
     const char** urls = NULL;
     const char* single_url_buf[2];
     const char** multi_url_buf = NULL;
 
-    if(!PyArg_ParseTuple(args, "s|Oz", &stack_name, &vdeurl, &config_dns)){
-        PyErr_SetFromErrno(PyExc_OSError);
-        return -1;
-    }
-
     if(stack_dns_init(s, config_dns) < 0) {
         PyErr_SetFromErrno(PyExc_OSError);
         return -1;
     }
 
-    if(vdeurl == Py_None){
+    if(vdeurl == NULL || vdeurl == Py_None){
         /*stack interface in configuration string */
         s->stack = ioth_newstackc(stack_name);
     }
@@ -194,6 +192,58 @@ stack_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
     return 0;
 }
 
+static int
+stack_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* vdeurl = NULL;
+
+    char* config_dns = NULL;
+    char* stack_name = NULL;
+
+    if(!PyArg_ParseTuple(args, "s|Oz", &stack_name, &vdeurl, &config_dns)){
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    return stack_init_impl((stack_object*)self, stack_name, vdeurl, config_dns);
+}
+
+/* 
+    Vectorcall constructor used when StackBase itself is called,
+    python subclasses go through tp_new and tp_init.
+*/
+static PyObject*
+stack_vectorcall(PyObject* type, PyObject* const* args, size_t nargsf, PyObject* kwnames)
+{
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    const char* stack_name;
+    char* config_dns = NULL;
+
+    if(!fastcall_check_nargs("StackBase", nargs, kwnames, 1, 3))
+        return NULL;
+
+    stack_name = PyUnicode_AsUTF8(args[0]);
+    if(stack_name == NULL)
+        return NULL;
+
+    if(nargs > 2 && args[2] != Py_None) {
+        config_dns = (char*)PyUnicode_AsUTF8(args[2]);
+        if(config_dns == NULL)
+            return NULL;
+    }
+
+    PyObject* new = stack_new((PyTypeObject*)type, NULL, NULL);
+    if(new == NULL)
+        return NULL;
+
+    if(stack_init_impl((stack_object*)new, stack_name, nargs > 1 ? args[1] : NULL, config_dns) < 0) {
+        Py_DECREF(new);
+        return NULL;
+    }
+
+    return new;
+}
+
 
 PyDoc_STRVAR(if_nameindex_doc, "if_nameindex()\n\
 \n\
@@ -1062,6 +1112,125 @@ static PyObject* dns_getnameinfo(PyObject* self, PyObject *args){
 }
 
 
+PyDoc_STRVAR(stack_socket_doc, "socket(family=AF_INET, type=SOCK_STREAM, proto=0, fileno=None)\n\
+\n\
+Create and return a new socket on this stack.\n\
+This method takes the same parameters as the builtin socket.socket() function.\n\
+The socket is an instance of the _socket_class attribute of the stack class\n\
+(MSocket for Stack objects), created without calling its constructor.");
+
+static PyObject*
+stack_socket(stack_object* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* kwlist[] = {"family", "type", "proto", "fileno", NULL};
+    PyObject* argv[4];
+
+    int family = -1;
+    int type = -1;
+    int proto = -1;
+    PyObject* fdobj;
+
+    if(!self->stack) 
+    {
+        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
+        return NULL;
+    }
+
+    if(!fastcall_unpack("socket", args, nargs, kwnames, kwlist, 0, argv))
+        return NULL;
+    if(argv[0] != NULL && !fastcall_int(argv[0], &family))
+        return NULL;
+    if(argv[1] != NULL && !fastcall_int(argv[1], &type))
+        return NULL;
+    if(argv[2] != NULL && !fastcall_int(argv[2], &proto))
+        return NULL;
+    fdobj = argv[3];
+
+    if(fdobj == NULL || fdobj == Py_None) {
+        if(family == -1)
+            family = AF_INET;
+        if(type == -1)
+            type = SOCK_STREAM;
+        if(proto == -1)
+            proto = 0;
+    }
+
+    /* Find the class of the new socket, the lookup goes through the type attribute cache */
+    PyTypeObject* cls = self->state->socket_type;
+    PyObject* attr = _PyType_Lookup(Py_TYPE(self), self->state->socket_class_name);
+    if(attr != NULL && PyType_Check(attr) && PyType_IsSubtype((PyTypeObject*)attr, cls))
+        cls = (PyTypeObject*)attr;
+
+    int fd = socket_fd_from_args((PyObject*)self, family, type, proto, fdobj);
+    if(fd == -1)
+        return NULL;
+
+    return socket_from_fd(cls, (PyObject*)self, fd, family, type, proto);
+}
+
+PyDoc_STRVAR(stack_accept_loop_doc, "accept_loop(sock, threads=1, queue_size=1024) -> AcceptLoop\n\
+\n\
+Accept the connections of the listening socket sock on native threads,\n\
+without taking the GIL for each connection. Use accept_many() of the\n\
+returned AcceptLoop to get the accepted sockets in batches and close()\n\
+to stop the threads. At most queue_size connections are kept waiting.");
+
+static PyObject*
+stack_accept_loop(stack_object* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"sock", "threads", "queue_size", NULL};
+    PyObject* argv[3];
+    int threads = 1;
+    Py_ssize_t queue_size = 1024;
+
+    if(!fastcall_unpack("accept_loop", args, nargs, kwnames, kwlist, 1, argv))
+        return NULL;
+    if(argv[1] != NULL && !fastcall_int(argv[1], &threads))
+        return NULL;
+    if(argv[2] != NULL && !fastcall_ssize_t(argv[2], &queue_size))
+        return NULL;
+
+    return acceptor_create((PyObject*)self, argv[0], threads, queue_size);
+}
+
+PyDoc_STRVAR(stack_connection_pool_doc, "connection_pool(max_per_host=8, idle_timeout=60.0, family=AF_INET) -> ConnectionPool\n\
+\n\
+Return a pool of keep-alive TCP connections of the stack. acquire()\n\
+reuses an idle connection to the same address when there is one still\n\
+open, release() keeps up to max_per_host idle connections per address\n\
+for at most idle_timeout seconds (None for no limit).");
+
+static PyObject*
+stack_connection_pool(stack_object* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"max_per_host", "idle_timeout", "family", NULL};
+    PyObject* argv[3];
+    Py_ssize_t max_per_host = 8;
+    int family = AF_INET;
+
+    if(!fastcall_unpack("connection_pool", args, nargs, kwnames, kwlist, 0, argv))
+        return NULL;
+    if(argv[0] != NULL && !fastcall_ssize_t(argv[0], &max_per_host))
+        return NULL;
+    if(argv[2] != NULL && !fastcall_int(argv[2], &family))
+        return NULL;
+
+    PyObject* idle_timeout = argv[1];
+    if(idle_timeout == NULL) {
+        idle_timeout = PyFloat_FromDouble(60.0);
+        if(idle_timeout == NULL)
+            return NULL;
+    }
+    else {
+        Py_INCREF(idle_timeout);
+    }
+
+    PyObject* pool = pool_create((PyObject*)self, max_per_host, idle_timeout, family);
+    Py_DECREF(idle_timeout);
+    return pool;
+}
+
+
 static PyMethodDef stack_methods[] = {
     /* Listing network interfaces */
     {"if_nameindex", (PyCFunction)stack_if_nameindex, METH_NOARGS, if_nameindex_doc},
@@ -1082,6 +1251,11 @@ static PyMethodDef stack_methods[] = {
     {"iproute_add", (PyCFunction)stack_iproute_add, METH_VARARGS | METH_KEYWORDS, iproute_add_doc},
     {"iproute_del", (PyCFunction)stack_iproute_del, METH_VARARGS | METH_KEYWORDS, iproute_del_doc},
 
+    /* Sockets */
+    {"socket", (PyCFunction)(void(*)(void))stack_socket, METH_FASTCALL | METH_KEYWORDS, stack_socket_doc},
+    {"accept_loop", (PyCFunction)(void(*)(void))stack_accept_loop, METH_FASTCALL | METH_KEYWORDS, stack_accept_loop_doc},
+    {"connection_pool", (PyCFunction)(void(*)(void))stack_connection_pool, METH_FASTCALL | METH_KEYWORDS, stack_connection_pool_doc},
+
     /* Iothconf */
     {"ioth_config", (PyCFunction)stack_ioth_config, METH_VARARGS, ioth_config_doc},
     {"ioth_resolvconf", (PyCFunction)stack_ioth_resolvconf, METH_VARARGS, ioth_resolvconf_doc},
@@ -1104,54 +1278,34 @@ PyDoc_STRVAR(stack_doc,
 This class is used internally as a base type for the Stack class\n\
 ");
 
-PyTypeObject stack_type = {
-  PyVarObject_HEAD_INIT(0, 0)                 /* Must fill in type value later */
-    "_iothpy.StackBase",                             /* tp_name */
-    sizeof(stack_object),                       /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    (destructor)stack_dealloc,                  /* tp_dealloc */
-    0,                                          /* tp_vectorcall_offset */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_as_async */
-    (reprfunc)stack_repr,                       /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    (reprfunc)stack_str,                        /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
-    stack_doc,                                  /* tp_doc */
-    0,                                          /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    0,                                          /* tp_iter */
-    0,                                          /* tp_iternext */
-    stack_methods,                              /* tp_methods */
-    0,                                          /* tp_members */
-    0,                                          /* tp_getset */
-    0,                                          /* tp_base */
-    0,                                          /* tp_dict */
-    0,                                          /* tp_descr_get */
-    0,                                          /* tp_descr_set */
-    0,                                          /* tp_dictoffset */
-    stack_initobj,                              /* tp_init */
-    PyType_GenericAlloc,                        /* tp_alloc */
-    stack_new,                                  /* tp_new */
-    PyObject_Del,                               /* tp_free */
-    0,                                          /* tp_is_gc */
-    0,                                          /* tp_bases */
-    0,                                          /* tp_mro */
-    0,                                          /* tp_cache */
-    0,                                          /* tp_subclasses */
-    0,                                          /* tp_weaklist */
-    0,                                          /* tp_del */
-    0,                                          /* tp_version_tag */
-    (destructor)stack_finalize,                 /* tp_finalize */
+static PyType_Slot stack_slots[] = {
+    {Py_tp_dealloc, stack_dealloc},
+    {Py_tp_repr, stack_repr},
+    {Py_tp_str, stack_str},
+    {Py_tp_doc, (void*)stack_doc},
+    {Py_tp_methods, stack_methods},
+    {Py_tp_init, stack_initobj},
+    {Py_tp_new, stack_new},
+    {Py_tp_finalize, stack_finalize},
+    {0, NULL}
 };
 
+static PyType_Spec stack_spec = {
+    .name = "_iothpy.StackBase",
+    .basicsize = sizeof(stack_object),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = stack_slots,
+};
+
+PyTypeObject*
+stack_type_create(PyObject* module)
+{
+    PyTypeObject* type = (PyTypeObject*)PyType_FromModuleAndSpec(module, &stack_spec, NULL);
+    if(type == NULL)
+        return NULL;
+
+    /* There is no slot for the vectorcall constructor before Python 3.14 */
+    type->tp_vectorcall = stack_vectorcall;
+    return type;
+}
+
@@ -5,10 +5,11 @@
 #include <iothconf.h>
 #include <iothdns.h>
 
+#include "iothpy.h"
+
 typedef struct stack_object {
     PyObject_HEAD
+    iothpy_state* state;        /* State of the module that created the stack type */
     struct ioth* stack;
     struct iothdns* stack_dns;
 } stack_object;
-
-extern PyTypeObject stack_type;
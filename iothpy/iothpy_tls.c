@@ -0,0 +1,753 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_socket.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+
+/*
+    TLS on an ioth socket. The ssl module can't wrap a socket that is not a
+    kernel one, so the connection runs on an ssl.SSLObject with memory BIOs:
+    the ciphertext the SSL object writes to the outgoing BIO is sent on the
+    socket and the one received is written to the incoming BIO. The pumping
+    is done here, retrying the SSL operations on SSLWantReadError without
+    going back to python, and the SSL operations call the _ssl object under
+    the SSLObject directly, skipping the python methods of SSLObject.
+*/
+
+/* Ciphertext received at once, more than a record of the largest size */
+#define TLS_FILL_SIZE (32 * 1024)
+
+/* Plaintext written at once by sendall(), bounding the ciphertext buffered */
+#define TLS_WRITE_SIZE (64 * 1024)
+
+/* Values of the errno attribute of SSLWantReadError and SSLWantWriteError */
+#define TLS_ERROR_WANT_READ 2
+#define TLS_ERROR_WANT_WRITE 3
+
+typedef struct tls_object {
+    PyObject_HEAD
+    iothpy_state* state;
+    PyObject* sock;
+    PyObject* ssl_object;       /* The ssl.SSLObject */
+    PyObject* incoming;         /* MemoryBIO of the ciphertext received */
+    PyObject* outgoing;         /* MemoryBIO of the ciphertext to send */
+
+    /* Bound methods called by the pump */
+    PyObject* ssl_read;
+    PyObject* ssl_write;
+    PyObject* ssl_handshake;
+    PyObject* ssl_shutdown;
+    PyObject* bio_write;
+    PyObject* bio_write_eof;
+    PyObject* bio_read;
+    PyObject* pending_name;     /* Interned "pending", the attribute of the incoming BIO */
+
+    /* Ciphertext read from the outgoing BIO and not yet sent, NULL if none */
+    PyObject* wpending;
+    Py_ssize_t woff;
+
+    int suppress_ragged_eofs;
+    int unwrapped;              /* unwrap() shut the TLS connection down */
+} tls_object;
+
+/* Import the ssl exceptions raised by the SSL object on first use */
+static int
+tls_import_errors(iothpy_state* state)
+{
+    int res = 0;
+
+    /* Threads of free-threaded builds can get here at the same time */
+    Py_BEGIN_CRITICAL_SECTION(state->tls_type);
+    if (state->ssl_eof == NULL) {
+        PyObject* ssl = PyImport_ImportModule("ssl");
+        if (ssl == NULL)
+            res = -1;
+        else {
+            state->ssl_want_read = PyObject_GetAttrString(ssl, "SSLWantReadError");
+            state->ssl_want_write = PyObject_GetAttrString(ssl, "SSLWantWriteError");
+            state->ssl_eof = PyObject_GetAttrString(ssl, "SSLEOFError");
+            Py_DECREF(ssl);
+            if (state->ssl_want_read == NULL || state->ssl_want_write == NULL || state->ssl_eof == NULL) {
+                Py_CLEAR(state->ssl_want_read);
+                Py_CLEAR(state->ssl_want_write);
+                Py_CLEAR(state->ssl_eof);
+                res = -1;
+            }
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+/*
+    Raise the error err of a sock_call() on the socket. A socket that would
+    block raises SSLWantReadError or SSLWantWriteError, as the non-blocking
+    sockets of the ssl module do.
+*/
+static int
+tls_sock_error(tls_object* self, int err, int writing)
+{
+    socket_object* s = (socket_object*)self->sock;
+
+    if (err == -1)
+        return -1;
+    if (err == EWOULDBLOCK || err == EAGAIN) {
+        if (s->sock_timeout > 0) {
+            PyErr_SetString(s->state->socket_timeout, "timed out");
+            return -1;
+        }
+        PyObject* exc = PyObject_CallFunction(writing ? self->state->ssl_want_write : self->state->ssl_want_read,
+                                              "is", writing ? TLS_ERROR_WANT_WRITE : TLS_ERROR_WANT_READ,
+                                              writing ? "The operation did not complete (write)"
+                                                      : "The operation did not complete (read)");
+        if (exc != NULL) {
+            PyErr_SetObject((PyObject*)Py_TYPE(exc), exc);
+            Py_DECREF(exc);
+        }
+        return -1;
+    }
+    errno = err;
+    PyErr_SetFromErrno(PyExc_OSError);
+    return -1;
+}
+
+/*
+    Send the ciphertext of the outgoing BIO. What can't be sent is kept and
+    sent first by the next flush. Returns -1 raising an exception.
+*/
+static int
+tls_flush(tls_object* self)
+{
+    socket_object* s = (socket_object*)self->sock;
+    PyObject* data;
+    Py_ssize_t off;
+    int err;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    data = self->wpending;
+    off = self->woff;
+    self->wpending = NULL;
+    Py_END_CRITICAL_SECTION();
+
+    while (1) {
+        if (data == NULL) {
+            data = PyObject_CallNoArgs(self->bio_read);
+            if (data == NULL)
+                return -1;
+            off = 0;
+        }
+        Py_ssize_t len = PyBytes_GET_SIZE(data);
+        if (len == 0)
+            break;
+
+        while (off < len) {
+            struct sock_send_ctx ctx;
+            ctx.buf = PyBytes_AS_STRING(data) + off;
+            ctx.len = len - off;
+            ctx.flags = 0;
+            if (sock_call(s, 1, sock_send_impl, &ctx, 0, &err, s->sock_timeout) < 0) {
+                Py_BEGIN_CRITICAL_SECTION(self);
+                Py_XSETREF(self->wpending, data);
+                self->woff = off;
+                Py_END_CRITICAL_SECTION();
+                return tls_sock_error(self, err, 1);
+            }
+            off += ctx.result;
+        }
+        Py_CLEAR(data);
+    }
+
+    Py_DECREF(data);
+    return 0;
+}
+
+/*
+    Receive ciphertext and write it to the incoming BIO, the end of file of
+    the socket is written as the end of file of the BIO. The bytes left in
+    the read-ahead buffer of the socket, by a STARTTLS exchange for example,
+    come first. Returns -1 raising an exception.
+*/
+static int
+tls_fill(tls_object* self)
+{
+    socket_object* s = (socket_object*)self->sock;
+    char buf[TLS_FILL_SIZE];
+    PyObject* res;
+    int err;
+
+    Py_ssize_t n = rbuf_read(s, buf, sizeof(buf), 0);
+    if (n < 0)
+        return -1;
+    if (n == 0) {
+        struct sock_recv ctx;
+        ctx.cbuf = buf;
+        ctx.len = sizeof(buf);
+        ctx.flags = 0;
+        if (sock_call(s, 0, sock_recv_impl, &ctx, 0, &err, s->sock_timeout) < 0)
+            return tls_sock_error(self, err, 0);
+        n = ctx.result;
+    }
+
+    if (n == 0)
+        res = PyObject_CallNoArgs(self->bio_write_eof);
+    else {
+        PyObject* view = PyMemoryView_FromMemory(buf, n, PyBUF_READ);
+        if (view == NULL)
+            return -1;
+        res = PyObject_CallOneArg(self->bio_write, view);
+        Py_DECREF(view);
+    }
+    if (res == NULL)
+        return -1;
+    Py_DECREF(res);
+    return 0;
+}
+
+/*
+    Call the SSL operation func until it completes, receiving when it wants
+    to read and sending what it writes. For reading the pending ciphertext
+    that can't be sent doesn't stop the operation.
+*/
+static PyObject*
+tls_do(tls_object* self, PyObject* func, PyObject* const* args, size_t nargs, int reading)
+{
+    PyObject* res;
+
+    if (self->unwrapped) {
+        PyErr_SetString(PyExc_ValueError, "the TLS connection was shut down with unwrap()");
+        return NULL;
+    }
+    if (self->wpending != NULL && tls_flush(self) < 0) {
+        if (!reading || !PyErr_ExceptionMatches(self->state->ssl_want_write))
+            return NULL;
+        PyErr_Clear();
+    }
+
+    while (1) {
+        res = PyObject_Vectorcall(func, args, nargs, NULL);
+        if (res != NULL)
+            break;
+
+        if (PyErr_ExceptionMatches(self->state->ssl_want_read)) {
+            PyErr_Clear();
+            /* A handshake writes its messages before waiting for the answer */
+            if (tls_flush(self) < 0 || tls_fill(self) < 0)
+                return NULL;
+        }
+        else if (PyErr_ExceptionMatches(self->state->ssl_want_write)) {
+            PyErr_Clear();
+            if (tls_flush(self) < 0)
+                return NULL;
+        }
+        else
+            return NULL;
+    }
+
+    if (tls_flush(self) < 0) {
+        if (!reading || !PyErr_ExceptionMatches(self->state->ssl_want_write)) {
+            Py_DECREF(res);
+            return NULL;
+        }
+        PyErr_Clear();
+    }
+    return res;
+}
+
+/* The end of file of a peer closing the connection without a close_notify */
+static int
+tls_ragged_eof(tls_object* self)
+{
+    if (!self->suppress_ragged_eofs || !PyErr_ExceptionMatches(self->state->ssl_eof))
+        return 0;
+    PyErr_Clear();
+    return 1;
+}
+
+static int
+tls_traverse(tls_object* self, visitproc visit, void* arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->sock);
+    Py_VISIT(self->ssl_object);
+    Py_VISIT(self->incoming);
+    Py_VISIT(self->outgoing);
+    Py_VISIT(self->ssl_read);
+    Py_VISIT(self->ssl_write);
+    Py_VISIT(self->ssl_handshake);
+    Py_VISIT(self->ssl_shutdown);
+    Py_VISIT(self->bio_write);
+    Py_VISIT(self->bio_write_eof);
+    Py_VISIT(self->bio_read);
+    Py_VISIT(self->pending_name);
+    return 0;
+}
+
+static int
+tls_clear(tls_object* self)
+{
+    Py_CLEAR(self->sock);
+    Py_CLEAR(self->ssl_object);
+    Py_CLEAR(self->incoming);
+    Py_CLEAR(self->outgoing);
+    Py_CLEAR(self->ssl_read);
+    Py_CLEAR(self->ssl_write);
+    Py_CLEAR(self->ssl_handshake);
+    Py_CLEAR(self->ssl_shutdown);
+    Py_CLEAR(self->bio_write);
+    Py_CLEAR(self->bio_write_eof);
+    Py_CLEAR(self->bio_read);
+    Py_CLEAR(self->pending_name);
+    Py_CLEAR(self->wpending);
+    return 0;
+}
+
+static void
+tls_dealloc(tls_object* self)
+{
+    PyTypeObject* tp = Py_TYPE(self);
+
+    /* The socket is closed by its own deallocation */
+    PyObject_GC_UnTrack(self);
+    tls_clear(self);
+
+    /* Instances of heap types own a reference to their type */
+    tp->tp_free((PyObject*)self);
+    Py_DECREF(tp);
+}
+
+static PyObject*
+tls_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    static char* kwlist[] = {"sock", "ssl_object", "incoming", "outgoing", "suppress_ragged_eofs", NULL};
+    PyObject *sock, *ssl_object, *incoming, *outgoing;
+    int suppress_ragged_eofs = 1;
+
+    iothpy_state* state = iothpy_get_state_by_type(type);
+    if (state == NULL)
+        return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOO|p:TLSSocketBase", kwlist, &sock, &ssl_object,
+                                     &incoming, &outgoing, &suppress_ragged_eofs))
+        return NULL;
+
+    if (!PyObject_TypeCheck(sock, state->socket_type)) {
+        PyErr_SetString(PyExc_TypeError, "TLSSocketBase() argument must be a socket");
+        return NULL;
+    }
+    if (tls_import_errors(state) < 0)
+        return NULL;
+
+    tls_object* self = (tls_object*)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->state = state;
+    Py_INCREF(sock);
+    self->sock = sock;
+    Py_INCREF(ssl_object);
+    self->ssl_object = ssl_object;
+    Py_INCREF(incoming);
+    self->incoming = incoming;
+    Py_INCREF(outgoing);
+    self->outgoing = outgoing;
+    self->suppress_ragged_eofs = suppress_ragged_eofs;
+
+    /* The methods of SSLObject are python wrappers of the ones of its _sslobj */
+    PyObject* sslobj = PyObject_GetAttrString(ssl_object, "_sslobj");
+    if (sslobj == NULL) {
+        PyErr_Clear();
+        Py_INCREF(ssl_object);
+        sslobj = ssl_object;
+    }
+    self->ssl_read = PyObject_GetAttrString(sslobj, "read");
+    self->ssl_write = PyObject_GetAttrString(sslobj, "write");
+    self->ssl_handshake = PyObject_GetAttrString(sslobj, "do_handshake");
+    self->ssl_shutdown = PyObject_GetAttrString(sslobj, sslobj == ssl_object ? "unwrap" : "shutdown");
+    Py_DECREF(sslobj);
+    if (self->ssl_read == NULL || self->ssl_write == NULL || self->ssl_handshake == NULL || self->ssl_shutdown == NULL)
+        goto error;
+
+    self->bio_write = PyObject_GetAttrString(incoming, "write");
+    self->bio_write_eof = PyObject_GetAttrString(incoming, "write_eof");
+    self->bio_read = PyObject_GetAttrString(outgoing, "read");
+    self->pending_name = PyUnicode_InternFromString("pending");
+    if (self->bio_write == NULL || self->bio_write_eof == NULL || self->bio_read == NULL ||
+        self->pending_name == NULL)
+        goto error;
+
+    return (PyObject*)self;
+
+error:
+    Py_DECREF(self);
+    return NULL;
+}
+
+PyDoc_STRVAR(tls_do_handshake_doc, "do_handshake()\n\
+\n\
+Perform the TLS handshake.");
+
+static PyObject*
+tls_do_handshake(tls_object* self, PyObject* Py_UNUSED(ignored))
+{
+    return tls_do(self, self->ssl_handshake, NULL, 0, 0);
+}
+
+/*
+    Decrypt up to len bytes into buf, waiting for the first ones. All the
+    records already received are decrypted, not only the first one, so that
+    a receive of a large buffer returns many small records at once. Returns
+    the number of bytes read, 0 at the end of file, -1 raising an exception.
+*/
+static Py_ssize_t
+tls_read(tls_object* self, char* buf, Py_ssize_t len)
+{
+    PyObject* args[2];
+    PyObject* res;
+    Py_ssize_t total = 0, n;
+
+    args[0] = PyLong_FromSsize_t(len);
+    if (args[0] == NULL)
+        return -1;
+    args[1] = PyMemoryView_FromMemory(buf, len, PyBUF_WRITE);
+    if (args[1] == NULL) {
+        Py_DECREF(args[0]);
+        return -1;
+    }
+    res = tls_do(self, self->ssl_read, args, 2, 1);
+    Py_DECREF(args[0]);
+    Py_DECREF(args[1]);
+    if (res == NULL)
+        return tls_ragged_eof(self) ? 0 : -1;
+    total = PyLong_AsSsize_t(res);
+    Py_DECREF(res);
+    if (total < 0)
+        return -1;
+
+    while (total > 0 && total < len) {
+        /* The rest of the last record was read, read on if there are more */
+        res = PyObject_GetAttr(self->incoming, self->pending_name);
+        if (res == NULL)
+            return -1;
+        n = PyLong_AsSsize_t(res);
+        Py_DECREF(res);
+        if (n <= 0) {
+            if (n < 0)
+                return -1;
+            break;
+        }
+
+        args[0] = PyLong_FromSsize_t(len - total);
+        if (args[0] == NULL)
+            return -1;
+        args[1] = PyMemoryView_FromMemory(buf + total, len - total, PyBUF_WRITE);
+        if (args[1] == NULL) {
+            Py_DECREF(args[0]);
+            return -1;
+        }
+        res = PyObject_Vectorcall(self->ssl_read, args, 2, NULL);
+        Py_DECREF(args[0]);
+        Py_DECREF(args[1]);
+        if (res == NULL) {
+            /* A partial record, or an error raised again by the next receive */
+            PyErr_Clear();
+            break;
+        }
+        n = PyLong_AsSsize_t(res);
+        Py_DECREF(res);
+        if (n <= 0) {
+            PyErr_Clear();
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+PyDoc_STRVAR(tls_recv_doc, "recv(bufsize[, flags]) -> data\n\
+\n\
+Receive up to bufsize bytes of decrypted data, an empty bytes object\n\
+when the peer closed the connection. flags must be 0.");
+
+static PyObject*
+tls_recv(tls_object* self, PyObject* const* args, Py_ssize_t nargs)
+{
+    Py_ssize_t len;
+    int flags = 0;
+
+    if (!fastcall_check_nargs("recv", nargs, NULL, 1, 2))
+        return NULL;
+    if (!fastcall_ssize_t(args[0], &len))
+        return NULL;
+    if (nargs > 1 && !fastcall_int(args[1], &flags))
+        return NULL;
+    if (flags != 0) {
+        PyErr_SetString(PyExc_ValueError, "non-zero flags not allowed in calls to recv() on TLSSocket");
+        return NULL;
+    }
+    if (len < 0) {
+        PyErr_SetString(PyExc_ValueError, "negative buffersize in recv");
+        return NULL;
+    }
+
+    PyObject* buf = PyBytes_FromStringAndSize(NULL, len);
+    if (buf == NULL)
+        return NULL;
+    if (len == 0)
+        return buf;
+
+    Py_ssize_t n = tls_read(self, PyBytes_AS_STRING(buf), len);
+    if (n < 0) {
+        Py_DECREF(buf);
+        return NULL;
+    }
+    if (n != len)
+        _PyBytes_Resize(&buf, n);
+    return buf;
+}
+
+PyDoc_STRVAR(tls_recv_into_doc, "recv_into(buffer, [nbytes[, flags]]) -> nbytes_read\n\
+\n\
+Receive up to nbytes bytes of decrypted data into buffer, all of its\n\
+length if nbytes is 0 or not given. flags must be 0.");
+
+static PyObject*
+tls_recv_into(tls_object* self, PyObject* const* args, Py_ssize_t nargs)
+{
+    Py_ssize_t len = 0;
+    int flags = 0;
+    Py_buffer pbuf;
+
+    if (!fastcall_check_nargs("recv_into", nargs, NULL, 1, 3))
+        return NULL;
+    if (nargs > 1 && !fastcall_ssize_t(args[1], &len))
+        return NULL;
+    if (nargs > 2 && !fastcall_int(args[2], &flags))
+        return NULL;
+    if (flags != 0) {
+        PyErr_SetString(PyExc_ValueError, "non-zero flags not allowed in calls to recv_into() on TLSSocket");
+        return NULL;
+    }
+    if (!fastcall_rwbuffer(args[0], &pbuf))
+        return NULL;
+    if (len < 0 || len > pbuf.len) {
+        PyBuffer_Release(&pbuf);
+        PyErr_SetString(PyExc_ValueError, len < 0 ? "negative buffersize in recv_into"
+                                                  : "buffer too small for requested bytes");
+        return NULL;
+    }
+    if (len == 0)
+        len = pbuf.len;
+
+    Py_ssize_t n = len == 0 ? 0 : tls_read(self, pbuf.buf, len);
+    PyBuffer_Release(&pbuf);
+    if (n < 0)
+        return NULL;
+    return PyLong_FromSsize_t(n);
+}
+
+/* Encrypt and send len bytes of buf, returns -1 raising an exception */
+static Py_ssize_t
+tls_write(tls_object* self, char* buf, Py_ssize_t len)
+{
+    PyObject* view = PyMemoryView_FromMemory(buf, len, PyBUF_READ);
+    if (view == NULL)
+        return -1;
+    PyObject* res = tls_do(self, self->ssl_write, &view, 1, 0);
+    Py_DECREF(view);
+    if (res == NULL)
+        return -1;
+    Py_ssize_t n = PyLong_AsSsize_t(res);
+    Py_DECREF(res);
+    return n;
+}
+
+static int
+tls_check_send_flags(const char* fname, int flags)
+{
+    if (flags == 0)
+        return 1;
+    PyErr_Format(PyExc_ValueError, "non-zero flags not allowed in calls to %s() on TLSSocket", fname);
+    return 0;
+}
+
+PyDoc_STRVAR(tls_send_doc, "send(data[, flags]) -> count\n\
+\n\
+Encrypt and send data, returning the number of bytes sent. On a\n\
+non-blocking socket the ciphertext that the socket can't take is sent\n\
+by the next operation. flags must be 0.");
+
+static PyObject*
+tls_send(tls_object* self, PyObject* const* args, Py_ssize_t nargs)
+{
+    int flags = 0;
+    Py_buffer pbuf;
+
+    if (!fastcall_check_nargs("send", nargs, NULL, 1, 2))
+        return NULL;
+    if (nargs > 1 && !fastcall_int(args[1], &flags))
+        return NULL;
+    if (!tls_check_send_flags("send", flags))
+        return NULL;
+    if (!fastcall_buffer(args[0], &pbuf))
+        return NULL;
+
+    Py_ssize_t n = tls_write(self, pbuf.buf, Py_MIN(pbuf.len, TLS_WRITE_SIZE));
+    if (n < 0 && PyErr_ExceptionMatches(self->state->ssl_want_write)) {
+        /* The data was encrypted, the ciphertext waits for the next operation */
+        PyErr_Clear();
+        n = Py_MIN(pbuf.len, TLS_WRITE_SIZE);
+    }
+    PyBuffer_Release(&pbuf);
+    if (n < 0)
+        return NULL;
+    return PyLong_FromSsize_t(n);
+}
+
+PyDoc_STRVAR(tls_sendall_doc, "sendall(data[, flags])\n\
+\n\
+Encrypt and send all of data. If an error occurs, it's impossible to\n\
+tell how much data has been sent. flags must be 0.");
+
+static PyObject*
+tls_sendall(tls_object* self, PyObject* const* args, Py_ssize_t nargs)
+{
+    int flags = 0;
+    Py_buffer pbuf;
+
+    if (!fastcall_check_nargs("sendall", nargs, NULL, 1, 2))
+        return NULL;
+    if (nargs > 1 && !fastcall_int(args[1], &flags))
+        return NULL;
+    if (!tls_check_send_flags("sendall", flags))
+        return NULL;
+    if (!fastcall_buffer(args[0], &pbuf))
+        return NULL;
+
+    Py_ssize_t off = 0;
+    while (off < pbuf.len) {
+        Py_ssize_t n = tls_write(self, (char*)pbuf.buf + off, Py_MIN(pbuf.len - off, TLS_WRITE_SIZE));
+        if (n < 0) {
+            PyBuffer_Release(&pbuf);
+            return NULL;
+        }
+        off += n;
+    }
+    PyBuffer_Release(&pbuf);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(tls_unwrap_doc, "unwrap() -> socket\n\
+\n\
+Shut the TLS connection down and return the underlying socket, which\n\
+can be used for cleartext again. The bytes received after the\n\
+close_notify of the peer are returned first by its receive methods.");
+
+static PyObject*
+tls_unwrap(tls_object* self, PyObject* Py_UNUSED(ignored))
+{
+    PyObject* res = tls_do(self, self->ssl_shutdown, NULL, 0, 0);
+    if (res == NULL)
+        return NULL;
+    Py_DECREF(res);
+
+    /* The cleartext the peer sent after its close_notify may have been received with it */
+    PyObject* rest = PyObject_CallMethod(self->incoming, "read", NULL);
+    if (rest == NULL)
+        return NULL;
+    int err = rbuf_unread((socket_object*)self->sock, PyBytes_AS_STRING(rest), PyBytes_GET_SIZE(rest));
+    Py_DECREF(rest);
+    if (err < 0)
+        return NULL;
+
+    self->unwrapped = 1;
+    Py_INCREF(self->sock);
+    return self->sock;
+}
+
+static PyObject*
+tls_get_socket(tls_object* self, void* closure)
+{
+    Py_INCREF(self->sock);
+    return self->sock;
+}
+
+static PyObject*
+tls_get_ssl_object(tls_object* self, void* closure)
+{
+    Py_INCREF(self->ssl_object);
+    return self->ssl_object;
+}
+
+static PyObject*
+tls_get_suppress_ragged_eofs(tls_object* self, void* closure)
+{
+    return PyBool_FromLong(self->suppress_ragged_eofs);
+}
+
+static PyMethodDef tls_methods[] = {
+    {"do_handshake", (PyCFunction)tls_do_handshake, METH_NOARGS, tls_do_handshake_doc},
+    {"recv", (PyCFunction)(void(*)(void))tls_recv, METH_FASTCALL, tls_recv_doc},
+    {"recv_into", (PyCFunction)(void(*)(void))tls_recv_into, METH_FASTCALL, tls_recv_into_doc},
+    {"send", (PyCFunction)(void(*)(void))tls_send, METH_FASTCALL, tls_send_doc},
+    {"sendall", (PyCFunction)(void(*)(void))tls_sendall, METH_FASTCALL, tls_sendall_doc},
+    {"unwrap", (PyCFunction)tls_unwrap, METH_NOARGS, tls_unwrap_doc},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef tls_getset[] = {
+    {"socket", (getter)tls_get_socket, NULL, "the underlying ioth socket", NULL},
+    {"ssl_object", (getter)tls_get_ssl_object, NULL, "the ssl.SSLObject of the connection", NULL},
+    {"suppress_ragged_eofs", (getter)tls_get_suppress_ragged_eofs, NULL,
+     "true if an end of file without close_notify reads as an end of file", NULL},
+    {NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(tls_doc,
+"TLSSocketBase(sock, ssl_object, incoming, outgoing, suppress_ragged_eofs=True)\n\
+\n\
+TLS connection on an ioth socket through the memory BIOs of ssl_object,\n\
+see iothpy.tls.wrap_socket()");
+
+static PyType_Slot tls_slots[] = {
+    {Py_tp_dealloc, tls_dealloc},
+    {Py_tp_traverse, tls_traverse},
+    {Py_tp_clear, tls_clear},
+    {Py_tp_doc, (void*)tls_doc},
+    {Py_tp_methods, tls_methods},
+    {Py_tp_getset, tls_getset},
+    {Py_tp_new, tls_new},
+    {0, NULL}
+};
+
+static PyType_Spec tls_spec = {
+    .name = "_iothpy.TLSSocketBase",
+    .basicsize = sizeof(tls_object),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    .slots = tls_slots,
+};
+
+PyTypeObject*
+tls_type_create(PyObject* module)
+{
+    return (PyTypeObject*)PyType_FromModuleAndSpec(module, &tls_spec, NULL);
+}
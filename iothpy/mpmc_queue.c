@@ -0,0 +1,131 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "mpmc_queue.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Each cell is the sequence number followed by the element */
+#define CELL_SEQ(q, pos) ((size_t*)((q)->cells + ((pos) & (q)->mask) * (q)->cell_size))
+#define CELL_DATA(q, pos) ((char*)CELL_SEQ(q, pos) + sizeof(size_t))
+
+int
+mpmc_queue_init(struct mpmc_queue* q, size_t capacity, size_t elem_size)
+{
+    size_t size = 2;
+
+    if (capacity > MPMC_QUEUE_MAX_CAPACITY) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The capacity is rounded up to a power of two to index with a mask */
+    while (size < capacity)
+        size <<= 1;
+
+    q->elem_size = elem_size;
+    q->cell_size = (sizeof(size_t) + elem_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    if (q->cell_size < elem_size || size > SIZE_MAX / q->cell_size) {
+        errno = ENOMEM;
+        return -1;
+    }
+    q->cells = malloc(size * q->cell_size);
+    if (q->cells == NULL)
+        return -1;
+
+    q->mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+        *CELL_SEQ(q, i) = i;
+
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+    return 0;
+}
+
+void
+mpmc_queue_free(struct mpmc_queue* q)
+{
+    free(q->cells);
+    q->cells = NULL;
+}
+
+int
+mpmc_queue_push(struct mpmc_queue* q, const void* elem)
+{
+    size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    size_t* seq;
+
+    for (;;) {
+        seq = CELL_SEQ(q, pos);
+        intptr_t diff = (intptr_t)__atomic_load_n(seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+
+        if (diff == 0) {
+            /* The cell is free for this position, try to take it */
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) {
+            /* The consumers did not free the cell yet */
+            return 0;
+        }
+        else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(CELL_DATA(q, pos), elem, q->elem_size);
+    __atomic_store_n(seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int
+mpmc_queue_pop(struct mpmc_queue* q, void* elem)
+{
+    size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    size_t* seq;
+
+    for (;;) {
+        seq = CELL_SEQ(q, pos);
+        intptr_t diff = (intptr_t)__atomic_load_n(seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            /* The cell is full for this position, try to take it */
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) {
+            /* The producers did not fill the cell yet */
+            return 0;
+        }
+        else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(elem, CELL_DATA(q, pos), q->elem_size);
+    __atomic_store_n(seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
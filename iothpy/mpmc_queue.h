@@ -0,0 +1,44 @@
+#ifndef IOTHPY_MPMC_QUEUE_H
+#define IOTHPY_MPMC_QUEUE_H
+
+#include <stddef.h>
+
+/*
+    Bounded lock-free multi-producer multi-consumer queue of fixed size
+    elements (Vyukov's algorithm). Each cell has a sequence number telling
+    producers and consumers whether it is free or full for their position,
+    so push and pop only need a compare and swap on the position counter.
+    It does not use the python API and can be used without the GIL.
+*/
+struct mpmc_queue {
+    char* cells;
+    size_t cell_size;
+    size_t elem_size;
+    size_t mask;
+
+    /* Keep the two positions on different cache lines, padding because
+       the queue is embedded in python objects without extra alignment */
+    char pad0[64];
+    size_t enqueue_pos;
+    char pad1[64];
+    size_t dequeue_pos;
+    char pad2[64];
+};
+
+/* Largest capacity accepted by mpmc_queue_init() */
+#define MPMC_QUEUE_MAX_CAPACITY ((size_t)1 << 24)
+
+/*
+    Allocate a queue of at least capacity elements, returns -1 with errno
+    set to EINVAL if capacity is above MPMC_QUEUE_MAX_CAPACITY or to ENOMEM.
+*/
+int mpmc_queue_init(struct mpmc_queue* q, size_t capacity, size_t elem_size);
+void mpmc_queue_free(struct mpmc_queue* q);
+
+/* Copy elem in the queue, returns 0 if the queue is full */
+int mpmc_queue_push(struct mpmc_queue* q, const void* elem);
+
+/* Copy the oldest element in elem, returns 0 if the queue is empty */
+int mpmc_queue_pop(struct mpmc_queue* q, void* elem);
+
+#endif /* IOTHPY_MPMC_QUEUE_H */
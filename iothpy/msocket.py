@@ -53,7 +53,9 @@ class MSocket(_iothpy.MSocketBase):
     using the method Stack.socket().
     """
 
-    __slots__ = ["__weakref__", "_io_refs", "_closed"]
+    # _io_refs and _closed are members of MSocketBase so that sockets
+    # created from C (accept, Stack.socket) skip this constructor
+    __slots__ = ["__weakref__"]
 
     def __init__(self, stack, family=-1, type=-1, proto=-1, fileno=None):
         if not isinstance(stack, iothpy.stack.Stack):
@@ -125,16 +127,9 @@ class MSocket(_iothpy.MSocketBase):
         representing the connection, and the address of the client.
         For IP sockets, the address info is a pair (hostaddr, port).
         """
-        fd, addr = self._accept()
-        sock = MSocket(self.stack, self.family, self.type, self.proto, fileno=fd)
-        
-        # Issue #7995: if no default timeout is set and the listening
-        # socket had a (non-zero) timeout, force the new socket in blocking
-        # mode to override platform-specific socket flags inheritance.
-        if _iothpy.getdefaulttimeout() is None and self.gettimeout():
-            sock.setblocking(True)
-
-        return sock, addr
+        # The new socket is built in C with the type of this socket,
+        # inheriting family, type, proto and timeout.
+        return self._accept()
 
     def makefile(self, mode="r", buffering=None, *,
                  encoding=None, errors=None, newline=None):
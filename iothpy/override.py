@@ -29,6 +29,7 @@ See help("iothpy.override_socket_module") for more information.
 
 from iothpy.msocket import MSocket
 from iothpy.stack import Stack
+from iothpy.selector import IothSelector
 import iothpy._iothpy as _iothpy
 
 def override_socket_module(stack):
@@ -39,6 +40,11 @@ def override_socket_module(stack):
     stack : Stack
        on success all the socket created using the built-in socket module will now 
        be created on this stack instead of using the default kernel stack
+
+    Name resolution (getaddrinfo), create_connection and create_server use
+    the stack too, and selectors.DefaultSelector becomes IothSelector so
+    that socketserver and http.server also see the bytes buffered by the
+    read-ahead methods of the sockets.
     """
 
     if not isinstance(stack, Stack):
@@ -64,3 +70,14 @@ def override_socket_module(stack):
 
     # Override timeout exception
     socket_module.__dict__["timeout"] = _iothpy.timeout
+
+    # Override name resolution and the connection helpers
+    socket_module.__dict__["getaddrinfo"] = stack.getaddrinfo
+    socket_module.__dict__["create_connection"] = stack.create_connection
+    socket_module.__dict__["create_server"] = stack.create_server
+
+    # Override the default selector, socketserver picks its own one at import
+    import selectors
+    import socketserver
+    selectors.DefaultSelector = IothSelector
+    socketserver._ServerSelector = IothSelector
@@ -0,0 +1,207 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "pacer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+static long long
+pacer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct pacer*
+pacer_new(void)
+{
+    struct pacer* p = calloc(1, sizeof(struct pacer));
+    if (p == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&p->lock, NULL) != 0) {
+        free(p);
+        return NULL;
+    }
+    p->last = pacer_now();
+    return p;
+}
+
+void
+pacer_free(struct pacer* p)
+{
+    if (p == NULL)
+        return;
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+void
+pacer_set(struct pacer* p, double rate, double packet_rate, double burst, double packet_burst)
+{
+    pthread_mutex_lock(&p->lock);
+    p->rate = rate;
+    p->packet_rate = packet_rate;
+    p->burst = burst;
+    p->packet_burst = packet_burst;
+    __atomic_store_n(&p->enabled, rate > 0 || packet_rate > 0, __ATOMIC_RELAXED);
+    p->tokens = burst;
+    p->packet_tokens = packet_burst;
+    p->last = pacer_now();
+    pthread_mutex_unlock(&p->lock);
+}
+
+size_t
+pacer_chunk(struct pacer* p, size_t len)
+{
+    size_t chunk;
+
+    pthread_mutex_lock(&p->lock);
+    chunk = (p->rate > 0 && len > p->burst) ? (size_t)p->burst : len;
+    pthread_mutex_unlock(&p->lock);
+    return chunk > 0 ? chunk : 1;
+}
+
+/* Add the tokens earned since the last refill, the lock must be held */
+static void
+pacer_refill(struct pacer* p, long long now)
+{
+    double elapsed = (now - p->last) / 1e9;
+
+    p->last = now;
+    if (p->rate > 0) {
+        p->tokens += elapsed * p->rate;
+        if (p->tokens > p->burst)
+            p->tokens = p->burst;
+    }
+    if (p->packet_rate > 0) {
+        p->packet_tokens += elapsed * p->packet_rate;
+        if (p->packet_tokens > p->packet_burst)
+            p->packet_tokens = p->packet_burst;
+    }
+}
+
+/*
+    Nanoseconds before the buckets hold need bytes and packets packets,
+    0 if they already do. The lock must be held.
+*/
+static long long
+pacer_wait_ns(struct pacer* p, double need, double packets)
+{
+    double wait = 0;
+
+    if (p->rate > 0 && p->tokens < need)
+        wait = (need - p->tokens) / p->rate;
+    if (p->packet_rate > 0 && p->packet_tokens < packets) {
+        double packet_wait = (packets - p->packet_tokens) / p->packet_rate;
+        if (packet_wait > wait)
+            wait = packet_wait;
+    }
+    return (long long)(wait * 1e9);
+}
+
+int
+pacer_take(struct pacer* p, size_t len, int wait, long long deadline)
+{
+    long long now = pacer_now(), delay;
+
+    pthread_mutex_lock(&p->lock);
+    pacer_refill(p, now);
+
+    /* A datagram larger than the burst goes when the bucket is full */
+    double need = (p->rate > 0 && len > p->burst) ? p->burst : (double)len;
+
+    if (!wait) {
+        if (pacer_wait_ns(p, need, 1) > 0) {
+            p->refused++;
+            pthread_mutex_unlock(&p->lock);
+            return EWOULDBLOCK;
+        }
+        delay = 0;
+    }
+    else {
+        /* Reserve the tokens, the send goes when the bucket is back to 0 */
+        delay = pacer_wait_ns(p, need, 1);
+        if (deadline != 0 && delay > 0 && now + delay > deadline) {
+            p->refused++;
+            pthread_mutex_unlock(&p->lock);
+            return ETIMEDOUT;
+        }
+    }
+    if (p->rate > 0)
+        p->tokens -= len;
+    if (p->packet_rate > 0)
+        p->packet_tokens -= 1;
+    p->bytes += len;
+    p->packets++;
+    if (delay > 0)
+        p->delayed++;
+    pthread_mutex_unlock(&p->lock);
+
+    if (delay <= 0)
+        return 0;
+
+    struct timespec until;
+    long long until_ns = now + delay;
+    until.tv_sec = until_ns / 1000000000LL;
+    until.tv_nsec = until_ns % 1000000000LL;
+    int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+
+    long long slept = pacer_now() - now;
+    pthread_mutex_lock(&p->lock);
+    p->throttled_ns += slept;
+    pthread_mutex_unlock(&p->lock);
+
+    if (err == 0)
+        return 0;
+    pacer_untake(p, len, 1);
+    return err;
+}
+
+void
+pacer_untake(struct pacer* p, size_t len, int packet)
+{
+    pthread_mutex_lock(&p->lock);
+    if (p->rate > 0)
+        p->tokens += len;
+    if (p->packet_rate > 0 && packet)
+        p->packet_tokens += 1;
+    p->bytes -= len;
+    if (packet)
+        p->packets--;
+    pthread_mutex_unlock(&p->lock);
+}
+
+long long
+pacer_delay(struct pacer* p, size_t len)
+{
+    long long delay;
+
+    pthread_mutex_lock(&p->lock);
+    pacer_refill(p, pacer_now());
+    double need = (p->rate > 0 && len > p->burst) ? p->burst : (double)len;
+    delay = pacer_wait_ns(p, need, 1);
+    pthread_mutex_unlock(&p->lock);
+    return delay;
+}
@@ -0,0 +1,61 @@
+#ifndef IOTHPY_PACER_H
+#define IOTHPY_PACER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+    Token bucket pacing of the sends of a socket, in bytes and in packets
+    per second. A send takes its tokens before going to the stack, when
+    there are not enough it reserves them in advance, driving the bucket
+    below zero, and sleeps until they are refilled: concurrent senders get
+    consecutive slots instead of waking up together.
+    It does not use the python API: the sends take the tokens without the GIL.
+*/
+struct pacer {
+    pthread_mutex_t lock;
+    int enabled;                /* There is a limit, read without the lock */
+    double rate;                /* Bytes per second, 0 for no limit */
+    double packet_rate;         /* Packets per second, 0 for no limit */
+    double burst;               /* Size of the buckets */
+    double packet_burst;
+    double tokens;              /* Negative when sends are waiting for their slot */
+    double packet_tokens;
+    long long last;             /* CLOCK_MONOTONIC nanoseconds of the last refill */
+
+    /* Counters */
+    unsigned long long bytes;           /* Bytes sent */
+    unsigned long long packets;         /* Sends to the stack */
+    unsigned long long delayed;         /* Sends that slept for their tokens */
+    unsigned long long refused;         /* Sends of non-blocking sockets failed for lack of tokens */
+    long long throttled_ns;             /* Time slept by the delayed sends */
+};
+
+/* Allocate a pacer with no limits, returns NULL on failure */
+struct pacer* pacer_new(void);
+
+void pacer_free(struct pacer* p);
+
+/* Change the limits, a rate of 0 removes the limit. The buckets start full, burst and packet_burst must be at least 1 */
+void pacer_set(struct pacer* p, double rate, double packet_rate, double burst, double packet_burst);
+
+/* Largest piece of a stream write of len bytes sent at once, to not go over the burst */
+size_t pacer_chunk(struct pacer* p, size_t len);
+
+/*
+    Take the tokens of a send of len bytes. With wait the tokens are
+    reserved and the send sleeps, returns 0 or EINTR if a signal stopped
+    the sleep, with the tokens given back. A deadline other than 0, in
+    CLOCK_MONOTONIC nanoseconds, bounds the sleep: returns ETIMEDOUT taking
+    nothing if the turn of the send comes after it. Without wait returns
+    EWOULDBLOCK taking nothing if there are not enough tokens.
+*/
+int pacer_take(struct pacer* p, size_t len, int wait, long long deadline);
+
+/* Give back the tokens of the len bytes not sent, and of the packet if none was */
+void pacer_untake(struct pacer* p, size_t len, int packet);
+
+/* Nanoseconds before a send of len bytes gets its tokens without waiting */
+long long pacer_delay(struct pacer* p, size_t len);
+
+#endif /* IOTHPY_PACER_H */
@@ -0,0 +1,183 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "relay.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include <ioth.h>
+
+int
+relay_init(struct relay* r, size_t bufsize)
+{
+    /* A single allocation holds the buffers of both directions */
+    char* buf = malloc(2 * bufsize);
+    if (buf == NULL)
+        return -1;
+
+    for (int i = 0; i < 2; i++) {
+        r->dir[i].buf = buf + i * bufsize;
+        r->dir[i].off = 0;
+        r->dir[i].len = 0;
+        r->dir[i].eof = 0;
+        r->dir[i].shut = 0;
+        r->dir[i].bytes = 0;
+    }
+    r->bufsize = bufsize;
+    return 0;
+}
+
+void
+relay_free(struct relay* r)
+{
+    free(r->dir[0].buf);
+    r->dir[0].buf = NULL;
+    r->dir[1].buf = NULL;
+}
+
+static ssize_t
+end_recv(struct relay_end* e, void* buf, size_t len)
+{
+    if (e->ioth)
+        return ioth_recv(e->fd, buf, len, MSG_DONTWAIT);
+    return recv(e->fd, buf, len, MSG_DONTWAIT);
+}
+
+static ssize_t
+end_send(struct relay_end* e, const void* buf, size_t len)
+{
+    if (e->ioth)
+        return ioth_send(e->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return send(e->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static int
+end_shutdown(struct relay_end* e)
+{
+    int res = e->ioth ? ioth_shutdown(e->fd, SHUT_WR) : shutdown(e->fd, SHUT_WR);
+
+    /* The peer may already be gone, there is nobody left to tell */
+    if (res < 0 && errno == ENOTCONN)
+        return 0;
+    return res;
+}
+
+/*
+    Move the data of one direction as far as possible without blocking.
+    Returns -1 on error.
+*/
+static int
+relay_pump(struct relay* r, int i)
+{
+    struct relay_dir* d = &r->dir[i];
+    struct relay_end* src = &r->end[i];
+    struct relay_end* dst = &r->end[1 - i];
+
+    for (;;) {
+        if (d->off < d->len) {
+            ssize_t n = end_send(dst, d->buf + d->off, d->len - d->off);
+            if (n < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            d->off += n;
+            d->bytes += n;
+            continue;
+        }
+
+        if (d->eof) {
+            if (!d->shut) {
+                if (end_shutdown(dst) < 0)
+                    return -1;
+                d->shut = 1;
+            }
+            return 0;
+        }
+
+        ssize_t n = end_recv(src, d->buf, r->bufsize);
+        if (n < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        if (n == 0)
+            d->eof = 1;
+        d->off = 0;
+        d->len = n;
+    }
+}
+
+int
+relay_run(struct relay* r)
+{
+    struct pollfd pfd[2];
+
+    for (;;) {
+        for (int i = 0; i < 2; i++) {
+            if (relay_pump(r, i) < 0) {
+                /* A peer that went away ends both directions, what was forwarded is kept */
+                if (errno == ECONNRESET || errno == EPIPE)
+                    return 0;
+                return -1;
+            }
+        }
+        if (r->dir[0].shut && r->dir[1].shut)
+            return 0;
+
+        /* Each direction waits to read from its source or to write to its destination */
+        for (int i = 0; i < 2; i++) {
+            pfd[i].fd = r->end[i].fd;
+            pfd[i].events = 0;
+            pfd[i].revents = 0;
+        }
+        for (int i = 0; i < 2; i++) {
+            struct relay_dir* d = &r->dir[i];
+            if (d->off < d->len)
+                pfd[1 - i].events |= POLLOUT;
+            else if (!d->eof)
+                pfd[i].events |= POLLIN;
+        }
+
+        /* Both ends may be the same socket */
+        int nfds = 2;
+        if (pfd[0].fd == pfd[1].fd) {
+            pfd[0].events |= pfd[1].events;
+            nfds = 1;
+        }
+
+        /* POLLHUP and POLLERR are reported even without events, an end
+           with nothing to wait for is left out or poll returns at once */
+        for (int i = 0; i < nfds; i++) {
+            if (pfd[i].events == 0)
+                pfd[i].fd = -1;
+        }
+
+        if (poll(pfd, nfds, -1) < 0)
+            return -1;
+
+        /* On POLLHUP and POLLERR the next pump gets the end of file or
+           the error of the socket, a closed descriptor would never change */
+        for (int i = 0; i < nfds; i++) {
+            if (pfd[i].revents & POLLNVAL) {
+                errno = EBADF;
+                return -1;
+            }
+        }
+    }
+}
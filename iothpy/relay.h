@@ -0,0 +1,44 @@
+#ifndef IOTHPY_RELAY_H
+#define IOTHPY_RELAY_H
+
+#include <stddef.h>
+
+/*
+    Bidirectional relay between two sockets, pumping the data in both
+    directions with a poll loop and a buffer per direction. An end can be
+    a socket of an ioth stack or a socket of the kernel. It does not use
+    the python API and runs without the GIL.
+*/
+struct relay_end {
+    int fd;
+    int ioth;               /* Use the ioth_* calls instead of the libc ones */
+};
+
+struct relay_dir {
+    char* buf;
+    size_t off;             /* Data in buf waiting to be sent is buf[off:len] */
+    size_t len;
+    int eof;                /* The source end has no more data */
+    int shut;               /* The destination end has been shut down for writing */
+    unsigned long long bytes;
+};
+
+struct relay {
+    struct relay_end end[2];
+    struct relay_dir dir[2];    /* dir[0] from end[0] to end[1], dir[1] the other way */
+    size_t bufsize;
+};
+
+/* Allocate the buffers, returns -1 on failure */
+int relay_init(struct relay* r, size_t bufsize);
+void relay_free(struct relay* r);
+
+/*
+    Pump the data until both directions reach end of file, shutting down
+    the writing side of an end when the other end closes. A connection
+    reset by either peer ends the relay too. Returns 0 when done or -1
+    with errno set, the relay can be resumed after EINTR.
+*/
+int relay_run(struct relay* r);
+
+#endif /* IOTHPY_RELAY_H */
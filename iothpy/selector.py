@@ -0,0 +1,90 @@
+# 
+# This file is part of the iothpy library: python support for ioth.
+# 
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License 
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+"""Selector module
+
+This module defines IothSelector, the selector that override_socket_module()
+installs as selectors.DefaultSelector. It waits like the epoll selector of
+the standard library and also reports the ioth sockets holding bytes in
+their read-ahead buffer, which the stack no longer signals as readable.
+
+See help("iothpy.IothSelector") for more information.
+"""
+
+import selectors
+
+from selectors import EVENT_READ
+
+_Selector = getattr(selectors, "EpollSelector", None) or selectors.PollSelector
+
+class IothSelector(_Selector):
+    """Selector aware of the read-ahead buffer of the ioth sockets
+
+    recv_until(), recv_frame() and set_readahead() move the received bytes
+    from the stack to a buffer of the socket, so a plain selector keeps
+    waiting while they are pending. The registered objects with a
+    pending() method are checked before waiting for EVENT_READ: when some
+    of them hold buffered bytes select() does not block and returns them
+    with the file descriptors that are already ready.
+    """
+    def __init__(self):
+        super().__init__()
+        self._buffered = {}
+
+    def _track(self, key):
+        if key.events & EVENT_READ and hasattr(key.fileobj, "pending"):
+            self._buffered[key.fd] = key
+        else:
+            self._buffered.pop(key.fd, None)
+        return key
+
+    def register(self, fileobj, events, data=None):
+        return self._track(super().register(fileobj, events, data))
+
+    def unregister(self, fileobj):
+        key = super().unregister(fileobj)
+        self._buffered.pop(key.fd, None)
+        return key
+
+    def modify(self, fileobj, events, data=None):
+        return self._track(super().modify(fileobj, events, data))
+
+    def select(self, timeout=None):
+        buffered = []
+        for key in list(self._buffered.values()):
+            try:
+                if key.fileobj.pending() > 0:
+                    buffered.append(key)
+            except (OSError, ValueError, RuntimeError):
+                # Closed, or another thread is reading from the buffer
+                pass
+        if not buffered:
+            return super().select(timeout)
+
+        ready = {key.fd: (key, events) for key, events in super().select(0)}
+        for key in buffered:
+            events = ready[key.fd][1] if key.fd in ready else 0
+            ready[key.fd] = (key, events | EVENT_READ)
+        return list(ready.values())
+
+    def close(self):
+        super().close()
+        self._buffered.clear()
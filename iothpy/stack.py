@@ -52,6 +52,9 @@ Other methods:
     getaddrinfo
     getnameinfo
     socket
+    create_connection
+    create_server
+    activate
 """
 
 #Import iothpy c module
@@ -60,9 +63,14 @@ from . import _iothpy
 #Import msocket for the MSocket class
 from . import msocket
 
+#Import dispatch for the context activation of the stack
+from . import dispatch
+
 #Import function and classes to get getaddrinfo like built-in
 from socket import _intenum_converter, AddressFamily, SocketKind, gaierror
 
+import socket as socket_module
+
 class Stack(_iothpy.StackBase):
     """Stack class that represents a ioth networking stack
     
@@ -84,14 +92,9 @@ class Stack(_iothpy.StackBase):
         # Pass all arguments to the base class constructor
        _iothpy.StackBase.__init__(self, stack, vdeurl, config_dns)
 
-    def socket(self, family=-1, type=-1, proto=-1, fileno=None):
-        """Create and return a new socket on this stack
-
-        This method takes the same parameters as the builtin socket.socket() function.
-        Stack.socket(family=AF_INET, type=SOCK_STREAM, proto=0, fileno=None)
-        """
-        return msocket.MSocket(self, family, type, proto, fileno)
-
+    # Class of the sockets returned by Stack.socket(), the socket
+    # is created in C without calling the MSocket constructor
+    _socket_class = msocket.MSocket
 
     def linksetaddr(self, ifindex, addr):
         """Set the MAC address of the interface ifindex");
@@ -119,8 +122,7 @@ class Stack(_iothpy.StackBase):
         else:
             addrlist = []
 
-            for res in _iothpy.StackBase.getaddrinfo(self, *args,**kwargs):
-                af, socktype, proto, canonname, sa = res
+            for af, socktype, proto, canonname, sa in res:
                 addrlist.append((_intenum_converter(af, AddressFamily),
                                 _intenum_converter(socktype, SocketKind),
                                 proto, canonname, sa))
@@ -137,4 +139,88 @@ class Stack(_iothpy.StackBase):
         if(isinstance(res[0], int)):
             raise gaierror(res[1])
 
-        return res
\ No newline at end of file
+        return res
+
+    def create_connection(self, address, timeout = socket_module._GLOBAL_DEFAULT_TIMEOUT,
+                          source_address = None, *, all_errors = False):
+        """Connect to address on this stack and return the socket
+
+        This method takes the same parameters as the builtin
+        socket.create_connection(): host is resolved with the stack
+        getaddrinfo() and every address is tried until one connects.
+        When all of them fail the last error is raised, or an
+        ExceptionGroup of all the errors if all_errors is true.
+        """
+        host, port = address
+        errors = []
+        for af, socktype, proto, canonname, sa in self.getaddrinfo(host, port, 0, socket_module.SOCK_STREAM):
+            sock = None
+            try:
+                sock = self.socket(af, socktype, proto)
+                if timeout is not socket_module._GLOBAL_DEFAULT_TIMEOUT:
+                    sock.settimeout(timeout)
+                if source_address:
+                    sock.bind(source_address)
+                sock.connect(sa)
+                # Break the reference cycles through the tracebacks
+                errors.clear()
+                return sock
+            except OSError as e:
+                if not all_errors:
+                    errors.clear()
+                errors.append(e)
+                if sock is not None:
+                    sock.close()
+
+        if errors:
+            try:
+                if not all_errors:
+                    raise errors[0]
+                raise ExceptionGroup("create_connection failed", errors)
+            finally:
+                errors.clear()
+        raise OSError("getaddrinfo returns an empty list")
+
+    def create_server(self, address, *, family = socket_module.AF_INET, backlog = None,
+                      reuse_port = False, dualstack_ipv6 = False):
+        """Create a TCP socket on this stack bound to address and listening
+
+        This method takes the same parameters as the builtin socket.create_server().
+        """
+        if dualstack_ipv6 and family != socket_module.AF_INET6:
+            raise ValueError("dualstack_ipv6 requires AF_INET6 family")
+
+        sock = self.socket(family, socket_module.SOCK_STREAM)
+        try:
+            sock.setsockopt(socket_module.SOL_SOCKET, socket_module.SO_REUSEADDR, 1)
+            if reuse_port:
+                sock.setsockopt(socket_module.SOL_SOCKET, socket_module.SO_REUSEPORT, 1)
+            if family == socket_module.AF_INET6:
+                sock.setsockopt(socket_module.IPPROTO_IPV6, socket_module.IPV6_V6ONLY,
+                                0 if dualstack_ipv6 else 1)
+            sock.bind(address)
+            if backlog is None:
+                sock.listen()
+            else:
+                sock.listen(backlog)
+        except BaseException:
+            sock.close()
+            raise
+        return sock
+
+    def activate(self):
+        """Return a context manager making this stack the current one
+
+        with stack.activate():
+            urllib.request.urlopen("http://10.0.0.2/")
+
+        Inside the with block the built-in socket module creates the sockets,
+        resolves names and opens connections on this stack. The current
+        stack is a context variable: other threads and asyncio tasks are not
+        affected, and each of them can activate its own stack. New threads
+        start with no stack, asyncio tasks inherit the one of their creator.
+        The first call installs the dispatch on the socket module, see
+        help("iothpy.install_socket_dispatch").
+        """
+        dispatch.install_socket_dispatch()
+        return dispatch.StackActivation(self)
@@ -0,0 +1,249 @@
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+""" StackPool module
+
+This module defines the StackPool class, used to spread sockets and
+connections over several identically configured stacks.
+
+A single stack instance runs its own threads, which can become the
+bottleneck long before all the cores are used. A pool of N stacks, e.g.
+on the same vde network with different addresses or with the same
+address behind a load balancer, spreads the load over N instances.
+
+see help("iothpy.StackPool") for more information.
+"""
+
+#Import iothpy c module
+from . import _iothpy
+
+#Import stack for the Stack class
+from .stack import Stack
+
+import select
+import socket as socket_module
+import threading
+import time
+import weakref
+
+class StackPool:
+    """Pool of identically configured networking stacks
+
+    Parameters
+    ----------
+    size : int
+        Number of stacks in the pool
+
+    stack : str
+        Name of the ioth stack to be used (e.g. vdestack, picox, ...)
+
+    vdeurl : str or list of strings
+        vde urls passed to the constructor of each stack
+
+    config_dns : str
+        Path or string of the configuration for iothdns of each stack
+
+    configure : callable
+        Called as configure(stack, index) after creating each stack, it
+        configures the interfaces and the addresses of the stack
+
+    stack_class : type
+        Class of the stacks, Stack or a subclass of it
+
+    Sockets created with StackPool.socket() are assigned to the stacks
+    in round robin order, servers created with StackPool.create_server()
+    listen on every stack of the pool.
+    """
+    def __init__(self, size, stack, vdeurl = None, config_dns = None,
+                 configure = None, stack_class = Stack):
+        if size < 1:
+            raise ValueError("a StackPool needs at least one stack")
+        if not issubclass(stack_class, _iothpy.StackBase):
+            raise TypeError("stack_class must be a subclass of StackBase")
+
+        self.stacks = [stack_class(stack, vdeurl, config_dns) for i in range(size)]
+        if configure is not None:
+            for index, s in enumerate(self.stacks):
+                configure(s, index)
+
+        self._lock = threading.Lock()
+        self._next = 0
+        self._created = [0] * size
+        self._accepted = [0] * size
+        self._sockets = [weakref.WeakSet() for i in range(size)]
+
+    def __len__(self):
+        return len(self.stacks)
+
+    def __getitem__(self, index):
+        return self.stacks[index]
+
+    def __iter__(self):
+        return iter(self.stacks)
+
+    def _track(self, index, sock, accepted):
+        with self._lock:
+            if accepted:
+                self._accepted[index] += 1
+            else:
+                self._created[index] += 1
+            self._sockets[index].add(sock)
+
+    def socket(self, family = -1, type = -1, proto = -1, fileno = None):
+        """Create a new socket on the next stack of the pool
+
+        This method takes the same parameters as Stack.socket(), the stacks
+        are used in round robin order.
+        """
+        with self._lock:
+            index = self._next
+            self._next = (index + 1) % len(self.stacks)
+
+        sock = self.stacks[index].socket(family, type, proto, fileno)
+        self._track(index, sock, False)
+        return sock
+
+    def create_server(self, address, *, family = socket_module.AF_INET, backlog = None,
+                      reuse_port = False):
+        """Create a PoolServer listening on address on every stack of the pool
+
+        The parameters are the same as the builtin socket.create_server().
+        The connections accepted with PoolServer.accept() come from all
+        the stacks of the pool.
+        """
+        listeners = []
+        try:
+            for s in self.stacks:
+                listeners.append(s.create_server(address, family = family, backlog = backlog,
+                                                 reuse_port = reuse_port))
+        except BaseException:
+            for sock in listeners:
+                sock.close()
+            raise
+
+        return PoolServer(self, listeners)
+
+    def stats(self):
+        """Return the load of the pool as a dictionary
+
+        "stacks" is a list with a dictionary for each stack with:
+            created:  sockets created with StackPool.socket()
+            accepted: connections accepted with PoolServer.accept()
+            open:     sockets of the pool still open on the stack
+        "created", "accepted" and "open" are the totals over all the stacks,
+        "imbalance" is the ratio between the most loaded stack and the average
+        load, counting created and accepted sockets (1.0 is a perfect balance).
+        """
+        with self._lock:
+            created = list(self._created)
+            accepted = list(self._accepted)
+            opened = [sum(1 for sock in live if sock.fileno() != -1) for live in self._sockets]
+
+        stacks = [{"created": c, "accepted": a, "open": o} for c, a, o in zip(created, accepted, opened)]
+        loads = [c + a for c, a in zip(created, accepted)]
+        average = sum(loads) / len(loads)
+
+        return {
+            "stacks": stacks,
+            "created": sum(created),
+            "accepted": sum(accepted),
+            "open": sum(opened),
+            "imbalance": max(loads) / average if average else 1.0,
+        }
+
+
+class PoolServer:
+    """Server socket listening on every stack of a StackPool
+
+    Use StackPool.create_server() to create it. The listening sockets, one
+    for each stack, are in the sockets attribute. They are non-blocking,
+    so that the threads waiting in accept() can race for a connection.
+    """
+    def __init__(self, pool, listeners):
+        self.pool = pool
+        self.sockets = listeners
+        self._lock = threading.Lock()
+        self._next = 0
+        self._local = threading.local()
+        self._index = {}
+        self._timeouts = []
+        for index, sock in enumerate(listeners):
+            self._index[sock.fileno()] = index
+            # The timeout a connection would inherit from its blocking listener
+            timeout = sock.gettimeout()
+            if timeout is not None and timeout > 0 and _iothpy.getdefaulttimeout() is None:
+                timeout = None
+            self._timeouts.append(timeout)
+            sock.setblocking(False)
+
+    def _poller(self):
+        # A select.poll object can't be polled by two threads at once
+        poll = getattr(self._local, "poll", None)
+        if poll is None:
+            poll = select.poll()
+            for sock in self.sockets:
+                poll.register(sock, select.POLLIN)
+            self._local.poll = poll
+        return poll
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def accept(self, timeout = None):
+        """accept(timeout=None) -> (socket object, address info)
+
+        Wait for an incoming connection on any stack of the pool. When
+        several stacks have pending connections they are served in round
+        robin order, so that a busy stack can't starve the others.
+        Raises iothpy.timeout if no connection arrives within timeout seconds.
+        """
+        deadline = None if timeout is None else time.monotonic() + timeout
+        poll = self._poller()
+
+        while True:
+            ms = None if deadline is None else max(int((deadline - time.monotonic()) * 1000), 0)
+            ready = [self._index[fd] for fd, event in poll.poll(ms)]
+            if not ready:
+                raise _iothpy.timeout("timed out")
+
+            # First ready stack starting from the one after the last served
+            with self._lock:
+                index = min(ready, key = lambda i: (i - self._next) % len(self.sockets))
+                self._next = (index + 1) % len(self.sockets)
+
+            try:
+                conn, addr = self.sockets[index].accept()
+                break
+            except BlockingIOError:
+                # Another thread got the connection first
+                continue
+
+        conn.settimeout(self._timeouts[index])
+        self.pool._track(index, conn, True)
+        return conn, addr
+
+    def close(self):
+        """Close the listening sockets on all the stacks"""
+        for sock in self.sockets:
+            sock.close()
@@ -0,0 +1,233 @@
+# 
+# This file is part of the iothpy library: python support for ioth.
+# 
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License 
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+"""TLS module
+
+This module adds TLS to the sockets of an ioth stack. The ssl module only
+wraps kernel sockets, here the connection runs on an ssl.SSLObject whose
+memory BIOs are pumped to and from the ioth socket in C, so a record costs
+no more python code than with ssl.SSLSocket.
+
+import ssl
+import iothpy.tls
+
+context = ssl.create_default_context()
+sock = stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+sock.connect(("10.0.0.2", 443))
+tls = iothpy.tls.wrap_socket(sock, context, server_hostname="example.org")
+tls.sendall(b"GET / HTTP/1.0\\r\\nHost: example.org\\r\\n\\r\\n")
+print(tls.recv(4096))
+
+See help("iothpy.tls.TLSSocket") for more information.
+"""
+
+from . import _iothpy
+
+import socket
+import ssl
+import io
+
+class TLSSocket(_iothpy.TLSSocketBase):
+    """TLS connection on an ioth socket, created by wrap_socket()
+
+    recv(), recv_into(), send(), sendall(), do_handshake() and unwrap()
+    run in C, each operation receiving and sending on the socket as the
+    TLS connection needs. The timeout of the socket applies to each wait
+    for the socket to be ready; with a non-blocking socket the operations
+    raise ssl.SSLWantReadError or ssl.SSLWantWriteError, like those of an
+    ssl.SSLSocket. The other socket methods are those of the underlying
+    socket and the TLS ones those of ssl_object.
+    """
+
+    def __init__(self, *args, **kwargs):
+        self._io_refs = 0
+        self._closed = False
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        if not self._closed:
+            self.close()
+
+    def __repr__(self):
+        return "<{}.{} {!r}>".format(type(self).__module__, type(self).__qualname__, self.socket)
+
+    def makefile(self, mode="r", buffering=None, *,
+                 encoding=None, errors=None, newline=None):
+        """makefile(...) -> an I/O stream connected to the TLS connection
+        The arguments are as for io.open() after the filename, except the only
+        supported mode values are 'r' (default), 'w' and 'b'.
+        """
+        if not set(mode) <= {"r", "w", "b"}:
+            raise ValueError("invalid mode %r (only r, w, b allowed)" % (mode,))
+        writing = "w" in mode
+        reading = "r" in mode or not writing
+        binary = "b" in mode
+        rawmode = ""
+        if reading:
+            rawmode += "r"
+        if writing:
+            rawmode += "w"
+        raw = socket.SocketIO(self, rawmode)
+        self._io_refs += 1
+        if buffering is None:
+            buffering = -1
+        if buffering < 0:
+            buffering = io.DEFAULT_BUFFER_SIZE
+        if buffering == 0:
+            if not binary:
+                raise ValueError("unbuffered streams must be binary")
+            return raw
+        if reading and writing:
+            buffer = io.BufferedRWPair(raw, raw, buffering)
+        elif reading:
+            buffer = io.BufferedReader(raw, buffering)
+        else:
+            buffer = io.BufferedWriter(raw, buffering)
+        if binary:
+            return buffer
+        text = io.TextIOWrapper(buffer, encoding, errors, newline)
+        text.mode = mode
+        return text
+
+    def _decref_socketios(self):
+        if self._io_refs > 0:
+            self._io_refs -= 1
+        if self._closed:
+            self.close()
+
+    def close(self):
+        """Close the connection without a TLS shutdown, see unwrap()"""
+        self._closed = True
+        if self._io_refs <= 0:
+            self.socket.close()
+
+    @property
+    def closed(self):
+        return self._closed
+
+    # Methods of the underlying socket
+    def fileno(self):
+        return self.socket.fileno()
+
+    def gettimeout(self):
+        return self.socket.gettimeout()
+
+    def settimeout(self, value):
+        self.socket.settimeout(value)
+
+    def get_deadline(self):
+        return self.socket.get_deadline()
+
+    def set_deadline(self, when):
+        self.socket.set_deadline(when)
+
+    def setblocking(self, flag):
+        self.socket.setblocking(flag)
+
+    def getblocking(self):
+        return self.socket.getblocking()
+
+    def getpeername(self):
+        return self.socket.getpeername()
+
+    def getsockname(self):
+        return self.socket.getsockname()
+
+    def getsockopt(self, *args):
+        return self.socket.getsockopt(*args)
+
+    def setsockopt(self, *args):
+        self.socket.setsockopt(*args)
+
+    def shutdown(self, how):
+        self.socket.shutdown(how)
+
+    @property
+    def family(self):
+        return self.socket.family
+
+    @property
+    def type(self):
+        return self.socket.type
+
+    # Methods of the TLS connection
+    def pending(self):
+        return self.ssl_object.pending()
+
+    def getpeercert(self, binary_form=False):
+        return self.ssl_object.getpeercert(binary_form)
+
+    def cipher(self):
+        return self.ssl_object.cipher()
+
+    def version(self):
+        return self.ssl_object.version()
+
+    def selected_alpn_protocol(self):
+        return self.ssl_object.selected_alpn_protocol()
+
+    def get_channel_binding(self, cb_type="tls-unique"):
+        return self.ssl_object.get_channel_binding(cb_type)
+
+    @property
+    def context(self):
+        return self.ssl_object.context
+
+    @property
+    def server_side(self):
+        return self.ssl_object.server_side
+
+    @property
+    def server_hostname(self):
+        return self.ssl_object.server_hostname
+
+    @property
+    def session(self):
+        return self.ssl_object.session
+
+    @property
+    def session_reused(self):
+        return self.ssl_object.session_reused
+
+def wrap_socket(sock, context, server_side=False, server_hostname=None,
+                do_handshake_on_connect=True, suppress_ragged_eofs=True, session=None):
+    """Wrap the connected ioth socket sock in a TLSSocket
+
+    The arguments are those of ssl.SSLContext.wrap_socket(). The socket
+    must not be used directly afterwards, the bytes it already received
+    with a read-ahead are the first ones of the TLS connection. Coalesced
+    writes are sent first and queued writes must have been sent.
+    """
+    if sock.queued():
+        raise ValueError("the socket has queued writes, send them with drain_queue() first")
+    if sock.get_cork() is not None:
+        sock.set_cork(0)
+
+    incoming = ssl.MemoryBIO()
+    outgoing = ssl.MemoryBIO()
+    ssl_object = context.wrap_bio(incoming, outgoing, server_side=server_side,
+                                  server_hostname=server_hostname, session=session)
+    tls = TLSSocket(sock, ssl_object, incoming, outgoing, suppress_ragged_eofs)
+    if do_handshake_on_connect:
+        tls.do_handshake()
+    return tls
@@ -67,6 +67,92 @@ PyObject * make_sockaddr(struct sockaddr *addr, size_t addrlen)
 }
 
 
+/* 
+    Fill addr with the IPv4 or IPv6 (depending on family) socket address for
+    host and port. The empty string is INADDR_ANY, "<broadcast>" is 
+    INADDR_BROADCAST for IPv4. Returns 0 raising an exception on failure.
+*/
+int parse_inet_sockaddr(const char* func_name, int family, const char* host, int port,
+                        unsigned int flowinfo, unsigned int scope_id,
+                        sockaddr_union* addr, socklen_t* len)
+{
+    if (port < 0 || port > 0xffff) {
+        PyErr_Format(PyExc_OverflowError, "%s(): port must be 0-65535", func_name);
+        return 0;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+
+    switch (family) {
+        case AF_INET:
+        {
+            if(len)
+                *len = sizeof(addr->in);
+
+            addr->in.sin_family = AF_INET;
+            addr->in.sin_port = htons(port);
+
+            /* Special case empty string to INADDR_ANY */
+            if(host[0] == '\0') 
+            {
+                addr->in.sin_addr.s_addr = htonl(INADDR_ANY);
+            }
+            /* Special case <broadcast> string to INADDR_BROADCAST */
+            else if(strcmp(host, "<broadcast>") == 0)
+            {
+                addr->in.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+            }
+            else 
+            {
+                if(inet_pton(AF_INET, host, &addr->in.sin_addr) != 1) 
+                {
+                    PyErr_SetString(PyExc_ValueError, "invalid ip address");
+                    return 0;
+                }
+            }
+        } break;
+
+        case AF_INET6:
+        {
+            if (flowinfo > 0xfffff) {
+                PyErr_Format(PyExc_OverflowError, "%s(): flowinfo must be 0-1048575.", func_name);
+                return 0;
+            }
+
+            if(len)
+                *len = sizeof(addr->in6);
+
+            addr->in6.sin6_family = AF_INET6;
+            addr->in6.sin6_port = htons(port);
+            addr->in6.sin6_flowinfo = htonl(flowinfo);
+            addr->in6.sin6_scope_id = scope_id;
+
+            /* Special case empty string to INADDR_ANY */
+            if(host[0] == '\0') 
+            {
+                addr->in6.sin6_addr = in6addr_any;
+            }
+            else 
+            {
+                if(inet_pton(AF_INET6, host, &addr->in6.sin6_addr) != 1) 
+                {
+                    PyErr_SetString(PyExc_ValueError, "invalid ip address");
+                    return 0;
+                }
+            }
+        } break;
+
+        default:
+        {
+            PyErr_SetString(PyExc_ValueError, "invalid socket family");
+            return 0;
+        } break;
+    }
+
+    return 1;
+}
+
+
 /* Convert IPv4 sockaddr to a Python str. */
 PyObject * make_ipv4_addr(struct sockaddr_in *addr)
 {
@@ -87,4 +173,149 @@ PyObject * make_ipv6_addr(struct sockaddr_in6 *addr)
         return NULL;
     }
     return PyUnicode_FromString(buf);
-}
\ No newline at end of file
+}
+
+/* Check that nargs positional arguments are in [min, max] and no keywords were given */
+int fastcall_check_nargs(const char* fname, Py_ssize_t nargs, PyObject* kwnames,
+                         Py_ssize_t min, Py_ssize_t max)
+{
+    if (kwnames != NULL && PyTuple_GET_SIZE(kwnames) > 0) {
+        PyErr_Format(PyExc_TypeError, "%s() takes no keyword arguments", fname);
+        return 0;
+    }
+
+    if (nargs < min || nargs > max) {
+        if (min == max)
+            PyErr_Format(PyExc_TypeError, "%s() takes exactly %zd argument%s (%zd given)",
+                         fname, min, min == 1 ? "" : "s", nargs);
+        else if (nargs < min)
+            PyErr_Format(PyExc_TypeError, "%s() takes at least %zd argument%s (%zd given)",
+                         fname, min, min == 1 ? "" : "s", nargs);
+        else
+            PyErr_Format(PyExc_TypeError, "%s() takes at most %zd argument%s (%zd given)",
+                         fname, max, max == 1 ? "" : "s", nargs);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* 
+    Collect positional and keyword arguments in out, following the order of
+    names (NULL terminated). Missing optional arguments are set to NULL.
+*/
+int fastcall_unpack(const char* fname, PyObject* const* args, Py_ssize_t nargs,
+                    PyObject* kwnames, const char* const* names, Py_ssize_t min,
+                    PyObject** out)
+{
+    Py_ssize_t max = 0;
+    while (names[max] != NULL)
+        max++;
+
+    if (nargs > max) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd argument%s (%zd given)",
+                     fname, max, max == 1 ? "" : "s", nargs);
+        return 0;
+    }
+
+    for (Py_ssize_t i = 0; i < max; i++)
+        out[i] = (i < nargs) ? args[i] : NULL;
+
+    Py_ssize_t nkw = (kwnames == NULL) ? 0 : PyTuple_GET_SIZE(kwnames);
+    for (Py_ssize_t k = 0; k < nkw; k++) {
+        const char* key = PyUnicode_AsUTF8(PyTuple_GET_ITEM(kwnames, k));
+        if (key == NULL)
+            return 0;
+
+        Py_ssize_t i = 0;
+        while (i < max && strcmp(names[i], key) != 0)
+            i++;
+
+        if (i == max) {
+            PyErr_Format(PyExc_TypeError, "'%s' is an invalid keyword argument for %s()",
+                         key, fname);
+            return 0;
+        }
+        if (out[i] != NULL) {
+            PyErr_Format(PyExc_TypeError, "argument for %s() given by name ('%s') and position (%zd)",
+                         fname, key, i + 1);
+            return 0;
+        }
+        out[i] = args[nargs + k];
+    }
+
+    for (Py_ssize_t i = 0; i < min; i++) {
+        if (out[i] == NULL) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s' (pos %zd)",
+                         fname, names[i], i + 1);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* "i" format */
+int fastcall_int(PyObject* obj, int* out)
+{
+    if (PyFloat_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "integer argument expected, got float");
+        return 0;
+    }
+
+    long value = PyLong_AsLong(obj);
+    if (value == -1 && PyErr_Occurred())
+        return 0;
+
+    if (value > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "signed integer is greater than maximum");
+        return 0;
+    }
+    if (value < INT_MIN) {
+        PyErr_SetString(PyExc_OverflowError, "signed integer is less than minimum");
+        return 0;
+    }
+
+    *out = (int)value;
+    return 1;
+}
+
+/* "n" format */
+int fastcall_ssize_t(PyObject* obj, Py_ssize_t* out)
+{
+    if (PyFloat_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "integer argument expected, got float");
+        return 0;
+    }
+
+    Py_ssize_t value = PyNumber_AsSsize_t(obj, PyExc_OverflowError);
+    if (value == -1 && PyErr_Occurred())
+        return 0;
+
+    *out = value;
+    return 1;
+}
+
+/* "y*" format, out must be released with PyBuffer_Release on success */
+int fastcall_buffer(PyObject* obj, Py_buffer* out)
+{
+    if (PyUnicode_Check(obj)) {
+        PyErr_Format(PyExc_TypeError, "a bytes-like object is required, not '%.100s'",
+                     Py_TYPE(obj)->tp_name);
+        return 0;
+    }
+
+    if (PyObject_GetBuffer(obj, out, PyBUF_SIMPLE) != 0)
+        return 0;
+
+    return 1;
+}
+
+/* "w*" format, out must be released with PyBuffer_Release on success */
+int fastcall_rwbuffer(PyObject* obj, Py_buffer* out)
+{
+    if (PyObject_GetBuffer(obj, out, PyBUF_WRITABLE) != 0)
+        return 0;
+
+    return 1;
+}
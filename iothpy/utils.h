@@ -1,3 +1,6 @@
+#ifndef IOTHPY_UTILS_H
+#define IOTHPY_UTILS_H
+
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
@@ -14,6 +17,99 @@
 #include <pthread.h>
 #include <arpa/inet.h>
 
+/* 
+    Python 3.13 removed the private time API in favour of PyTime_t,
+    implement the few functions used by the sockets on top of it.
+*/
+#if PY_VERSION_HEX >= 0x030D0000
+#include <math.h>
+
+typedef PyTime_t _PyTime_t;
+
+#define _PYTIME_FROMSECONDS(seconds) ((PyTime_t)(seconds) * 1000000000)
+#define _PyTime_FromSeconds(seconds) _PYTIME_FROMSECONDS(seconds)
+#define _PyTime_AsSecondsDouble PyTime_AsSecondsDouble
+#define _PyLong_AsInt PyLong_AsInt
+
+/* Round towards +inf, or away from zero for timeouts */
+#define _PyTime_ROUND_CEILING 1
+#define _PyTime_ROUND_TIMEOUT 3
+
+static inline _PyTime_t
+_PyTime_GetMonotonicClock(void)
+{
+    PyTime_t t;
+    if (PyTime_MonotonicRaw(&t) < 0)
+        t = 0;
+    return t;
+}
+
+static inline _PyTime_t
+_PyTime_AsMilliseconds(_PyTime_t t, int round)
+{
+    _PyTime_t ms = t / 1000000, rem = t % 1000000;
+    if (rem > 0)
+        ms++;
+    else if (rem < 0 && round == _PyTime_ROUND_TIMEOUT)
+        ms--;
+    return ms;
+}
+
+static inline int
+_PyTime_FromSecondsObject(_PyTime_t* t, PyObject* obj, int round)
+{
+    if (PyFloat_Check(obj)) {
+        double d = PyFloat_AsDouble(obj) * 1e9;
+        if (isnan(d)) {
+            PyErr_SetString(PyExc_ValueError, "Invalid value NaN (not a number)");
+            return -1;
+        }
+        d = (d >= 0 || round == _PyTime_ROUND_CEILING) ? ceil(d) : floor(d);
+        if (!((double)PyTime_MIN <= d && d < (double)PyTime_MAX)) {
+            PyErr_SetString(PyExc_OverflowError, "timestamp too large to convert to C PyTime_t");
+            return -1;
+        }
+        *t = (_PyTime_t)d;
+        return 0;
+    }
+
+    long long seconds = PyLong_AsLongLong(obj);
+    if (seconds == -1 && PyErr_Occurred())
+        return -1;
+    if (seconds > PyTime_MAX / 1000000000 || seconds < PyTime_MIN / 1000000000) {
+        PyErr_SetString(PyExc_OverflowError, "timestamp too large to convert to C PyTime_t");
+        return -1;
+    }
+    *t = _PYTIME_FROMSECONDS(seconds);
+    return 0;
+}
+#endif
+
+/* 
+    Critical sections lock an object on free-threaded builds and do nothing
+    when the GIL is enabled, they are not defined before Python 3.13.
+*/
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+/* Storage for an IPv4 or IPv6 socket address */
+typedef union sockaddr_union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+} sockaddr_union;
+
+/* 
+    Fill addr with the IPv4 or IPv6 (depending on family) socket address for
+    host and port. The empty string is INADDR_ANY, "<broadcast>" is 
+    INADDR_BROADCAST for IPv4. Returns 0 raising an exception on failure.
+*/
+int parse_inet_sockaddr(const char* func_name, int family, const char* host, int port,
+                        unsigned int flowinfo, unsigned int scope_id,
+                        sockaddr_union* addr, socklen_t* len);
+
 /* Utility to create a tuple representing the given sockaddr suitable
    for passing it back to bind, connect etc.. */
 PyObject* make_sockaddr(struct sockaddr *addr, size_t addrlen);
@@ -22,4 +118,36 @@ PyObject* make_sockaddr(struct sockaddr *addr, size_t addrlen);
 PyObject* make_ipv4_addr(struct sockaddr_in *addr);
 
 /* Convert IPv6 sockaddr to a Python str. */
-PyObject* make_ipv6_addr(struct sockaddr_in6 *addr);
\ No newline at end of file
+PyObject* make_ipv6_addr(struct sockaddr_in6 *addr);
+
+/* 
+    Argument parsing helpers for METH_FASTCALL methods and vectorcall
+    constructors. They follow the semantics of the corresponding
+    PyArg_ParseTuple formats and return 0 raising an exception on failure.
+*/
+
+/* Check that nargs positional arguments are in [min, max] and no keywords were given */
+int fastcall_check_nargs(const char* fname, Py_ssize_t nargs, PyObject* kwnames,
+                         Py_ssize_t min, Py_ssize_t max);
+
+/* 
+    Collect positional and keyword arguments in out, following the order of
+    names (NULL terminated). Missing optional arguments are set to NULL.
+*/
+int fastcall_unpack(const char* fname, PyObject* const* args, Py_ssize_t nargs,
+                    PyObject* kwnames, const char* const* names, Py_ssize_t min,
+                    PyObject** out);
+
+/* "i" format */
+int fastcall_int(PyObject* obj, int* out);
+
+/* "n" format */
+int fastcall_ssize_t(PyObject* obj, Py_ssize_t* out);
+
+/* "y*" format, out must be released with PyBuffer_Release on success */
+int fastcall_buffer(PyObject* obj, Py_buffer* out);
+
+/* "w*" format, out must be released with PyBuffer_Release on success */
+int fastcall_rwbuffer(PyObject* obj, Py_buffer* out);
+
+#endif /* IOTHPY_UTILS_H */
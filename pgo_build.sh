@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Profile guided optimization build of iothpy:
+#   1. build and install an instrumented extension
+#   2. run the benchmarks in examples/ to collect the profile
+#   3. rebuild and install the extension optimized with the profile
+#
+# Usage: ./pgo_build.sh vdeurl [extra cmake options]
+# e.g.   ./pgo_build.sh vxvde://234.0.0.1 -DIOTHPY_LTO=ON
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 vdeurl [extra cmake options]"
+    echo "e.g.   $0 vxvde://234.0.0.1 -DIOTHPY_LTO=ON"
+    exit 1
+fi
+
+VDEURL=$1
+shift
+EXTRA_ARGS="$*"
+
+cd "$(dirname "$0")"
+SRC_DIR="$(pwd)"
+PGO_DIR="$SRC_DIR/_pgo"
+PYTHON=${PYTHON:-python3}
+
+rm -rf _skbuild "$PGO_DIR"
+mkdir -p "$PGO_DIR"
+
+echo "== Building instrumented extension"
+IOTHPY_CMAKE_ARGS="-DIOTHPY_PGO=GENERATE -DIOTHPY_PGO_DIR=$PGO_DIR $EXTRA_ARGS" \
+    $PYTHON -m pip install --no-build-isolation --force-reinstall --no-deps .
+
+echo "== Training on the benchmark workloads"
+(
+    # Run from another directory so the installed package is imported
+    cd /tmp
+    for bench in bench_calls.py bench_accept.py; do
+        $PYTHON "$SRC_DIR/examples/$bench" "$VDEURL"
+    done
+)
+
+# clang writes raw profiles that must be merged
+if ls "$PGO_DIR"/*.profraw >/dev/null 2>&1; then
+    llvm-profdata merge -output="$PGO_DIR/iothpy.profdata" "$PGO_DIR"/*.profraw
+fi
+
+echo "== Building optimized extension"
+rm -rf _skbuild
+IOTHPY_CMAKE_ARGS="-DIOTHPY_PGO=USE -DIOTHPY_PGO_DIR=$PGO_DIR $EXTRA_ARGS" \
+    $PYTHON -m pip install --no-build-isolation --force-reinstall --no-deps .
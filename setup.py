@@ -23,6 +23,9 @@
 
 from skbuild import setup
 
+import os
+import shlex
+
 long_description = ""
 with open("README.md", "r") as f:
     long_description = f.read()
@@ -39,10 +42,11 @@ setup (
        long_description_content_type="text/markdown",
        packages = ["iothpy"],
        classifiers = ["Operating System :: POSIX :: Linux"],
-       python_requires='>=3.6',
+       python_requires='>=3.9',
 
        #skbuild options
-       cmake_args= [],
+       # Extra cmake options, e.g. IOTHPY_CMAKE_ARGS="-DIOTHPY_LTO=ON"
+       cmake_args= shlex.split(os.environ.get("IOTHPY_CMAKE_ARGS", "")),
        setup_requires=["cmake"]
        )
 